@@ -0,0 +1,1159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "bench.h"
+#include "csc.h"
+#include "h264enc.h"
+#include "ve.h"
+
+#define BENCH_FRAMES 50
+
+static const struct {
+    const char *name;
+    int width;
+    int height;
+} bench_sizes[] = {
+    { "480p", 640, 480 },
+    { "720p", 1280, 720 },
+    { "1080p", 1920, 1080 },
+};
+
+static double now_ms(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * Every kernel table against the C kernels on random rows of many widths,
+ * both byte orders. The bytes after each destination row must be left
+ * alone too. Returns the number of mismatching rows.
+ */
+#define CHECK_MAX_WIDTH 1920
+#define CHECK_GUARD 64
+
+static int check_kernels(const struct csc_kernels *k) {
+    static const int wide[] = { 638, 720, 1278, 1280, 1918, 1920 };
+    uint8 *s0 = malloc(CHECK_MAX_WIDTH * 2);
+    uint8 *s1 = malloc(CHECK_MAX_WIDTH * 2);
+    uint8 *s2 = malloc(CHECK_MAX_WIDTH * 2);
+    uint8 *hist = malloc(CHECK_MAX_WIDTH * 2);
+    uint8 *ref = malloc(3 * (CHECK_MAX_WIDTH + CHECK_GUARD));
+    uint8 *out = malloc(3 * (CHECK_MAX_WIDTH + CHECK_GUARD));
+    unsigned short sums[CHECK_MAX_WIDTH], scale[8 * 3];
+    int cols[CHECK_MAX_WIDTH / 8 + 1];
+    int len = CHECK_MAX_WIDTH + CHECK_GUARD;
+    int errors = 0;
+    int i, n, uyvy;
+
+    if (s0 == NULL || s1 == NULL || s2 == NULL || hist == NULL || ref == NULL || out == NULL) {
+        errors = 1;
+        goto out;
+    }
+
+    /* 1 or 2 columns, lane l as if over l + 1 rows */
+    for (n = 8; n < 8 * 3; n++) {
+        int area = n / 8 * (n % 8 + 1);
+
+        scale[n] = area > 1 ? 65536 / area : 65535;
+    }
+
+    for (i = 0; i < 128 + (int)(sizeof(wide) / sizeof(wide[0])); i++) {
+        int w = i < 128 ? 2 * (i + 1) : wide[i - 128];
+
+        for (uyvy = 0; uyvy < 2; uyvy++) {
+            for (n = 0; n < w * 2; n++) {
+                s0[n] = rand();
+                s1[n] = rand();
+                s2[n] = rand();
+                /* the last frame, close to s1 so both sides of the threshold are hit */
+                hist[n] = s1[n] + rand() % 33 - 16;
+            }
+
+#define CHECK(name, call_ref, call_out) do { \
+                memset(ref, 0x5a, 3 * len); \
+                memset(out, 0x5a, 3 * len); \
+                call_ref; \
+                call_out; \
+                if (memcmp(ref, out, 3 * len) != 0) { \
+                    if (errors++ < 8) \
+                        printf("  %s %s width %d %s: mismatch\n", k->isa, name, w, uyvy ? "UYVY" : "YUYV"); \
+                } \
+            } while (0)
+
+            CHECK("row_y", csc_c.row_y(s0, ref, w, uyvy), k->row_y(s0, out, w, uyvy));
+            CHECK("row_uv", csc_c.row_uv(s0, s1, ref, w, uyvy), k->row_uv(s0, s1, out, w, uyvy));
+            CHECK("row_u_v", csc_c.row_u_v(s0, s1, ref, ref + len, w, uyvy),
+                  k->row_u_v(s0, s1, out, out + len, w, uyvy));
+            CHECK("row_y2", csc_c.row_y2(s0, ref, ref + len, w, uyvy),
+                  k->row_y2(s0, out, out + len, w, uyvy));
+            CHECK("row_uv_u_v", csc_c.row_uv_u_v(s0, s1, ref, ref + len, ref + 2 * len, w, uyvy),
+                  k->row_uv_u_v(s0, s1, out, out + len, out + 2 * len, w, uyvy));
+
+            /* the deinterlacer is byte wise, w bytes of it */
+            CHECK("row_avg", csc_c.row_avg(s0, s1, ref, w), k->row_avg(s0, s1, out, w));
+            CHECK("row_avg in place", (memcpy(ref, s0, w), csc_c.row_avg(ref, s1, ref, w)),
+                  (memcpy(out, s0, w), k->row_avg(out, s1, out, w)));
+            CHECK("row_motion",
+                  (memcpy(ref + len, hist, w),
+                   csc_c.row_motion(s0, s1, s2, ref + len, ref, w, CSC_DEINT_THRESHOLD)),
+                  (memcpy(out + len, hist, w),
+                   k->row_motion(s0, s1, s2, out + len, out, w, CSC_DEINT_THRESHOLD)));
+
+            /* w / 2 pixels mirrored, 8x8 blocks out of the first 8 rows of s0 */
+            CHECK("row_mirror", csc_c.row_mirror(s0, ref, w / 2 & ~1, uyvy),
+                  k->row_mirror(s0, out, w / 2 & ~1, uyvy));
+            if (w >= 16) {
+                int off = w / 2 - 8;
+
+                CHECK("transpose_8x8", csc_c.transpose_8x8(s0 + off, w / 8, ref + off, len / 8),
+                      k->transpose_8x8(s0 + off, w / 8, out + off, len / 8));
+                CHECK("transpose_8x8_16", csc_c.transpose_8x8_16(s0 + off, w / 8, ref + off, len / 8),
+                      k->transpose_8x8_16(s0 + off, w / 8, out + off, len / 8));
+            }
+            /* 8 pixels of 8 rows, 16 of 16 rows, as many bytes apart as fit in s0 */
+            if (w >= 16) {
+                int off = w / 2 - 8, step = (2 * w - 32) / 15;
+
+                CHECK("transpose_y_8x8", csc_c.transpose_y_8x8(s0, step, ref + off, len / 8, uyvy),
+                      k->transpose_y_8x8(s0, step, out + off, len / 8, uyvy));
+                CHECK("transpose_uv_8x8", csc_c.transpose_uv_8x8(s0, step, ref + off, len / 8, NULL, 0, uyvy),
+                      k->transpose_uv_8x8(s0, step, out + off, len / 8, NULL, 0, uyvy));
+                CHECK("transpose_uv_8x8 planar",
+                      csc_c.transpose_uv_8x8(s0, step, ref + off, len / 8, ref + len + off, len / 8, uyvy),
+                      k->transpose_uv_8x8(s0, step, out + off, len / 8, out + len + off, len / 8, uyvy));
+            }
+
+            /* w bytes of s0 added to sums that start out as s1 */
+            CHECK("row_accum", (memcpy(ref, s1, 2 * w), csc_c.row_accum(s0, (unsigned short *)ref, w)),
+                  (memcpy(out, s1, 2 * w), k->row_accum(s0, (unsigned short *)out, w)));
+            /* s0 as w / 2 pixels of sums, halved in place and into the next row */
+            CHECK("row_half", csc_c.row_half((unsigned short *)s0, (unsigned short *)ref, w / 2 & ~3, uyvy),
+                  k->row_half((unsigned short *)s0, (unsigned short *)out, w / 2 & ~3, uyvy));
+            CHECK("row_half in place",
+                  (memcpy(ref, s0, 2 * w), csc_c.row_half((unsigned short *)ref, (unsigned short *)ref, w / 2 & ~3, uyvy)),
+                  (memcpy(out, s0, 2 * w), k->row_half((unsigned short *)out, (unsigned short *)out, w / 2 & ~3, uyvy)));
+            /* s0 bytes as w / 8 columns of 8 lanes, 3 columns to 2 outputs, every other one out */
+            if (w >= 16) {
+                int count = w / 8 * 2 / 3;
+
+                for (n = 0; n < w; n++)
+                    sums[n] = s0[n];
+                for (n = 0; n <= count; n++)
+                    cols[n] = n * (w / 8) / count;
+                CHECK("cols_box", csc_c.cols_box(sums, 1, cols, scale, ref, 2, count),
+                      k->cols_box(sums, 1, cols, scale, out, 2, count));
+            }
+
+            /* s0 as w / 2 running totals after s1, and pairs of bytes scaled by a half */
+            CHECK("row_delta",
+                  (memcpy(ref + len, s1, w),
+                   csc_c.row_delta((unsigned short *)s0, (unsigned short *)(ref + len), (unsigned short *)ref, w / 2)),
+                  (memcpy(out + len, s1, w),
+                   k->row_delta((unsigned short *)s0, (unsigned short *)(out + len), (unsigned short *)out, w / 2)));
+            for (n = 0; n < w; n++)
+                sums[n] = s0[n] + s1[n];
+            CHECK("row_scale", csc_c.row_scale(sums, ref, w, 32768), k->row_scale(sums, out, w, 32768));
+
+            /* two terms of s0 out of two loads per sample, halved to stay in a byte, random lanes */
+            if (k->row_box && w >= 64) {
+                static const unsigned short box_scale[8] = { 0, 65535, 32768 };
+                static const int base[2] = { 0, 4 };
+                uint8 masks[2 * 5 * 16];
+                struct csc_box box = { .terms = 2, .loads = 2, .advance = 16, .base = base, .masks = masks };
+                int t, b;
+
+                for (n = 0; n < 2; n++) {
+                    uint8 *m = masks + n * 5 * 16;
+
+                    memset(m, 0x80, 4 * 16);
+                    for (t = 0; t < 2; t++)
+                        for (b = 0; b < 8; b++) {
+                            uint8 *lane = m + (2 * t + rand() % 2) * 16 + 2 * b;
+                            int x = rand() % 8;
+
+                            lane[0] = 2 * x;
+                            lane[1] = 2 * x + 1;
+                        }
+                    for (b = 0; b < 8; b++) {
+                        m[4 * 16 + 2 * b] = 4;
+                        m[4 * 16 + 2 * b + 1] = 5;
+                    }
+                }
+                for (n = 0; n < w; n++)
+                    sums[n] = s0[n];
+                for (box.period = 1; box.period <= 2; box.period++) {
+                    box.vecs = box.period * ((w - 20) / 16);
+                    CHECK("row_box", csc_c.row_box(sums, ref, &box, box_scale),
+                          k->row_box(sums, out, &box, box_scale));
+                }
+            }
+#undef CHECK
+        }
+    }
+
+out:
+    free(s0);
+    free(s1);
+    free(s2);
+    free(hist);
+    free(ref);
+    free(out);
+    return errors;
+}
+
+/*
+ * Every specialised registry entry against the generic path of the same
+ * format pair, on padded odd sized frames. Returns the number of mismatches.
+ */
+static int check_conversions(void) {
+    static const int sizes[][2] = { { 640, 480 }, { 1918, 1078 }, { 34, 7 }, { 66, 33 } };
+    const struct csc_conversion *list[128];
+    int count = csc_list_conversions(list, 128);
+    int errors = 0;
+    int i, j, n;
+
+    for (i = 0; i < count && i < 128; i++) {
+        const struct csc_conversion *c = list[i];
+        const struct csc_conversion *generic = NULL;
+
+        for (j = 0; j < count && j < 128; j++)
+            if (list[j]->src == c->src && list[j]->dst == c->dst && strcmp(list[j]->name, "generic") == 0)
+                generic = list[j];
+        if (!generic || generic == c)
+            continue;
+
+        for (n = 0; n < (int)(sizeof(sizes) / sizeof(sizes[0])); n++) {
+            int w = sizes[n][0], h = sizes[n][1];
+            int stride = (w + 15) & ~15, rows = (h + 15) & ~15;
+            int in_size = csc_frame_size(c->src, w, h);
+            int out_size = csc_frame_size(c->dst, stride, rows);
+            uint8 *in = malloc(in_size);
+            uint8 *a = calloc(1, out_size);
+            uint8 *b = calloc(1, out_size);
+            struct csc_image src, da, db;
+            int k;
+
+            if (in && a && b) {
+                for (k = 0; k < in_size; k++)
+                    in[k] = rand();
+                csc_image_init(&src, c->src, in, w, h, 0, 0);
+                csc_image_init(&da, c->dst, a, w, h, stride, rows);
+                csc_image_init(&db, c->dst, b, w, h, stride, rows);
+                da.out_width = db.out_width = stride;
+                da.out_height = db.out_height = rows;
+                c->run(&src, &da);
+                generic->run(&src, &db);
+                if (memcmp(a, b, out_size) != 0 && errors++ < 8)
+                    printf("  %.4s->%.4s %s %dx%d: differs from the generic path\n",
+                           (const char *)&c->src, (const char *)&c->dst, c->name, w, h);
+            }
+            free(in);
+            free(a);
+            free(b);
+        }
+    }
+
+    printf("  conversion registry: %d entries, specialised ones %s the generic path\n",
+           count, errors ? "do NOT match" : "match");
+    return errors;
+}
+
+/*
+ * bit-exactness and single thread UYVY->NV12 speed of each kernel table
+ */
+static int bench_kernels(void) {
+    const struct csc_kernels *list[CSC_MAX_KERNELS];
+    int count = csc_supported_kernels(list, CSC_MAX_KERNELS);
+    int w = 1920, h = 1080;
+    uint8 *src = malloc(w * h * 2);
+    uint8 *dst = malloc(w * h * 3 / 2);
+    int errors = 0;
+    int i, n, y;
+
+    if (src == NULL || dst == NULL) {
+        free(src);
+        free(dst);
+        return 1;
+    }
+
+    for (n = 0; n < w * h * 2; n++)
+        src[n] = rand();
+
+    for (i = 0; i < count; i++) {
+        const struct csc_kernels *k = list[i];
+        int bad = k == &csc_c ? 0 : check_kernels(k);
+
+        double start = now_ms();
+        for (n = 0; n < BENCH_FRAMES; n++) {
+            for (y = 0; y < h; y += 2) {
+                const uint8 *s = src + y * w * 2;
+
+                k->row_uv(s, s + w * 2, dst + w * h + y / 2 * w, w, 1);
+                k->row_y(s, dst + y * w, w, 1);
+                k->row_y(s + w * 2, dst + (y + 1) * w, w, 1);
+            }
+        }
+        double ms = (now_ms() - start) / BENCH_FRAMES;
+
+        printf("  %-6s kernels: 1080p UYVY->NV12 %7.3f ms/frame, %s\n", k->isa, ms,
+               k == &csc_c ? "reference" : bad ? "NOT bit-exact" : "bit-exact");
+        errors += bad;
+    }
+
+    free(src);
+    free(dst);
+    return errors;
+}
+
+/*
+ * NV12 for the encoder plus I420 for a raw sink, as two conversions and
+ * as one fused pass
+ */
+static void bench_fused(void) {
+    unsigned int i;
+    int n;
+
+    for (i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+        int w = bench_sizes[i].width;
+        int h = bench_sizes[i].height;
+        uint8 *src = malloc(w * h * 2);
+        uint8 *nv12 = malloc(w * h * 3 / 2);
+        uint8 *i420 = malloc(w * h * 3 / 2);
+
+        if (src == NULL || nv12 == NULL || i420 == NULL) {
+            free(src);
+            free(nv12);
+            free(i420);
+            continue;
+        }
+
+        for (n = 0; n < w * h * 2; n++)
+            src[n] = rand();
+
+        double start = now_ms();
+        for (n = 0; n < BENCH_FRAMES; n++) {
+            csc_packed422_to_nv12(1, src, w * 2, nv12, w, nv12 + w * h, w, w, h, w, h, NULL, NULL);
+            csc_packed422_to_i420(1, src, w * 2, i420, w, i420 + w * h, w / 2,
+                                  i420 + w * h * 5 / 4, w / 2, w, h, NULL, NULL);
+        }
+        double two_pass = (now_ms() - start) / BENCH_FRAMES;
+
+        start = now_ms();
+        for (n = 0; n < BENCH_FRAMES; n++)
+            csc_packed422_to_nv12_i420(1, src, w * 2, nv12, w, nv12 + w * h, w,
+                                       i420, w, i420 + w * h, w / 2,
+                                       i420 + w * h * 5 / 4, w / 2, w, h, w, h, NULL);
+        double fused = (now_ms() - start) / BENCH_FRAMES;
+
+        printf("  %-6s UYVY->NV12+I420 %d thread(s): two-pass %7.3f ms, fused %7.3f ms, %.2fx\n",
+               bench_sizes[i].name, csc_get_threads(), two_pass, fused,
+               fused > 0 ? two_pass / fused : 0.0);
+
+        free(src);
+        free(nv12);
+        free(i420);
+    }
+}
+
+/*
+ * the two encoder inputs, NV12 averages chroma rows, NV16 only splits them
+ */
+static void bench_nv16(void) {
+    unsigned int i;
+    int n;
+
+    for (i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+        int w = bench_sizes[i].width;
+        int h = bench_sizes[i].height;
+        int stride = (w + 15) & ~15;
+        int rows = (h + 15) & ~15;
+        uint8 *src = malloc(w * h * 2);
+        uint8 *dst = malloc(stride * rows * 2);
+
+        if (src == NULL || dst == NULL) {
+            free(src);
+            free(dst);
+            continue;
+        }
+
+        for (n = 0; n < w * h * 2; n++)
+            src[n] = rand();
+
+        double start = now_ms();
+        for (n = 0; n < BENCH_FRAMES; n++)
+            csc_packed422_to_nv12(1, src, w * 2, dst, stride, dst + stride * rows, stride,
+                                  w, h, stride, rows, NULL, NULL);
+        double nv12 = (now_ms() - start) / BENCH_FRAMES;
+
+        start = now_ms();
+        for (n = 0; n < BENCH_FRAMES; n++)
+            csc_packed422_to_nv16(1, src, w * 2, dst, stride, dst + stride * rows, stride,
+                                  w, h, stride, rows, NULL, NULL);
+        double nv16 = (now_ms() - start) / BENCH_FRAMES;
+
+        printf("  %-6s UYVY->NV12 %7.3f ms, UYVY->NV16 %7.3f ms, %d thread(s)\n",
+               bench_sizes[i].name, nv12, nv16, csc_get_threads());
+
+        free(src);
+        free(dst);
+    }
+}
+
+/*
+ * UYVY to the encoder's NV12 with each deinterlacer, at the analog frame
+ * sizes. The source is a woven moving picture: every other row comes from
+ * a shifted copy and one frame in two moves, so the motion mode does both.
+ */
+static void bench_deint(void) {
+    static const struct { const char *name; int width, height; } sizes[] = {
+        { "NTSC", 720, 480 },
+        { "PAL", 720, 576 },
+    };
+    unsigned int i;
+    int mode, n, x, y;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        int w = sizes[i].width;
+        int h = sizes[i].height;
+        int stride = (w + 15) & ~15;
+        int rows = (h + 15) & ~15;
+        uint8 *src[2] = { malloc(w * h * 2), malloc(w * h * 2) };
+        uint8 *dst = malloc(stride * rows * 3 / 2);
+        double base = 0;
+
+        if (src[0] == NULL || src[1] == NULL || dst == NULL)
+            goto next;
+
+        for (y = 0; y < h; y++)
+            for (x = 0; x < w * 2; x++) {
+                src[0][y * w * 2 + x] = (x / 2 + (y & 1) * 8) * 3 + y;
+                src[1][y * w * 2 + x] = (x / 2 + (y & 1) * 24) * 3 + y;
+            }
+
+        printf("  %-6s UYVY->NV12 deinterlaced, %d thread(s):", sizes[i].name, csc_get_threads());
+        for (mode = CSC_DEINT_OFF; mode <= CSC_DEINT_MOTION; mode++) {
+            struct csc_deint d;
+
+            csc_deint_init(&d, mode, 0);
+            double start = now_ms();
+            for (n = 0; n < BENCH_FRAMES; n++)
+                csc_packed422_to_nv12(1, src[n / 2 & 1], w * 2, dst, stride, dst + stride * rows, stride,
+                                      w, h, stride, rows, mode ? &d : NULL, NULL);
+            double ms = (now_ms() - start) / BENCH_FRAMES;
+            csc_deint_free(&d);
+
+            if (mode == CSC_DEINT_OFF)
+                base = ms;
+            printf(" %s %.3f ms", csc_deint_name(mode), ms);
+            if (mode != CSC_DEINT_OFF)
+                printf(" (+%.0f%%)", base > 0 ? (ms - base) * 100 / base : 0.0);
+        }
+        printf("\n");
+
+next:
+        free(src[0]);
+        free(src[1]);
+        free(dst);
+    }
+}
+
+/*
+ * UYVY to the encoder's NV12 through each geometry, against the plain
+ * conversion of the same frame
+ */
+static void bench_geometry(void) {
+    static const struct { const char *name; struct csc_geometry g; } cases[] = {
+        { "plain", { 0 } },
+        { "crop", { .crop_x = 64, .crop_y = 32, .crop_width = -128, .crop_height = -64 } },
+        { "mirror", { .hflip = 1 } },
+        { "flip", { .vflip = 1 } },
+        { "rot90", { .rotate = 90 } },
+        { "rot180", { .rotate = 180 } },
+        { "rot270", { .rotate = 270 } },
+    };
+    unsigned int i, c;
+    int n;
+
+    for (i = 1; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+        int w = bench_sizes[i].width;
+        int h = bench_sizes[i].height;
+        int size = ((w > h ? w : h) + 15) & ~15;
+        uint8 *src = malloc(w * h * 2);
+        uint8 *dst = malloc(size * size * 3 / 2);
+        double base = 0;
+
+        if (src == NULL || dst == NULL) {
+            free(src);
+            free(dst);
+            continue;
+        }
+
+        for (n = 0; n < w * h * 2; n++)
+            src[n] = rand();
+
+        printf("  %-6s UYVY->NV12 %d thread(s):", bench_sizes[i].name, csc_get_threads());
+        for (c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+            struct csc_geometry g = cases[c].g;
+            int ow, oh, stride, rows;
+
+            /* the crop is relative to the frame size */
+            if (g.crop_width < 0)
+                g.crop_width += w;
+            if (g.crop_height < 0)
+                g.crop_height += h;
+            csc_geometry_size(&g, w, h, &ow, &oh);
+            stride = (ow + 15) & ~15;
+            rows = (oh + 15) & ~15;
+
+            double start = now_ms();
+            for (n = 0; n < BENCH_FRAMES; n++)
+                csc_packed422_to_nv12(1, src, w * 2, dst, stride, dst + stride * rows, stride,
+                                      w, h, stride, rows, NULL, c ? &g : NULL);
+            double ms = (now_ms() - start) / BENCH_FRAMES;
+
+            if (c == 0)
+                base = ms;
+            printf(" %s %.3f ms", cases[c].name, ms);
+            if (c)
+                printf(" (%+.0f%%)", base > 0 ? (ms - base) * 100 / base : 0.0);
+        }
+        printf("\n");
+
+        free(src);
+        free(dst);
+    }
+}
+
+/*
+ * A downscaled I420 picture against a plain box filter: every output
+ * sample the average of the source samples it covers, chroma rows then
+ * averaged in pairs like the conversion does. Off by one is rounding, the
+ * scaler multiplies by 65536 / area rounded down. Returns the largest
+ * difference, or -1 when out of memory.
+ */
+static int scale_error(const uint8 *src, int w, int h, int uyvy, int vflip,
+                       const uint8 *dst, int sw, int sh) {
+    int cw = sw / 2, luma = uyvy, chroma = !uyvy;
+    int *row_c = malloc(2 * cw * sizeof(int));
+    int x, y, n, worst = 0;
+
+    if (row_c == NULL)
+        return -1;
+
+    for (y = 0; y < sh; y++) {
+        int sy = vflip ? sh - 1 - y : y;
+        int y0 = sy * h / sh, y1 = (sy + 1) * h / sh;
+
+        for (x = 0; x < sw; x++) {
+            int x0 = x * w / sw, x1 = (x + 1) * w / sw;
+            int sum = 0, r, c, d;
+
+            for (r = y0; r < y1; r++)
+                for (c = x0; c < x1; c++)
+                    sum += src[r * w * 2 + 2 * c + luma];
+            d = dst[y * sw + x] - (2 * sum + (y1 - y0) * (x1 - x0)) / (2 * (y1 - y0) * (x1 - x0));
+            if (abs(d) > worst)
+                worst = abs(d);
+        }
+
+        /* chroma of the scaled row, the I420 row averages two of them */
+        for (x = 0; x < 2 * cw; x++) {
+            int x0 = x / 2 * (w / 2) / cw, x1 = (x / 2 + 1) * (w / 2) / cw;
+            int sum = 0, r, c;
+
+            for (r = y0; r < y1; r++)
+                for (c = x0; c < x1; c++)
+                    sum += src[r * w * 2 + 4 * c + chroma + 2 * (x & 1)];
+            n = (y1 - y0) * (x1 - x0);
+            row_c[x] = y & 1 ? (row_c[x] + (2 * sum + n) / (2 * n)) / 2 : (2 * sum + n) / (2 * n);
+        }
+        if (y & 1) {
+            for (x = 0; x < cw; x++) {
+                int du = dst[sw * sh + y / 2 * cw + x] - row_c[2 * x];
+                int dv = dst[sw * sh * 5 / 4 + y / 2 * cw + x] - row_c[2 * x + 1];
+
+                if (abs(du) > worst)
+                    worst = abs(du);
+                if (abs(dv) > worst)
+                    worst = abs(dv);
+            }
+        }
+    }
+    free(row_c);
+    return worst;
+}
+
+/*
+ * Downscaled conversions through scale_error(), one size at a time and
+ * then every size of a case from one pyramid pass, with one and three
+ * workers so bands of different pictures meet at different rows. Returns
+ * the number of pictures off by more than one.
+ */
+static int check_scale(void) {
+    static const struct {
+        int width, height, scale_width, scale_height, uyvy, vflip;
+    } cases[] = {
+        { 1920, 1080, 1280, 720, 1, 0 },
+        { 1920, 1080, 960, 540, 1, 0 },
+        { 1920, 1080, 640, 360, 0, 0 },
+        { 1920, 1080, 320, 180, 1, 1 },
+        { 640, 480, 176, 144, 1, 0 },
+        { 1918, 1078, 1000, 562, 0, 1 },
+    };
+    static const struct {
+        int width, height, uyvy, vflip, sizes[4][2];
+    } pyramids[] = {
+        { 1920, 1080, 1, 0, { { 1920, 1080 }, { 1280, 720 }, { 640, 360 }, { 320, 180 } } },
+        { 1918, 1078, 0, 1, { { 1000, 562 }, { 960, 538 }, { 480, 270 }, { 176, 144 } } },
+    };
+    int errors = 0, worst, t, l;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        int w = cases[i].width, h = cases[i].height;
+        int sw = cases[i].scale_width, sh = cases[i].scale_height, cw = sw / 2;
+        struct csc_geometry g = { .scale_width = sw, .scale_height = sh, .vflip = cases[i].vflip };
+        uint8 *src = malloc(w * h * 2);
+        uint8 *dst = malloc(sw * sh * 3 / 2);
+        int n;
+
+        if (src == NULL || dst == NULL) {
+            free(src);
+            free(dst);
+            return errors + 1;
+        }
+        for (n = 0; n < w * h * 2; n++)
+            src[n] = rand();
+        csc_packed422_to_i420(cases[i].uyvy, src, w * 2, dst, sw, dst + sw * sh, cw,
+                              dst + sw * sh * 5 / 4, cw, w, h, NULL, &g);
+
+        worst = scale_error(src, w, h, cases[i].uyvy, g.vflip, dst, sw, sh);
+        if ((worst < 0 || worst > 1) && errors++ < 8)
+            printf("  %s %dx%d->%dx%d%s: off by up to %d from a box filter\n",
+                   cases[i].uyvy ? "UYVY" : "YUYV", w, h, sw, sh, g.vflip ? " flipped" : "", worst);
+        free(src);
+        free(dst);
+    }
+
+    for (i = 0; i < sizeof(pyramids) / sizeof(pyramids[0]); i++) {
+        int w = pyramids[i].width, h = pyramids[i].height, uyvy = pyramids[i].uyvy;
+        struct csc_geometry g = { .vflip = pyramids[i].vflip };
+        struct csc_level level[4];
+        uint8 *src = malloc(w * h * 2);
+        uint8 *dst[4] = { NULL };
+        int n;
+
+        for (l = 0; l < 4; l++) {
+            int sw = pyramids[i].sizes[l][0], sh = pyramids[i].sizes[l][1];
+
+            dst[l] = malloc(sw * sh * 3 / 2);
+            level[l] = (struct csc_level){ .kind = CSC_LEVEL_I420, .width = sw, .height = sh,
+                                           .plane = { dst[l], dst[l] + sw * sh, dst[l] + sw * sh * 5 / 4 },
+                                           .stride = { sw, sw / 2, sw / 2 } };
+        }
+        if (src == NULL || !dst[0] || !dst[1] || !dst[2] || !dst[3]) {
+            free(src);
+            for (l = 0; l < 4; l++)
+                free(dst[l]);
+            return errors + 1;
+        }
+        for (n = 0; n < w * h * 2; n++)
+            src[n] = rand();
+
+        for (t = 1; t <= 3; t += 2) {
+            csc_set_threads(t);
+            if (csc_packed422_pyramid(uyvy, src, w * 2, w, h, NULL, &g, level, 4) < 0) {
+                if (errors++ < 8)
+                    printf("  %s %dx%d pyramid refused\n", uyvy ? "UYVY" : "YUYV", w, h);
+                continue;
+            }
+            for (l = 0; l < 4; l++) {
+                int sw = level[l].width, sh = level[l].height;
+
+                worst = scale_error(src, w, h, uyvy, g.vflip, dst[l], sw, sh);
+                if ((worst < 0 || worst > 1) && errors++ < 8)
+                    printf("  %s %dx%d->%dx%d%s in a pyramid, %d thread(s): off by up to %d from a box filter\n",
+                           uyvy ? "UYVY" : "YUYV", w, h, sw, sh, g.vflip ? " flipped" : "", t, worst);
+            }
+        }
+        free(src);
+        for (l = 0; l < 4; l++)
+            free(dst[l]);
+    }
+
+    printf("  downscaler: %d sizes, %d pyramids, %s a box filter\n", (int)(sizeof(cases) / sizeof(cases[0])),
+           (int)(sizeof(pyramids) / sizeof(pyramids[0])), errors ? "do NOT match" : "match");
+    return errors;
+}
+
+/*
+ * The rotated conversions against their definition: each destination
+ * sample looked up in the source through the crop, the mirrors and the
+ * rotation, the chroma of a destination pixel pair the average of the two
+ * source rows under it rounding down (NV16 takes it for both of its rows),
+ * the padding a copy of the last row and column. Odd crops, both rotations
+ * and byte orders, each destination format, with one and three workers so
+ * bands meet inside the picture. Returns the number of mismatches.
+ */
+enum { ROT_NV12, ROT_NV16, ROT_I420 };
+
+/* the pixel pair of source pixel (x, y) of the rotated picture, odd for its second pixel */
+static const uint8 *rot_pixel(const uint8 *src, int stride, const struct csc_geometry *g,
+                              int x, int y, int *odd) {
+    int c = g->rotate == 90 ? y : g->crop_width - 1 - y;
+    int r = g->rotate == 90 ? g->crop_height - 1 - x : x;
+
+    if (g->hflip)
+        c = g->crop_width - 1 - c;
+    if (g->vflip)
+        r = g->crop_height - 1 - r;
+    *odd = c & 1;
+    return src + (g->crop_y + r) * stride + (g->crop_x + (c & ~1)) * 2;
+}
+
+static int check_rotation(void) {
+    static const struct {
+        int width, height;
+        struct csc_geometry g;
+    } cases[] = {
+        { 66, 34, { .crop_width = 66, .crop_height = 34, .rotate = 90 } },
+        { 66, 34, { .crop_width = 66, .crop_height = 34, .rotate = 270 } },
+        { 640, 480, { .crop_width = 640, .crop_height = 480, .hflip = 1, .rotate = 90 } },
+        { 1280, 720, { .crop_x = 18, .crop_y = 6, .crop_width = 1202, .crop_height = 694, .rotate = 270 } },
+        { 1280, 720, { .crop_x = 18, .crop_y = 6, .crop_width = 1202, .crop_height = 694,
+                       .hflip = 1, .vflip = 1, .rotate = 90 } },
+        { 1920, 1080, { .crop_x = 2, .crop_width = 16, .crop_height = 1080, .vflip = 1, .rotate = 270 } },
+    };
+    int errors = 0;
+    unsigned int i;
+    int fmt, t, uyvy;
+
+    for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        int w = cases[i].width, h = cases[i].height;
+        struct csc_geometry g = cases[i].g;
+        int pw, ph;
+        uint8 *src = malloc(w * h * 2);
+        uint8 *dst = NULL;
+
+        if (src == NULL || csc_geometry_size(&g, w, h, &pw, &ph) < 0 ||
+            (dst = malloc(((pw + 15) & ~15) * ((ph + 15) & ~15) * 2)) == NULL) {
+            free(src);
+            return errors + 1;
+        }
+        for (t = 0; t < w * h * 2; t++)
+            src[t] = rand();
+
+        for (t = 1; t <= 3; t += 2)
+        for (uyvy = 0; uyvy < 2; uyvy++)
+        for (fmt = ROT_NV12; fmt <= ROT_I420; fmt++) {
+            /* the I420 conversion has no padding */
+            int ow = fmt == ROT_I420 ? pw : (pw + 15) & ~15;
+            int oh = fmt == ROT_I420 ? ph : (ph + 15) & ~15;
+            int ocw = (ow + 1) / 2, och = fmt == ROT_NV16 ? oh : (oh + 1) / 2;
+            uint8 *dst_c = dst + ow * oh;
+            int x, y, odd, bad = 0;
+
+            csc_set_threads(t);
+            if (fmt == ROT_NV12)
+                csc_packed422_to_nv12(uyvy, src, w * 2, dst, ow, dst_c, ow, w, h, ow, oh, NULL, &g);
+            else if (fmt == ROT_NV16)
+                csc_packed422_to_nv16(uyvy, src, w * 2, dst, ow, dst_c, ow, w, h, ow, oh, NULL, &g);
+            else
+                csc_packed422_to_i420(uyvy, src, w * 2, dst, ow, dst_c, ocw, dst_c + ocw * och, ocw,
+                                      w, h, NULL, &g);
+
+            for (y = 0; y < oh; y++)
+                for (x = 0; x < ow; x++) {
+                    const uint8 *p = rot_pixel(src, w * 2, &g, x < pw ? x : pw - 1,
+                                               y < ph ? y : ph - 1, &odd);
+
+                    bad += dst[y * ow + x] != p[2 * odd + uyvy];
+                }
+
+            /* U and V of each pixel pair, the pair and the row it is the chroma of */
+            for (y = 0; y < och; y++)
+                for (x = 0; x < 2 * ocw; x++) {
+                    int px = (x / 2 < pw / 2 ? x / 2 : pw / 2 - 1) * 2;
+                    int py = fmt == ROT_NV16 ? (y < ph ? y : ph - 1) : (y < ph / 2 ? y : ph / 2 - 1) * 2;
+                    int k = 2 * (x & 1) + !uyvy;
+                    int v = (rot_pixel(src, w * 2, &g, px, py, &odd)[k] +
+                             rot_pixel(src, w * 2, &g, px + 1, py, &odd)[k]) / 2;
+
+                    if (fmt == ROT_I420)
+                        bad += dst_c[(x & 1) * ocw * och + y * ocw + x / 2] != v;
+                    else
+                        bad += dst_c[y * ow + x] != v;
+                }
+
+            if (bad && errors++ < 8)
+                printf("  %s %dx%d+%d+%d of %dx%d%s%s rotated by %d to %s, %d thread(s): %d samples differ\n",
+                       uyvy ? "UYVY" : "YUYV", g.crop_width, g.crop_height, g.crop_x, g.crop_y, w, h,
+                       g.hflip ? " mirrored" : "", g.vflip ? " upside down" : "", g.rotate,
+                       fmt == ROT_NV12 ? "NV12" : fmt == ROT_NV16 ? "NV16" : "I420", t, bad);
+        }
+        free(src);
+        free(dst);
+    }
+
+    printf("  rotation: %d geometries, %s their definition\n", (int)(sizeof(cases) / sizeof(cases[0])),
+           errors ? "do NOT match" : "match");
+    return errors;
+}
+
+/*
+ * 1080p UYVY downscaled to I420 at the usual preview sizes, each against
+ * the full size conversion, all of them one after the other and all of
+ * them from one pyramid pass
+ */
+static void bench_scale(void) {
+    static const int sizes[][2] = { { 1920, 1080 }, { 1280, 720 }, { 960, 540 }, { 640, 360 }, { 320, 180 } };
+    enum { SIZES = sizeof(sizes) / sizeof(sizes[0]) };
+    struct csc_level level[SIZES];
+    int w = 1920, h = 1080;
+    uint8 *src = malloc(w * h * 2);
+    uint8 *dst = malloc(w * h * 3);
+    uint8 *plane;
+    double base = 0, total = 0;
+    unsigned int i;
+    int n;
+
+    if (src == NULL || dst == NULL) {
+        free(src);
+        free(dst);
+        return;
+    }
+
+    for (n = 0; n < w * h * 2; n++)
+        src[n] = rand();
+
+    printf("  1080p  UYVY->I420 %d thread(s):", csc_get_threads());
+    for (i = 0, plane = dst; i < SIZES; i++) {
+        struct csc_geometry g = { .scale_width = sizes[i][0], .scale_height = sizes[i][1] };
+        int sw = sizes[i][0], sh = sizes[i][1];
+
+        double start = now_ms();
+        for (n = 0; n < BENCH_FRAMES; n++)
+            csc_packed422_to_i420(1, src, w * 2, dst, sw, dst + sw * sh, sw / 2,
+                                  dst + sw * sh * 5 / 4, sw / 2, w, h, NULL, i ? &g : NULL);
+        double ms = (now_ms() - start) / BENCH_FRAMES;
+
+        if (i == 0)
+            base = ms;
+        total += ms;
+        printf(" %dx%d %.3f ms", sw, sh, ms);
+        if (i)
+            printf(" (%.2fx)", ms > 0 ? base / ms : 0.0);
+
+        /* the pyramid's pictures side by side, 1.5 bytes a pixel each */
+        level[i] = (struct csc_level){ .kind = CSC_LEVEL_I420, .width = sw, .height = sh,
+                                       .plane = { plane, plane + sw * sh, plane + sw * sh * 5 / 4 },
+                                       .stride = { sw, sw / 2, sw / 2 } };
+        plane += sw * sh * 3 / 2;
+    }
+    printf(", all %.3f ms", total);
+
+    double start = now_ms();
+    for (n = 0; n < BENCH_FRAMES; n++)
+        csc_packed422_pyramid(1, src, w * 2, w, h, NULL, NULL, level, SIZES);
+    double ms = (now_ms() - start) / BENCH_FRAMES;
+    printf(", one pass %.3f ms (%.2fx)\n", ms, ms > 0 ? total / ms : 0.0);
+
+    free(src);
+    free(dst);
+}
+
+/*
+ * UYVY to NV12 in the encoder's macroblock aligned layout for every frame
+ * size and 1..max_threads workers. Returns non-zero when a kernel table
+ * does not match the C kernels.
+ */
+int bench_csc(int max_threads) {
+    unsigned int i;
+    int t, n, errors;
+
+    if (max_threads <= 0)
+        max_threads = csc_set_threads(0);
+
+    printf("CSC benchmark, %s kernels, %d frames per run\n",
+           csc_get_kernels()->isa, BENCH_FRAMES);
+    errors = bench_kernels();
+    errors += check_conversions();
+    errors += check_scale();
+    errors += check_rotation();
+
+    for (i = 0; i < sizeof(bench_sizes) / sizeof(bench_sizes[0]); i++) {
+        int w = bench_sizes[i].width;
+        int h = bench_sizes[i].height;
+        int stride = (w + 15) & ~15;
+        int rows = (h + 15) & ~15;
+        uint8 *src = malloc(w * h * 2);
+        uint8 *dst = malloc(stride * rows * 3 / 2);
+        double single = 0;
+
+        if (src == NULL || dst == NULL) {
+            free(src);
+            free(dst);
+            continue;
+        }
+
+        for (n = 0; n < w * h * 2; n++)
+            src[n] = rand();
+
+        for (t = 1; t <= max_threads; t++) {
+            csc_set_threads(t);
+
+            /* warm up caches and the pool */
+            csc_packed422_to_nv12(1, src, w * 2, dst, stride, dst + stride * rows, stride,
+                                  w, h, stride, rows, NULL, NULL);
+
+            double start = now_ms();
+            for (n = 0; n < BENCH_FRAMES; n++)
+                csc_packed422_to_nv12(1, src, w * 2, dst, stride, dst + stride * rows, stride,
+                                      w, h, stride, rows, NULL, NULL);
+            double ms = (now_ms() - start) / BENCH_FRAMES;
+
+            if (t == 1)
+                single = ms;
+            printf("  %-6s UYVY->NV12 %d thread(s): %7.3f ms/frame, %.2fx\n",
+                   bench_sizes[i].name, t, ms, ms > 0 ? single / ms : 0.0);
+        }
+
+        free(src);
+        free(dst);
+    }
+
+    csc_set_threads(max_threads);
+    bench_fused();
+    bench_nv16();
+    bench_deint();
+    bench_geometry();
+    bench_scale();
+
+    return errors;
+}
+
+/*
+ * SPS, PPS and slice headers of fixed parameters against bytes written
+ * out by hand from the syntax tables, an unaligned end zero padded. The
+ * last case is no real profile, it is there for the 00 00 02 it puts in
+ * the SPS. Returns the number of mismatches.
+ */
+static const struct {
+    struct { int width, height, profile, level, cabac, qp; } p;
+    int sps_pps;
+    unsigned int frame_num;
+    unsigned int bits;
+    uint8_t bytes[40];
+} header_cases[] = {
+    /* 1280x720 CABAC, IDR with SPS and PPS */
+    { { 1280, 720, 77, 41, 1, 24 }, 1, 0, 232,
+        { 0x00, 0x00, 0x00, 0x01, 0x67, 0x4d, 0x00, 0x29, 0xda, 0x01, 0x40, 0x16, 0xc4, 0x00,
+          0x00, 0x00, 0x01, 0x68, 0xee, 0x0a, 0x51, 0x12, 0x00, 0x00, 0x00, 0x01, 0x65, 0xb8,
+          0x4f } },
+    /* 1280x720 CABAC, P slice */
+    { { 1280, 720, 77, 41, 1, 24 }, 0, 1, 55,
+        { 0x00, 0x00, 0x00, 0x01, 0x41, 0xe2, 0x3e } },
+    /* 1920x1080 CAVLC, cropped to 1080 rows */
+    { { 1920, 1080, 66, 40, 0, 30 }, 1, 0, 248,
+        { 0x00, 0x00, 0x00, 0x01, 0x67, 0x42, 0x00, 0x28, 0xda, 0x01, 0xe0, 0x08, 0x97, 0x95,
+          0x00, 0x00, 0x00, 0x01, 0x68, 0xce, 0x04, 0x08, 0x11, 0x20, 0x00, 0x00, 0x00, 0x01,
+          0x65, 0xb8, 0x4f } },
+    /* 00 00 02 in the SPS gets an emulation prevention byte */
+    { { 320, 240, 0, 2, 0, 26 }, 1, 3, 222,
+        { 0x00, 0x00, 0x00, 0x01, 0x67, 0x00, 0x00, 0x03, 0x02, 0xda, 0x05, 0x07, 0xc4, 0x00,
+          0x00, 0x00, 0x01, 0x68, 0xce, 0x31, 0x12, 0x00, 0x00, 0x00, 0x01, 0x41, 0xe6, 0x3c } },
+};
+
+int bench_h264_headers(void) {
+    unsigned int i;
+    int errors = 0;
+
+    for (i = 0; i < sizeof(header_cases) / sizeof(header_cases[0]); i++) {
+        struct h264enc_params p;
+        uint8_t buf[64];
+        unsigned int bits;
+
+        memset(&p, 0, sizeof(p));
+        p.width = p.src_width = header_cases[i].p.width;
+        p.height = header_cases[i].p.height;
+        p.src_height = (p.height + 15) & ~15;
+        p.profile_idc = header_cases[i].p.profile;
+        p.level_idc = header_cases[i].p.level;
+        p.entropy_coding_mode = header_cases[i].p.cabac ? H264_EC_CABAC : H264_EC_CAVLC;
+        p.qp = header_cases[i].p.qp;
+        p.keyframe_interval = 25;
+
+        memset(buf, 0xff, sizeof(buf));
+        bits = h264enc_get_headers(&p, header_cases[i].sps_pps, header_cases[i].frame_num, buf, sizeof(buf));
+        if (bits != header_cases[i].bits || memcmp(buf, header_cases[i].bytes, (bits + 7) / 8) != 0) {
+            unsigned int n;
+
+            errors++;
+            printf("  %dx%d %s frame %u: %u bits", p.width, p.height,
+                   header_cases[i].p.cabac ? "CABAC" : "CAVLC", header_cases[i].frame_num, bits);
+            for (n = 0; n < (bits + 7) / 8 && n < sizeof(buf); n++)
+                printf(" %02x", buf[n]);
+            printf("\n");
+        }
+    }
+
+    printf("H264 headers: %u cases %s\n", i, errors ? "do NOT match" : "match");
+    return errors;
+}
+
+/*
+ * one VE client of bench_ve(), a job holds the VE for job_us
+ */
+struct sched_client {
+    const char *name;
+    int priority;
+    enum ve_late_policy late;
+    int jobs;
+    int job_us;
+    int period_us;      /* from one request to the next, 0 back to back */
+    int deadline_us;    /* after the request, 0 for none */
+    struct ve_client *client;
+};
+
+static int sched_busy;
+static int sched_overlaps;
+
+static void *sched_thread(void *arg) {
+    struct sched_client *c = arg;
+    struct timespec start, deadline;
+    int i;
+
+    for (i = 0; i < c->jobs; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        deadline = start;
+        deadline.tv_nsec += c->deadline_us * 1000L;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+
+        if (ve_acquire(c->client, VE_ENGINE_AVC, 0, c->deadline_us ? &deadline : NULL)) {
+            if (__sync_fetch_and_add(&sched_busy, 1))
+                __sync_fetch_and_add(&sched_overlaps, 1);
+            usleep(c->job_us);
+            __sync_fetch_and_sub(&sched_busy, 1);
+            ve_put();
+        }
+
+        if (c->period_us) {
+            double left = c->period_us / 1000.0 - (now_ms() - (start.tv_sec * 1000.0 + start.tv_nsec / 1000000.0));
+
+            if (left > 0)
+                usleep(left * 1000);
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * A live stream that has to run, a preview that drops frames it is late
+ * for and an archive encode without deadlines keeping the VE busy, the
+ * way several streams or cameras share it. Runs without the device, the
+ * scheduler only skips the register writes.
+ */
+int bench_ve(void) {
+    static struct sched_client clients[] = {
+        { "live", 1, VE_LATE_RUN, 30, 4000, 33000, 10000, NULL },
+        { "preview", 0, VE_LATE_DROP, 30, 2000, 33000, 10000, NULL },
+        { "archive", 0, VE_LATE_RUN, 120, 6000, 0, 0, NULL },
+    };
+    const int n = sizeof(clients) / sizeof(clients[0]);
+    pthread_t threads[sizeof(clients) / sizeof(clients[0])];
+    struct ve_sched_stats ss;
+    int i;
+
+    printf("VE scheduler, software engine\n");
+    sched_overlaps = 0;
+    for (i = 0; i < n; i++) {
+        clients[i].client = ve_client_new(clients[i].priority, clients[i].late);
+        if (!clients[i].client || pthread_create(&threads[i], NULL, sched_thread, &clients[i])) {
+            printf("  could not start %s\n", clients[i].name);
+            while (i--)
+                pthread_join(threads[i], NULL);
+            return 1;
+        }
+    }
+    for (i = 0; i < n; i++)
+        pthread_join(threads[i], NULL);
+
+    for (i = 0; i < n; i++) {
+        struct ve_client_stats st;
+        unsigned long requests;
+
+        ve_client_stats(clients[i].client, &st);
+        requests = st.jobs + st.dropped;
+        printf("  %-8s priority %d, %d ms jobs: %lu run, %lu late, %lu dropped, wait avg %.2f ms max %.2f ms,"
+               " up to %u requests ahead\n",
+               clients[i].name, clients[i].priority, clients[i].job_us / 1000, st.jobs, st.late, st.dropped,
+               requests ? st.wait_us / 1000.0 / requests : 0.0, st.max_wait_us / 1000.0, st.max_queued);
+        ve_client_free(clients[i].client);
+    }
+
+    ve_sched_stats(&ss);
+    printf("  %lu jobs, %lu engine switches%s\n", ss.jobs, ss.engine_switches,
+           sched_overlaps ? ", VE HELD TWICE" : "");
+
+    return sched_overlaps != 0;
+}
+
+/*
+ * A 1080p frame converted into a cached VE buffer and flushed, the way
+ * -C range feeds the encoder, against the same conversion through the
+ * write-combined view -C uncached uses, with nothing to flush.
+ */
+void bench_cache(void) {
+    int w = bench_sizes[2].width;
+    int h = bench_sizes[2].height;
+    int size = w * h * 3 / 2;
+    struct ve_mem_stats ms;
+    uint8 *src, *cached, *wc;
+    int n;
+
+    if (!ve_open()) {
+        printf("VE cache modes: no VE, not measured\n");
+        return;
+    }
+
+    src = malloc(w * h * 2);
+    cached = ve_malloc(size);
+    wc = ve_malloc_uncached(size);
+    ve_mem_stats(&ms);
+    if (src != NULL && cached != NULL && wc != NULL) {
+        for (n = 0; n < w * h * 2; n++)
+            src[n] = rand();
+
+        csc_packed422_to_nv12(1, src, w * 2, cached, w, cached + w * h, w, w, h, w, h, NULL, NULL);
+        double start = now_ms();
+        for (n = 0; n < BENCH_FRAMES; n++) {
+            csc_packed422_to_nv12(1, src, w * 2, cached, w, cached + w * h, w, w, h, w, h, NULL, NULL);
+            ve_flush_cache(cached, size);
+        }
+        double range = (now_ms() - start) / BENCH_FRAMES;
+
+        csc_packed422_to_nv12(1, src, w * 2, wc, w, wc + w * h, w, w, h, w, h, NULL, NULL);
+        start = now_ms();
+        for (n = 0; n < BENCH_FRAMES; n++)
+            csc_packed422_to_nv12(1, src, w * 2, wc, w, wc + w * h, w, w, h, w, h, NULL, NULL);
+        double uncached = (now_ms() - start) / BENCH_FRAMES;
+
+        printf("VE cache modes, %s UYVY->NV12: range flush %.3f ms/frame, %s %.3f ms/frame\n",
+               bench_sizes[2].name, range,
+               ms.write_combined ? "write-combined" : "no write-combined view, cached unflushed", uncached);
+    }
+
+    free(src);
+    ve_free(cached);
+    ve_free(wc);
+    ve_close();
+}
@@ -0,0 +1,31 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/*
+ * colour conversion self-check and timings: every kernel table against the
+ * C kernels, thread scaling, fused vs two-pass and NV12 vs NV16 encoder
+ * input, -B on the command line.
+ * Returns non-zero if a kernel table is not bit-exact.
+ */
+int bench_csc(int max_threads);
+
+/*
+ * SPS, PPS and slice headers as the encoder writes them against known
+ * bytes, no VE needed. Returns the number of mismatches.
+ */
+int bench_h264_headers(void);
+
+/*
+ * VE scheduler with a software stand-in for the engine, clients of each
+ * priority and late policy at once. Returns non-zero if two of them
+ * ever held the VE together.
+ */
+int bench_ve(void);
+
+/*
+ * -C range against -C uncached on the real VE memory, skipped without
+ * the device.
+ */
+void bench_cache(void);
+
+#endif
@@ -1,3 +1,12 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#if defined(CPU_HAS_NEON)
+#include <sys/auxv.h>
+#endif
 #include "csc.h"
 /*
  *
@@ -73,6 +82,290 @@ void uyvy422to420(int width, int height, unsigned char *FrameIn, unsigned char *
     }
 }
 
+/*
+ *
+ */
+void nv12to420(int width, int height, unsigned char *FrameIn, unsigned char *FrameOut) {
+    int x;
+    const int YBufOutSize = height*width;
+    const int UVBufOutSize = height*width/4;
+    unsigned char *uv = FrameIn + YBufOutSize;
+
+    memcpy(FrameOut, FrameIn, YBufOutSize);
+    for (x = 0; x < UVBufOutSize; x++) {
+        FrameOut[YBufOutSize + x] = uv[2*x];
+        FrameOut[YBufOutSize + UVBufOutSize + x] = uv[2*x+1];
+    }
+}
+
+/*
+ *
+ */
+void nv16to420(int width, int height, unsigned char *FrameIn, unsigned char *FrameOut) {
+    int x,y,u,v;
+    const int YBufOutSize = height*width;
+    const int UVBufOutSize = height*width/4;
+    unsigned char *uv = FrameIn + YBufOutSize;
+
+    memcpy(FrameOut, FrameIn, YBufOutSize);
+    u = YBufOutSize;
+    v = YBufOutSize + UVBufOutSize;
+    for (y = 0; y < height; y+=2) {
+        for (x = 0; x < width; x+=2) {
+            FrameOut[u++] = (uv[x+y*width] + uv[x+(y+1)*width])/2;
+            FrameOut[v++] = (uv[1+x+y*width] + uv[1+x+(y+1)*width])/2;
+        }
+    }
+}
+
+/*
+ * scalar row kernels, also used for the tails of the SIMD ones
+ */
+static void c_row_y(const uint8 *src, uint8 *dst_y, int width, int uyvy) {
+    int x;
+
+    src += uyvy ? 1 : 0;
+    for (x = 0; x < width; x++)
+        dst_y[x] = src[2 * x];
+}
+
+static void c_row_uv(const uint8 *s0, const uint8 *s1, uint8 *dst_uv, int width, int uyvy) {
+    int x;
+
+    s0 += uyvy ? 0 : 1;
+    s1 += uyvy ? 0 : 1;
+    for (x = 0; x < width; x++)
+        dst_uv[x] = (s0[2 * x] + s1[2 * x]) / 2;
+}
+
+static void c_row_u_v(const uint8 *s0, const uint8 *s1, uint8 *dst_u, uint8 *dst_v, int width, int uyvy) {
+    int x;
+
+    s0 += uyvy ? 0 : 1;
+    s1 += uyvy ? 0 : 1;
+    for (x = 0; x < width / 2; x++) {
+        dst_u[x] = (s0[4 * x] + s1[4 * x]) / 2;
+        dst_v[x] = (s0[4 * x + 2] + s1[4 * x + 2]) / 2;
+    }
+}
+
+static void c_row_y2(const uint8 *src, uint8 *dst_a, uint8 *dst_b, int width, int uyvy) {
+    int x;
+
+    src += uyvy ? 1 : 0;
+    for (x = 0; x < width; x++)
+        dst_a[x] = dst_b[x] = src[2 * x];
+}
+
+static void c_row_uv_u_v(const uint8 *s0, const uint8 *s1, uint8 *dst_uv,
+                         uint8 *dst_u, uint8 *dst_v, int width, int uyvy) {
+    int x;
+
+    s0 += uyvy ? 0 : 1;
+    s1 += uyvy ? 0 : 1;
+    for (x = 0; x < width / 2; x++) {
+        dst_uv[2 * x] = dst_u[x] = (s0[4 * x] + s1[4 * x]) / 2;
+        dst_uv[2 * x + 1] = dst_v[x] = (s0[4 * x + 2] + s1[4 * x + 2]) / 2;
+    }
+}
+
+static void c_row_avg(const uint8 *a, const uint8 *b, uint8 *dst, int bytes) {
+    int x;
+
+    for (x = 0; x < bytes; x++)
+        dst[x] = (a[x] + b[x] + 1) / 2;
+}
+
+static void c_row_motion(const uint8 *above, const uint8 *cur, const uint8 *below,
+                         uint8 *prev, uint8 *dst, int bytes, int threshold) {
+    int x;
+
+    for (x = 0; x < bytes; x++) {
+        int c = cur[x];
+        int diff = c > prev[x] ? c - prev[x] : prev[x] - c;
+
+        dst[x] = diff > threshold ? (above[x] + below[x] + 1) / 2 : c;
+        prev[x] = c;
+    }
+}
+
+static void c_row_mirror(const uint8 *src, uint8 *dst, int width, int uyvy) {
+    const uint8 *s = src + 2 * width;
+    int x;
+
+    /* the two luma samples of a pair swap, its chroma stays */
+    for (x = 0; x < width / 2; x++) {
+        s -= 4;
+        if (uyvy) {
+            dst[4 * x] = s[0];
+            dst[4 * x + 1] = s[3];
+            dst[4 * x + 2] = s[2];
+            dst[4 * x + 3] = s[1];
+        } else {
+            dst[4 * x] = s[2];
+            dst[4 * x + 1] = s[1];
+            dst[4 * x + 2] = s[0];
+            dst[4 * x + 3] = s[3];
+        }
+    }
+}
+
+static void c_transpose_8x8(const uint8 *src, int src_stride, uint8 *dst, int dst_stride) {
+    int x, y;
+
+    for (y = 0; y < 8; y++)
+        for (x = 0; x < 8; x++)
+            dst[x * dst_stride + y] = src[y * src_stride + x];
+}
+
+static void c_transpose_8x8_16(const uint8 *src, int src_stride, uint8 *dst, int dst_stride) {
+    int x, y;
+
+    for (y = 0; y < 8; y++)
+        for (x = 0; x < 8; x++) {
+            dst[x * dst_stride + 2 * y] = src[y * src_stride + 2 * x];
+            dst[x * dst_stride + 2 * y + 1] = src[y * src_stride + 2 * x + 1];
+        }
+}
+
+static void c_transpose_y_8x8(const uint8 *src, int src_stride, uint8 *dst, int dst_stride, int uyvy) {
+    int x, y;
+
+    src += uyvy ? 1 : 0;
+    for (y = 0; y < 8; y++)
+        for (x = 0; x < 8; x++)
+            dst[x * dst_stride + y] = src[y * src_stride + 2 * x];
+}
+
+static void c_transpose_uv_8x8(const uint8 *src, int src_stride, uint8 *dst_u, int dst_stride_u,
+                               uint8 *dst_v, int dst_stride_v, int uyvy) {
+    int x, y;
+
+    src += uyvy ? 0 : 1;
+    for (y = 0; y < 8; y++) {
+        const uint8 *s0 = src + 2 * y * src_stride, *s1 = s0 + src_stride;
+
+        for (x = 0; x < 8; x++) {
+            int u = (s0[4 * x] + s1[4 * x]) / 2;
+            int v = (s0[4 * x + 2] + s1[4 * x + 2]) / 2;
+
+            if (dst_v) {
+                dst_u[x * dst_stride_u + y] = u;
+                dst_v[x * dst_stride_v + y] = v;
+            } else {
+                dst_u[x * dst_stride_u + 2 * y] = u;
+                dst_u[x * dst_stride_u + 2 * y + 1] = v;
+            }
+        }
+    }
+}
+
+static void c_row_accum(const uint8 *src, unsigned short *acc, int bytes) {
+    int x;
+
+    for (x = 0; x < bytes; x++)
+        acc[x] += src[x];
+}
+
+static void c_row_half(const unsigned short *src, unsigned short *dst, int width, int uyvy) {
+    int luma = uyvy, chroma = !uyvy;
+    int x;
+
+    for (x = 0; x < width / 4; x++) {
+        const unsigned short *s = src + 8 * x;
+        unsigned short *d = dst + 4 * x;
+        unsigned short u = s[chroma] + s[chroma + 4], v = s[chroma + 2] + s[chroma + 6];
+        unsigned short y0 = s[luma] + s[luma + 2], y1 = s[luma + 4] + s[luma + 6];
+
+        d[chroma] = u;
+        d[chroma + 2] = v;
+        d[luma] = y0;
+        d[luma + 2] = y1;
+    }
+}
+
+static void c_row_delta(const unsigned short *sum, unsigned short *last, unsigned short *dst, int count) {
+    int x;
+
+    for (x = 0; x < count; x++) {
+        dst[x] = sum[x] - last[x];
+        last[x] = sum[x];
+    }
+}
+
+static void c_row_scale(const unsigned short *src, uint8 *dst, int count, int scale) {
+    int x;
+
+    for (x = 0; x < count; x++)
+        dst[x] = (src[x] * (unsigned int)scale + 32768) >> 16;
+}
+
+static void c_cols_box(const unsigned short *src, int step, const int *cols,
+                       const unsigned short *scale, uint8 *dst, int dst_step, int count) {
+    int x, c, l;
+
+    for (x = 0; x < count; x++) {
+        const unsigned short *f = scale + 8 * (cols[x + 1] - cols[x]);
+        unsigned int sum[8] = { 0 };
+
+        for (c = cols[x]; c < cols[x + 1]; c++)
+            for (l = 0; l < 8; l++)
+                sum[l] += src[8 * step * c + l];
+        for (l = 0; l < 8; l++)
+            dst[8 * dst_step * x + l] = (sum[l] * f[l] + 32768) >> 16;
+    }
+}
+
+static void c_row_box(const unsigned short *src, uint8 *dst, const struct csc_box *box,
+                      const unsigned short *scale) {
+    int size = (box->terms * box->loads + 1) * 16;
+    int v, p = 0, advance = 0, t, l, b;
+
+    for (v = 0; v < box->vecs; v++) {
+        const unsigned short *in = src + box->base[p] + advance;
+        const uint8 *m = box->masks + p * size;
+        unsigned int sum[8] = { 0 };
+
+        for (t = 0; t < box->terms; t++) {
+            for (l = 0; l < box->loads; l++, m += 16) {
+                for (b = 0; b < 8; b++) {
+                    if (m[2 * b] < 16)
+                        sum[b] += in[8 * l + m[2 * b] / 2];
+                }
+            }
+        }
+        for (b = 0; b < 8; b++)
+            dst[8 * v + b] = (sum[b] * scale[m[2 * b] / 2] + 32768) >> 16;
+
+        if (++p == box->period) {
+            p = 0;
+            advance += box->advance;
+        }
+    }
+}
+
+const struct csc_kernels csc_c = {
+    .isa = "c",
+    .row_y = c_row_y,
+    .row_uv = c_row_uv,
+    .row_u_v = c_row_u_v,
+    .row_y2 = c_row_y2,
+    .row_uv_u_v = c_row_uv_u_v,
+    .row_avg = c_row_avg,
+    .row_motion = c_row_motion,
+    .row_mirror = c_row_mirror,
+    .transpose_8x8 = c_transpose_8x8,
+    .transpose_8x8_16 = c_transpose_8x8_16,
+    .transpose_y_8x8 = c_transpose_y_8x8,
+    .transpose_uv_8x8 = c_transpose_uv_8x8,
+    .row_accum = c_row_accum,
+    .row_delta = c_row_delta,
+    .row_half = c_row_half,
+    .row_scale = c_row_scale,
+    .cols_box = c_cols_box,
+    .row_box = c_row_box,
+};
+
 #if defined(CPU_HAS_NEON)  
 
 #define IS_ALIGNED(x, a) (((x) & ((typeof(x))(a) - 1)) == 0)
@@ -96,33 +389,41 @@ void ExtractY_NEON(const uint8 *src_uyvy, uint8 *dst_y, int width) {
     );                            
 }
 
-void ExtractUV_NEON(const uint8 *src_uyvy, uint8 *dst_uv, int width) {
+void ExtractUV_NEON(const uint8 *src_uyvy, const uint8 *src_uyvy1, uint8 *dst_uv, int width) {
     asm volatile (
        "1:                                      \n"
        "vld4.u8    {d0,d1,d2,d3}, [%0]!        \n" // load 16 pairs of UYVY
-       "subs  %2, %2, #16                     \n" // 16 processed per loop
-       "vst2.u8   {d0,d2}, [%1]!              \n" // store back U and V
+       "vld4.u8    {d4,d5,d6,d7}, [%1]!        \n" // and 16 of the next row
+       "subs  %3, %3, #16                     \n" // 16 processed per loop
+       "vhadd.u8  d0, d0, d4                  \n" // (U0 + U1) / 2
+       "vhadd.u8  d2, d2, d6                  \n" // (V0 + V1) / 2
+       "vst2.u8   {d0,d2}, [%2]!              \n" // store back U and V
        "bgt   1b                              \n" // Loop back if not done
        : "+r"(src_uyvy), // %0
-         "+r"(dst_uv), // %1
+         "+r"(src_uyvy1), // %1
+         "+r"(dst_uv), // %2
          "+r"(width)     // %3      // output registers
        :                            // input registers
        : "memory", "cc", "q0", "q1", "q2", "q3" // Clobber List
     );                             
 }
 
-void ExtractU_V_NEON(const uint8 *src_uyvy, uint8 *dst_u, uint8 *dst_v, int width) {
+void ExtractU_V_NEON(const uint8 *src_uyvy, const uint8 *src_uyvy1, uint8 *dst_u, uint8 *dst_v, int width) {
     asm volatile (
        "1:                                      \n"
        "vld4.u8    {d0,d1,d2,d3}, [%0]!        \n" // load 16 pairs of UYVY
-       "subs  %3, %3, #16                     \n" // 16 processed per loop
-       "vst1.u8   {d0}, [%1]!              \n" // store back U
-       "vst1.u8   {d2}, [%2]!              \n" // store back V
+       "vld4.u8    {d4,d5,d6,d7}, [%1]!        \n" // and 16 of the next row
+       "subs  %4, %4, #16                     \n" // 16 processed per loop
+       "vhadd.u8  d0, d0, d4                  \n" // (U0 + U1) / 2
+       "vhadd.u8  d2, d2, d6                  \n" // (V0 + V1) / 2
+       "vst1.u8   {d0}, [%2]!              \n" // store back U
+       "vst1.u8   {d2}, [%3]!              \n" // store back V
        "bgt   1b                              \n" // Loop back if not done
        : "+r"(src_uyvy), // %0
-         "+r"(dst_u), // %1
-         "+r"(dst_v), // %2
-         "+r"(width)     // %3      // output registers
+         "+r"(src_uyvy1), // %1
+         "+r"(dst_u), // %2
+         "+r"(dst_v), // %3
+         "+r"(width)     // %4      // output registers
        :                            // input registers
        : "memory", "cc", "q0", "q1", "q2", "q3" // Clobber List
     );                             
@@ -147,33 +448,41 @@ void ExtractY_yuyv_NEON(const uint8 *src_uyvy, uint8 *dst_y, int width) {
     );                            
 }
 
-void ExtractUV_yuyv_NEON(const uint8 *src_uyvy, uint8 *dst_uv, int width) {
+void ExtractUV_yuyv_NEON(const uint8 *src_uyvy, const uint8 *src_uyvy1, uint8 *dst_uv, int width) {
     asm volatile (
        "1:                                      \n"
        "vld4.u8    {d0,d1,d2,d3}, [%0]!        \n" // load 16 pairs of UYVY
-       "subs  %2, %2, #16                     \n" // 16 processed per loop
-       "vst2.u8   {d1,d3}, [%1]!              \n" // store back U and V
+       "vld4.u8    {d4,d5,d6,d7}, [%1]!        \n" // and 16 of the next row
+       "subs  %3, %3, #16                     \n" // 16 processed per loop
+       "vhadd.u8  d1, d1, d5                  \n" // (U0 + U1) / 2
+       "vhadd.u8  d3, d3, d7                  \n" // (V0 + V1) / 2
+       "vst2.u8   {d1,d3}, [%2]!              \n" // store back U and V
        "bgt   1b                              \n" // Loop back if not done
        : "+r"(src_uyvy), // %0
-         "+r"(dst_uv), // %1
+         "+r"(src_uyvy1), // %1
+         "+r"(dst_uv), // %2
          "+r"(width)     // %3      // output registers
        :                            // input registers
        : "memory", "cc", "q0", "q1", "q2", "q3" // Clobber List
     );                             
 }
 
-void ExtractU_V_yuyv_NEON(const uint8 *src_uyvy, uint8 *dst_u, uint8 *dst_v, int width) {
+void ExtractU_V_yuyv_NEON(const uint8 *src_uyvy, const uint8 *src_uyvy1, uint8 *dst_u, uint8 *dst_v, int width) {
     asm volatile (
        "1:                                      \n"
        "vld4.u8    {d0,d1,d2,d3}, [%0]!        \n" // load 16 pairs of UYVY
-       "subs  %3, %3, #16                     \n" // 16 processed per loop
-       "vst1.u8   {d1}, [%1]!              \n" // store back U
-       "vst1.u8   {d3}, [%2]!              \n" // store back V
+       "vld4.u8    {d4,d5,d6,d7}, [%1]!        \n" // and 16 of the next row
+       "subs  %4, %4, #16                     \n" // 16 processed per loop
+       "vhadd.u8  d1, d1, d5                  \n" // (U0 + U1) / 2
+       "vhadd.u8  d3, d3, d7                  \n" // (V0 + V1) / 2
+       "vst1.u8   {d1}, [%2]!              \n" // store back U
+       "vst1.u8   {d3}, [%3]!              \n" // store back V
        "bgt   1b                              \n" // Loop back if not done
        : "+r"(src_uyvy), // %0
-         "+r"(dst_u), // %1
-         "+r"(dst_v), // %2
-         "+r"(width)     // %3      // output registers
+         "+r"(src_uyvy1), // %1
+         "+r"(dst_u), // %2
+         "+r"(dst_v), // %3
+         "+r"(width)     // %4      // output registers
        :                            // input registers
        : "memory", "cc", "q0", "q1", "q2", "q3" // Clobber List
     );                             
@@ -190,7 +499,7 @@ int UYVYToNV12_neon(const uint8 *src_uyvy, int src_stride_uyvy,
     }
 
     for (i = 0; i < height; i+=2) {
-        ExtractUV_NEON(src_uyvy, dst_uv, width);
+        ExtractUV_NEON(src_uyvy, src_uyvy + src_stride_uyvy, dst_uv, width);
         dst_uv += dst_stride_uv;
 
         ExtractY_NEON(src_uyvy, dst_y, width);
@@ -219,7 +528,7 @@ int UYVYTo420P_neon(const uint8 *src_uyvy, int src_stride_uyvy,
     }
 
     for (i = 0; i < height; i+=2) {
-        ExtractU_V_NEON(src_uyvy, dst_u, dst_v, width);
+        ExtractU_V_NEON(src_uyvy, src_uyvy + src_stride_uyvy, dst_u, dst_v, width);
         dst_u += dst_stride_u;
         dst_v += dst_stride_v;
 
@@ -247,7 +556,7 @@ int YUYVToNV12_neon(const uint8 *src_uyvy, int src_stride_uyvy,
     }
 
     for (i = 0; i < height; i+=2) {
-        ExtractUV_yuyv_NEON(src_uyvy, dst_uv, width);
+        ExtractUV_yuyv_NEON(src_uyvy, src_uyvy + src_stride_uyvy, dst_uv, width);
         dst_uv += dst_stride_uv;
 
         ExtractY_yuyv_NEON(src_uyvy, dst_y, width);
@@ -276,7 +585,7 @@ int YUYVTo420P_neon(const uint8 *src_uyvy, int src_stride_uyvy,
     }
 
     for (i = 0; i < height; i+=2) {
-        ExtractU_V_yuyv_NEON(src_uyvy, dst_u, dst_v, width);
+        ExtractU_V_yuyv_NEON(src_uyvy, src_uyvy + src_stride_uyvy, dst_u, dst_v, width);
         dst_u += dst_stride_u;
         dst_v += dst_stride_v;
 
@@ -293,4 +602,2308 @@ int YUYVTo420P_neon(const uint8 *src_uyvy, int src_stride_uyvy,
 
 }
 
-#endif
+/*
+ * row kernels for the dispatch table, chroma is the average of both rows
+ * rounded down (vhadd) like the C kernels. A width that is not a multiple of 16 ends with one more vector moved
+ * back onto the last 16 pixels, rows under 16 pixels use the C kernels.
+ */
+static void neon_row_y(const uint8 *src, uint8 *dst_y, int width, int uyvy) {
+    void (*extract)(const uint8 *, uint8 *, int) = uyvy ? ExtractY_NEON : ExtractY_yuyv_NEON;
+    int t = width - 16;
+
+    if (width < 16) {
+        c_row_y(src, dst_y, width, uyvy);
+        return;
+    }
+    extract(src, dst_y, width & ~15);
+    if (width & 15)
+        extract(src + 2 * t, dst_y + t, 16);
+}
+
+static void neon_row_uv(const uint8 *s0, const uint8 *s1, uint8 *dst_uv, int width, int uyvy) {
+    void (*extract)(const uint8 *, const uint8 *, uint8 *, int) = uyvy ? ExtractUV_NEON : ExtractUV_yuyv_NEON;
+    int t = width - 16;
+
+    if (width < 16) {
+        c_row_uv(s0, s1, dst_uv, width, uyvy);
+        return;
+    }
+    extract(s0, s1, dst_uv, width & ~15);
+    if (width & 15)
+        extract(s0 + 2 * t, s1 + 2 * t, dst_uv + t, 16);
+}
+
+static void neon_row_u_v(const uint8 *s0, const uint8 *s1, uint8 *dst_u, uint8 *dst_v, int width, int uyvy) {
+    void (*extract)(const uint8 *, const uint8 *, uint8 *, uint8 *, int) =
+        uyvy ? ExtractU_V_NEON : ExtractU_V_yuyv_NEON;
+    int t = width - 16;
+
+    if (width < 16) {
+        c_row_u_v(s0, s1, dst_u, dst_v, width, uyvy);
+        return;
+    }
+    extract(s0, s1, dst_u, dst_v, width & ~15);
+    if (width & 15)
+        extract(s0 + 2 * t, s1 + 2 * t, dst_u + t / 2, dst_v + t / 2, 16);
+}
+
+/*
+ * fused extractors, one load feeds both destination layouts
+ */
+void ExtractY2_NEON(const uint8 *src_uyvy, uint8 *dst_a, uint8 *dst_b, int width) {
+    asm volatile (
+       "1:                                      \n"
+       "vld4.u8    {d0,d1,d2,d3}, [%0]!        \n" // load 16 pairs of UYVY
+       "subs  %3, %3, #16                     \n" // 16 processed per loop
+       "vst2.u8   {d1,d3}, [%1]!              \n" // store Y and Y
+       "vst2.u8   {d1,d3}, [%2]!              \n" // and again
+       "bgt   1b                              \n" // Loop back if not done
+       : "+r"(src_uyvy), // %0
+         "+r"(dst_a), // %1
+         "+r"(dst_b), // %2
+         "+r"(width)     // %3      // output registers
+       :                            // input registers
+       : "memory", "cc", "q0", "q1", "q2", "q3" // Clobber List
+    );
+}
+
+void ExtractUV_U_V_NEON(const uint8 *src_uyvy, const uint8 *src_uyvy1,
+                        uint8 *dst_uv, uint8 *dst_u, uint8 *dst_v, int width) {
+    asm volatile (
+       "1:                                      \n"
+       "vld4.u8    {d0,d1,d2,d3}, [%0]!        \n" // load 16 pairs of UYVY
+       "vld4.u8    {d4,d5,d6,d7}, [%1]!        \n" // and 16 of the next row
+       "subs  %5, %5, #16                     \n" // 16 processed per loop
+       "vhadd.u8  d0, d0, d4                  \n" // (U0 + U1) / 2
+       "vhadd.u8  d2, d2, d6                  \n" // (V0 + V1) / 2
+       "vst2.u8   {d0,d2}, [%2]!              \n" // store U and V
+       "vst1.u8   {d0}, [%3]!                 \n" // store U
+       "vst1.u8   {d2}, [%4]!                 \n" // store V
+       "bgt   1b                              \n" // Loop back if not done
+       : "+r"(src_uyvy), // %0
+         "+r"(src_uyvy1), // %1
+         "+r"(dst_uv), // %2
+         "+r"(dst_u), // %3
+         "+r"(dst_v), // %4
+         "+r"(width)     // %5      // output registers
+       :                            // input registers
+       : "memory", "cc", "q0", "q1", "q2", "q3" // Clobber List
+    );
+}
+
+void ExtractY2_yuyv_NEON(const uint8 *src_uyvy, uint8 *dst_a, uint8 *dst_b, int width) {
+    asm volatile (
+       "1:                                      \n"
+       "vld4.u8    {d0,d1,d2,d3}, [%0]!        \n" // load 16 pairs of YUYV
+       "subs  %3, %3, #16                     \n" // 16 processed per loop
+       "vst2.u8   {d0,d2}, [%1]!              \n" // store Y and Y
+       "vst2.u8   {d0,d2}, [%2]!              \n" // and again
+       "bgt   1b                              \n" // Loop back if not done
+       : "+r"(src_uyvy), // %0
+         "+r"(dst_a), // %1
+         "+r"(dst_b), // %2
+         "+r"(width)     // %3      // output registers
+       :                            // input registers
+       : "memory", "cc", "q0", "q1", "q2", "q3" // Clobber List
+    );
+}
+
+void ExtractUV_U_V_yuyv_NEON(const uint8 *src_uyvy, const uint8 *src_uyvy1,
+                             uint8 *dst_uv, uint8 *dst_u, uint8 *dst_v, int width) {
+    asm volatile (
+       "1:                                      \n"
+       "vld4.u8    {d0,d1,d2,d3}, [%0]!        \n" // load 16 pairs of YUYV
+       "vld4.u8    {d4,d5,d6,d7}, [%1]!        \n" // and 16 of the next row
+       "subs  %5, %5, #16                     \n" // 16 processed per loop
+       "vhadd.u8  d1, d1, d5                  \n" // (U0 + U1) / 2
+       "vhadd.u8  d3, d3, d7                  \n" // (V0 + V1) / 2
+       "vst2.u8   {d1,d3}, [%2]!              \n" // store U and V
+       "vst1.u8   {d1}, [%3]!                 \n" // store U
+       "vst1.u8   {d3}, [%4]!                 \n" // store V
+       "bgt   1b                              \n" // Loop back if not done
+       : "+r"(src_uyvy), // %0
+         "+r"(src_uyvy1), // %1
+         "+r"(dst_uv), // %2
+         "+r"(dst_u), // %3
+         "+r"(dst_v), // %4
+         "+r"(width)     // %5      // output registers
+       :                            // input registers
+       : "memory", "cc", "q0", "q1", "q2", "q3" // Clobber List
+    );
+}
+
+static void neon_row_y2(const uint8 *src, uint8 *dst_a, uint8 *dst_b, int width, int uyvy) {
+    void (*extract)(const uint8 *, uint8 *, uint8 *, int) = uyvy ? ExtractY2_NEON : ExtractY2_yuyv_NEON;
+    int t = width - 16;
+
+    if (width < 16) {
+        c_row_y2(src, dst_a, dst_b, width, uyvy);
+        return;
+    }
+    extract(src, dst_a, dst_b, width & ~15);
+    if (width & 15)
+        extract(src + 2 * t, dst_a + t, dst_b + t, 16);
+}
+
+static void neon_row_uv_u_v(const uint8 *s0, const uint8 *s1, uint8 *dst_uv,
+                            uint8 *dst_u, uint8 *dst_v, int width, int uyvy) {
+    void (*extract)(const uint8 *, const uint8 *, uint8 *, uint8 *, uint8 *, int) =
+        uyvy ? ExtractUV_U_V_NEON : ExtractUV_U_V_yuyv_NEON;
+    int t = width - 16;
+
+    if (width < 16) {
+        c_row_uv_u_v(s0, s1, dst_uv, dst_u, dst_v, width, uyvy);
+        return;
+    }
+    extract(s0, s1, dst_uv, dst_u, dst_v, width & ~15);
+    if (width & 15)
+        extract(s0 + 2 * t, s1 + 2 * t, dst_uv + t, dst_u + t / 2, dst_v + t / 2, 16);
+}
+
+/*
+ * deinterlacer, 16 bytes per loop. dst may be a source, so the tail goes
+ * to the C kernels instead of an overlapping vector.
+ */
+void AverageRows_NEON(const uint8 *src_a, const uint8 *src_b, uint8 *dst, int bytes) {
+    asm volatile (
+       "1:                                      \n"
+       "vld1.u8    {q0}, [%0]!                 \n" // load 16 bytes of a
+       "vld1.u8    {q1}, [%1]!                 \n" // and of b
+       "subs  %3, %3, #16                     \n" // 16 processed per loop
+       "vrhadd.u8  q0, q0, q1                 \n" // (a + b + 1) / 2
+       "vst1.u8    {q0}, [%2]!                 \n" // store
+       "bgt   1b                              \n" // Loop back if not done
+       : "+r"(src_a), // %0
+         "+r"(src_b), // %1
+         "+r"(dst), // %2
+         "+r"(bytes)     // %3      // output registers
+       :                            // input registers
+       : "memory", "cc", "q0", "q1" // Clobber List
+    );
+}
+
+void MotionRows_NEON(const uint8 *src_above, const uint8 *src_cur, const uint8 *src_below,
+                     uint8 *prev, uint8 *dst, int bytes, int threshold) {
+    asm volatile (
+       "vdup.u8    q15, %6                     \n" // threshold in every lane
+       "1:                                      \n"
+       "vld1.u8    {q0}, [%0]!                 \n" // load 16 bytes above
+       "vld1.u8    {q1}, [%1]!                 \n" // of this row
+       "vld1.u8    {q2}, [%2]!                 \n" // below
+       "vld1.u8    {q3}, [%3]                  \n" // and of the last frame
+       "subs  %5, %5, #16                     \n" // 16 processed per loop
+       "vabd.u8    q3, q1, q3                 \n" // |cur - prev|
+       "vst1.u8    {q1}, [%3]!                 \n" // prev = cur
+       "vrhadd.u8  q0, q0, q2                 \n" // (above + below + 1) / 2
+       "vcgt.u8    q3, q3, q15                \n" // moved more than threshold
+       "vbsl       q3, q0, q1                 \n" // interpolated where it moved
+       "vst1.u8    {q3}, [%4]!                 \n" // store
+       "bgt   1b                              \n" // Loop back if not done
+       : "+r"(src_above), // %0
+         "+r"(src_cur), // %1
+         "+r"(src_below), // %2
+         "+r"(prev), // %3
+         "+r"(dst), // %4
+         "+r"(bytes)     // %5      // output registers
+       : "r"(threshold)             // %6 input registers
+       : "memory", "cc", "q0", "q1", "q2", "q3", "q15" // Clobber List
+    );
+}
+
+/* downscaler, 16 bytes widened into the 16 bit sums per loop */
+void AccumulateRow_NEON(const uint8 *src, unsigned short *acc, int bytes) {
+    asm volatile (
+       "1:                                      \n"
+       "vld1.u8    {q0}, [%0]!                 \n" // load 16 bytes
+       "vld1.u16   {q1,q2}, [%1]               \n" // and their sums so far
+       "subs  %2, %2, #16                     \n" // 16 processed per loop
+       "vaddw.u8   q1, q1, d0                 \n" // sum += src, low 8
+       "vaddw.u8   q2, q2, d1                 \n" // high 8
+       "vst1.u16   {q1,q2}, [%1]!              \n" // store the sums
+       "bgt   1b                              \n" // Loop back if not done
+       : "+r"(src), // %0
+         "+r"(acc), // %1
+         "+r"(bytes)     // %2      // output registers
+       :                            // input registers
+       : "memory", "cc", "q0", "q1", "q2" // Clobber List
+    );
+}
+
+/* the sums since the last totals, which become the new ones, 16 per loop */
+void DeltaRow_NEON(const unsigned short *sum, unsigned short *last, unsigned short *dst, int count) {
+    asm volatile (
+       "1:                                      \n"
+       "vld1.u16   {q0,q1}, [%0]!              \n" // load 16 totals
+       "vld1.u16   {q2,q3}, [%1]               \n" // and the last ones
+       "subs  %3, %3, #16                     \n" // 16 processed per loop
+       "vsub.u16   q2, q0, q2                 \n" // total - last, wrapping
+       "vsub.u16   q3, q1, q3                 \n"
+       "vst1.u16   {q0,q1}, [%1]!              \n" // the totals are the last now
+       "vst1.u16   {q2,q3}, [%2]!              \n" // store the sums
+       "bgt   1b                              \n" // Loop back if not done
+       : "+r"(sum), // %0
+         "+r"(last), // %1
+         "+r"(dst), // %2
+         "+r"(count)     // %3      // output registers
+       :                            // input registers
+       : "memory", "cc", "q0", "q1", "q2", "q3" // Clobber List
+    );
+}
+
+/*
+ * 8 pixels of sums per loop as four groups of U Y V Y lanes: the chroma
+ * of groups 0 and 1 adds lane by lane, the luma of a group adds to itself
+ * shifted by two lanes. The masks pick the lanes each result goes to,
+ * chroma then the first luma, per byte order.
+ */
+static const unsigned short half_masks[2][16] = {
+    { 0, 0xffff, 0, 0xffff, 0, 0xffff, 0, 0xffff, 0xffff, 0, 0, 0, 0xffff, 0, 0, 0 },
+    { 0xffff, 0, 0xffff, 0, 0xffff, 0, 0xffff, 0, 0, 0xffff, 0, 0, 0, 0xffff, 0, 0 },
+};
+
+void HalveRow_NEON(const unsigned short *src, unsigned short *dst, int width, int uyvy) {
+    asm volatile (
+       "vld1.u16   {q9,q10}, [%3]              \n" // chroma and first luma lanes
+       "1:                                      \n"
+       "vld1.u16   {q0,q1}, [%0]!              \n" // load 8 pixels of sums
+       "subs  %2, %2, #8                      \n" // 8 processed per loop
+       "vswp       d1, d2                     \n" // groups 0, 2 in q0 and 1, 3 in q1
+       "vadd.u16   q2, q0, q1                 \n" // chroma of two pixel pairs
+       "vshr.u64   q3, q0, #32                \n" // luma of 0 and 2 with its
+       "vadd.u16   q3, q3, q0                 \n" // neighbour in the low lanes
+       "vshl.u64   q8, q1, #32                \n" // of 1 and 3 in the high lanes
+       "vadd.u16   q8, q8, q1                 \n"
+       "vbit       q8, q3, q10                \n" // first luma
+       "vbit       q8, q2, q9                 \n" // and chroma in place
+       "vst1.u16   {q8}, [%1]!                 \n" // store 4 pixels
+       "bgt   1b                              \n" // Loop back if not done
+       : "+r"(src), // %0
+         "+r"(dst), // %1
+         "+r"(width)     // %2      // output registers
+       : "r"(half_masks[uyvy ? 1 : 0]) // %3 input registers
+       : "memory", "cc", "q0", "q1", "q2", "q3", "q8", "q9", "q10" // Clobber List
+    );
+}
+
+/* a row of sums kept at its width, 16 per loop multiplied by scale and narrowed with rounding */
+void ScaleRow_NEON(const unsigned short *src, uint8 *dst, int count, int scale) {
+    asm volatile (
+       "vdup.16    d30, %3                    \n" // the scale in every lane
+       "1:                                      \n"
+       "vld1.u16   {q0,q1}, [%0]!              \n" // load 16 sums
+       "subs  %2, %2, #16                     \n" // 16 processed per loop
+       "vmull.u16  q2, d0, d30                \n" // sum * scale
+       "vmull.u16  q3, d1, d30                \n"
+       "vmull.u16  q8, d2, d30                \n"
+       "vmull.u16  q9, d3, d30                \n"
+       "vrshrn.i32 d0, q2, #16                \n" // (+ 32768) >> 16
+       "vrshrn.i32 d1, q3, #16                \n"
+       "vrshrn.i32 d2, q8, #16                \n"
+       "vrshrn.i32 d3, q9, #16                \n"
+       "vmovn.i16  d0, q0                     \n" // to bytes
+       "vmovn.i16  d1, q1                     \n"
+       "vst1.u8    {q0}, [%1]!                 \n" // store 16 samples
+       "bgt   1b                              \n" // Loop back if not done
+       : "+r"(src), // %0
+         "+r"(dst), // %1
+         "+r"(count)     // %2      // output registers
+       : "r"(scale)     // %3 input registers
+       : "memory", "cc", "q0", "q1", "q2", "q3", "q8", "q9", "q15" // Clobber List
+    );
+}
+
+/*
+ * downscaler columns, one output per loop: its columns added up in 8
+ * lanes, multiplied by the scale of that many and narrowed with rounding.
+ * step and dst_step in bytes.
+ */
+void BoxColumns_NEON(const unsigned short *src, int step, const int *cols,
+                     const unsigned short *scale, uint8 *dst, int dst_step, int count) {
+    const unsigned short *p, *f;
+    int n;
+
+    asm volatile (
+       "1:                                      \n"
+       "ldr   %4, [%0], #4                    \n" // first column
+       "ldr   %3, [%0]                        \n" // and the next output's
+       "sub   %3, %3, %4                      \n" // columns to add
+       "mla   %4, %4, %7, %6                  \n" // address of the first
+       "add   %5, %8, %3, lsl #4              \n" // scale of that many
+       "vmov.i16   q0, #0                     \n"
+       "2:                                      \n"
+       "vld1.u16   {q1}, [%4], %7              \n" // load a column of 8 lanes
+       "subs  %3, %3, #1                      \n"
+       "vadd.u16   q0, q0, q1                 \n" // sum += column
+       "bgt   2b                              \n"
+       "vld1.u16   {q1}, [%5]                  \n" // load the scale
+       "vmull.u16  q2, d0, d2                 \n" // sum * scale
+       "vmull.u16  q3, d1, d3                 \n"
+       "vrshrn.i32 d0, q2, #16                \n" // (+ 32768) >> 16
+       "vrshrn.i32 d1, q3, #16                \n"
+       "vmovn.i16  d0, q0                     \n" // to bytes
+       "subs  %2, %2, #1                      \n" // 1 output per loop
+       "vst1.u8    {d0}, [%1], %9              \n" // store 8 lanes
+       "bgt   1b                              \n" // Loop back if not done
+       : "+r"(cols), // %0
+         "+r"(dst), // %1
+         "+r"(count), // %2
+         "=&r"(n), // %3
+         "=&r"(p), // %4
+         "=&r"(f)     // %5      // output registers
+       : "r"(src), // %6
+         "r"(step), // %7
+         "r"(scale), // %8
+         "r"(dst_step) // %9 input registers
+       : "memory", "cc", "q0", "q1", "q2", "q3" // Clobber List
+    );
+}
+
+static void neon_row_avg(const uint8 *a, const uint8 *b, uint8 *dst, int bytes) {
+    int n = bytes & ~15;
+
+    if (n)
+        AverageRows_NEON(a, b, dst, n);
+    c_row_avg(a + n, b + n, dst + n, bytes - n);
+}
+
+static void neon_row_motion(const uint8 *above, const uint8 *cur, const uint8 *below,
+                            uint8 *prev, uint8 *dst, int bytes, int threshold) {
+    int n = bytes & ~15;
+
+    if (n)
+        MotionRows_NEON(above, cur, below, prev, dst, n, threshold);
+    c_row_motion(above + n, cur + n, below + n, prev + n, dst + n, bytes - n, threshold);
+}
+
+static void neon_row_accum(const uint8 *src, unsigned short *acc, int bytes) {
+    int n = bytes & ~15;
+
+    if (n)
+        AccumulateRow_NEON(src, acc, n);
+    c_row_accum(src + n, acc + n, bytes - n);
+}
+
+static void neon_row_half(const unsigned short *src, unsigned short *dst, int width, int uyvy) {
+    int n = width & ~7;
+
+    if (n)
+        HalveRow_NEON(src, dst, n, uyvy);
+    c_row_half(src + 2 * n, dst + n, width - n, uyvy);
+}
+
+static void neon_row_delta(const unsigned short *sum, unsigned short *last, unsigned short *dst, int count) {
+    int n = count & ~15;
+
+    if (n)
+        DeltaRow_NEON(sum, last, dst, n);
+    c_row_delta(sum + n, last + n, dst + n, count - n);
+}
+
+static void neon_row_scale(const unsigned short *src, uint8 *dst, int count, int scale) {
+    int n = count & ~15;
+
+    if (n)
+        ScaleRow_NEON(src, dst, n, scale);
+    c_row_scale(src + n, dst + n, count - n, scale);
+}
+
+static void neon_cols_box(const unsigned short *src, int step, const int *cols,
+                          const unsigned short *scale, uint8 *dst, int dst_step, int count) {
+    if (count > 0)
+        BoxColumns_NEON(src, 16 * step, cols, scale, dst, 8 * dst_step, count);
+}
+
+/*
+ * geometry: vld4 splits 16 pixels into U, Y0, V, Y1 lanes (Y0, U, Y1, V for
+ * YUYV), every lane is reversed and the two luma lanes swap places. src
+ * walks back from the end of the row.
+ */
+void MirrorRow_NEON(const uint8 *src_uyvy, uint8 *dst, int width) {
+    const int step = -32;
+
+    src_uyvy += 2 * width - 32;
+    asm volatile (
+       "1:                                      \n"
+       "vld4.u8    {d0,d1,d2,d3}, [%0], %3     \n" // load 16 pixels from the end
+       "subs  %2, %2, #16                     \n" // 16 processed per loop
+       "vrev64.u8  d4, d0                     \n" // U reversed
+       "vrev64.u8  d5, d3                     \n" // Y1 reversed is the new Y0
+       "vrev64.u8  d6, d2                     \n" // V reversed
+       "vrev64.u8  d7, d1                     \n" // Y0 reversed is the new Y1
+       "vst4.u8    {d4,d5,d6,d7}, [%1]!       \n" // store 16 pixels
+       "bgt   1b                              \n" // Loop back if not done
+       : "+r"(src_uyvy), // %0
+         "+r"(dst), // %1
+         "+r"(width)     // %2      // output registers
+       : "r"(step)                  // %3 input registers
+       : "memory", "cc", "q0", "q1", "q2", "q3" // Clobber List
+    );
+}
+
+void MirrorRow_yuyv_NEON(const uint8 *src_yuyv, uint8 *dst, int width) {
+    const int step = -32;
+
+    src_yuyv += 2 * width - 32;
+    asm volatile (
+       "1:                                      \n"
+       "vld4.u8    {d0,d1,d2,d3}, [%0], %3     \n" // load 16 pixels from the end
+       "subs  %2, %2, #16                     \n" // 16 processed per loop
+       "vrev64.u8  d4, d2                     \n" // Y1 reversed is the new Y0
+       "vrev64.u8  d5, d1                     \n" // U reversed
+       "vrev64.u8  d6, d0                     \n" // Y0 reversed is the new Y1
+       "vrev64.u8  d7, d3                     \n" // V reversed
+       "vst4.u8    {d4,d5,d6,d7}, [%1]!       \n" // store 16 pixels
+       "bgt   1b                              \n" // Loop back if not done
+       : "+r"(src_yuyv), // %0
+         "+r"(dst), // %1
+         "+r"(width)     // %2      // output registers
+       : "r"(step)                  // %3 input registers
+       : "memory", "cc", "q0", "q1", "q2", "q3" // Clobber List
+    );
+}
+
+/* three rounds of vtrn, bytes then halfwords then words */
+void Transpose8x8_NEON(const uint8 *src, int src_stride, uint8 *dst, int dst_stride) {
+    asm volatile (
+       "vld1.u8    {d0}, [%0], %1              \n" // load 8 rows of 8
+       "vld1.u8    {d1}, [%0], %1              \n"
+       "vld1.u8    {d2}, [%0], %1              \n"
+       "vld1.u8    {d3}, [%0], %1              \n"
+       "vld1.u8    {d4}, [%0], %1              \n"
+       "vld1.u8    {d5}, [%0], %1              \n"
+       "vld1.u8    {d6}, [%0], %1              \n"
+       "vld1.u8    {d7}, [%0]                  \n"
+       "vtrn.8     d0, d1                     \n"
+       "vtrn.8     d2, d3                     \n"
+       "vtrn.8     d4, d5                     \n"
+       "vtrn.8     d6, d7                     \n"
+       "vtrn.16    d0, d2                     \n"
+       "vtrn.16    d1, d3                     \n"
+       "vtrn.16    d4, d6                     \n"
+       "vtrn.16    d5, d7                     \n"
+       "vtrn.32    d0, d4                     \n"
+       "vtrn.32    d1, d5                     \n"
+       "vtrn.32    d2, d6                     \n"
+       "vtrn.32    d3, d7                     \n"
+       "vst1.u8    {d0}, [%2], %3              \n" // store 8 columns as rows
+       "vst1.u8    {d1}, [%2], %3              \n"
+       "vst1.u8    {d2}, [%2], %3              \n"
+       "vst1.u8    {d3}, [%2], %3              \n"
+       "vst1.u8    {d4}, [%2], %3              \n"
+       "vst1.u8    {d5}, [%2], %3              \n"
+       "vst1.u8    {d6}, [%2], %3              \n"
+       "vst1.u8    {d7}, [%2]                  \n"
+       : "+r"(src), // %0
+         "+r"(src_stride), // %1
+         "+r"(dst), // %2
+         "+r"(dst_stride)     // %3      // output registers
+       :                            // input registers
+       : "memory", "q0", "q1", "q2", "q3" // Clobber List
+    );
+}
+
+/* the same on halfwords, the last round swaps the 64 bit halves */
+void Transpose8x8_16_NEON(const uint8 *src, int src_stride, uint8 *dst, int dst_stride) {
+    asm volatile (
+       "vld1.u8    {q0}, [%0], %1              \n" // load 8 rows of 8 pairs
+       "vld1.u8    {q1}, [%0], %1              \n"
+       "vld1.u8    {q2}, [%0], %1              \n"
+       "vld1.u8    {q3}, [%0], %1              \n"
+       "vld1.u8    {q4}, [%0], %1              \n"
+       "vld1.u8    {q5}, [%0], %1              \n"
+       "vld1.u8    {q6}, [%0], %1              \n"
+       "vld1.u8    {q7}, [%0]                  \n"
+       "vtrn.16    q0, q1                     \n"
+       "vtrn.16    q2, q3                     \n"
+       "vtrn.16    q4, q5                     \n"
+       "vtrn.16    q6, q7                     \n"
+       "vtrn.32    q0, q2                     \n"
+       "vtrn.32    q1, q3                     \n"
+       "vtrn.32    q4, q6                     \n"
+       "vtrn.32    q5, q7                     \n"
+       "vswp       d1, d8                     \n"
+       "vswp       d3, d10                    \n"
+       "vswp       d5, d12                    \n"
+       "vswp       d7, d14                    \n"
+       "vst1.u8    {q0}, [%2], %3              \n" // store 8 columns as rows
+       "vst1.u8    {q1}, [%2], %3              \n"
+       "vst1.u8    {q2}, [%2], %3              \n"
+       "vst1.u8    {q3}, [%2], %3              \n"
+       "vst1.u8    {q4}, [%2], %3              \n"
+       "vst1.u8    {q5}, [%2], %3              \n"
+       "vst1.u8    {q6}, [%2], %3              \n"
+       "vst1.u8    {q7}, [%2]                  \n"
+       : "+r"(src), // %0
+         "+r"(src_stride), // %1
+         "+r"(dst), // %2
+         "+r"(dst_stride)     // %3      // output registers
+       :                            // input registers
+       : "memory", "q0", "q1", "q2", "q3", "q4", "q5", "q6", "q7" // Clobber List
+    );
+}
+
+/*
+ * luma of 8 pixels of 8 packed rows straight into a transposed block,
+ * each row narrowed to its luma bytes before the transpose
+ */
+void TransposeY8x8_NEON(const uint8 *src, int src_stride, uint8 *dst, int dst_stride, int uyvy) {
+    int shift = uyvy ? -8 : 0;
+
+    asm volatile (
+       "vdup.16    q15, %4                  \n" // luma to the low byte: >> 8 for UYVY
+       "vld1.u8    {q8}, [%0], %1           \n" // load 8 pixels of 8 rows
+       "vld1.u8    {q9}, [%0], %1           \n"
+       "vld1.u8    {q10}, [%0], %1          \n"
+       "vld1.u8    {q11}, [%0], %1          \n"
+       "vshl.u16   q8, q8, q15              \n"
+       "vshl.u16   q9, q9, q15              \n"
+       "vshl.u16   q10, q10, q15            \n"
+       "vshl.u16   q11, q11, q15            \n"
+       "vmovn.u16  d0, q8                   \n" // narrowed to bytes
+       "vmovn.u16  d1, q9                   \n"
+       "vmovn.u16  d2, q10                  \n"
+       "vmovn.u16  d3, q11                  \n"
+       "vld1.u8    {q8}, [%0], %1           \n"
+       "vld1.u8    {q9}, [%0], %1           \n"
+       "vld1.u8    {q10}, [%0], %1          \n"
+       "vld1.u8    {q11}, [%0]              \n"
+       "vshl.u16   q8, q8, q15              \n"
+       "vshl.u16   q9, q9, q15              \n"
+       "vshl.u16   q10, q10, q15            \n"
+       "vshl.u16   q11, q11, q15            \n"
+       "vmovn.u16  d4, q8                   \n"
+       "vmovn.u16  d5, q9                   \n"
+       "vmovn.u16  d6, q10                  \n"
+       "vmovn.u16  d7, q11                  \n"
+       "vtrn.8     d0, d1                   \n"
+       "vtrn.8     d2, d3                   \n"
+       "vtrn.8     d4, d5                   \n"
+       "vtrn.8     d6, d7                   \n"
+       "vtrn.16    d0, d2                   \n"
+       "vtrn.16    d1, d3                   \n"
+       "vtrn.16    d4, d6                   \n"
+       "vtrn.16    d5, d7                   \n"
+       "vtrn.32    d0, d4                   \n"
+       "vtrn.32    d1, d5                   \n"
+       "vtrn.32    d2, d6                   \n"
+       "vtrn.32    d3, d7                   \n"
+       "vst1.u8    {d0}, [%2], %3           \n" // store 8 columns as rows
+       "vst1.u8    {d1}, [%2], %3           \n"
+       "vst1.u8    {d2}, [%2], %3           \n"
+       "vst1.u8    {d3}, [%2], %3           \n"
+       "vst1.u8    {d4}, [%2], %3           \n"
+       "vst1.u8    {d5}, [%2], %3           \n"
+       "vst1.u8    {d6}, [%2], %3           \n"
+       "vst1.u8    {d7}, [%2]               \n"
+       : "+r"(src), // %0
+         "+r"(src_stride), // %1
+         "+r"(dst), // %2
+         "+r"(dst_stride)     // %3      // output registers
+       : "r"(shift)                 // %4   // input registers
+       : "memory", "q0", "q1", "q2", "q3", "q8", "q9", "q10", "q11", "q15" // Clobber List
+    );
+}
+
+/* chroma the same way, two rows averaged into each of the 8 before the transpose */
+void TransposeUV8x8_NEON(const uint8 *src, int src_stride, uint8 *dst_u, int dst_stride_u,
+                         uint8 *dst_v, int dst_stride_v, int uyvy) {
+    int shift = uyvy ? 0 : -8;
+
+    asm volatile (
+       "vdup.16    q15, %6                  \n" // chroma to the low byte: >> 8 for YUYV
+       "vld1.u8    {q8, q9}, [%0], %1       \n" // load 8 pairs of two rows
+       "vld1.u8    {q10, q11}, [%0], %1     \n"
+       "vshl.u16   q8, q8, q15              \n"
+       "vshl.u16   q9, q9, q15              \n"
+       "vshl.u16   q10, q10, q15            \n"
+       "vshl.u16   q11, q11, q15            \n"
+       "vmovn.u16  d24, q8                  \n" // narrowed to bytes
+       "vmovn.u16  d25, q9                  \n"
+       "vmovn.u16  d26, q10                 \n"
+       "vmovn.u16  d27, q11                 \n"
+       "vhadd.u8   q0, q12, q13             \n" // (a + b) / 2
+       "vld1.u8    {q8, q9}, [%0], %1       \n"
+       "vld1.u8    {q10, q11}, [%0], %1     \n"
+       "vshl.u16   q8, q8, q15              \n"
+       "vshl.u16   q9, q9, q15              \n"
+       "vshl.u16   q10, q10, q15            \n"
+       "vshl.u16   q11, q11, q15            \n"
+       "vmovn.u16  d24, q8                  \n"
+       "vmovn.u16  d25, q9                  \n"
+       "vmovn.u16  d26, q10                 \n"
+       "vmovn.u16  d27, q11                 \n"
+       "vhadd.u8   q1, q12, q13             \n"
+       "vld1.u8    {q8, q9}, [%0], %1       \n"
+       "vld1.u8    {q10, q11}, [%0], %1     \n"
+       "vshl.u16   q8, q8, q15              \n"
+       "vshl.u16   q9, q9, q15              \n"
+       "vshl.u16   q10, q10, q15            \n"
+       "vshl.u16   q11, q11, q15            \n"
+       "vmovn.u16  d24, q8                  \n"
+       "vmovn.u16  d25, q9                  \n"
+       "vmovn.u16  d26, q10                 \n"
+       "vmovn.u16  d27, q11                 \n"
+       "vhadd.u8   q2, q12, q13             \n"
+       "vld1.u8    {q8, q9}, [%0], %1       \n"
+       "vld1.u8    {q10, q11}, [%0], %1     \n"
+       "vshl.u16   q8, q8, q15              \n"
+       "vshl.u16   q9, q9, q15              \n"
+       "vshl.u16   q10, q10, q15            \n"
+       "vshl.u16   q11, q11, q15            \n"
+       "vmovn.u16  d24, q8                  \n"
+       "vmovn.u16  d25, q9                  \n"
+       "vmovn.u16  d26, q10                 \n"
+       "vmovn.u16  d27, q11                 \n"
+       "vhadd.u8   q3, q12, q13             \n"
+       "vld1.u8    {q8, q9}, [%0], %1       \n"
+       "vld1.u8    {q10, q11}, [%0], %1     \n"
+       "vshl.u16   q8, q8, q15              \n"
+       "vshl.u16   q9, q9, q15              \n"
+       "vshl.u16   q10, q10, q15            \n"
+       "vshl.u16   q11, q11, q15            \n"
+       "vmovn.u16  d24, q8                  \n"
+       "vmovn.u16  d25, q9                  \n"
+       "vmovn.u16  d26, q10                 \n"
+       "vmovn.u16  d27, q11                 \n"
+       "vhadd.u8   q4, q12, q13             \n"
+       "vld1.u8    {q8, q9}, [%0], %1       \n"
+       "vld1.u8    {q10, q11}, [%0], %1     \n"
+       "vshl.u16   q8, q8, q15              \n"
+       "vshl.u16   q9, q9, q15              \n"
+       "vshl.u16   q10, q10, q15            \n"
+       "vshl.u16   q11, q11, q15            \n"
+       "vmovn.u16  d24, q8                  \n"
+       "vmovn.u16  d25, q9                  \n"
+       "vmovn.u16  d26, q10                 \n"
+       "vmovn.u16  d27, q11                 \n"
+       "vhadd.u8   q5, q12, q13             \n"
+       "vld1.u8    {q8, q9}, [%0], %1       \n"
+       "vld1.u8    {q10, q11}, [%0], %1     \n"
+       "vshl.u16   q8, q8, q15              \n"
+       "vshl.u16   q9, q9, q15              \n"
+       "vshl.u16   q10, q10, q15            \n"
+       "vshl.u16   q11, q11, q15            \n"
+       "vmovn.u16  d24, q8                  \n"
+       "vmovn.u16  d25, q9                  \n"
+       "vmovn.u16  d26, q10                 \n"
+       "vmovn.u16  d27, q11                 \n"
+       "vhadd.u8   q6, q12, q13             \n"
+       "vld1.u8    {q8, q9}, [%0], %1       \n"
+       "vld1.u8    {q10, q11}, [%0]         \n"
+       "vshl.u16   q8, q8, q15              \n"
+       "vshl.u16   q9, q9, q15              \n"
+       "vshl.u16   q10, q10, q15            \n"
+       "vshl.u16   q11, q11, q15            \n"
+       "vmovn.u16  d24, q8                  \n"
+       "vmovn.u16  d25, q9                  \n"
+       "vmovn.u16  d26, q10                 \n"
+       "vmovn.u16  d27, q11                 \n"
+       "vhadd.u8   q7, q12, q13             \n"
+       "vtrn.16    q0, q1                   \n"
+       "vtrn.16    q2, q3                   \n"
+       "vtrn.16    q4, q5                   \n"
+       "vtrn.16    q6, q7                   \n"
+       "vtrn.32    q0, q2                   \n"
+       "vtrn.32    q1, q3                   \n"
+       "vtrn.32    q4, q6                   \n"
+       "vtrn.32    q5, q7                   \n"
+       "vswp       d1, d8                   \n"
+       "vswp       d3, d10                  \n"
+       "vswp       d5, d12                  \n"
+       "vswp       d7, d14                  \n"
+       "cmp        %4, #0                   \n" // interleaved without dst_v
+       "beq        2f                       \n"
+       "vuzp.8     d0, d1                   \n" // U and V apart
+       "vst1.u8    {d0}, [%2], %3           \n" // store 8 columns as rows
+       "vst1.u8    {d1}, [%4], %5           \n"
+       "vuzp.8     d2, d3                   \n"
+       "vst1.u8    {d2}, [%2], %3           \n"
+       "vst1.u8    {d3}, [%4], %5           \n"
+       "vuzp.8     d4, d5                   \n"
+       "vst1.u8    {d4}, [%2], %3           \n"
+       "vst1.u8    {d5}, [%4], %5           \n"
+       "vuzp.8     d6, d7                   \n"
+       "vst1.u8    {d6}, [%2], %3           \n"
+       "vst1.u8    {d7}, [%4], %5           \n"
+       "vuzp.8     d8, d9                   \n"
+       "vst1.u8    {d8}, [%2], %3           \n"
+       "vst1.u8    {d9}, [%4], %5           \n"
+       "vuzp.8     d10, d11                 \n"
+       "vst1.u8    {d10}, [%2], %3          \n"
+       "vst1.u8    {d11}, [%4], %5          \n"
+       "vuzp.8     d12, d13                 \n"
+       "vst1.u8    {d12}, [%2], %3          \n"
+       "vst1.u8    {d13}, [%4], %5          \n"
+       "vuzp.8     d14, d15                 \n"
+       "vst1.u8    {d14}, [%2], %3          \n"
+       "vst1.u8    {d15}, [%4], %5          \n"
+       "b          3f                       \n"
+       "2:                                  \n"
+       "vst1.u8    {q0}, [%2], %3           \n"
+       "vst1.u8    {q1}, [%2], %3           \n"
+       "vst1.u8    {q2}, [%2], %3           \n"
+       "vst1.u8    {q3}, [%2], %3           \n"
+       "vst1.u8    {q4}, [%2], %3           \n"
+       "vst1.u8    {q5}, [%2], %3           \n"
+       "vst1.u8    {q6}, [%2], %3           \n"
+       "vst1.u8    {q7}, [%2], %3           \n"
+       "3:                                  \n"
+       : "+r"(src), // %0
+         "+r"(src_stride), // %1
+         "+r"(dst_u), // %2
+         "+r"(dst_stride_u), // %3
+         "+r"(dst_v), // %4
+         "+r"(dst_stride_v)     // %5      // output registers
+       : "r"(shift)                 // %6   // input registers
+       : "memory", "cc", "q0", "q1", "q2", "q3", "q4", "q5", "q6", "q7",
+         "q8", "q9", "q10", "q11", "q12", "q13", "q15" // Clobber List
+    );
+}
+
+static void neon_row_mirror(const uint8 *src, uint8 *dst, int width, int uyvy) {
+    void (*mirror)(const uint8 *, uint8 *, int) = uyvy ? MirrorRow_NEON : MirrorRow_yuyv_NEON;
+    int n = width & ~15;
+
+    if (width < 16) {
+        c_row_mirror(src, dst, width, uyvy);
+        return;
+    }
+    /* the last 16 pixels of src come first in dst, the first 16 last */
+    mirror(src + 2 * (width - n), dst, n);
+    if (width & 15)
+        mirror(src, dst + 2 * (width - 16), 16);
+}
+
+const struct csc_kernels csc_neon = {
+    .isa = "neon",
+    .row_y = neon_row_y,
+    .row_uv = neon_row_uv,
+    .row_u_v = neon_row_u_v,
+    .row_y2 = neon_row_y2,
+    .row_uv_u_v = neon_row_uv_u_v,
+    .row_avg = neon_row_avg,
+    .row_motion = neon_row_motion,
+    .row_mirror = neon_row_mirror,
+    .transpose_8x8 = Transpose8x8_NEON,
+    .transpose_8x8_16 = Transpose8x8_16_NEON,
+    .transpose_y_8x8 = TransposeY8x8_NEON,
+    .transpose_uv_8x8 = TransposeUV8x8_NEON,
+    .row_accum = neon_row_accum,
+    .row_delta = neon_row_delta,
+    .row_half = neon_row_half,
+    .row_scale = neon_row_scale,
+    .cols_box = neon_cols_box,
+};
+
+#endif
+
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+
+/*
+ * every kernel table this CPU can run, slowest first
+ */
+int csc_supported_kernels(const struct csc_kernels **list, int max) {
+    int n = 0;
+
+    if (n < max)
+        list[n++] = &csc_c;
+#if defined(__i386__) || defined(__x86_64__)
+    __builtin_cpu_init();
+    if (n < max && __builtin_cpu_supports("sse2"))
+        list[n++] = &csc_sse2;
+    if (n < max && __builtin_cpu_supports("ssse3"))
+        list[n++] = &csc_ssse3;
+    if (n < max && __builtin_cpu_supports("avx2"))
+        list[n++] = &csc_avx2;
+#elif defined(CPU_HAS_NEON)
+    if (n < max && (getauxval(AT_HWCAP) & HWCAP_NEON))
+        list[n++] = &csc_neon;
+#endif
+
+    return n;
+}
+
+/*
+ *
+ */
+const struct csc_kernels *csc_get_kernels(void) {
+    static const struct csc_kernels *kernels;
+    const struct csc_kernels *list[CSC_MAX_KERNELS];
+
+    if (kernels)
+        return kernels;
+
+    kernels = list[csc_supported_kernels(list, CSC_MAX_KERNELS) - 1];
+
+    return kernels;
+}
+
+/*
+ * A frame conversion, cut into row bands for the worker pool.
+ * Bands start on even rows so 4:2:0 chroma rows are never split.
+ * The first output can be larger than the picture (out_width x out_height,
+ * the VE wants whole macroblocks), its extra columns and rows repeat the
+ * picture edge. Packed 4:2:2 is converted in whole pixel pairs, an odd last
+ * column is filled the same way. Every source row goes through source_row()
+ * once, which deinterlaces, scales and mirrors it as the job asks. A crop
+ * only moves src, a rotation is a transpose of the (mirrored) source, see
+ * job_geometry(). width x height is the picture the rows are converted
+ * from, src_width x src_height the source's when it is downscaled to it.
+ * The pictures of a pyramid are a list of jobs with the same source, see
+ * convert_pyramid_band().
+ */
+enum csc_job_kind { JOB_NV12, JOB_NV16, JOB_I420, JOB_NV12_I420 };
+
+struct csc_job {
+    enum csc_job_kind kind;
+    int uyvy;
+    const uint8 *src;
+    int src_stride;
+    uint8 *dst_y, *dst_u, *dst_v;
+    int dst_stride_y, dst_stride_u, dst_stride_v;
+    /* second output of the fused conversion */
+    uint8 *dst2_y, *dst2_u, *dst2_v;
+    int dst2_stride_y, dst2_stride_u, dst2_stride_v;
+    int width, height;
+    int out_width, out_height;
+    struct csc_deint *deint;
+    int hflip, vflip, transpose;
+    int src_width, src_height;
+    /*
+     * downscaler: times the row sums are halved first, then the column
+     * bounds of each output pixel and pair in the halved row and 65536 / area
+     */
+    int scaled;
+    int halvings;
+    const int *cols_y, *cols_c;
+    const unsigned int *inv_area;
+    struct csc_box box;         /* vecs 0 when the columns are transposed */
+    int bands;
+    /*
+     * pyramid: the next picture made from the same walk over the source
+     * rows, and for all of them, their rows come from it
+     */
+    const struct csc_job *next;
+    int walked;
+};
+
+/* repeat the last of width samples (size bytes each) up to out_width */
+static void pad_right(uint8 *row, int width, int out_width, int size) {
+    int x;
+
+    if (size == 1) {
+        if (out_width > width)
+            memset(row + width, row[width - 1], out_width - width);
+        return;
+    }
+    for (x = width; x < out_width; x++)
+        memcpy(row + x * size, row + (width - 1) * size, size);
+}
+
+/* repeat the last of rows rows down to out_rows */
+static void pad_bottom(uint8 *plane, int stride, int rows, int out_rows, int bytes) {
+    const uint8 *last = plane + (rows - 1) * stride;
+    int y;
+
+    for (y = rows; y < out_rows; y++)
+        memcpy(plane + y * stride, last, bytes);
+}
+
+/*
+ * Source row y as the conversion sees it. Progressive rows are read in
+ * place, a deinterlaced row is built in line (one packed row that stays in
+ * L1) from the rows around it, so the frame is still read from memory once.
+ */
+static const uint8 *deint_row(const struct csc_job *j, const struct csc_kernels *k,
+                              int y, uint8 *line) {
+    const struct csc_deint *d = j->deint;
+    const uint8 *cur = j->src + y * j->src_stride;
+    const uint8 *above, *below;
+    int bytes = (j->src_width & ~1) * 2;
+
+    if (!d || d->mode == CSC_DEINT_OFF || !line || j->src_height < 2)
+        return cur;
+    if (d->mode != CSC_DEINT_BLEND && (y & 1) == d->field)
+        return cur;
+
+    /* the first and last rows mirror their only neighbour */
+    above = y > 0 ? cur - j->src_stride : cur + j->src_stride;
+    below = y + 1 < j->src_height ? cur + j->src_stride : cur - j->src_stride;
+
+    if (d->mode == CSC_DEINT_MOTION && d->history) {
+        k->row_motion(above, cur, below, d->history + y / 2 * bytes, line, bytes, d->threshold);
+    } else {
+        k->row_avg(above, below, line, bytes);
+        if (d->mode == CSC_DEINT_BLEND)
+            k->row_avg(line, cur, line, bytes);
+    }
+    return line;
+}
+
+/*
+ * The downscaler walks the source rows once per band, in the order the
+ * output rows need them (bottom up when flipped), deinterlacing each into
+ * a ring of rows and adding it to sum, a running total that wraps at 16
+ * bits. A picture takes the sums under each of its output rows out of
+ * that as the walk passes their last source row, the difference from the
+ * total it saw last, so any number of pictures share one pass over the
+ * source. scale_bound() gives the walk row an output row starts at.
+ * Those sums are halved in place while that keeps every output pixel on
+ * whole halved pixels, then CSC_SCALE_ROWS output rows at a time are
+ * either scaled as they are, when that makes them the output's width, or
+ * transposed into one column of 8 lanes per sample so cols_box adds up
+ * the columns under the output pixels of all 8 rows at once. Luma and
+ * chroma have their own column bounds, the byte order stays the source's.
+ * Blocks start at multiples of 8 in the output, a band is whole blocks so
+ * none is made twice.
+ */
+#define CSC_SCALE_ROWS 8
+
+struct csc_scale;
+
+struct csc_walk {
+    const struct csc_job *job;
+    int pos;                    /* the next walk row */
+    int ring, bytes;
+    const uint8 *rows[CSC_SCALE_ROWS];  /* the last rows walked */
+    unsigned short *sum;        /* of every row walked, 0 when nothing is scaled */
+    unsigned short *acc;        /* the row a straight picture takes, see take_row() */
+    uint8 *lines;               /* ring deinterlaced rows */
+    int pics;
+    struct csc_scale *pic[CSC_PYRAMID_MAX];
+};
+
+struct csc_scale {
+    const struct csc_job *job;
+    struct csc_walk *walk;
+    int start;                  /* the walk row of the band's first output row */
+    int next, end;              /* the next output row to take and the band's end */
+    int first;                  /* the block's first row, or -1 */
+    int acc_stride, row_stride;
+    unsigned short *last;       /* sum as of the last row taken */
+    unsigned short *acc;        /* the walk's, or CSC_SCALE_ROWS rows of sums */
+    unsigned short *cols;       /* and their columns */
+    unsigned short *scale;      /* 65536 / area per column count and lane */
+    uint8 *lanes;               /* output columns of 8 lanes */
+    uint8 *rows;                /* and the block's rows */
+};
+
+/* the walk row output row y starts at, from the bottom when flipped */
+static int scale_bound(const struct csc_job *j, int y) {
+    if (j->vflip)
+        return j->src_height - (j->height - y) * j->src_height / j->height;
+    return y * j->src_height / j->height;
+}
+
+static int scale_max_cols(const struct csc_job *j) {
+    int w = j->width & ~1, hw = (j->src_width & ~1) >> j->halvings;
+
+    return (hw + w - 1) / w;
+}
+
+/* bytes of a struct csc_walk keeping ring rows and its buffers; row_box loads may run past acc */
+static int walk_size(const struct csc_job *j, int ring) {
+    int bytes = 2 * (j->src_width & ~1);
+
+    return (sizeof(struct csc_walk) + 15) / 16 * 16 + 2 * bytes * sizeof(unsigned short) +
+           CSC_BOX_LOADS * 16 + ring * bytes;
+}
+
+static struct csc_walk *walk_init(const struct csc_job *j, uint8 *mem, int ring, int pos) {
+    struct csc_walk *w = (struct csc_walk *)mem;
+
+    w->job = j;
+    w->pos = pos;
+    w->ring = ring;
+    w->bytes = 2 * (j->src_width & ~1);
+    w->sum = (unsigned short *)(mem + (sizeof(*w) + 15) / 16 * 16);
+    w->acc = w->sum + w->bytes;
+    w->lines = (uint8 *)(w->acc + w->bytes) + CSC_BOX_LOADS * 16;
+    w->pics = 0;
+    memset(w->sum, 0, w->bytes * sizeof(*w->sum));
+    return w;
+}
+
+/*
+ * a row that keeps its width once halved, or whose columns row_box adds
+ * up, is scaled as it is taken; the others wait for the whole block
+ */
+static int scale_straight(const struct csc_job *j) {
+    return ((j->src_width & ~1) >> j->halvings) == (j->width & ~1) || j->box.vecs;
+}
+
+/* bytes of a struct csc_scale and, for a scaled picture, its buffers */
+static int scale_size(const struct csc_job *j) {
+    int acc_stride = (2 * (j->src_width & ~1) + 7) & ~7;
+    int row_stride = (2 * (j->width & ~1) + 7) & ~7;
+    int size = (sizeof(struct csc_scale) + 15) / 16 * 16;
+
+    if (!j->scaled)
+        return size;
+    size += acc_stride * sizeof(unsigned short) + CSC_SCALE_ROWS * row_stride;
+    if (scale_straight(j))
+        return size;
+    return size + 2 * CSC_SCALE_ROWS * acc_stride * sizeof(unsigned short) +
+           CSC_SCALE_ROWS * (scale_max_cols(j) + 1) * sizeof(unsigned short) +
+           CSC_SCALE_ROWS * row_stride;
+}
+
+/* a picture converting output rows y0 up to y1 from walk */
+static struct csc_scale *scale_init(const struct csc_job *j, uint8 *mem, struct csc_walk *walk,
+                                    int y0, int y1) {
+    struct csc_scale *s = (struct csc_scale *)mem;
+
+    s->job = j;
+    s->walk = walk;
+    if (!j->scaled)
+        return s;
+
+    s->start = scale_bound(j, y0);
+    s->next = y0;
+    s->end = y1;
+    s->first = -1;
+    s->acc_stride = (2 * (j->src_width & ~1) + 7) & ~7;
+    s->row_stride = (2 * (j->width & ~1) + 7) & ~7;
+    s->rows = mem + (sizeof(*s) + 15) / 16 * 16;
+    s->last = (unsigned short *)(s->rows + CSC_SCALE_ROWS * s->row_stride);
+    s->acc = walk->acc;
+    if (!scale_straight(j)) {
+        s->acc = s->last + s->acc_stride;
+        s->cols = s->acc + CSC_SCALE_ROWS * s->acc_stride;
+        s->scale = s->cols + CSC_SCALE_ROWS * s->acc_stride;
+        s->lanes = (uint8 *)(s->scale + CSC_SCALE_ROWS * (scale_max_cols(j) + 1));
+    }
+    walk->pic[walk->pics++] = s;
+    return s;
+}
+
+/*
+ * output row s->next, whose last source row was just walked: its sums,
+ * halved, and scaled to bytes right away when scale_straight()
+ */
+static void take_row(struct csc_scale *s, const struct csc_kernels *k) {
+    const struct csc_job *j = s->job;
+    int sw = j->src_width & ~1, w = j->width & ~1;
+    int straight = scale_straight(j);
+    unsigned short *acc = s->acc + (straight ? 0 : s->next % CSC_SCALE_ROWS * s->acc_stride);
+    uint8 *row = s->rows + s->next % CSC_SCALE_ROWS * s->row_stride;
+    /* source pixels under one sample of the halved row */
+    int n = (scale_bound(j, s->next + 1) - scale_bound(j, s->next)) << j->halvings;
+    unsigned short scale[8];
+    int x;
+
+    /* a lone straight picture takes the total as it is and starts it again */
+    if (straight && s->walk->pics == 1)
+        acc = s->walk->sum;
+    else
+        k->row_delta(s->walk->sum, s->last, acc, 2 * sw);
+    for (x = 0; x < j->halvings; x++)
+        k->row_half(acc, acc, sw >> x, j->uyvy);
+
+    /* 65535 for a single pixel, the same result in 16 bits */
+    if (!j->box.vecs && straight) {
+        k->row_scale(acc, row, 2 * w, j->inv_area[n] < 65535 ? j->inv_area[n] : 65535);
+    } else if (j->box.vecs) {
+        for (x = 0; x < 8; x++)
+            scale[x] = x > j->box.terms ? 0 : j->inv_area[n * x] < 65535 ? j->inv_area[n * x] : 65535;
+        k->row_box(acc, row, &j->box, scale);
+    }
+    if (acc == s->walk->sum)
+        memset(acc, 0, 2 * sw * sizeof(*acc));
+    s->next++;
+}
+
+/* walk the rows up to end, every picture taking the output rows that end on them */
+static void walk_to(struct csc_walk *w, const struct csc_kernels *k, int end) {
+    const struct csc_job *j = w->job;
+    int i;
+
+    for (; w->pos < end; w->pos++) {
+        int sy = j->vflip ? j->src_height - 1 - w->pos : w->pos;
+        const uint8 *row = deint_row(j, k, sy, w->lines + w->pos % w->ring * w->bytes);
+
+        w->rows[w->pos % CSC_SCALE_ROWS] = row;
+        if (!w->pics)
+            continue;
+
+        for (i = 0; i < w->pics; i++) {
+            if (w->pic[i]->start == w->pos)
+                memcpy(w->pic[i]->last, w->sum, w->bytes * sizeof(*w->sum));
+        }
+        k->row_accum(row, w->sum, w->bytes);
+        for (i = 0; i < w->pics; i++) {
+            struct csc_scale *s = w->pic[i];
+
+            if (s->next < s->end && scale_bound(s->job, s->next + 1) == w->pos + 1)
+                take_row(s, k);
+        }
+    }
+}
+
+static const uint8 *scale_row(const struct csc_job *j, const struct csc_kernels *k,
+                              int y, struct csc_scale *s) {
+    int sw = j->src_width & ~1, w = j->width & ~1, hw = sw >> j->halvings;
+    int first = y - y % CSC_SCALE_ROWS;
+    int rows = j->height - first < CSC_SCALE_ROWS ? j->height - first : CSC_SCALE_ROWS;
+    int max_cols = scale_max_cols(j);
+    const unsigned int *inv = j->inv_area;
+    int luma = j->uyvy, chroma = !j->uyvy;
+    int r, x;
+
+    if (first == s->first)
+        return s->rows + (y - first) * s->row_stride;
+    s->first = first;
+    walk_to(s->walk, k, scale_bound(j, first + rows));
+    if (scale_straight(j))
+        return s->rows + (y - first) * s->row_stride;
+
+    for (r = 0; r < CSC_SCALE_ROWS; r++) {
+        /* source pixels under one sample of the halved row */
+        int n = 0;
+
+        if (r < rows)
+            n = (scale_bound(j, first + r + 1) - scale_bound(j, first + r)) << j->halvings;
+        else
+            memset(s->acc + r * s->acc_stride, 0, s->acc_stride * sizeof(*s->acc));
+        for (x = 1; x <= max_cols; x++)
+            s->scale[CSC_SCALE_ROWS * x + r] = inv[n * x] < 65535 ? inv[n * x] : 65535;
+    }
+
+    for (x = 0; x < 2 * hw; x += 8)
+        k->transpose_8x8_16((const uint8 *)(s->acc + x), 2 * s->acc_stride,
+                            (uint8 *)(s->cols + 8 * x), 16);
+    k->cols_box(s->cols + 8 * luma, 2, j->cols_y, s->scale, s->lanes + 8 * luma, 2, w);
+    k->cols_box(s->cols + 8 * chroma, 4, j->cols_c, s->scale, s->lanes + 8 * chroma, 4, w / 2);
+    k->cols_box(s->cols + 8 * (chroma + 2), 4, j->cols_c, s->scale,
+                s->lanes + 8 * (chroma + 2), 4, w / 2);
+    for (x = 0; x < 2 * w; x += 8)
+        k->transpose_8x8(s->lanes + 8 * x, 8, s->rows + x, s->row_stride);
+    return s->rows + (y - first) * s->row_stride;
+}
+
+/*
+ * lines holds two slots, one per row in flight, each room for two packed
+ * rows: the deinterlaced and the mirrored one. A scaled row comes from
+ * the struct csc_scale after them, so does a row of a picture that keeps
+ * the crop's size in a pyramid, straight from the walk.
+ */
+static const uint8 *source_row(const struct csc_job *j, const struct csc_kernels *k,
+                               int y, uint8 *lines, int slot) {
+    int w = j->width & ~1;
+    uint8 *line = lines ? lines + slot * 4 * w : NULL;
+    struct csc_scale *s = lines ? (struct csc_scale *)(lines + 8 * w) : NULL;
+    const uint8 *row;
+
+    if (j->scaled)
+        row = scale_row(j, k, y, s);
+    else if (j->walked)
+        row = s->walk->rows[y % CSC_SCALE_ROWS];
+    else
+        row = deint_row(j, k, j->vflip ? j->height - 1 - y : y, line);
+
+    if (!j->hflip || !line)
+        return row;
+    k->row_mirror(row, line + 2 * w, w, j->uyvy);
+    return line + 2 * w;
+}
+
+/*
+ * Scratch memory of one band, kept by the thread that runs it from one
+ * frame to the next and only ever grown, see run_bands()
+ */
+struct csc_scratch {
+    uint8 *mem;
+    int size;
+};
+
+static uint8 *scratch_get(struct csc_scratch *s, int size) {
+    if (size > s->size) {
+        free(s->mem);
+        s->mem = malloc(size);
+        s->size = s->mem ? size : 0;
+    }
+    return s->mem;
+}
+
+/*
+ * Rotated by 90 or 270: strips of CSC_TILE source rows, written out as
+ * 8x8 blocks the kernels convert and transpose straight from the packed
+ * rows, source column x becoming destination row x: 16 columns a step,
+ * the last step moved back to end on the last column. A mirrored source
+ * (270) is the same blocks written from the bottom up. Rows that are
+ * deinterlaced or scaled are made once per strip into lines, and so is
+ * the last strip, which repeats the last source row for the luma of the
+ * destination's right edge padding; the others are read in place. NV16
+ * takes the NV12 chroma of the rotated picture twice, its destination rows
+ * are source columns too. The destination rows below the picture repeat
+ * its last one.
+ */
+#define CSC_TILE 32
+
+/* the part of a block left of the destination's right edge, cols columns of it */
+static void put_y_block(const struct csc_kernels *k, const uint8 *src, int src_stride,
+                        uint8 *dst, int dst_stride, int cols, int uyvy) {
+    uint8 tmp[8 * 8];
+    int r;
+
+    if (cols >= 8) {
+        k->transpose_y_8x8(src, src_stride, dst, dst_stride, uyvy);
+        return;
+    }
+    k->transpose_y_8x8(src, src_stride, tmp, 8, uyvy);
+    for (r = 0; r < 8; r++)
+        memcpy(dst + r * dst_stride, tmp + 8 * r, cols);
+}
+
+static void put_uv_block(const struct csc_kernels *k, const uint8 *src, int src_stride,
+                         uint8 *dst_u, int dst_stride_u, uint8 *dst_v, int dst_stride_v,
+                         int cols, int uyvy) {
+    uint8 tmp[8 * 16];
+    int r;
+
+    if (cols >= 8) {
+        k->transpose_uv_8x8(src, src_stride, dst_u, dst_stride_u, dst_v, dst_stride_v, uyvy);
+        return;
+    }
+    k->transpose_uv_8x8(src, src_stride, tmp, 16, dst_v ? tmp + 8 : NULL, 16, uyvy);
+    for (r = 0; r < 8; r++) {
+        if (dst_v) {
+            memcpy(dst_u + r * dst_stride_u, tmp + 16 * r, cols);
+            memcpy(dst_v + r * dst_stride_v, tmp + 16 * r + 8, cols);
+        } else {
+            memcpy(dst_u + r * dst_stride_u, tmp + 16 * r, 2 * cols);
+        }
+    }
+}
+
+static void convert_rows_transposed(const struct csc_job *j, const struct csc_kernels *k,
+                                    int y0, int y1, struct csc_scratch *scratch) {
+    int w = j->width & ~1, cw = w / 2;
+    int planar = j->kind == JOB_I420, nv16 = j->kind == JOB_NV16;
+    /* destination chroma: columns (pairs for NV12 and NV16) and rows, of the picture and in all */
+    int pic_cw = (j->height + 1) / 2, out_cw = (j->out_width + 1) / 2;
+    int pic_ch = nv16 ? w : cw;
+    int out_ch = nv16 ? j->out_height : (j->out_height + 1) / 2;
+    int csize = planar ? 1 : 2;
+    int written = (j->height + CSC_TILE - 1) & ~(CSC_TILE - 1);
+    int end = y0 + ((y1 - y0 + CSC_TILE - 1) & ~(CSC_TILE - 1));
+    int cend = end / 2 < out_cw ? end / 2 : out_cw;
+    int own = (j->deint && j->deint->mode != CSC_DEINT_OFF) || j->scaled;
+    int scale = j->scaled ? scale_size(j) : 0;
+    uint8 *mem = scratch_get(scratch, scale + CSC_TILE * 2 * w + (j->scaled ? walk_size(j, 1) : 0));
+    int dir = j->hflip ? -1 : 1;
+    struct csc_scale *s = NULL;
+    uint8 *lines;
+    int y, r, x, b;
+
+    if (!mem)
+        return;
+    lines = mem + scale;
+    if (j->scaled)
+        s = scale_init(j, mem, walk_init(j, lines + CSC_TILE * 2 * w, 1, scale_bound(j, y0)), y0, y1);
+
+    for (y = y0; y < y1; y += CSC_TILE) {
+        int rows = y1 - y < CSC_TILE ? y1 - y : CSC_TILE;
+        const uint8 *src;
+        int stride;
+
+        if (own || rows < CSC_TILE) {
+            for (r = 0; r < CSC_TILE; r++) {
+                uint8 *line = lines + r * 2 * w;
+                const uint8 *row;
+
+                if (r >= rows)
+                    row = line - 2 * w;
+                else if (j->scaled)
+                    row = scale_row(j, k, y + r, s);
+                else
+                    row = deint_row(j, k, j->vflip ? j->height - 1 - (y + r) : y + r, line);
+                if (row != line)
+                    memcpy(line, row, 2 * w);
+            }
+            src = lines;
+            stride = 2 * w;
+        } else {
+            src = j->src + (j->vflip ? j->height - 1 - y : y) * j->src_stride;
+            stride = j->vflip ? -j->src_stride : j->src_stride;
+        }
+
+        for (x = 0; x < w; x = x + 32 > w && x + 16 < w ? w - 16 : x + 16) {
+            /* the destination rows of source column x and of its chroma */
+            int cx = nv16 ? x : x / 2;
+            int dx = j->hflip ? w - 1 - x : x;
+            int dcx = j->hflip ? pic_ch - 1 - cx : cx;
+            uint8 *dy = j->dst_y + dx * j->dst_stride_y + y;
+            uint8 *du = j->dst_u + dcx * j->dst_stride_u + y / 2 * csize;
+            uint8 *dv = planar ? j->dst_v + dcx * j->dst_stride_v + y / 2 : NULL;
+
+            for (b = 0; b < CSC_TILE && y + b < j->out_width; b += 8) {
+                put_y_block(k, src + b * stride + 2 * x, stride, dy + b, dir * j->dst_stride_y,
+                            j->out_width - y - b, j->uyvy);
+                put_y_block(k, src + b * stride + 2 * x + 16, stride,
+                            dy + 8 * dir * j->dst_stride_y + b, dir * j->dst_stride_y,
+                            j->out_width - y - b, j->uyvy);
+            }
+            for (b = 0; b < CSC_TILE / 2 && y / 2 + b < pic_cw; b += 8) {
+                const uint8 *cs = src + 2 * b * stride + 2 * x;
+                int stride_u = (nv16 ? 2 : 1) * dir * j->dst_stride_u;
+
+                put_uv_block(k, cs, stride, du + b * csize, stride_u,
+                             dv ? dv + b : NULL, dir * j->dst_stride_v, pic_cw - y / 2 - b, j->uyvy);
+                if (nv16)
+                    put_uv_block(k, cs, stride, du + dir * j->dst_stride_u + b * csize, stride_u,
+                                 NULL, 0, pic_cw - y / 2 - b, j->uyvy);
+            }
+        }
+    }
+
+    /*
+     * the chroma right of the picture repeats its last column rather than
+     * the average of the repeated last row
+     */
+    if (y1 == j->height && out_cw > pic_cw) {
+        for (x = 0; x < pic_ch; x++) {
+            pad_right(j->dst_u + x * j->dst_stride_u, pic_cw, out_cw, csize);
+            if (planar)
+                pad_right(j->dst_v + x * j->dst_stride_v, pic_cw, out_cw, 1);
+        }
+    }
+
+    /* the rows below the picture, this band's columns of them */
+    if (end > j->out_width)
+        end = j->out_width;
+    for (x = w; x < j->out_height; x++)
+        memcpy(j->dst_y + x * j->dst_stride_y + y0, j->dst_y + (w - 1) * j->dst_stride_y + y0, end - y0);
+    for (x = pic_ch; x < out_ch; x++) {
+        memcpy(j->dst_u + x * j->dst_stride_u + y0 / 2 * csize,
+               j->dst_u + (pic_ch - 1) * j->dst_stride_u + y0 / 2 * csize, (cend - y0 / 2) * csize);
+        if (planar)
+            memcpy(j->dst_v + x * j->dst_stride_v + y0 / 2,
+                   j->dst_v + (pic_ch - 1) * j->dst_stride_v + y0 / 2, cend - y0 / 2);
+    }
+
+    /* a destination wider than the strips cover */
+    if (y1 == j->height && j->out_width > written) {
+        for (x = 0; x < j->out_height; x++)
+            pad_right(j->dst_y + x * j->dst_stride_y, written, j->out_width, 1);
+        for (x = 0; x < out_ch; x++) {
+            pad_right(j->dst_u + x * j->dst_stride_u, written / 2, out_cw, csize);
+            if (planar)
+                pad_right(j->dst_v + x * j->dst_stride_v, written / 2, out_cw, 1);
+        }
+    }
+}
+
+/* rows y0 up to y1 of the picture, lines as source_row() wants them or NULL */
+static void convert_lines(const struct csc_job *j, const struct csc_kernels *k,
+                          int y0, int y1, uint8 *lines) {
+    const uint8 *src, *s1;
+    uint8 *dst_y = j->dst_y + y0 * j->dst_stride_y;
+    int w = j->width & ~1;
+    int cw = w / 2, out_cw = (j->out_width + 1) / 2;
+    int crows = (j->height + 1) / 2, out_crows = (j->out_height + 1) / 2;
+    int y;
+
+    switch (j->kind) {
+    case JOB_NV12: {
+        uint8 *dst_uv = j->dst_u + y0 / 2 * j->dst_stride_u;
+
+        for (y = y0; y < y1; y += 2) {
+            src = source_row(j, k, y, lines, 0);
+            s1 = y + 1 < j->height ? source_row(j, k, y + 1, lines, 1) : src;
+
+            k->row_uv(src, s1, dst_uv, w, j->uyvy);
+            pad_right(dst_uv, cw, out_cw, 2);
+            dst_uv += j->dst_stride_u;
+
+            k->row_y(src, dst_y, w, j->uyvy);
+            pad_right(dst_y, w, j->out_width, 1);
+            if (y + 1 < j->height) {
+                k->row_y(s1, dst_y + j->dst_stride_y, w, j->uyvy);
+                pad_right(dst_y + j->dst_stride_y, w, j->out_width, 1);
+            }
+            dst_y += 2 * j->dst_stride_y;
+        }
+        if (y1 == j->height)
+            pad_bottom(j->dst_u, j->dst_stride_u, crows, out_crows, out_cw * 2);
+        break;
+    }
+    case JOB_NV16: {
+        uint8 *dst_uv = j->dst_u + y0 * j->dst_stride_u;
+
+        /*
+         * no vertical filter, the chroma of a row is just its other byte
+         * lane: the luma kernel for the opposite byte order
+         */
+        for (y = y0; y < y1; y++) {
+            src = source_row(j, k, y, lines, 0);
+            k->row_y(src, dst_uv, w, !j->uyvy);
+            pad_right(dst_uv, cw, out_cw, 2);
+            k->row_y(src, dst_y, w, j->uyvy);
+            pad_right(dst_y, w, j->out_width, 1);
+            dst_y += j->dst_stride_y;
+            dst_uv += j->dst_stride_u;
+        }
+        if (y1 == j->height)
+            pad_bottom(j->dst_u, j->dst_stride_u, j->height, j->out_height, out_cw * 2);
+        break;
+    }
+    case JOB_I420: {
+        uint8 *dst_u = j->dst_u + y0 / 2 * j->dst_stride_u;
+        uint8 *dst_v = j->dst_v + y0 / 2 * j->dst_stride_v;
+
+        for (y = y0; y < y1; y += 2) {
+            src = source_row(j, k, y, lines, 0);
+            s1 = y + 1 < j->height ? source_row(j, k, y + 1, lines, 1) : src;
+
+            k->row_u_v(src, s1, dst_u, dst_v, w, j->uyvy);
+            pad_right(dst_u, cw, out_cw, 1);
+            pad_right(dst_v, cw, out_cw, 1);
+            dst_u += j->dst_stride_u;
+            dst_v += j->dst_stride_v;
+
+            k->row_y(src, dst_y, w, j->uyvy);
+            pad_right(dst_y, w, j->out_width, 1);
+            if (y + 1 < j->height) {
+                k->row_y(s1, dst_y + j->dst_stride_y, w, j->uyvy);
+                pad_right(dst_y + j->dst_stride_y, w, j->out_width, 1);
+            }
+            dst_y += 2 * j->dst_stride_y;
+        }
+        if (y1 == j->height) {
+            pad_bottom(j->dst_u, j->dst_stride_u, crows, out_crows, out_cw);
+            pad_bottom(j->dst_v, j->dst_stride_v, crows, out_crows, out_cw);
+        }
+        break;
+    }
+    case JOB_NV12_I420: {
+        uint8 *dst_uv = j->dst_u + y0 / 2 * j->dst_stride_u;
+        uint8 *dst2_y = j->dst2_y + y0 * j->dst2_stride_y;
+        uint8 *dst2_u = j->dst2_u + y0 / 2 * j->dst2_stride_u;
+        uint8 *dst2_v = j->dst2_v + y0 / 2 * j->dst2_stride_v;
+        int cw2 = (j->width + 1) / 2;
+
+        /* the I420 picture keeps the frame size, only the NV12 one is padded */
+        for (y = y0; y < y1; y += 2) {
+            src = source_row(j, k, y, lines, 0);
+            s1 = y + 1 < j->height ? source_row(j, k, y + 1, lines, 1) : src;
+
+            k->row_uv_u_v(src, s1, dst_uv, dst2_u, dst2_v, w, j->uyvy);
+            pad_right(dst_uv, cw, out_cw, 2);
+            pad_right(dst2_u, cw, cw2, 1);
+            pad_right(dst2_v, cw, cw2, 1);
+            dst_uv += j->dst_stride_u;
+            dst2_u += j->dst2_stride_u;
+            dst2_v += j->dst2_stride_v;
+
+            k->row_y2(src, dst_y, dst2_y, w, j->uyvy);
+            pad_right(dst_y, w, j->out_width, 1);
+            pad_right(dst2_y, w, j->width, 1);
+            if (y + 1 < j->height) {
+                k->row_y2(s1, dst_y + j->dst_stride_y, dst2_y + j->dst2_stride_y, w, j->uyvy);
+                pad_right(dst_y + j->dst_stride_y, w, j->out_width, 1);
+                pad_right(dst2_y + j->dst2_stride_y, w, j->width, 1);
+            }
+            dst_y += 2 * j->dst_stride_y;
+            dst2_y += 2 * j->dst2_stride_y;
+        }
+        if (y1 == j->height)
+            pad_bottom(j->dst_u, j->dst_stride_u, crows, out_crows, out_cw * 2);
+        break;
+    }
+    }
+
+    if (y1 == j->height)
+        pad_bottom(j->dst_y, j->dst_stride_y, j->height, j->out_height, j->out_width);
+}
+
+static void convert_rows(const struct csc_job *j, int y0, int y1, struct csc_scratch *scratch) {
+    const struct csc_kernels *k = csc_get_kernels();
+    uint8 *lines = NULL;
+    int w = j->width & ~1;
+
+    if (j->transpose) {
+        convert_rows_transposed(j, k, y0, y1, scratch);
+        return;
+    }
+
+    /* two rows are in flight for 4:2:0, see source_row() */
+    if (j->scaled) {
+        int scale = scale_size(j);
+
+        lines = scratch_get(scratch, 8 * w + scale + walk_size(j, 1));
+        if (!lines)
+            return;
+        scale_init(j, lines + 8 * w, walk_init(j, lines + 8 * w + scale, 1, scale_bound(j, y0)), y0, y1);
+    } else if ((j->deint && j->deint->mode != CSC_DEINT_OFF) || j->hflip) {
+        lines = scratch_get(scratch, 8 * w);
+    }
+
+    convert_lines(j, k, y0, y1, lines);
+}
+
+/* rows y0 up to y1 of j in band band of bands */
+static void band_rows(const struct csc_job *j, int band, int bands, int *y0, int *y1) {
+    int rows = ((j->height + 1) / 2 + bands - 1) / bands * 2;
+
+    /* a transposing band is whole strips, a scaling one whole blocks */
+    if (j->transpose)
+        rows = (rows + CSC_TILE - 1) & ~(CSC_TILE - 1);
+    else if (j->scaled || j->walked)
+        rows = (rows + CSC_SCALE_ROWS - 1) & ~(CSC_SCALE_ROWS - 1);
+    *y0 = band * rows;
+    *y1 = *y0 + rows < j->height ? *y0 + rows : j->height;
+}
+
+/*
+ * A band of a pyramid: every picture's share of it, taken from one walk
+ * over the source rows. The walk keeps the last CSC_SCALE_ROWS rows for
+ * the pictures that keep the crop's size, and only ever goes as far as
+ * the block that ends first needs, which is converted next, so no picture
+ * loses rows it has yet to take.
+ */
+static void convert_pyramid_band(const struct csc_job *j, int band, struct csc_scratch *scratch) {
+    const struct csc_kernels *k = csc_get_kernels();
+    const struct csc_job *pic[CSC_PYRAMID_MAX];
+    uint8 *lines[CSC_PYRAMID_MAX];
+    int y[CSC_PYRAMID_MAX], end[CSC_PYRAMID_MAX];
+    int n, i, size = 0, pos = -1;
+    struct csc_walk *walk;
+    uint8 *mem;
+
+    for (n = 0; j && n < CSC_PYRAMID_MAX; j = j->next, n++) {
+        pic[n] = j;
+        band_rows(j, band, pic[0]->bands, &y[n], &end[n]);
+        size += 8 * (j->width & ~1) + scale_size(j);
+        if (y[n] < end[n] && (pos < 0 || scale_bound(j, y[n]) < pos))
+            pos = scale_bound(j, y[n]);
+    }
+    if (pos < 0 || !(mem = scratch_get(scratch, size + walk_size(pic[0], CSC_SCALE_ROWS))))
+        return;
+
+    walk = walk_init(pic[0], mem + size, CSC_SCALE_ROWS, pos);
+    for (i = 0; i < n; i++) {
+        lines[i] = mem;
+        mem += 8 * (pic[i]->width & ~1);
+        if (y[i] < end[i])
+            scale_init(pic[i], mem, walk, y[i], end[i]);
+        mem += scale_size(pic[i]);
+    }
+
+    for (;;) {
+        int next = -1, bound = 0, y1;
+
+        for (i = 0; i < n; i++) {
+            int e = y[i] + CSC_SCALE_ROWS < end[i] ? y[i] + CSC_SCALE_ROWS : end[i];
+
+            if (y[i] < end[i] && (next < 0 || scale_bound(pic[i], e) < bound)) {
+                next = i;
+                bound = scale_bound(pic[i], e);
+            }
+        }
+        if (next < 0)
+            break;
+
+        y1 = y[next] + CSC_SCALE_ROWS < end[next] ? y[next] + CSC_SCALE_ROWS : end[next];
+        walk_to(walk, k, bound);
+        convert_lines(pic[next], k, y[next], y1, lines[next]);
+        y[next] = y1;
+    }
+}
+
+static void convert_band(const struct csc_job *j, int band, struct csc_scratch *scratch) {
+    int y0, y1;
+
+    if (j->next) {
+        convert_pyramid_band(j, band, scratch);
+        return;
+    }
+
+    band_rows(j, band, j->bands, &y0, &y1);
+    if (y0 < y1)
+        convert_rows(j, y0, y1, scratch);
+}
+
+/*
+ * persistent workers, worker i runs band i + 1 of the current job and the
+ * caller runs band 0, with the scratch memory kept here
+ */
+#define CSC_MIN_BAND_ROWS 16
+
+static struct {
+    int threads;
+    pthread_t *workers;
+    pthread_mutex_t call_lock;
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    unsigned int generation;
+    int pending;
+    int quit;
+    struct csc_job job;
+    struct csc_scratch scratch;
+} pool = { .threads = 1, .call_lock = PTHREAD_MUTEX_INITIALIZER,
+           .lock = PTHREAD_MUTEX_INITIALIZER, .start = PTHREAD_COND_INITIALIZER,
+           .done = PTHREAD_COND_INITIALIZER };
+
+static void *csc_worker(void *arg) {
+    int band = (int)(long)arg;
+    unsigned int seen = 0;
+    struct csc_scratch scratch = { NULL, 0 };
+    struct csc_job job;
+
+    pthread_mutex_lock(&pool.lock);
+    for (;;) {
+        while (!pool.quit && pool.generation == seen)
+            pthread_cond_wait(&pool.start, &pool.lock);
+        if (pool.quit)
+            break;
+        seen = pool.generation;
+        job = pool.job;
+        pthread_mutex_unlock(&pool.lock);
+
+        if (band < job.bands)
+            convert_band(&job, band, &scratch);
+
+        pthread_mutex_lock(&pool.lock);
+        if (--pool.pending == 0)
+            pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    free(scratch.mem);
+    return NULL;
+}
+
+static void csc_stop_workers(void) {
+    int i;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.quit = 1;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (i = 0; i < pool.threads - 1; i++)
+        pthread_join(pool.workers[i], NULL);
+
+    free(pool.workers);
+    pool.workers = NULL;
+    pool.threads = 1;
+    pool.quit = 0;
+
+    /* new workers start from generation 0 */
+    pool.generation = 0;
+}
+
+/*
+ * size the worker pool, 0 means one thread per online CPU.
+ * Worker i is pinned to CPU i + 1, the caller keeps its own affinity.
+ */
+int csc_set_threads(int threads) {
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int i;
+
+    if (ncpu < 1)
+        ncpu = 1;
+    if (threads <= 0)
+        threads = ncpu;
+
+    pthread_mutex_lock(&pool.call_lock);
+    csc_stop_workers();
+
+    pool.workers = calloc(threads - 1, sizeof(*pool.workers));
+    for (i = 0; pool.workers && i < threads - 1; i++) {
+        if (pthread_create(&pool.workers[i], NULL, csc_worker, (void *)(long)(i + 1)) != 0)
+            break;
+
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET((i + 1) % ncpu, &cpus);
+        pthread_setaffinity_np(pool.workers[i], sizeof(cpus), &cpus);
+    }
+    pool.threads = i + 1;
+    pthread_mutex_unlock(&pool.call_lock);
+
+    return pool.threads;
+}
+
+int csc_get_threads(void) {
+    return pool.threads;
+}
+
+/*
+ * crop by moving the source, the rotations become mirrors of the source
+ * plus a transpose: 90 is the transpose of the upside down picture, 270
+ * that of the mirrored one. A downscaled job converts from the scaled
+ * rows, the crop is what they are scaled from.
+ */
+static void job_geometry(struct csc_job *j, const struct csc_geometry *geom) {
+    struct csc_geometry g;
+
+    if (!geom)
+        return;
+
+    g = *geom;
+    if (csc_geometry_size(&g, j->width, j->height, NULL, NULL) < 0) {
+        j->width = 0;
+        return;
+    }
+
+    j->src += g.crop_y * j->src_stride + g.crop_x * 2;
+    j->src_width = g.crop_width;
+    j->src_height = g.crop_height;
+    j->width = g.scale_width;
+    j->height = g.scale_height;
+    j->scaled = g.scale_width != g.crop_width || g.scale_height != g.crop_height;
+    j->hflip = g.hflip;
+    j->vflip = g.vflip;
+    switch (g.rotate) {
+    case 90:
+        j->transpose = 1;
+        j->vflip ^= 1;
+        break;
+    case 180:
+        j->hflip ^= 1;
+        j->vflip ^= 1;
+        break;
+    case 270:
+        j->transpose = 1;
+        j->hflip ^= 1;
+        break;
+    }
+}
+
+/*
+ * history for the motion mode, the interpolated field of one frame. A new
+ * one starts out black, so the first frame is interpolated throughout.
+ * Without it the motion mode does what bob does.
+ */
+static void deint_prepare(struct csc_deint *d, int width, int height) {
+    int size = (width & ~1) * 2 * ((height + 1) / 2);
+
+    if (d->mode != CSC_DEINT_MOTION || (d->history && d->history_size == size))
+        return;
+
+    free(d->history);
+    d->history = calloc(1, size);
+    d->history_size = d->history ? size : 0;
+}
+
+/*
+ * first sample of the halved row under output sample o, count of them,
+ * step apart; the column bounds of scale_tables()
+ */
+static int box_lane(const struct csc_job *j, int o, int *count, int *step) {
+    int w = j->width & ~1, hw = (j->src_width & ~1) >> j->halvings;
+    int x0, x1;
+
+    if ((o & 1) == j->uyvy) {
+        x0 = o / 2 * hw / w;
+        x1 = (o / 2 + 1) * hw / w;
+        *step = 2;
+    } else {
+        x0 = o / 4 * (hw / 2) / (w / 2);
+        x1 = (o / 4 + 1) * (hw / 2) / (w / 2);
+        *step = 4;
+    }
+    *count = x1 - x0;
+    return *step * x0 + (o & (*step - 1));
+}
+
+/* first sample of vector v, and its loads and terms */
+static int box_vec(const struct csc_job *j, int v, int *loads, int *terms) {
+    int o, first, count, step, base = -1, last = 0;
+
+    *terms = 0;
+    for (o = 8 * v; o < 8 * v + 8 && o < 2 * (j->width & ~1); o++) {
+        first = box_lane(j, o, &count, &step);
+        if (base < 0 || first < base)
+            base = first;
+        if (first + step * (count - 1) > last)
+            last = first + step * (count - 1);
+        if (count > *terms)
+            *terms = count;
+    }
+    *loads = (2 * (last - base) + 2 + 15) / 16;
+    return base;
+}
+
+/* vector v takes the same samples as vector u, from its own base on */
+static int box_same(const struct csc_job *j, int v, int u) {
+    int bv, bu, loads, terms, b, cv, cu, step;
+
+    bv = box_vec(j, v, &loads, &terms);
+    bu = box_vec(j, u, &loads, &terms);
+    for (b = 0; b < 8 && 8 * v + b < 2 * (j->width & ~1); b++) {
+        if (box_lane(j, 8 * v + b, &cv, &step) - bv != box_lane(j, 8 * u + b, &cu, &step) - bu ||
+            cv != cu)
+            return 0;
+    }
+    return 1;
+}
+
+/*
+ * The shuffles of row_box for j, see struct csc_box, into mem when it is
+ * set. The vectors repeat after the first period that does for all of
+ * them, looked for up to CSC_BOX_PERIOD, else every vector has its own
+ * masks. Returns the bytes they take, 0 when a vector needs more terms
+ * or loads than the kernels have.
+ */
+#define CSC_BOX_PERIOD 64
+
+static int box_build(struct csc_job *j, uint8 *mem) {
+    struct csc_box *box = &j->box;
+    int vecs = (2 * (j->width & ~1) + 7) / 8;
+    int v, p, t, l, b, loads, terms;
+    int *base;
+    uint8 *m;
+
+    if (!mem) {
+        box->terms = box->loads = 0;
+        for (v = 0; v < vecs; v++) {
+            box_vec(j, v, &loads, &terms);
+            if (loads > box->loads)
+                box->loads = loads;
+            if (terms > box->terms)
+                box->terms = terms;
+        }
+        if (box->terms > CSC_BOX_TERMS || box->loads > CSC_BOX_LOADS)
+            return 0;
+
+        box->vecs = vecs;
+        box->period = vecs;
+        box->advance = 0;
+        for (p = 1; p < vecs && p <= CSC_BOX_PERIOD; p++) {
+            int advance = box_vec(j, p, &loads, &terms) - box_vec(j, 0, &loads, &terms);
+
+            for (v = p; v < vecs; v++) {
+                if (box_vec(j, v, &loads, &terms) - box_vec(j, v - p, &loads, &terms) != advance ||
+                    !box_same(j, v, v - p))
+                    break;
+            }
+            if (v == vecs) {
+                box->period = p;
+                box->advance = advance;
+                break;
+            }
+        }
+        return box->period * ((box->terms * box->loads + 1) * 16 + sizeof(int));
+    }
+
+    m = mem;
+    base = (int *)(mem + box->period * (box->terms * box->loads + 1) * 16);
+    for (p = 0; p < box->period; p++) {
+        base[p] = box_vec(j, p, &loads, &terms);
+        for (t = 0; t < box->terms; t++) {
+            for (l = 0; l < box->loads; l++, m += 16) {
+                memset(m, 0x80, 16);
+                for (b = 0; b < 8 && 8 * p + b < 2 * (j->width & ~1); b++) {
+                    int count, step, first = box_lane(j, 8 * p + b, &count, &step);
+                    int at = 2 * (first + step * t - base[p]) - 16 * l;
+
+                    if (t < count && at >= 0 && at < 16) {
+                        m[2 * b] = at;
+                        m[2 * b + 1] = at + 1;
+                    }
+                }
+            }
+        }
+        /* the scale of each sample by its count, 0 past the row */
+        memset(m, 0, 16);
+        for (b = 0; b < 8 && 8 * p + b < 2 * (j->width & ~1); b++) {
+            int count, step;
+
+            box_lane(j, 8 * p + b, &count, &step);
+            m[2 * b] = 2 * count;
+            m[2 * b + 1] = 2 * count + 1;
+        }
+        m += 16;
+    }
+    box->base = base;
+    box->masks = mem;
+    return 0;
+}
+
+/*
+ * Halvings and column bounds of the downscaler, output pixel x covers
+ * columns cols_y[x] up to cols_y[x + 1] of the halved row, and the
+ * reciprocals of every area it can average over, rounded down so a
+ * sample never comes out above 255. With kernels that have row_box, the
+ * columns of few samples each go by its shuffles. One allocation shared
+ * by the bands, freed by the caller.
+ */
+static void *scale_tables(struct csc_job *j) {
+    int sw = j->src_width & ~1, w = j->width & ~1, hw;
+    int max_area, size, box = 0;
+    int *cols_y, *cols_c;
+    unsigned int *inv;
+    uint8 *mem;
+    int x;
+
+    /* only while every output pixel still covers whole halved pixel pairs */
+    for (j->halvings = 0; sw % (w << (j->halvings + 1)) == 0; j->halvings++)
+        ;
+    hw = sw >> j->halvings;
+    max_area = (((j->src_height + j->height - 1) / j->height) << j->halvings) * ((hw + w - 1) / w);
+
+    memset(&j->box, 0, sizeof(j->box));
+    if (hw != w && csc_get_kernels()->row_box)
+        box = box_build(j, NULL);
+    size = ((w + 1 + w / 2 + 1) * sizeof(int) + (max_area + 1) * sizeof(unsigned int) + 15) / 16 * 16;
+    mem = malloc(size + box);
+    if (!mem)
+        return NULL;
+    cols_y = (int *)mem;
+    cols_c = cols_y + w + 1;
+    inv = (unsigned int *)(cols_c + w / 2 + 1);
+
+    for (x = 0; x <= w; x++)
+        cols_y[x] = x * hw / w;
+    for (x = 0; x <= w / 2; x++)
+        cols_c[x] = x * (hw / 2) / (w / 2);
+    inv[0] = 0;
+    for (x = 1; x <= max_area; x++)
+        inv[x] = 65536 / x;
+    if (box)
+        box_build(j, mem + size);
+
+    j->cols_y = cols_y;
+    j->cols_c = cols_c;
+    j->inv_area = inv;
+    return mem;
+}
+
+/*
+ * run a job on the pool; a caller that finds the pool busy (another
+ * thread converting) does its frame alone instead of waiting, with scratch
+ * memory of its own
+ */
+static void run_bands(struct csc_job *j) {
+    int bands = j->height / CSC_MIN_BAND_ROWS;
+
+    int pic_width = j->transpose ? j->height : j->width;
+    int pic_height = j->transpose ? j->width : j->height;
+
+    if (j->width < 2 || j->height < 1)
+        return;
+    if (j->out_width < pic_width)
+        j->out_width = pic_width;
+    if (j->out_height < pic_height)
+        j->out_height = pic_height;
+    if (j->deint)
+        deint_prepare(j->deint, j->src_width, j->src_height);
+
+    j->bands = 1;
+    if (pthread_mutex_trylock(&pool.call_lock) != 0) {
+        struct csc_scratch scratch = { NULL, 0 };
+
+        convert_band(j, 0, &scratch);
+        free(scratch.mem);
+        return;
+    }
+
+    if (bands > pool.threads)
+        bands = pool.threads;
+    /* the bands of a pyramid overlap in the source, the motion history is one pass */
+    if (j->next && j->deint && j->deint->mode == CSC_DEINT_MOTION)
+        bands = 1;
+    if (bands <= 1) {
+        convert_band(j, 0, &pool.scratch);
+        pthread_mutex_unlock(&pool.call_lock);
+        return;
+    }
+    j->bands = bands;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.job = *j;
+    pool.pending = pool.threads - 1;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.start);
+    pthread_mutex_unlock(&pool.lock);
+
+    convert_band(j, 0, &pool.scratch);
+
+    pthread_mutex_lock(&pool.lock);
+    while (pool.pending > 0)
+        pthread_cond_wait(&pool.done, &pool.lock);
+    pthread_mutex_unlock(&pool.lock);
+
+    pthread_mutex_unlock(&pool.call_lock);
+}
+
+static void csc_run(struct csc_job *j) {
+    void *tables = NULL;
+
+    if (!j->scaled) {
+        j->src_width = j->width;
+        j->src_height = j->height;
+    } else if (j->width < 2 || j->height < 1 || !(tables = scale_tables(j))) {
+        return;
+    }
+
+    run_bands(j);
+    free(tables);
+}
+
+/*
+ *
+ */
+void csc_packed422_to_nv12(int uyvy, const uint8 *src, int src_stride,
+                           uint8 *dst_y, int dst_stride_y,
+                           uint8 *dst_uv, int dst_stride_uv,
+                           int width, int height, int out_width, int out_height,
+                           struct csc_deint *deint, const struct csc_geometry *geom) {
+    struct csc_job j = {
+        .kind = JOB_NV12, .uyvy = uyvy, .src = src, .src_stride = src_stride,
+        .dst_y = dst_y, .dst_stride_y = dst_stride_y,
+        .dst_u = dst_uv, .dst_stride_u = dst_stride_uv,
+        .width = width, .height = height,
+        .out_width = out_width, .out_height = out_height,
+        .deint = deint,
+    };
+
+    job_geometry(&j, geom);
+    csc_run(&j);
+}
+
+/*
+ *
+ */
+void csc_packed422_to_nv16(int uyvy, const uint8 *src, int src_stride,
+                           uint8 *dst_y, int dst_stride_y,
+                           uint8 *dst_uv, int dst_stride_uv,
+                           int width, int height, int out_width, int out_height,
+                           struct csc_deint *deint, const struct csc_geometry *geom) {
+    struct csc_job j = {
+        .kind = JOB_NV16, .uyvy = uyvy, .src = src, .src_stride = src_stride,
+        .dst_y = dst_y, .dst_stride_y = dst_stride_y,
+        .dst_u = dst_uv, .dst_stride_u = dst_stride_uv,
+        .width = width, .height = height,
+        .out_width = out_width, .out_height = out_height,
+        .deint = deint,
+    };
+
+    job_geometry(&j, geom);
+    csc_run(&j);
+}
+
+/*
+ *
+ */
+void csc_packed422_to_i420(int uyvy, const uint8 *src, int src_stride,
+                           uint8 *dst_y, int dst_stride_y,
+                           uint8 *dst_u, int dst_stride_u,
+                           uint8 *dst_v, int dst_stride_v,
+                           int width, int height, struct csc_deint *deint,
+                           const struct csc_geometry *geom) {
+    struct csc_job j = {
+        .kind = JOB_I420, .uyvy = uyvy, .src = src, .src_stride = src_stride,
+        .dst_y = dst_y, .dst_stride_y = dst_stride_y,
+        .dst_u = dst_u, .dst_stride_u = dst_stride_u,
+        .dst_v = dst_v, .dst_stride_v = dst_stride_v,
+        .width = width, .height = height,
+        .deint = deint,
+    };
+
+    job_geometry(&j, geom);
+    csc_run(&j);
+}
+
+/*
+ *
+ */
+void csc_packed422_to_nv12_i420(int uyvy, const uint8 *src, int src_stride,
+                                uint8 *nv12_y, int nv12_stride_y,
+                                uint8 *nv12_uv, int nv12_stride_uv,
+                                uint8 *dst_y, int dst_stride_y,
+                                uint8 *dst_u, int dst_stride_u,
+                                uint8 *dst_v, int dst_stride_v,
+                                int width, int height, int out_width, int out_height,
+                                struct csc_deint *deint) {
+    struct csc_job j = {
+        .kind = JOB_NV12_I420, .uyvy = uyvy, .src = src, .src_stride = src_stride,
+        .dst_y = nv12_y, .dst_stride_y = nv12_stride_y,
+        .dst_u = nv12_uv, .dst_stride_u = nv12_stride_uv,
+        .dst2_y = dst_y, .dst2_stride_y = dst_stride_y,
+        .dst2_u = dst_u, .dst2_stride_u = dst_stride_u,
+        .dst2_v = dst_v, .dst2_stride_v = dst_stride_v,
+        .width = width, .height = height,
+        .out_width = out_width, .out_height = out_height,
+        .deint = deint,
+    };
+
+    csc_run(&j);
+}
+
+/*
+ * every level a job of its own, linked into one list for run_bands();
+ * a single level is an ordinary conversion
+ */
+int csc_packed422_pyramid(int uyvy, const uint8 *src, int src_stride, int width, int height,
+                          struct csc_deint *deint, const struct csc_geometry *geom,
+                          const struct csc_level *level, int count) {
+    static const enum csc_job_kind kinds[] = { JOB_NV12, JOB_NV16, JOB_I420 };
+    struct csc_job jobs[CSC_PYRAMID_MAX];
+    void *tables[CSC_PYRAMID_MAX] = { NULL };
+    int i, ret = 0;
+
+    if (count < 1 || count > CSC_PYRAMID_MAX || (geom && geom->rotate % 180))
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        const struct csc_level *l = &level[i];
+        struct csc_geometry g = { 0 };
+        struct csc_job *j = &jobs[i];
+
+        if (l->kind < CSC_LEVEL_NV12 || l->kind > CSC_LEVEL_I420) {
+            ret = -1;
+            break;
+        }
+        if (geom)
+            g = *geom;
+        g.scale_width = l->width;
+        g.scale_height = l->height;
+
+        memset(j, 0, sizeof(*j));
+        j->kind = kinds[l->kind];
+        j->uyvy = uyvy;
+        j->src = src;
+        j->src_stride = src_stride;
+        j->dst_y = l->plane[0];
+        j->dst_u = l->plane[1];
+        j->dst_v = l->plane[2];
+        j->dst_stride_y = l->stride[0];
+        j->dst_stride_u = l->stride[1];
+        j->dst_stride_v = l->stride[2];
+        j->width = width;
+        j->height = height;
+        j->deint = deint;
+        j->walked = count > 1;
+        j->next = i + 1 < count ? &jobs[i + 1] : NULL;
+        job_geometry(j, &g);
+
+        if (j->width < 2 || j->height < 1) {
+            ret = -1;
+            break;
+        }
+        if (!j->scaled) {
+            j->src_width = j->width;
+            j->src_height = j->height;
+        } else if (!(tables[i] = scale_tables(j))) {
+            ret = -1;
+            break;
+        }
+        /* run_bands() only sees to the first level's */
+        j->out_width = l->out_width > j->width ? l->out_width : j->width;
+        j->out_height = l->out_height > j->height ? l->out_height : j->height;
+    }
+
+    if (ret == 0)
+        run_bands(&jobs[0]);
+    for (i = 0; i < count; i++)
+        free(tables[i]);
+    return ret;
+}
+
+/*
+ * repeat the right column and bottom row of a plane out to out_width x
+ * out_height samples of size bytes
+ */
+void csc_pad_plane(uint8 *plane, int stride, int width, int height,
+                   int out_width, int out_height, int size) {
+    int y;
+
+    if (width < 1 || height < 1)
+        return;
+    if (out_width < width)
+        out_width = width;
+
+    for (y = 0; y < height; y++)
+        pad_right(plane + y * stride, width, out_width, size);
+    pad_bottom(plane, stride, height, out_height, out_width * size);
+}
+
+static const char *const deint_names[] = { "off", "bob", "blend", "motion" };
+
+/*
+ *
+ */
+void csc_deint_init(struct csc_deint *d, int mode, int field) {
+    memset(d, 0, sizeof(*d));
+    d->mode = mode;
+    d->field = field & 1;
+    d->threshold = CSC_DEINT_THRESHOLD;
+}
+
+void csc_deint_free(struct csc_deint *d) {
+    free(d->history);
+    d->history = NULL;
+    d->history_size = 0;
+}
+
+const char *csc_deint_name(int mode) {
+    if (mode < 0 || mode > CSC_DEINT_MOTION)
+        return "?";
+    return deint_names[mode];
+}
+
+int csc_deint_mode(const char *name) {
+    int i;
+
+    for (i = 0; i <= CSC_DEINT_MOTION; i++)
+        if (strcmp(name, deint_names[i]) == 0)
+            return i;
+    return -1;
+}
+
+/*
+ *
+ */
+int csc_geometry_size(struct csc_geometry *g, int width, int height, int *out_width, int *out_height) {
+    if (g->crop_x < 0 || g->crop_y < 0 || g->crop_width < 0 || g->crop_height < 0 ||
+        g->scale_width < 0 || g->scale_height < 0)
+        return -1;
+    if (!g->crop_width)
+        g->crop_width = width - g->crop_x;
+    if (!g->crop_height)
+        g->crop_height = height - g->crop_y;
+
+    /* whole pixel pairs and whole 4:2:0 chroma rows, the field order stays */
+    g->crop_x &= ~1;
+    g->crop_y &= ~1;
+    g->crop_width &= ~1;
+    g->crop_height &= ~1;
+    if (g->crop_width < 2 || g->crop_height < 2 ||
+        g->crop_x + g->crop_width > width || g->crop_y + g->crop_height > height)
+        return -1;
+
+    /* down only, and no further than the 16 bit row sums hold */
+    if (!g->scale_width)
+        g->scale_width = g->crop_width;
+    if (!g->scale_height)
+        g->scale_height = g->crop_height;
+    g->scale_width &= ~1;
+    g->scale_height &= ~1;
+    if (g->scale_width < 2 || g->scale_height < 2 ||
+        g->scale_width > g->crop_width || g->scale_height > g->crop_height ||
+        g->scale_width * CSC_SCALE_MAX < g->crop_width ||
+        g->scale_height * CSC_SCALE_MAX < g->crop_height)
+        return -1;
+
+    g->rotate = (g->rotate % 360 + 360) % 360;
+    if (g->rotate % 90 || (g->rotate % 180 && g->scale_width < 16))
+        return -1;
+
+    if (out_width)
+        *out_width = g->rotate % 180 ? g->scale_height : g->scale_width;
+    if (out_height)
+        *out_height = g->rotate % 180 ? g->scale_width : g->scale_height;
+    return 0;
+}
+
+int csc_geometry_active(const struct csc_geometry *g) {
+    return g->crop_x || g->crop_y || g->crop_width || g->crop_height ||
+           g->scale_width || g->scale_height || g->hflip || g->vflip || g->rotate % 360;
+}
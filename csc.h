@@ -3,9 +3,314 @@
 
 #define uint8 unsigned char
 
+/*
+ * Row kernels for packed 4:2:2 (UYVY when uyvy is set, else YUYV), one
+ * table per instruction set. width is in pixels and even, any even width
+ * runs in SIMD except rows narrower than one vector.
+ *   row_y   - luma of one row
+ *   row_uv  - interleaved chroma, average of rows s0 and s1 (s1 == s0 for 4:2:2 output)
+ *   row_u_v - planar chroma, average of rows s0 and s1
+ * and fused variants that read the source once for two layouts:
+ *   row_y2     - luma into two destinations
+ *   row_uv_u_v - interleaved and planar chroma
+ * The deinterlacer works on whole packed rows, bytes long, luma and chroma
+ * alike, dst may be one of the sources:
+ *   row_avg    - (a + b + 1) / 2
+ *   row_motion - cur where it changed by at most threshold since prev,
+ *                else the average of above and below; prev becomes cur
+ * and the geometry stage:
+ *   row_mirror       - packed row reversed, pixel pairs keep their chroma
+ *   transpose_8x8    - 8x8 block of bytes, rows become columns
+ *   transpose_8x8_16 - 8x8 block of byte pairs (NV12 chroma)
+ *   transpose_y_8x8  - luma of 8 pixels of 8 packed rows src_stride apart,
+ *                      dst row i the luma of pixel i of each row
+ *   transpose_uv_8x8 - chroma of 8 pixel pairs of 16 packed rows, the rows
+ *                      averaged two by two like row_uv, dst row i pair i
+ *                      of each average: interleaved, or U into dst_u and
+ *                      V into dst_v when dst_v is set
+ * and the downscaler, which keeps a running total of the source rows,
+ * takes the sums under one output row out of it, halves them while the
+ * output pixels stay on whole halved ones and adds up the columns under
+ * each output pixel:
+ *   row_accum        - acc[i] += src[i] for bytes samples
+ *   row_delta        - dst[i] = sum[i] - last[i], then last[i] = sum[i],
+ *                      16 bit and wrapping, for count samples
+ *   row_half         - 16 bit sums of a packed row, each two pixels (and
+ *                      chroma pairs) added into one; width pixels in, a
+ *                      multiple of 4, dst may be src
+ *   row_scale        - dst[i] = (src[i] * scale + 32768) >> 16 for a row
+ *                      that keeps its width, scale below 65536
+ *   cols_box         - the sums of 8 rows transposed, one column of 8 lanes
+ *                      per sample: output x adds columns cols[x] up to
+ *                      cols[x + 1], step columns apart, and comes out as
+ *                      (sum * scale[8 * n + lane] + 32768) >> 16 for its n
+ *                      columns, 8 bytes at dst + 8 * dst_step * x
+ *   row_box          - the columns of one row of sums by the shuffles of
+ *                      box, see struct csc_box, each output sample
+ *                      (sum * scale[n] + 32768) >> 16 for its n terms;
+ *                      NULL where the transposes are cheaper
+ */
+
+/*
+ * Columns of a downscale where every output sample adds up a few
+ * neighbouring ones: output samples 8v up to 8v + 8 are the sums of
+ * terms samples each, picked pshufb style (byte indexes, 0x80 for none)
+ * out of loads 16 byte loads from sample base[v % period] +
+ * v / period * advance on. Per vector of the period the masks are terms
+ * x loads of those, then one that picks the scale of each sample from
+ * the 8 of its row.
+ */
+#define CSC_BOX_TERMS 4
+#define CSC_BOX_LOADS 4
+
+struct csc_box {
+    int vecs;
+    int terms, loads;
+    int period, advance;
+    const int *base;
+    const uint8 *masks;
+};
+
+struct csc_kernels {
+    const char *isa;
+    void (*row_y)(const uint8 *src, uint8 *dst_y, int width, int uyvy);
+    void (*row_uv)(const uint8 *s0, const uint8 *s1, uint8 *dst_uv, int width, int uyvy);
+    void (*row_u_v)(const uint8 *s0, const uint8 *s1, uint8 *dst_u, uint8 *dst_v, int width, int uyvy);
+    void (*row_y2)(const uint8 *src, uint8 *dst_a, uint8 *dst_b, int width, int uyvy);
+    void (*row_uv_u_v)(const uint8 *s0, const uint8 *s1, uint8 *dst_uv,
+                       uint8 *dst_u, uint8 *dst_v, int width, int uyvy);
+    void (*row_avg)(const uint8 *a, const uint8 *b, uint8 *dst, int bytes);
+    void (*row_motion)(const uint8 *above, const uint8 *cur, const uint8 *below,
+                       uint8 *prev, uint8 *dst, int bytes, int threshold);
+    void (*row_mirror)(const uint8 *src, uint8 *dst, int width, int uyvy);
+    void (*transpose_8x8)(const uint8 *src, int src_stride, uint8 *dst, int dst_stride);
+    void (*transpose_8x8_16)(const uint8 *src, int src_stride, uint8 *dst, int dst_stride);
+    void (*transpose_y_8x8)(const uint8 *src, int src_stride, uint8 *dst, int dst_stride, int uyvy);
+    void (*transpose_uv_8x8)(const uint8 *src, int src_stride, uint8 *dst_u, int dst_stride_u,
+                             uint8 *dst_v, int dst_stride_v, int uyvy);
+    void (*row_accum)(const uint8 *src, unsigned short *acc, int bytes);
+    void (*row_delta)(const unsigned short *sum, unsigned short *last, unsigned short *dst, int count);
+    void (*row_half)(const unsigned short *src, unsigned short *dst, int width, int uyvy);
+    void (*row_scale)(const unsigned short *src, uint8 *dst, int count, int scale);
+    void (*cols_box)(const unsigned short *src, int step, const int *cols,
+                     const unsigned short *scale, uint8 *dst, int dst_step, int count);
+    void (*row_box)(const unsigned short *src, uint8 *dst, const struct csc_box *box,
+                    const unsigned short *scale);
+};
+
+extern const struct csc_kernels csc_c;
+#if defined(CPU_HAS_NEON)
+extern const struct csc_kernels csc_neon;
+#endif
+#if defined(__i386__) || defined(__x86_64__)
+extern const struct csc_kernels csc_sse2;
+extern const struct csc_kernels csc_ssse3;
+extern const struct csc_kernels csc_avx2;
+#endif
+
+/* best kernels for the CPU we run on, picked once from CPUID/HWCAP */
+const struct csc_kernels *csc_get_kernels(void);
+
+/* all tables the CPU supports, csc_c first and the best last */
+#define CSC_MAX_KERNELS 4
+int csc_supported_kernels(const struct csc_kernels **list, int max);
+
+/*
+ * The frame conversions below split the rows over a pool of worker
+ * threads, 0 means one per online CPU. Returns the resulting pool size.
+ */
+int csc_set_threads(int threads);
+int csc_get_threads(void);
+
+/*
+ * Deinterlacing of packed 4:2:2 sources with both fields interleaved, done
+ * on the source rows as the frame conversions below read them, so it costs
+ * no pass of its own. field is the one kept as captured (0 top, even rows),
+ * the rows of the other one are
+ *   bob    - interpolated from the rows above and below
+ *   blend  - every row averaged with the two around it, about (a + 2c + b) / 4
+ *   motion - kept where they changed by at most threshold since the last
+ *            frame, interpolated like bob where they did not. history holds
+ *            those rows of the last frame, so one csc_deint per stream of
+ *            frames (allocated on first use).
+ */
+enum csc_deint_mode { CSC_DEINT_OFF, CSC_DEINT_BOB, CSC_DEINT_BLEND, CSC_DEINT_MOTION };
+
+#define CSC_DEINT_THRESHOLD 12
+
+struct csc_deint {
+    int mode;
+    int field;
+    int threshold;
+    uint8 *history;
+    int history_size;
+};
+
+void csc_deint_init(struct csc_deint *d, int mode, int field);
+void csc_deint_free(struct csc_deint *d);
+/* "off", "bob", "blend", "motion"; csc_deint_mode() returns -1 for anything else */
+const char *csc_deint_name(int mode);
+int csc_deint_mode(const char *name);
+
+/*
+ * Geometry of the converted picture, taken from a packed 4:2:2 source in
+ * the same pass: the crop rectangle (0 width or height for the whole
+ * picture), then the downscale to scale_width x scale_height (0 keeps the
+ * crop's size), then the mirrors, then rotate degrees clockwise. 90 and
+ * 270 transpose the picture in 8x8 blocks as it is converted, for a
+ * picture at least 16 wide before the rotation.
+ * The scaler is a box filter, every output pixel the rounded average of
+ * the source pixels it covers, by at most CSC_SCALE_MAX each way.
+ * Sizes and offsets are rounded down to even.
+ */
+#define CSC_SCALE_MAX 16
+
+struct csc_geometry {
+    int crop_x, crop_y;
+    int crop_width, crop_height;
+    int scale_width, scale_height;
+    int hflip, vflip;
+    int rotate;
+};
+
+/*
+ * check g against a width x height source and round it, returns the size
+ * of the converted picture or -1 when the crop, scale or rotation is invalid
+ */
+int csc_geometry_size(struct csc_geometry *g, int width, int height, int *out_width, int *out_height);
+/* anything other than the whole picture as it is */
+int csc_geometry_active(const struct csc_geometry *g);
+
+/*
+ * packed 4:2:2 frame conversions through the selected kernels. Strides are
+ * in bytes. The encoder side output is out_width x out_height (at least
+ * width x height, e.g. rounded up to whole macroblocks), the padding
+ * repeats the right column and bottom row in the same pass. deint is NULL
+ * for progressive sources, geom NULL for the picture as captured; width
+ * and height are the source's, out_width x out_height the destination's.
+ */
+void csc_packed422_to_nv12(int uyvy, const uint8 *src, int src_stride,
+                           uint8 *dst_y, int dst_stride_y,
+                           uint8 *dst_uv, int dst_stride_uv,
+                           int width, int height, int out_width, int out_height,
+                           struct csc_deint *deint, const struct csc_geometry *geom);
+void csc_packed422_to_nv16(int uyvy, const uint8 *src, int src_stride,
+                           uint8 *dst_y, int dst_stride_y,
+                           uint8 *dst_uv, int dst_stride_uv,
+                           int width, int height, int out_width, int out_height,
+                           struct csc_deint *deint, const struct csc_geometry *geom);
+void csc_packed422_to_i420(int uyvy, const uint8 *src, int src_stride,
+                           uint8 *dst_y, int dst_stride_y,
+                           uint8 *dst_u, int dst_stride_u,
+                           uint8 *dst_v, int dst_stride_v,
+                           int width, int height, struct csc_deint *deint,
+                           const struct csc_geometry *geom);
+
+/* NV12 (padded as above) and I420 in one pass over the source, swap u and v for YV12 */
+void csc_packed422_to_nv12_i420(int uyvy, const uint8 *src, int src_stride,
+                                uint8 *nv12_y, int nv12_stride_y,
+                                uint8 *nv12_uv, int nv12_stride_uv,
+                                uint8 *dst_y, int dst_stride_y,
+                                uint8 *dst_u, int dst_stride_u,
+                                uint8 *dst_v, int dst_stride_v,
+                                int width, int height, int out_width, int out_height,
+                                struct csc_deint *deint);
+
+/*
+ * One frame at several sizes in a single pass, e.g. the outputs of a
+ * simulcast: the source rows are read, deinterlaced and summed once per
+ * band and every level is taken from those shared sums. The levels share
+ * geom's crop and mirrors (its scale is ignored, 90 and 270 are refused),
+ * each has its own size, the crop's or a downscale of it, and is padded
+ * to out_width x out_height. Returns -1, converting nothing, when a level
+ * can't be made.
+ */
+#define CSC_PYRAMID_MAX 8
+
+enum csc_level_kind { CSC_LEVEL_NV12, CSC_LEVEL_NV16, CSC_LEVEL_I420 };
+
+struct csc_level {
+    int kind;
+    uint8 *plane[3];
+    int stride[3];
+    int width, height;
+    int out_width, out_height;
+};
+
+int csc_packed422_pyramid(int uyvy, const uint8 *src, int src_stride, int width, int height,
+                          struct csc_deint *deint, const struct csc_geometry *geom,
+                          const struct csc_level *level, int count);
+
+/* repeat the right column and bottom row of a plane into its padding */
+void csc_pad_plane(uint8 *plane, int stride, int width, int height,
+                   int out_width, int out_height, int size);
+
+/*
+ * A picture in one of the registry's formats (V4L2 fourccs YUYV, UYVY,
+ * NV12, NV21, NV16, YU12, YV12, GREY). plane[] is Y, U, V (chroma in
+ * plane[1] for semi-planar), strides are in bytes. A destination is
+ * written out to out_width x out_height, 0 for the picture size, with
+ * the edges repeated. A packed 4:2:2 source with deint set is deinterlaced
+ * by the conversions to NV12, NV16, I420 and YV12, and geom is applied by
+ * them too; width and height stay the source's, the destination's are
+ * those csc_geometry_size() returns.
+ */
+struct csc_image {
+    unsigned int fourcc;
+    int width, height;
+    int out_width, out_height;
+    uint8 *plane[3];
+    int stride[3];
+    struct csc_deint *deint;
+    const struct csc_geometry *geom;
+};
+
+/*
+ * planes of a contiguous buffer, stride is the luma line in bytes and rows
+ * the number of luma rows before the chroma, 0 for the picture size
+ */
+int csc_image_init(struct csc_image *img, unsigned int fourcc, void *buf,
+                   int width, int height, int stride, int rows);
+
+/*
+ * a packed 4:2:2 src to count NV12, NV16, YU12 or YV12 destinations at
+ * their own sizes in one pass, see csc_packed422_pyramid(); -1 for any
+ * other formats
+ */
+int csc_convert_pyramid(const struct csc_image *src, const struct csc_image *dst, int count);
+
+/* bytes of a tightly packed frame, 0 for a format the registry doesn't know */
+int csc_frame_size(unsigned int fourcc, int width, int height);
+
+/*
+ * Conversion registry keyed by (source, destination) fourcc. Specialised
+ * entries run on the kernel table csc_get_kernels() picked, every pair
+ * that has no specialised entry falls back to the scalar generic path.
+ * Packed 4:2:2 destinations only come from packed sources. Only entries
+ * with CSC_CONV_DEINT read src->deint and only those with CSC_CONV_GEOM
+ * src->geom, callers refuse the others when deinterlacing is on or the
+ * geometry is not the identity.
+ */
+#define CSC_CONV_DEINT  0x1
+#define CSC_CONV_GEOM   0x2
+
+struct csc_conversion {
+    unsigned int src, dst;
+    const char *name;
+    int cost;       /* relative, lookups take the lowest */
+    unsigned int caps;  /* CSC_CONV_* */
+    void (*run)(const struct csc_image *src, const struct csc_image *dst);
+};
+
+/* cheapest way from src to dst, NULL if there is none */
+const struct csc_conversion *csc_find_conversion(unsigned int src, unsigned int dst);
+int csc_list_conversions(const struct csc_conversion **list, int max);
+
 void uyvy422toNV12(int width, int height, unsigned char *FrameIn, unsigned char *FrameOut);
 void uyvy422to420(int width, int height, unsigned char *FrameIn, unsigned char *FrameOut);
 void yuyv422toNV12(int width, int height, unsigned char *FrameIn, unsigned char *FrameOut);
+void nv12to420(int width, int height, unsigned char *FrameIn, unsigned char *FrameOut);
+void nv16to420(int width, int height, unsigned char *FrameIn, unsigned char *FrameOut);
 
 int UYVYToNV12_neon(const uint8 *src_uyvy, int src_stride_uyvy,
                uint8 *dst_y, int dst_stride_y,
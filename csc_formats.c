@@ -0,0 +1,449 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <linux/videodev2.h>
+
+#include "csc.h"
+
+/*
+ * Pixel formats the registry converts between. The planes of a csc_image
+ * are always Y, U, V whatever their order in memory, order only tells
+ * the byte or plane order: UYVY for packed, VU for semi-planar, V before
+ * U for planar.
+ */
+enum csc_layout { LAYOUT_PACKED, LAYOUT_SEMI, LAYOUT_PLANAR, LAYOUT_LUMA };
+
+struct csc_format {
+    unsigned int fourcc;
+    enum csc_layout layout;
+    int sub_v;      /* luma rows per chroma row, 2 for 4:2:0 */
+    int order;
+};
+
+static const struct csc_format formats[] = {
+    { V4L2_PIX_FMT_YUYV,   LAYOUT_PACKED, 1, 0 },
+    { V4L2_PIX_FMT_UYVY,   LAYOUT_PACKED, 1, 1 },
+    { V4L2_PIX_FMT_NV12,   LAYOUT_SEMI,   2, 0 },
+    { V4L2_PIX_FMT_NV21,   LAYOUT_SEMI,   2, 1 },
+    { V4L2_PIX_FMT_NV16,   LAYOUT_SEMI,   1, 0 },
+    { V4L2_PIX_FMT_YUV420, LAYOUT_PLANAR, 2, 0 },
+    { V4L2_PIX_FMT_YVU420, LAYOUT_PLANAR, 2, 1 },
+    { V4L2_PIX_FMT_GREY,   LAYOUT_LUMA,   1, 0 },
+};
+
+#define N_FORMATS (int)(sizeof(formats) / sizeof(formats[0]))
+
+static const struct csc_format *find_format(unsigned int fourcc) {
+    int i;
+
+    for (i = 0; i < N_FORMATS; i++)
+        if (formats[i].fourcc == fourcc)
+            return &formats[i];
+    return NULL;
+}
+
+static int chroma_rows(const struct csc_format *f, int rows) {
+    return f->sub_v == 2 ? (rows + 1) / 2 : rows;
+}
+
+/*
+ *
+ */
+int csc_frame_size(unsigned int fourcc, int width, int height) {
+    const struct csc_format *f = find_format(fourcc);
+    int cw = (width + 1) / 2;
+
+    if (!f)
+        return 0;
+
+    switch (f->layout) {
+    case LAYOUT_PACKED:
+        return width * 2 * height;
+    case LAYOUT_LUMA:
+        return width * height;
+    default:
+        return width * height + 2 * cw * chroma_rows(f, height);
+    }
+}
+
+/*
+ *
+ */
+int csc_image_init(struct csc_image *img, unsigned int fourcc, void *buf,
+                   int width, int height, int stride, int rows) {
+    const struct csc_format *f = find_format(fourcc);
+    uint8 *p = buf;
+    int cw = (width + 1) / 2;
+
+    if (!f)
+        return -1;
+    if (rows < height)
+        rows = height;
+
+    memset(img, 0, sizeof(*img));
+    img->fourcc = fourcc;
+    img->width = width;
+    img->height = height;
+
+    switch (f->layout) {
+    case LAYOUT_PACKED:
+        img->plane[0] = p;
+        img->stride[0] = stride ? stride : width * 2;
+        break;
+    case LAYOUT_LUMA:
+        img->plane[0] = p;
+        img->stride[0] = stride ? stride : width;
+        break;
+    case LAYOUT_SEMI:
+        img->plane[0] = p;
+        img->stride[0] = stride ? stride : width;
+        img->plane[1] = p + img->stride[0] * rows;
+        img->stride[1] = stride ? stride : 2 * cw;
+        break;
+    case LAYOUT_PLANAR: {
+        uint8 *first;
+
+        img->stride[0] = stride ? stride : width;
+        img->stride[1] = img->stride[2] = stride ? stride / 2 : cw;
+        img->plane[0] = p;
+        first = p + img->stride[0] * rows;
+        img->plane[f->order ? 2 : 1] = first;
+        img->plane[f->order ? 1 : 2] = first + img->stride[1] * chroma_rows(f, rows);
+        break;
+    }
+    }
+
+    return 0;
+}
+
+/*
+ * repeat the picture edges into out_width x out_height of a destination
+ */
+static void pad_image(const struct csc_image *img, const struct csc_format *f) {
+    int w = img->width, h = img->height;
+    int ow = img->out_width > w ? img->out_width : w;
+    int oh = img->out_height > h ? img->out_height : h;
+    int cw = (w + 1) / 2, ocw = (ow + 1) / 2;
+
+    if ((ow == w && oh == h) || f->layout == LAYOUT_PACKED)
+        return;
+
+    csc_pad_plane(img->plane[0], img->stride[0], w, h, ow, oh, 1);
+    if (f->layout == LAYOUT_SEMI) {
+        csc_pad_plane(img->plane[1], img->stride[1], cw, chroma_rows(f, h),
+                      ocw, chroma_rows(f, oh), 2);
+    } else if (f->layout == LAYOUT_PLANAR) {
+        csc_pad_plane(img->plane[1], img->stride[1], cw, chroma_rows(f, h),
+                      ocw, chroma_rows(f, oh), 1);
+        csc_pad_plane(img->plane[2], img->stride[2], cw, chroma_rows(f, h),
+                      ocw, chroma_rows(f, oh), 1);
+    }
+}
+
+static int out_width(const struct csc_image *img) {
+    return img->out_width > img->width ? img->out_width : img->width;
+}
+
+static int out_height(const struct csc_image *img) {
+    return img->out_height > img->height ? img->out_height : img->height;
+}
+
+/*
+ * specialised conversions, packed 4:2:2 through the SIMD row kernels;
+ * the frame conversions deinterlace and apply the geometry on the way,
+ * grey and swap don't, see the caps in registry_init()
+ */
+static void run_packed_nv12(const struct csc_image *src, const struct csc_image *dst) {
+    csc_packed422_to_nv12(src->fourcc == V4L2_PIX_FMT_UYVY, src->plane[0], src->stride[0],
+                          dst->plane[0], dst->stride[0], dst->plane[1], dst->stride[1],
+                          src->width, src->height, out_width(dst), out_height(dst),
+                          src->deint, src->geom);
+}
+
+static void run_packed_nv16(const struct csc_image *src, const struct csc_image *dst) {
+    csc_packed422_to_nv16(src->fourcc == V4L2_PIX_FMT_UYVY, src->plane[0], src->stride[0],
+                          dst->plane[0], dst->stride[0], dst->plane[1], dst->stride[1],
+                          src->width, src->height, out_width(dst), out_height(dst),
+                          src->deint, src->geom);
+}
+
+/* I420 and YV12, the image planes are already in U, V order */
+static void run_packed_i420(const struct csc_image *src, const struct csc_image *dst) {
+    csc_packed422_to_i420(src->fourcc == V4L2_PIX_FMT_UYVY, src->plane[0], src->stride[0],
+                          dst->plane[0], dst->stride[0],
+                          dst->plane[1], dst->stride[1],
+                          dst->plane[2], dst->stride[2],
+                          src->width, src->height, src->deint, src->geom);
+    pad_image(dst, find_format(dst->fourcc));
+}
+
+int csc_convert_pyramid(const struct csc_image *src, const struct csc_image *dst, int count) {
+    struct csc_level level[CSC_PYRAMID_MAX];
+    int i;
+
+    if (src->fourcc != V4L2_PIX_FMT_UYVY && src->fourcc != V4L2_PIX_FMT_YUYV)
+        return -1;
+    if (count < 1 || count > CSC_PYRAMID_MAX)
+        return -1;
+
+    for (i = 0; i < count; i++) {
+        switch (dst[i].fourcc) {
+        case V4L2_PIX_FMT_NV12:
+            level[i].kind = CSC_LEVEL_NV12;
+            break;
+        case V4L2_PIX_FMT_NV16:
+            level[i].kind = CSC_LEVEL_NV16;
+            break;
+        case V4L2_PIX_FMT_YUV420:
+        case V4L2_PIX_FMT_YVU420:
+            level[i].kind = CSC_LEVEL_I420;
+            break;
+        default:
+            return -1;
+        }
+        memcpy(level[i].plane, dst[i].plane, sizeof(level[i].plane));
+        memcpy(level[i].stride, dst[i].stride, sizeof(level[i].stride));
+        level[i].width = dst[i].width;
+        level[i].height = dst[i].height;
+        level[i].out_width = out_width(&dst[i]);
+        level[i].out_height = out_height(&dst[i]);
+    }
+
+    return csc_packed422_pyramid(src->fourcc == V4L2_PIX_FMT_UYVY, src->plane[0], src->stride[0],
+                                 src->width, src->height, src->deint, src->geom, level, count);
+}
+
+static void run_packed_grey(const struct csc_image *src, const struct csc_image *dst) {
+    const struct csc_kernels *k = csc_get_kernels();
+    int w = src->width & ~1;
+    int y;
+
+    for (y = 0; y < src->height; y++) {
+        uint8 *d = dst->plane[0] + y * dst->stride[0];
+
+        k->row_y(src->plane[0] + y * src->stride[0], d, w, src->fourcc == V4L2_PIX_FMT_UYVY);
+        if (w < src->width)
+            d[w] = d[w - 1];
+    }
+    pad_image(dst, find_format(dst->fourcc));
+}
+
+/* YUYV <-> UYVY, every byte pair swapped */
+static void run_packed_swap(const struct csc_image *src, const struct csc_image *dst) {
+    int x, y;
+
+    for (y = 0; y < src->height; y++) {
+        const uint8 *s = src->plane[0] + y * src->stride[0];
+        uint8 *d = dst->plane[0] + y * dst->stride[0];
+
+        for (x = 0; x < src->width * 2; x += 2) {
+            d[x] = s[x + 1];
+            d[x + 1] = s[x];
+        }
+    }
+}
+
+static void run_copy(const struct csc_image *src, const struct csc_image *dst) {
+    const struct csc_format *f = find_format(src->fourcc);
+    int w = src->width, h = src->height, cw = (w + 1) / 2;
+    int ch = chroma_rows(f, h);
+    int y;
+
+    for (y = 0; y < h; y++)
+        memcpy(dst->plane[0] + y * dst->stride[0], src->plane[0] + y * src->stride[0],
+               f->layout == LAYOUT_PACKED ? w * 2 : w);
+
+    for (y = 0; y < ch && f->layout == LAYOUT_SEMI; y++)
+        memcpy(dst->plane[1] + y * dst->stride[1], src->plane[1] + y * src->stride[1], 2 * cw);
+
+    for (y = 0; y < ch && f->layout == LAYOUT_PLANAR; y++) {
+        memcpy(dst->plane[1] + y * dst->stride[1], src->plane[1] + y * src->stride[1], cw);
+        memcpy(dst->plane[2] + y * dst->stride[2], src->plane[2] + y * src->stride[2], cw);
+    }
+
+    pad_image(dst, f);
+}
+
+/*
+ * Generic path, any source to any non-packed destination a row at a time.
+ * Chroma goes through planar U and V rows: 4:2:2 to 4:2:0 averages two
+ * rows rounding down like the kernels, 4:2:0 to 4:2:2 repeats each row,
+ * grey sources get neutral chroma.
+ */
+static void read_chroma(const struct csc_image *img, const struct csc_format *f, int row,
+                        uint8 *u, uint8 *v, int cw) {
+    int x, pairs;
+
+    switch (f->layout) {
+    case LAYOUT_PACKED: {
+        const uint8 *s = img->plane[0] + row * img->stride[0] + (f->order ? 0 : 1);
+
+        pairs = img->width / 2;
+        for (x = 0; x < pairs; x++) {
+            u[x] = s[4 * x];
+            v[x] = s[4 * x + 2];
+        }
+        for (; x < cw; x++) {
+            u[x] = u[pairs - 1];
+            v[x] = v[pairs - 1];
+        }
+        break;
+    }
+    case LAYOUT_SEMI: {
+        const uint8 *s = img->plane[1] + row * img->stride[1];
+
+        for (x = 0; x < cw; x++) {
+            u[x] = s[2 * x + f->order];
+            v[x] = s[2 * x + 1 - f->order];
+        }
+        break;
+    }
+    case LAYOUT_PLANAR:
+        memcpy(u, img->plane[1] + row * img->stride[1], cw);
+        memcpy(v, img->plane[2] + row * img->stride[2], cw);
+        break;
+    case LAYOUT_LUMA:
+        memset(u, 128, cw);
+        memset(v, 128, cw);
+        break;
+    }
+}
+
+static void write_chroma(const struct csc_image *img, const struct csc_format *f, int row,
+                         const uint8 *u, const uint8 *v, int cw) {
+    int x;
+
+    if (f->layout == LAYOUT_SEMI) {
+        uint8 *d = img->plane[1] + row * img->stride[1];
+
+        for (x = 0; x < cw; x++) {
+            d[2 * x + f->order] = u[x];
+            d[2 * x + 1 - f->order] = v[x];
+        }
+    } else if (f->layout == LAYOUT_PLANAR) {
+        memcpy(img->plane[1] + row * img->stride[1], u, cw);
+        memcpy(img->plane[2] + row * img->stride[2], v, cw);
+    }
+}
+
+static void run_generic(const struct csc_image *src, const struct csc_image *dst) {
+    const struct csc_format *sf = find_format(src->fourcc);
+    const struct csc_format *df = find_format(dst->fourcc);
+    const struct csc_kernels *k = csc_get_kernels();
+    int w = src->width, h = src->height, cw = (w + 1) / 2;
+    int sch = sf->layout == LAYOUT_LUMA ? h : chroma_rows(sf, h);
+    uint8 *u, *v, *u1, *v1;
+    int x, y;
+
+    for (y = 0; y < h; y++) {
+        const uint8 *s = src->plane[0] + y * src->stride[0];
+        uint8 *d = dst->plane[0] + y * dst->stride[0];
+
+        if (sf->layout == LAYOUT_PACKED) {
+            k->row_y(s, d, w & ~1, sf->order);
+            if (w & 1)
+                d[w - 1] = d[w - 2];
+        } else {
+            memcpy(d, s, w);
+        }
+    }
+
+    if (df->layout != LAYOUT_LUMA && (u = malloc(4 * cw)) != NULL) {
+        v = u + cw;
+        u1 = v + cw;
+        v1 = u1 + cw;
+
+        for (y = 0; y < chroma_rows(df, h); y++) {
+            if (sf->layout == LAYOUT_LUMA || df->sub_v == sf->sub_v) {
+                read_chroma(src, sf, y, u, v, cw);
+            } else if (df->sub_v == 2) {
+                read_chroma(src, sf, 2 * y, u, v, cw);
+                read_chroma(src, sf, 2 * y + 1 < sch ? 2 * y + 1 : 2 * y, u1, v1, cw);
+                for (x = 0; x < cw; x++) {
+                    u[x] = (u[x] + u1[x]) / 2;
+                    v[x] = (v[x] + v1[x]) / 2;
+                }
+            } else {
+                read_chroma(src, sf, y / 2, u, v, cw);
+            }
+            write_chroma(dst, df, y, u, v, cw);
+        }
+        free(u);
+    }
+
+    pad_image(dst, df);
+}
+
+/*
+ * The registry: specialised entries first, then a copy for every format and
+ * the generic path for every pair it can do. Lookups take the cheapest.
+ */
+#define MAX_CONVERSIONS (N_FORMATS * N_FORMATS + 16)
+
+static struct csc_conversion registry[MAX_CONVERSIONS];
+static int registry_size;
+static pthread_once_t registry_once = PTHREAD_ONCE_INIT;
+
+static void add_conversion(unsigned int src, unsigned int dst, const char *name, int cost,
+                           unsigned int caps,
+                           void (*run)(const struct csc_image *, const struct csc_image *)) {
+    struct csc_conversion *c = &registry[registry_size++];
+
+    c->src = src;
+    c->dst = dst;
+    c->name = name;
+    c->cost = cost;
+    c->caps = caps;
+    c->run = run;
+}
+
+static void registry_init(void) {
+    static const unsigned int packed[] = { V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_UYVY };
+    int i, j;
+
+    for (i = 0; i < 2; i++) {
+        add_conversion(packed[i], V4L2_PIX_FMT_NV12, "packed422_to_nv12", 2, CSC_CONV_DEINT | CSC_CONV_GEOM, run_packed_nv12);
+        add_conversion(packed[i], V4L2_PIX_FMT_NV16, "packed422_to_nv16", 2, CSC_CONV_DEINT | CSC_CONV_GEOM, run_packed_nv16);
+        add_conversion(packed[i], V4L2_PIX_FMT_YUV420, "packed422_to_i420", 2, CSC_CONV_DEINT | CSC_CONV_GEOM, run_packed_i420);
+        add_conversion(packed[i], V4L2_PIX_FMT_YVU420, "packed422_to_i420", 2, CSC_CONV_DEINT | CSC_CONV_GEOM, run_packed_i420);
+        add_conversion(packed[i], V4L2_PIX_FMT_GREY, "packed422_to_grey", 1, 0, run_packed_grey);
+        add_conversion(packed[i], packed[1 - i], "packed422_swap", 2, 0, run_packed_swap);
+    }
+
+    for (i = 0; i < N_FORMATS; i++) {
+        add_conversion(formats[i].fourcc, formats[i].fourcc, "copy", 1, 0, run_copy);
+        for (j = 0; j < N_FORMATS; j++)
+            if (i != j && formats[j].layout != LAYOUT_PACKED)
+                add_conversion(formats[i].fourcc, formats[j].fourcc, "generic", 8, 0, run_generic);
+    }
+}
+
+/*
+ *
+ */
+const struct csc_conversion *csc_find_conversion(unsigned int src, unsigned int dst) {
+    const struct csc_conversion *best = NULL;
+    int i;
+
+    pthread_once(&registry_once, registry_init);
+
+    for (i = 0; i < registry_size; i++)
+        if (registry[i].src == src && registry[i].dst == dst &&
+            (!best || registry[i].cost < best->cost))
+            best = &registry[i];
+
+    return best;
+}
+
+/*
+ *
+ */
+int csc_list_conversions(const struct csc_conversion **list, int max) {
+    int i;
+
+    pthread_once(&registry_once, registry_init);
+
+    for (i = 0; i < registry_size && i < max; i++)
+        list[i] = &registry[i];
+    return registry_size;
+}
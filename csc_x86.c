@@ -0,0 +1,938 @@
+#if defined(__i386__) || defined(__x86_64__)
+
+#include <immintrin.h>
+#include "csc.h"
+
+/*
+ * Row kernels for packed 4:2:2, see struct csc_kernels. Y is the odd byte
+ * of UYVY and the even byte of YUYV. Chroma of two rows is averaged like
+ * the scalar code, rounding down. Rows narrower than a vector are done
+ * by the C kernels.
+ */
+
+/*
+ * Step x over a row n pixels at a time. When the width is not a multiple
+ * of n the last step is moved back to end on the last pixel, redoing part
+ * of the one before, so the tail stays in SIMD. width must be even and at
+ * least n.
+ */
+#define FOR_VECTORS(x, width, n) \
+    for ((x) = 0; (x) < (width); \
+         (x) = (x) + 2 * (n) > (width) && (x) + (n) < (width) ? (width) - (n) : (x) + (n))
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_luma(__m128i v, int uyvy) {
+    return uyvy ? _mm_srli_epi16(v, 8) : _mm_and_si128(v, _mm_set1_epi16(0x00ff));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i sse2_chroma(__m128i v, int uyvy) {
+    return uyvy ? _mm_and_si128(v, _mm_set1_epi16(0x00ff)) : _mm_srli_epi16(v, 8);
+}
+
+/* average of two rows of chroma as 16 bit lanes */
+__attribute__((target("sse2")))
+static inline __m128i sse2_chroma_avg(const uint8 *s0, const uint8 *s1, int uyvy) {
+    __m128i a = sse2_chroma(_mm_loadu_si128((const __m128i *)s0), uyvy);
+    __m128i b = sse2_chroma(_mm_loadu_si128((const __m128i *)s1), uyvy);
+    return _mm_srli_epi16(_mm_add_epi16(a, b), 1);
+}
+
+__attribute__((target("sse2")))
+static void sse2_row_y(const uint8 *src, uint8 *dst_y, int width, int uyvy) {
+    int x;
+
+    if (width < 16) {
+        csc_c.row_y(src, dst_y, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 16) {
+        __m128i a = sse2_luma(_mm_loadu_si128((const __m128i *)(src + 2 * x)), uyvy);
+        __m128i b = sse2_luma(_mm_loadu_si128((const __m128i *)(src + 2 * x + 16)), uyvy);
+        _mm_storeu_si128((__m128i *)(dst_y + x), _mm_packus_epi16(a, b));
+    }
+}
+
+__attribute__((target("sse2")))
+static void sse2_row_uv(const uint8 *s0, const uint8 *s1, uint8 *dst_uv, int width, int uyvy) {
+    int x;
+
+    if (width < 16) {
+        csc_c.row_uv(s0, s1, dst_uv, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 16) {
+        __m128i a = sse2_chroma_avg(s0 + 2 * x, s1 + 2 * x, uyvy);
+        __m128i b = sse2_chroma_avg(s0 + 2 * x + 16, s1 + 2 * x + 16, uyvy);
+        _mm_storeu_si128((__m128i *)(dst_uv + x), _mm_packus_epi16(a, b));
+    }
+}
+
+__attribute__((target("sse2")))
+static void sse2_row_u_v(const uint8 *s0, const uint8 *s1, uint8 *dst_u, uint8 *dst_v, int width, int uyvy) {
+    int x;
+
+    if (width < 16) {
+        csc_c.row_u_v(s0, s1, dst_u, dst_v, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 16) {
+        __m128i a = sse2_chroma_avg(s0 + 2 * x, s1 + 2 * x, uyvy);
+        __m128i b = sse2_chroma_avg(s0 + 2 * x + 16, s1 + 2 * x + 16, uyvy);
+        __m128i uv = _mm_packus_epi16(a, b);
+        __m128i u = _mm_and_si128(uv, _mm_set1_epi16(0x00ff));
+        __m128i v = _mm_srli_epi16(uv, 8);
+        _mm_storel_epi64((__m128i *)(dst_u + x / 2), _mm_packus_epi16(u, u));
+        _mm_storel_epi64((__m128i *)(dst_v + x / 2), _mm_packus_epi16(v, v));
+    }
+}
+
+__attribute__((target("sse2")))
+static void sse2_row_y2(const uint8 *src, uint8 *dst_a, uint8 *dst_b, int width, int uyvy) {
+    int x;
+
+    if (width < 16) {
+        csc_c.row_y2(src, dst_a, dst_b, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 16) {
+        __m128i a = sse2_luma(_mm_loadu_si128((const __m128i *)(src + 2 * x)), uyvy);
+        __m128i b = sse2_luma(_mm_loadu_si128((const __m128i *)(src + 2 * x + 16)), uyvy);
+        __m128i y = _mm_packus_epi16(a, b);
+        _mm_storeu_si128((__m128i *)(dst_a + x), y);
+        _mm_storeu_si128((__m128i *)(dst_b + x), y);
+    }
+}
+
+__attribute__((target("sse2")))
+static void sse2_row_uv_u_v(const uint8 *s0, const uint8 *s1, uint8 *dst_uv,
+                            uint8 *dst_u, uint8 *dst_v, int width, int uyvy) {
+    int x;
+
+    if (width < 16) {
+        csc_c.row_uv_u_v(s0, s1, dst_uv, dst_u, dst_v, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 16) {
+        __m128i a = sse2_chroma_avg(s0 + 2 * x, s1 + 2 * x, uyvy);
+        __m128i b = sse2_chroma_avg(s0 + 2 * x + 16, s1 + 2 * x + 16, uyvy);
+        __m128i uv = _mm_packus_epi16(a, b);
+        __m128i u = _mm_and_si128(uv, _mm_set1_epi16(0x00ff));
+        __m128i v = _mm_srli_epi16(uv, 8);
+        _mm_storeu_si128((__m128i *)(dst_uv + x), uv);
+        _mm_storel_epi64((__m128i *)(dst_u + x / 2), _mm_packus_epi16(u, u));
+        _mm_storel_epi64((__m128i *)(dst_v + x / 2), _mm_packus_epi16(v, v));
+    }
+}
+
+/*
+ * Deinterlacer rows. dst may be one of the sources, so these step whole
+ * vectors and leave the tail to the C kernels rather than redoing bytes.
+ */
+__attribute__((target("sse2")))
+static void sse2_row_avg(const uint8 *a, const uint8 *b, uint8 *dst, int bytes) {
+    int x;
+
+    for (x = 0; x + 16 <= bytes; x += 16)
+        _mm_storeu_si128((__m128i *)(dst + x),
+                         _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(a + x)),
+                                      _mm_loadu_si128((const __m128i *)(b + x))));
+    csc_c.row_avg(a + x, b + x, dst + x, bytes - x);
+}
+
+__attribute__((target("sse2")))
+static void sse2_row_motion(const uint8 *above, const uint8 *cur, const uint8 *below,
+                            uint8 *prev, uint8 *dst, int bytes, int threshold) {
+    const __m128i th = _mm_set1_epi8((char)threshold);
+    int x;
+
+    for (x = 0; x + 16 <= bytes; x += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i *)(cur + x));
+        __m128i p = _mm_loadu_si128((const __m128i *)(prev + x));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(c, p), _mm_subs_epu8(p, c));
+        /* all ones where diff <= threshold */
+        __m128i still = _mm_cmpeq_epi8(_mm_subs_epu8(diff, th), _mm_setzero_si128());
+        __m128i interp = _mm_avg_epu8(_mm_loadu_si128((const __m128i *)(above + x)),
+                                      _mm_loadu_si128((const __m128i *)(below + x)));
+
+        _mm_storeu_si128((__m128i *)(dst + x),
+                         _mm_or_si128(_mm_and_si128(still, c), _mm_andnot_si128(still, interp)));
+        _mm_storeu_si128((__m128i *)(prev + x), c);
+    }
+    csc_c.row_motion(above + x, cur + x, below + x, prev + x, dst + x, bytes - x, threshold);
+}
+
+/*
+ * mirror 8 pixels: the dwords (pixel pairs) reversed, the two luma bytes
+ * of each swapped. Swapping the words of each dword brings the other luma
+ * byte into place, the chroma is taken from the original.
+ */
+__attribute__((target("sse2")))
+static inline __m128i sse2_mirror(__m128i v, int uyvy) {
+    const __m128i luma = _mm_set1_epi16(uyvy ? (short)0xff00 : 0x00ff);
+    __m128i sw = _mm_shufflehi_epi16(_mm_shufflelo_epi16(v, 0xb1), 0xb1);
+
+    v = _mm_or_si128(_mm_and_si128(sw, luma), _mm_andnot_si128(luma, v));
+    return _mm_shuffle_epi32(v, 0x1b);
+}
+
+__attribute__((target("sse2")))
+static void sse2_row_mirror(const uint8 *src, uint8 *dst, int width, int uyvy) {
+    int x;
+
+    if (width < 8) {
+        csc_c.row_mirror(src, dst, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 8)
+        _mm_storeu_si128((__m128i *)(dst + 2 * x),
+                         sse2_mirror(_mm_loadu_si128((const __m128i *)(src + 2 * (width - 8 - x))), uyvy));
+}
+
+/* 8x8 transposes through three rounds of unpacks, rows of bytes in the low halves of r */
+__attribute__((target("sse2")))
+static inline void sse2_transpose_rows(const __m128i *r, uint8 *dst, int dst_stride) {
+    __m128i a[4], b[4], c[4];
+    int i;
+
+    for (i = 0; i < 4; i++)
+        a[i] = _mm_unpacklo_epi8(r[2 * i], r[2 * i + 1]);
+    b[0] = _mm_unpacklo_epi16(a[0], a[1]);
+    b[1] = _mm_unpackhi_epi16(a[0], a[1]);
+    b[2] = _mm_unpacklo_epi16(a[2], a[3]);
+    b[3] = _mm_unpackhi_epi16(a[2], a[3]);
+    c[0] = _mm_unpacklo_epi32(b[0], b[2]);
+    c[1] = _mm_unpackhi_epi32(b[0], b[2]);
+    c[2] = _mm_unpacklo_epi32(b[1], b[3]);
+    c[3] = _mm_unpackhi_epi32(b[1], b[3]);
+    for (i = 0; i < 4; i++) {
+        _mm_storel_epi64((__m128i *)(dst + 2 * i * dst_stride), c[i]);
+        _mm_storel_epi64((__m128i *)(dst + (2 * i + 1) * dst_stride), _mm_unpackhi_epi64(c[i], c[i]));
+    }
+}
+
+/* the transposed rows of byte pairs into out[] */
+__attribute__((target("sse2")))
+static inline void sse2_transpose_rows_16(const __m128i *r, __m128i *out) {
+    __m128i a[8], b[8];
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        a[2 * i] = _mm_unpacklo_epi16(r[2 * i], r[2 * i + 1]);
+        a[2 * i + 1] = _mm_unpackhi_epi16(r[2 * i], r[2 * i + 1]);
+    }
+    for (i = 0; i < 2; i++) {
+        b[4 * i] = _mm_unpacklo_epi32(a[4 * i], a[4 * i + 2]);
+        b[4 * i + 1] = _mm_unpackhi_epi32(a[4 * i], a[4 * i + 2]);
+        b[4 * i + 2] = _mm_unpacklo_epi32(a[4 * i + 1], a[4 * i + 3]);
+        b[4 * i + 3] = _mm_unpackhi_epi32(a[4 * i + 1], a[4 * i + 3]);
+    }
+    for (i = 0; i < 4; i++) {
+        out[2 * i] = _mm_unpacklo_epi64(b[i], b[i + 4]);
+        out[2 * i + 1] = _mm_unpackhi_epi64(b[i], b[i + 4]);
+    }
+}
+
+__attribute__((target("sse2")))
+static void sse2_transpose_8x8(const uint8 *src, int src_stride, uint8 *dst, int dst_stride) {
+    __m128i r[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+        r[i] = _mm_loadl_epi64((const __m128i *)(src + i * src_stride));
+    sse2_transpose_rows(r, dst, dst_stride);
+}
+
+__attribute__((target("sse2")))
+static void sse2_transpose_8x8_16(const uint8 *src, int src_stride, uint8 *dst, int dst_stride) {
+    __m128i r[8];
+    int i;
+
+    for (i = 0; i < 8; i++)
+        r[i] = _mm_loadu_si128((const __m128i *)(src + i * src_stride));
+    sse2_transpose_rows_16(r, r);
+    for (i = 0; i < 8; i++)
+        _mm_storeu_si128((__m128i *)(dst + i * dst_stride), r[i]);
+}
+
+/* the rows narrowed to their luma or averaged chroma first, straight from the packed rows */
+__attribute__((target("sse2")))
+static void sse2_transpose_y_8x8(const uint8 *src, int src_stride, uint8 *dst, int dst_stride, int uyvy) {
+    __m128i r[8];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        __m128i y = sse2_luma(_mm_loadu_si128((const __m128i *)(src + i * src_stride)), uyvy);
+        r[i] = _mm_packus_epi16(y, y);
+    }
+    sse2_transpose_rows(r, dst, dst_stride);
+}
+
+__attribute__((target("sse2")))
+static void sse2_transpose_uv_8x8(const uint8 *src, int src_stride, uint8 *dst_u, int dst_stride_u,
+                                  uint8 *dst_v, int dst_stride_v, int uyvy) {
+    __m128i r[8];
+    int i;
+
+    for (i = 0; i < 8; i++) {
+        const uint8 *s0 = src + 2 * i * src_stride;
+
+        r[i] = _mm_packus_epi16(sse2_chroma_avg(s0, s0 + src_stride, uyvy),
+                                sse2_chroma_avg(s0 + 16, s0 + src_stride + 16, uyvy));
+    }
+    sse2_transpose_rows_16(r, r);
+    for (i = 0; i < 8; i++) {
+        if (dst_v) {
+            __m128i u = _mm_and_si128(r[i], _mm_set1_epi16(0x00ff));
+            __m128i v = _mm_srli_epi16(r[i], 8);
+
+            _mm_storel_epi64((__m128i *)(dst_u + i * dst_stride_u), _mm_packus_epi16(u, u));
+            _mm_storel_epi64((__m128i *)(dst_v + i * dst_stride_v), _mm_packus_epi16(v, v));
+        } else {
+            _mm_storeu_si128((__m128i *)(dst_u + i * dst_stride_u), r[i]);
+        }
+    }
+}
+
+/* downscaler row sums, in place so the tail goes to C like the deinterlacer's */
+__attribute__((target("sse2")))
+static void sse2_row_accum(const uint8 *src, unsigned short *acc, int bytes) {
+    const __m128i zero = _mm_setzero_si128();
+    int x;
+
+    for (x = 0; x + 16 <= bytes; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i *a = (__m128i *)(acc + x);
+
+        _mm_storeu_si128(a, _mm_add_epi16(_mm_loadu_si128(a), _mm_unpacklo_epi8(v, zero)));
+        _mm_storeu_si128(a + 1, _mm_add_epi16(_mm_loadu_si128(a + 1), _mm_unpackhi_epi8(v, zero)));
+    }
+    csc_c.row_accum(src + x, acc + x, bytes - x);
+}
+
+/*
+ * 8 pixels of sums per loop as four groups of U Y V Y lanes (Y U Y V): the
+ * even groups and the odd ones add up to the chroma, the luma of a group
+ * adds to itself shifted by two lanes. In place, the store trails the loads.
+ */
+__attribute__((target("sse2")))
+static inline __m128i sse2_half(__m128i v0, __m128i v1, __m128i chroma, __m128i first) {
+    __m128i e = _mm_unpacklo_epi64(v0, v1);
+    __m128i o = _mm_unpackhi_epi64(v0, v1);
+    __m128i c = _mm_add_epi16(e, o);
+    __m128i le = _mm_add_epi16(e, _mm_srli_epi64(e, 32));
+    __m128i lo = _mm_add_epi16(o, _mm_slli_epi64(o, 32));
+    __m128i y = _mm_or_si128(_mm_and_si128(first, le), _mm_andnot_si128(first, lo));
+
+    return _mm_or_si128(_mm_and_si128(chroma, c), _mm_andnot_si128(chroma, y));
+}
+
+__attribute__((target("sse2")))
+static void sse2_row_half(const unsigned short *src, unsigned short *dst, int width, int uyvy) {
+    const __m128i chroma = uyvy ? _mm_set1_epi32(0x0000ffff) : _mm_set1_epi32((int)0xffff0000);
+    const __m128i first = uyvy ? _mm_set1_epi64x(0x00000000ffff0000LL) : _mm_set1_epi64x(0xffff);
+    int x;
+
+    for (x = 0; x + 8 <= width; x += 8)
+        _mm_storeu_si128((__m128i *)(dst + x),
+                         sse2_half(_mm_loadu_si128((const __m128i *)(src + 2 * x)),
+                                   _mm_loadu_si128((const __m128i *)(src + 2 * x + 8)), chroma, first));
+    csc_c.row_half(src + 2 * x, dst + x, width - x, uyvy);
+}
+
+__attribute__((target("sse2")))
+static void sse2_row_delta(const unsigned short *sum, unsigned short *last, unsigned short *dst, int count) {
+    int x;
+
+    for (x = 0; x + 8 <= count; x += 8) {
+        __m128i t = _mm_loadu_si128((const __m128i *)(sum + x));
+
+        _mm_storeu_si128((__m128i *)(dst + x),
+                         _mm_sub_epi16(t, _mm_loadu_si128((const __m128i *)(last + x))));
+        _mm_storeu_si128((__m128i *)(last + x), t);
+    }
+    csc_c.row_delta(sum + x, last + x, dst + x, count - x);
+}
+
+/* (sum * scale + 32768) >> 16 is the high half of the product plus the top bit of the low half */
+__attribute__((target("sse2")))
+static inline __m128i sse2_scale(__m128i sum, __m128i f) {
+    return _mm_add_epi16(_mm_mulhi_epu16(sum, f), _mm_srli_epi16(_mm_mullo_epi16(sum, f), 15));
+}
+
+__attribute__((target("sse2")))
+static void sse2_row_scale(const unsigned short *src, uint8 *dst, int count, int scale) {
+    const __m128i f = _mm_set1_epi16((short)scale);
+    int x;
+
+    for (x = 0; x + 16 <= count; x += 16)
+        _mm_storeu_si128((__m128i *)(dst + x),
+                         _mm_packus_epi16(sse2_scale(_mm_loadu_si128((const __m128i *)(src + x)), f),
+                                          sse2_scale(_mm_loadu_si128((const __m128i *)(src + x + 8)), f)));
+    csc_c.row_scale(src + x, dst + x, count - x, scale);
+}
+
+/* downscaler columns, one output of 8 lanes per loop */
+__attribute__((target("sse2")))
+static void sse2_cols_box(const unsigned short *src, int step, const int *cols,
+                          const unsigned short *scale, uint8 *dst, int dst_step, int count) {
+    int x, c;
+
+    for (x = 0; x < count; x++) {
+        __m128i f = _mm_loadu_si128((const __m128i *)(scale + 8 * (cols[x + 1] - cols[x])));
+        __m128i sum = _mm_setzero_si128();
+
+        for (c = cols[x]; c < cols[x + 1]; c++)
+            sum = _mm_add_epi16(sum, _mm_loadu_si128((const __m128i *)(src + 8 * step * c)));
+        sum = sse2_scale(sum, f);
+        _mm_storel_epi64((__m128i *)(dst + 8 * dst_step * x), _mm_packus_epi16(sum, sum));
+    }
+}
+
+const struct csc_kernels csc_sse2 = {
+    .isa = "sse2",
+    .row_y = sse2_row_y,
+    .row_uv = sse2_row_uv,
+    .row_u_v = sse2_row_u_v,
+    .row_y2 = sse2_row_y2,
+    .row_uv_u_v = sse2_row_uv_u_v,
+    .row_avg = sse2_row_avg,
+    .row_motion = sse2_row_motion,
+    .row_mirror = sse2_row_mirror,
+    .transpose_8x8 = sse2_transpose_8x8,
+    .transpose_8x8_16 = sse2_transpose_8x8_16,
+    .transpose_y_8x8 = sse2_transpose_y_8x8,
+    .transpose_uv_8x8 = sse2_transpose_uv_8x8,
+    .row_accum = sse2_row_accum,
+    .row_delta = sse2_row_delta,
+    .row_half = sse2_row_half,
+    .row_scale = sse2_row_scale,
+    .cols_box = sse2_cols_box,
+    .row_box = NULL,            /* no pshufb, the scaler transposes */
+};
+
+/*
+ * one vector of ssse3_row_box(), inlined for the common terms and loads
+ * so the loads stay in registers
+ */
+__attribute__((target("ssse3"), always_inline))
+static inline __m128i ssse3_box(const uint8 *in, const __m128i *m, __m128i table, int terms, int loads) {
+    __m128i load[CSC_BOX_LOADS];
+    __m128i sum = _mm_setzero_si128();
+    int t, l;
+
+    for (l = 0; l < loads; l++)
+        load[l] = _mm_loadu_si128((const __m128i *)(in + 16 * l));
+    for (t = 0; t < terms; t++) {
+        __m128i term = _mm_shuffle_epi8(load[0], _mm_loadu_si128(m++));
+
+        for (l = 1; l < loads; l++)
+            term = _mm_or_si128(term, _mm_shuffle_epi8(load[l], _mm_loadu_si128(m++)));
+        sum = _mm_add_epi16(sum, term);
+    }
+    sum = sse2_scale(sum, _mm_shuffle_epi8(table, _mm_loadu_si128(m)));
+    return _mm_packus_epi16(sum, sum);
+}
+
+__attribute__((target("ssse3"), always_inline))
+static inline void ssse3_box_row(const unsigned short *src, uint8 *dst, const struct csc_box *box,
+                                 __m128i table, int terms, int loads) {
+    const __m128i *m = (const __m128i *)box->masks;
+    int size = terms * loads + 1;
+    int v, p = 0, advance = 0;
+
+    /* one vector a period, its masks loaded once */
+    if (box->period == 1) {
+        __m128i mask[CSC_BOX_TERMS * CSC_BOX_LOADS + 1];
+
+        for (v = 0; v < size; v++)
+            mask[v] = _mm_loadu_si128(m + v);
+        src += box->base[0];
+        for (v = 0; v < box->vecs; v++, src += box->advance)
+            _mm_storel_epi64((__m128i *)(dst + 8 * v),
+                             ssse3_box((const uint8 *)src, mask, table, terms, loads));
+        return;
+    }
+
+    for (v = 0; v < box->vecs; v++) {
+        _mm_storel_epi64((__m128i *)(dst + 8 * v),
+                         ssse3_box((const uint8 *)(src + box->base[p] + advance), m + p * size,
+                                   table, terms, loads));
+        if (++p == box->period) {
+            p = 0;
+            advance += box->advance;
+        }
+    }
+}
+
+__attribute__((target("ssse3")))
+static void ssse3_row_box(const unsigned short *src, uint8 *dst, const struct csc_box *box,
+                          const unsigned short *scale) {
+    __m128i table = _mm_loadu_si128((const __m128i *)scale);
+
+    if (box->terms == 2 && box->loads == 2)
+        ssse3_box_row(src, dst, box, table, 2, 2);
+    else if (box->terms == 3 && box->loads == 3)
+        ssse3_box_row(src, dst, box, table, 3, 3);
+    else
+        ssse3_box_row(src, dst, box, table, box->terms, box->loads);
+}
+
+/* pshufb splits 8 pixels into 8 luma bytes (low half) and 8 chroma bytes (high half) */
+__attribute__((target("ssse3")))
+static inline __m128i ssse3_split(const uint8 *src, int uyvy) {
+    const __m128i uyvy_mask = _mm_setr_epi8(1, 3, 5, 7, 9, 11, 13, 15, 0, 2, 4, 6, 8, 10, 12, 14);
+    const __m128i yuyv_mask = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+
+    return _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)src), uyvy ? uyvy_mask : yuyv_mask);
+}
+
+/* (a + b) / 2 rounded down, pavgb rounds up */
+__attribute__((target("ssse3")))
+static inline __m128i ssse3_avg_floor(__m128i a, __m128i b) {
+    __m128i odd = _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1));
+    return _mm_sub_epi8(_mm_avg_epu8(a, b), odd);
+}
+
+__attribute__((target("ssse3")))
+static void ssse3_row_y(const uint8 *src, uint8 *dst_y, int width, int uyvy) {
+    int x;
+
+    if (width < 16) {
+        csc_c.row_y(src, dst_y, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 16) {
+        __m128i a = ssse3_split(src + 2 * x, uyvy);
+        __m128i b = ssse3_split(src + 2 * x + 16, uyvy);
+        _mm_storeu_si128((__m128i *)(dst_y + x), _mm_unpacklo_epi64(a, b));
+    }
+}
+
+/* 16 chroma bytes U V U V ... of 16 pixels, averaged over both rows */
+__attribute__((target("ssse3")))
+static inline __m128i ssse3_chroma_avg(const uint8 *s0, const uint8 *s1, int uyvy) {
+    __m128i a = _mm_unpackhi_epi64(ssse3_split(s0, uyvy), ssse3_split(s0 + 16, uyvy));
+    __m128i b = _mm_unpackhi_epi64(ssse3_split(s1, uyvy), ssse3_split(s1 + 16, uyvy));
+    return ssse3_avg_floor(a, b);
+}
+
+__attribute__((target("ssse3")))
+static void ssse3_row_uv(const uint8 *s0, const uint8 *s1, uint8 *dst_uv, int width, int uyvy) {
+    int x;
+
+    if (width < 16) {
+        csc_c.row_uv(s0, s1, dst_uv, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 16)
+        _mm_storeu_si128((__m128i *)(dst_uv + x), ssse3_chroma_avg(s0 + 2 * x, s1 + 2 * x, uyvy));
+}
+
+__attribute__((target("ssse3")))
+static void ssse3_row_u_v(const uint8 *s0, const uint8 *s1, uint8 *dst_u, uint8 *dst_v, int width, int uyvy) {
+    const __m128i split_mask = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    int x;
+
+    if (width < 16) {
+        csc_c.row_u_v(s0, s1, dst_u, dst_v, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 16) {
+        __m128i uv = _mm_shuffle_epi8(ssse3_chroma_avg(s0 + 2 * x, s1 + 2 * x, uyvy), split_mask);
+        _mm_storel_epi64((__m128i *)(dst_u + x / 2), uv);
+        _mm_storel_epi64((__m128i *)(dst_v + x / 2), _mm_unpackhi_epi64(uv, uv));
+    }
+}
+
+__attribute__((target("ssse3")))
+static void ssse3_row_y2(const uint8 *src, uint8 *dst_a, uint8 *dst_b, int width, int uyvy) {
+    int x;
+
+    if (width < 16) {
+        csc_c.row_y2(src, dst_a, dst_b, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 16) {
+        __m128i a = ssse3_split(src + 2 * x, uyvy);
+        __m128i b = ssse3_split(src + 2 * x + 16, uyvy);
+        __m128i y = _mm_unpacklo_epi64(a, b);
+        _mm_storeu_si128((__m128i *)(dst_a + x), y);
+        _mm_storeu_si128((__m128i *)(dst_b + x), y);
+    }
+}
+
+__attribute__((target("ssse3")))
+static void ssse3_row_uv_u_v(const uint8 *s0, const uint8 *s1, uint8 *dst_uv,
+                             uint8 *dst_u, uint8 *dst_v, int width, int uyvy) {
+    const __m128i split_mask = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    int x;
+
+    if (width < 16) {
+        csc_c.row_uv_u_v(s0, s1, dst_uv, dst_u, dst_v, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 16) {
+        __m128i uv = ssse3_chroma_avg(s0 + 2 * x, s1 + 2 * x, uyvy);
+        __m128i planar = _mm_shuffle_epi8(uv, split_mask);
+        _mm_storeu_si128((__m128i *)(dst_uv + x), uv);
+        _mm_storel_epi64((__m128i *)(dst_u + x / 2), planar);
+        _mm_storel_epi64((__m128i *)(dst_v + x / 2), _mm_unpackhi_epi64(planar, planar));
+    }
+}
+
+const struct csc_kernels csc_ssse3 = {
+    .isa = "ssse3",
+    .row_y = ssse3_row_y,
+    .row_uv = ssse3_row_uv,
+    .row_u_v = ssse3_row_u_v,
+    .row_y2 = ssse3_row_y2,
+    .row_uv_u_v = ssse3_row_uv_u_v,
+    /* nothing to shuffle, SSE2 has it all */
+    .row_avg = sse2_row_avg,
+    .row_motion = sse2_row_motion,
+    .row_mirror = sse2_row_mirror,
+    .transpose_8x8 = sse2_transpose_8x8,
+    .transpose_8x8_16 = sse2_transpose_8x8_16,
+    .transpose_y_8x8 = sse2_transpose_y_8x8,
+    .transpose_uv_8x8 = sse2_transpose_uv_8x8,
+    .row_accum = sse2_row_accum,
+    .row_delta = sse2_row_delta,
+    .row_half = sse2_row_half,
+    .row_scale = sse2_row_scale,
+    .cols_box = sse2_cols_box,
+    .row_box = ssse3_row_box,
+};
+
+/*
+ * AVX2 packs work per 128 bit lane, the permute puts the qwords of
+ * packus(a, b) back into a0 a1 b0 b1 order
+ */
+__attribute__((target("avx2")))
+static inline __m256i avx2_pack(__m256i a, __m256i b) {
+    return _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_luma(const uint8 *src, int uyvy) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)src);
+    return uyvy ? _mm256_srli_epi16(v, 8) : _mm256_and_si256(v, _mm256_set1_epi16(0x00ff));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i avx2_chroma_avg(const uint8 *s0, const uint8 *s1, int uyvy) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)s0);
+    __m256i b = _mm256_loadu_si256((const __m256i *)s1);
+
+    if (uyvy) {
+        a = _mm256_and_si256(a, _mm256_set1_epi16(0x00ff));
+        b = _mm256_and_si256(b, _mm256_set1_epi16(0x00ff));
+    } else {
+        a = _mm256_srli_epi16(a, 8);
+        b = _mm256_srli_epi16(b, 8);
+    }
+    return _mm256_srli_epi16(_mm256_add_epi16(a, b), 1);
+}
+
+__attribute__((target("avx2")))
+static void avx2_row_y(const uint8 *src, uint8 *dst_y, int width, int uyvy) {
+    int x;
+
+    if (width < 32) {
+        ssse3_row_y(src, dst_y, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 32)
+        _mm256_storeu_si256((__m256i *)(dst_y + x),
+                            avx2_pack(avx2_luma(src + 2 * x, uyvy), avx2_luma(src + 2 * x + 32, uyvy)));
+}
+
+__attribute__((target("avx2")))
+static void avx2_row_uv(const uint8 *s0, const uint8 *s1, uint8 *dst_uv, int width, int uyvy) {
+    int x;
+
+    if (width < 32) {
+        ssse3_row_uv(s0, s1, dst_uv, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 32)
+        _mm256_storeu_si256((__m256i *)(dst_uv + x),
+                            avx2_pack(avx2_chroma_avg(s0 + 2 * x, s1 + 2 * x, uyvy),
+                                      avx2_chroma_avg(s0 + 2 * x + 32, s1 + 2 * x + 32, uyvy)));
+}
+
+__attribute__((target("avx2")))
+static void avx2_row_u_v(const uint8 *s0, const uint8 *s1, uint8 *dst_u, uint8 *dst_v, int width, int uyvy) {
+    int x;
+
+    if (width < 32) {
+        ssse3_row_u_v(s0, s1, dst_u, dst_v, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 32) {
+        __m256i uv = avx2_pack(avx2_chroma_avg(s0 + 2 * x, s1 + 2 * x, uyvy),
+                               avx2_chroma_avg(s0 + 2 * x + 32, s1 + 2 * x + 32, uyvy));
+        __m256i u = _mm256_and_si256(uv, _mm256_set1_epi16(0x00ff));
+        __m256i v = _mm256_srli_epi16(uv, 8);
+        __m256i planar = avx2_pack(u, v);
+        _mm_storeu_si128((__m128i *)(dst_u + x / 2), _mm256_castsi256_si128(planar));
+        _mm_storeu_si128((__m128i *)(dst_v + x / 2), _mm256_extracti128_si256(planar, 1));
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_row_y2(const uint8 *src, uint8 *dst_a, uint8 *dst_b, int width, int uyvy) {
+    int x;
+
+    if (width < 32) {
+        ssse3_row_y2(src, dst_a, dst_b, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 32) {
+        __m256i y = avx2_pack(avx2_luma(src + 2 * x, uyvy), avx2_luma(src + 2 * x + 32, uyvy));
+        _mm256_storeu_si256((__m256i *)(dst_a + x), y);
+        _mm256_storeu_si256((__m256i *)(dst_b + x), y);
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_row_uv_u_v(const uint8 *s0, const uint8 *s1, uint8 *dst_uv,
+                            uint8 *dst_u, uint8 *dst_v, int width, int uyvy) {
+    int x;
+
+    if (width < 32) {
+        ssse3_row_uv_u_v(s0, s1, dst_uv, dst_u, dst_v, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 32) {
+        __m256i uv = avx2_pack(avx2_chroma_avg(s0 + 2 * x, s1 + 2 * x, uyvy),
+                               avx2_chroma_avg(s0 + 2 * x + 32, s1 + 2 * x + 32, uyvy));
+        __m256i planar = avx2_pack(_mm256_and_si256(uv, _mm256_set1_epi16(0x00ff)),
+                                   _mm256_srli_epi16(uv, 8));
+        _mm256_storeu_si256((__m256i *)(dst_uv + x), uv);
+        _mm_storeu_si128((__m128i *)(dst_u + x / 2), _mm256_castsi256_si128(planar));
+        _mm_storeu_si128((__m128i *)(dst_v + x / 2), _mm256_extracti128_si256(planar, 1));
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_row_avg(const uint8 *a, const uint8 *b, uint8 *dst, int bytes) {
+    int x;
+
+    for (x = 0; x + 32 <= bytes; x += 32)
+        _mm256_storeu_si256((__m256i *)(dst + x),
+                            _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(a + x)),
+                                            _mm256_loadu_si256((const __m256i *)(b + x))));
+    sse2_row_avg(a + x, b + x, dst + x, bytes - x);
+}
+
+__attribute__((target("avx2")))
+static void avx2_row_motion(const uint8 *above, const uint8 *cur, const uint8 *below,
+                            uint8 *prev, uint8 *dst, int bytes, int threshold) {
+    const __m256i th = _mm256_set1_epi8((char)threshold);
+    int x;
+
+    for (x = 0; x + 32 <= bytes; x += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i *)(cur + x));
+        __m256i p = _mm256_loadu_si256((const __m256i *)(prev + x));
+        __m256i diff = _mm256_or_si256(_mm256_subs_epu8(c, p), _mm256_subs_epu8(p, c));
+        __m256i still = _mm256_cmpeq_epi8(_mm256_subs_epu8(diff, th), _mm256_setzero_si256());
+        __m256i interp = _mm256_avg_epu8(_mm256_loadu_si256((const __m256i *)(above + x)),
+                                         _mm256_loadu_si256((const __m256i *)(below + x)));
+
+        _mm256_storeu_si256((__m256i *)(dst + x), _mm256_blendv_epi8(interp, c, still));
+        _mm256_storeu_si256((__m256i *)(prev + x), c);
+    }
+    sse2_row_motion(above + x, cur + x, below + x, prev + x, dst + x, bytes - x, threshold);
+}
+
+__attribute__((target("avx2")))
+static void avx2_row_mirror(const uint8 *src, uint8 *dst, int width, int uyvy) {
+    const __m256i luma = _mm256_set1_epi16(uyvy ? (short)0xff00 : 0x00ff);
+    const __m256i reverse = _mm256_setr_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    int x;
+
+    if (width < 16) {
+        sse2_row_mirror(src, dst, width, uyvy);
+        return;
+    }
+
+    FOR_VECTORS(x, width, 16) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(src + 2 * (width - 16 - x)));
+        __m256i sw = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(v, 0xb1), 0xb1);
+
+        v = _mm256_or_si256(_mm256_and_si256(sw, luma), _mm256_andnot_si256(luma, v));
+        _mm256_storeu_si256((__m256i *)(dst + 2 * x), _mm256_permutevar8x32_epi32(v, reverse));
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_row_accum(const uint8 *src, unsigned short *acc, int bytes) {
+    int x;
+
+    for (x = 0; x + 16 <= bytes; x += 16) {
+        __m256i *a = (__m256i *)(acc + x);
+        __m256i v = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(src + x)));
+
+        _mm256_storeu_si256(a, _mm256_add_epi16(_mm256_loadu_si256(a), v));
+    }
+    csc_c.row_accum(src + x, acc + x, bytes - x);
+}
+
+__attribute__((target("avx2")))
+static void avx2_row_delta(const unsigned short *sum, unsigned short *last, unsigned short *dst, int count) {
+    int x;
+
+    for (x = 0; x + 16 <= count; x += 16) {
+        __m256i t = _mm256_loadu_si256((const __m256i *)(sum + x));
+
+        _mm256_storeu_si256((__m256i *)(dst + x),
+                            _mm256_sub_epi16(t, _mm256_loadu_si256((const __m256i *)(last + x))));
+        _mm256_storeu_si256((__m256i *)(last + x), t);
+    }
+    sse2_row_delta(sum + x, last + x, dst + x, count - x);
+}
+
+/* sse2_scale() on two 128 bit lanes, packus interleaves them by 64 bits */
+__attribute__((target("avx2")))
+static inline __m256i avx2_scale(__m256i sum, __m256i f) {
+    return _mm256_add_epi16(_mm256_mulhi_epu16(sum, f), _mm256_srli_epi16(_mm256_mullo_epi16(sum, f), 15));
+}
+
+__attribute__((target("avx2")))
+static void avx2_row_scale(const unsigned short *src, uint8 *dst, int count, int scale) {
+    const __m256i f = _mm256_set1_epi16((short)scale);
+    int x;
+
+    for (x = 0; x + 32 <= count; x += 32) {
+        __m256i a = avx2_scale(_mm256_loadu_si256((const __m256i *)(src + x)), f);
+        __m256i b = avx2_scale(_mm256_loadu_si256((const __m256i *)(src + x + 16)), f);
+
+        _mm256_storeu_si256((__m256i *)(dst + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xd8));
+    }
+    sse2_row_scale(src + x, dst + x, count - x, scale);
+}
+
+/* sse2_half() on two 128 bit lanes, the groups come out of order by 64 bits */
+__attribute__((target("avx2")))
+static void avx2_row_half(const unsigned short *src, unsigned short *dst, int width, int uyvy) {
+    const __m256i chroma = uyvy ? _mm256_set1_epi32(0x0000ffff) : _mm256_set1_epi32((int)0xffff0000);
+    const __m256i first = uyvy ? _mm256_set1_epi64x(0x00000000ffff0000LL) : _mm256_set1_epi64x(0xffff);
+    int x;
+
+    for (x = 0; x + 16 <= width; x += 16) {
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)(src + 2 * x));
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(src + 2 * x + 16));
+        __m256i e = _mm256_unpacklo_epi64(v0, v1);
+        __m256i o = _mm256_unpackhi_epi64(v0, v1);
+        __m256i c = _mm256_add_epi16(e, o);
+        __m256i le = _mm256_add_epi16(e, _mm256_srli_epi64(e, 32));
+        __m256i lo = _mm256_add_epi16(o, _mm256_slli_epi64(o, 32));
+        __m256i y = _mm256_blendv_epi8(lo, le, first);
+
+        _mm256_storeu_si256((__m256i *)(dst + x),
+                            _mm256_permute4x64_epi64(_mm256_blendv_epi8(y, c, chroma), 0xd8));
+    }
+    sse2_row_half(src + 2 * x, dst + x, width - x, uyvy);
+}
+
+/* ssse3_box() of the vectors at a and b, one a lane, still in 16 bits */
+__attribute__((target("avx2"), always_inline))
+static inline __m256i avx2_box(const uint8 *a, const uint8 *b, const __m256i *m, __m256i table,
+                               int terms, int loads) {
+    __m256i load[CSC_BOX_LOADS];
+    __m256i sum = _mm256_setzero_si256();
+    int t, l;
+
+    for (l = 0; l < loads; l++)
+        load[l] = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)(a + 16 * l))),
+                                          _mm_loadu_si128((const __m128i *)(b + 16 * l)), 1);
+    for (t = 0; t < terms; t++) {
+        __m256i term = _mm256_shuffle_epi8(load[0], *m++);
+
+        for (l = 1; l < loads; l++)
+            term = _mm256_or_si256(term, _mm256_shuffle_epi8(load[l], *m++));
+        sum = _mm256_add_epi16(sum, term);
+    }
+    return avx2_scale(sum, _mm256_shuffle_epi8(table, *m));
+}
+
+/* four vectors a loop when they share their masks, the rest as ssse3_row_box() */
+__attribute__((target("avx2"), always_inline))
+static inline void avx2_box_row(const unsigned short *src, uint8 *dst, const struct csc_box *box,
+                                const unsigned short *scale, int terms, int loads) {
+    const __m256i table = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)scale));
+    const int step = box->advance;
+    __m256i mask[CSC_BOX_TERMS * CSC_BOX_LOADS + 1];
+    int v;
+
+    for (v = 0; v < terms * loads + 1; v++)
+        mask[v] = _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)box->masks + v));
+    src += box->base[0];
+    for (v = 0; v + 4 <= box->vecs; v += 4, src += 4 * step) {
+        __m256i lo = avx2_box((const uint8 *)src, (const uint8 *)(src + step), mask, table, terms, loads);
+        __m256i hi = avx2_box((const uint8 *)(src + 2 * step), (const uint8 *)(src + 3 * step), mask, table,
+                              terms, loads);
+
+        _mm256_storeu_si256((__m256i *)(dst + 8 * v), _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8));
+    }
+    for (; v < box->vecs; v++, src += step)
+        _mm_storel_epi64((__m128i *)(dst + 8 * v),
+                         ssse3_box((const uint8 *)src, (const __m128i *)box->masks,
+                                   _mm256_castsi256_si128(table), terms, loads));
+}
+
+__attribute__((target("avx2")))
+static void avx2_row_box(const unsigned short *src, uint8 *dst, const struct csc_box *box,
+                         const unsigned short *scale) {
+    if (box->period != 1)
+        ssse3_row_box(src, dst, box, scale);
+    else if (box->terms == 2 && box->loads == 2)
+        avx2_box_row(src, dst, box, scale, 2, 2);
+    else if (box->terms == 3 && box->loads == 3)
+        avx2_box_row(src, dst, box, scale, 3, 3);
+    else
+        avx2_box_row(src, dst, box, scale, box->terms, box->loads);
+}
+
+const struct csc_kernels csc_avx2 = {
+    .isa = "avx2",
+    .row_y = avx2_row_y,
+    .row_uv = avx2_row_uv,
+    .row_u_v = avx2_row_u_v,
+    .row_y2 = avx2_row_y2,
+    .row_uv_u_v = avx2_row_uv_u_v,
+    .row_avg = avx2_row_avg,
+    .row_motion = avx2_row_motion,
+    .row_mirror = avx2_row_mirror,
+    /* an 8x8 block is one SSE2 register a row */
+    .transpose_8x8 = sse2_transpose_8x8,
+    .transpose_8x8_16 = sse2_transpose_8x8_16,
+    .transpose_y_8x8 = sse2_transpose_y_8x8,
+    .transpose_uv_8x8 = sse2_transpose_uv_8x8,
+    .row_accum = avx2_row_accum,
+    .row_delta = avx2_row_delta,
+    .row_half = avx2_row_half,
+    .row_scale = avx2_row_scale,
+    /* 8 lanes an output, an SSE2 register */
+    .cols_box = sse2_cols_box,
+    .row_box = avx2_row_box,
+};
+
+#endif
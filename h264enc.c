@@ -18,9 +18,12 @@
  *
  */
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include "h264enc.h"
 #include "ve.h"
 
@@ -29,6 +32,26 @@
 #define ALIGN(x, a) (((x) + ((typeof(x))(a) - 1)) & ~((typeof(x))(a) - 1))
 #define IS_ALIGNED(x, a) (((x) & ((typeof(x))(a) - 1)) == 0)
 #define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+/* per-frame slots in the register programs */
+enum {
+	PROG_VLE_OFFSET = 0,
+	PROG_VLE_ADDR = 1,
+	PROG_VLE_END = 2,
+};
+
+enum {
+	PROG_INPUT_LUMA = 3,
+	PROG_INPUT_CHROMA = 4,
+	PROG_REC_LUMA = 5,
+	PROG_REC_CHROMA = 6,
+	PROG_REC_SLUMA = 7,
+	PROG_REF_LUMA = 8,
+	PROG_REF_CHROMA = 9,
+	PROG_REF_SLUMA = 10,
+	PROG_PARAM = 15,
+};
 
 struct h264enc_internal {
 	unsigned int mb_width, mb_height, mb_stride;
@@ -37,20 +60,70 @@ struct h264enc_internal {
 	uint8_t *luma_buffer, *chroma_buffer;
 	unsigned int input_buffer_size;
 	enum color_format input_color_format;
+	enum cache_mode cache_mode;
+
+	/* ring of input buffers, luma_buffer points to the one being encoded */
+	struct h264enc_input {
+		uint8_t *luma_buffer, *chroma_buffer;
+		uint32_t luma_phys, chroma_phys;
+		enum { INPUT_FREE = 0, INPUT_FILLING, INPUT_QUEUED } state;
+		unsigned int flushed; /* written rows already flushed by h264enc_input_written() */
+	} *input;
+	unsigned int num_inputs;
+	unsigned int *input_queue;
+	unsigned int input_queue_head, input_queue_count;
+	pthread_mutex_t input_lock;
+	pthread_cond_t input_free;
 
 	uint8_t *bytestream_buffer;
 	unsigned int bytestream_buffer_size;
 	unsigned int bytestream_length;
 
+	/* pool of bytestream buffers, bytestream_buffer points to the one being written */
+	struct h264enc_output {
+		struct h264enc_packet packet;
+		uint32_t phys;
+		enum { OUTPUT_FREE = 0, OUTPUT_ENCODING, OUTPUT_READY, OUTPUT_HELD } state;
+		int refs;
+	} *output;
+	unsigned int num_outputs;
+	int current_output;
+	pthread_mutex_t output_lock;
+	pthread_cond_t output_free;
+
 	struct h264enc_ref_pic {
 		void *luma_buffer, *chroma_buffer;
 		void *extra_buffer; /* unknown purpose, looks like smaller luma */
+		uint32_t luma_phys, chroma_phys, extra_phys;
 	} ref_picture[2];
 
 	void *extra_buffer_line, *extra_buffer_frame; /* unknown purpose */
 
 	void *regs;
 
+	/*
+	 * register setup built once in h264enc_new(), replayed for each frame
+	 * with only the slots below patched
+	 */
+	struct h264enc_reg {
+		uint16_t offset;
+		uint16_t set_bits; /* read-modify-write, value is or'ed in */
+		uint32_t value;
+	} prog_output[4], prog_frame[18];
+
+	/* SPS and PPS NAL units, rebuilt only when the parameters change */
+	uint8_t sps_pps[64];
+	unsigned int sps_pps_length;
+	unsigned int sps_pps_dirty;
+
+	/* bytes written by the CPU in front of the slice data */
+	unsigned int header_length;
+
+	/* slice header bits left to the VE, see write_headers() */
+	unsigned int header_zero_bytes;
+	uint32_t header_tail;
+	int header_tail_bits;
+
 	unsigned int write_sps_pps;
 
 	unsigned int profile_idc, level_idc, constraints;
@@ -64,158 +137,372 @@ struct h264enc_internal {
 	enum slice_type { SLICE_P = 0, SLICE_I = 2 } current_slice_type;
 	unsigned int streaming_mode;
 
+	/* input in VE memory owned by the caller, e.g. a capture buffer */
+	uint32_t ext_luma_phys, ext_chroma_phys;
+	unsigned int ext_input;
+
+	/* frame in flight between h264enc_submit() and h264enc_complete() */
+	int pending_input;
+	unsigned int busy;
+
+	/* the waiter signals completion_fd, see h264enc_get_completion_fd() */
+	int completion_fd;
+	unsigned int waiting;
+
+#ifdef VE_DEBUG_MMIO
+	/* register accesses of the last frame, start and finish together */
+	unsigned long mmio_start, mmio_frame;
+#endif
+
+	/* VE shared with the other instances, see h264enc_get_stats() */
+	struct ve_client *ve_client;
+	struct timespec deadline;
+	unsigned int has_deadline;
+	struct timespec ve_acquired;
+	struct h264enc_stats stats;
+
 };
 
-static void put_bits(void* regs, uint32_t x, int num)
+/* spins on VE_AVC_VLE_LENGTH, a few register reads at most in practice */
+#define PUT_BITS_SPIN 1000
+
+/*
+ * length is the bitstream length in bits the VE has before this call,
+ * the VE counts the bits it took in VE_AVC_VLE_LENGTH and is done with
+ * them once that moved on by num
+ */
+static void put_bits(void* regs, uint32_t x, int num, unsigned int *length)
 {
+	unsigned int i;
+
 	writel(x, regs + VE_AVC_BASIC_BITS);
 	writel(0x1 | ((num & 0x1f) << 8), regs + VE_AVC_TRIGGER);
-	/* again the problem, how to check for finish? */
+
+	*length += num;
+	for (i = 0; i < PUT_BITS_SPIN && readl(regs + VE_AVC_VLE_LENGTH) != *length; i++)
+		;
+	if (i == PUT_BITS_SPIN)
+		MSG("VE didn't take the header bits in time");
 }
 
-static void put_ue(void* regs, uint32_t x)
+/*
+ * Headers are written by the CPU into normal memory, with the
+ * emulation_prevention_three_byte inserted here instead of by the VE.
+ */
+struct bitwriter
+{
+	uint8_t *data;
+	unsigned int size, length;
+	uint64_t cache;
+	int cache_bits;
+	int zeros;
+};
+
+static void bw_init(struct bitwriter *bw, uint8_t *data, unsigned int size)
+{
+	bw->data = data;
+	bw->size = size;
+	bw->length = 0;
+	bw->cache = 0;
+	bw->cache_bits = 0;
+	bw->zeros = 0;
+}
+
+static void bw_put_byte(struct bitwriter *bw, uint8_t b)
+{
+	if (bw->zeros >= 2 && b <= 0x03)
+	{
+		if (bw->length < bw->size)
+			bw->data[bw->length++] = 0x03;
+		bw->zeros = 0;
+	}
+
+	if (bw->length < bw->size)
+		bw->data[bw->length++] = b;
+	bw->zeros = b ? 0 : bw->zeros + 1;
+}
+
+static void bw_bits(struct bitwriter *bw, uint32_t x, int num)
+{
+	bw->cache = (bw->cache << num) | (x & (0xffffffffULL >> (32 - num)));
+	bw->cache_bits += num;
+
+	while (bw->cache_bits >= 8)
+	{
+		bw->cache_bits -= 8;
+		bw_put_byte(bw, bw->cache >> bw->cache_bits);
+	}
+}
+
+static void bw_ue(struct bitwriter *bw, uint32_t x)
 {
 	x++;
-	put_bits(regs, x, (32 - __builtin_clz(x)) * 2 - 1);
+	int len = 32 - __builtin_clz(x);
+	if (len > 1)
+		bw_bits(bw, 0, len - 1);
+	bw_bits(bw, x, len);
 }
 
-static void put_se(void* regs, int x)
+static void bw_se(struct bitwriter *bw, int x)
 {
 	x = 2 * x - 1;
 	x ^= (x >> 31);
-	put_ue(regs, x);
+	bw_ue(bw, x);
 }
 
-static void put_start_code(void* regs, unsigned int nal_ref_idc, unsigned int nal_unit_type)
+/* start code and NAL header, no emulation prevention, must be byte aligned */
+static void bw_start_code(struct bitwriter *bw, unsigned int nal_ref_idc, unsigned int nal_unit_type)
 {
-	uint32_t tmp = readl(regs + VE_AVC_PARAM);
-
-	/* disable emulation_prevention_three_byte */
-	writel(tmp | (0x1 << 31), regs + VE_AVC_PARAM);
+	const uint8_t start[5] = { 0x00, 0x00, 0x00, 0x01, (nal_ref_idc << 5) | (nal_unit_type << 0) };
+	unsigned int i;
 
-	put_bits(regs, 0, 24);
-	put_bits(regs, 0x100 | (nal_ref_idc << 5) | (nal_unit_type << 0), 16);
-
-	writel(tmp, regs + VE_AVC_PARAM);
+	for (i = 0; i < sizeof(start) && bw->length < bw->size; i++)
+		bw->data[bw->length++] = start[i];
+	bw->zeros = 0;
 }
 
-static void put_rbsp_trailing_bits(void* regs)
+static void bw_rbsp_trailing_bits(struct bitwriter *bw)
 {
-	unsigned int cur_bs_len = readl(regs + VE_AVC_VLE_LENGTH);
+	bw_bits(bw, 1, 1);
+	if (bw->cache_bits)
+		bw_bits(bw, 0, 8 - bw->cache_bits);
+}
 
-	int num_zero_bits = 8 - ((cur_bs_len + 1) & 0x7);
-	put_bits(regs, 1 << num_zero_bits, num_zero_bits + 1);
+static void bw_bytes(struct bitwriter *bw, const uint8_t *data, unsigned int length)
+{
+	for (; length > 0 && bw->length < bw->size; length--)
+		bw->data[bw->length++] = *data++;
+	bw->zeros = 0;
 }
 
-static void put_seq_parameter_set(h264enc *c)
+static void write_seq_parameter_set(h264enc *c, struct bitwriter *bw)
 {
-	put_start_code(c->regs, 3, 7);
+	bw_start_code(bw, 3, 7);
 
-	put_bits(c->regs, c->profile_idc, 8);
-	put_bits(c->regs, c->constraints, 8);
-	put_bits(c->regs, c->level_idc, 8);
+	bw_bits(bw, c->profile_idc, 8);
+	bw_bits(bw, c->constraints, 8);
+	bw_bits(bw, c->level_idc, 8);
 
-	put_ue(c->regs, /* seq_parameter_set_id = */ 0);
+	bw_ue(bw, /* seq_parameter_set_id = */ 0);
 
-	put_ue(c->regs, /* log2_max_frame_num_minus4 = */ 0);
-	put_ue(c->regs, /* pic_order_cnt_type = */ 2);
+	bw_ue(bw, /* log2_max_frame_num_minus4 = */ 0);
+	bw_ue(bw, /* pic_order_cnt_type = */ 2);
 
-	put_ue(c->regs, /* max_num_ref_frames = */ 1);
-	put_bits(c->regs, /* gaps_in_frame_num_value_allowed_flag = */ 0, 1);
+	bw_ue(bw, /* max_num_ref_frames = */ 1);
+	bw_bits(bw, /* gaps_in_frame_num_value_allowed_flag = */ 0, 1);
 
-	put_ue(c->regs, c->mb_width - 1);
-	put_ue(c->regs, c->mb_height - 1);
+	bw_ue(bw, c->mb_width - 1);
+	bw_ue(bw, c->mb_height - 1);
 
-	put_bits(c->regs, /* frame_mbs_only_flag = */ 1, 1);
+	bw_bits(bw, /* frame_mbs_only_flag = */ 1, 1);
 
-	put_bits(c->regs, /* direct_8x8_inference_flag = */ 0, 1);
+	bw_bits(bw, /* direct_8x8_inference_flag = */ 0, 1);
 
 	unsigned int frame_cropping_flag = c->crop_right || c->crop_bottom;
-	put_bits(c->regs, frame_cropping_flag, 1);
+	bw_bits(bw, frame_cropping_flag, 1);
 	if (frame_cropping_flag)
 	{
-		put_ue(c->regs, 0);
-		put_ue(c->regs, c->crop_right);
-		put_ue(c->regs, 0);
-		put_ue(c->regs, c->crop_bottom);
+		bw_ue(bw, 0);
+		bw_ue(bw, c->crop_right);
+		bw_ue(bw, 0);
+		bw_ue(bw, c->crop_bottom);
 	}
 
-	put_bits(c->regs, /* vui_parameters_present_flag = */ 0, 1);
+	bw_bits(bw, /* vui_parameters_present_flag = */ 0, 1);
 
-	put_rbsp_trailing_bits(c->regs);
+	bw_rbsp_trailing_bits(bw);
 }
 
-static void put_pic_parameter_set(h264enc *c)
+static void write_pic_parameter_set(h264enc *c, struct bitwriter *bw)
 {
-	put_start_code(c->regs, 3, 8);
+	bw_start_code(bw, 3, 8);
 
-	put_ue(c->regs, /* pic_parameter_set_id = */ 0);
-	put_ue(c->regs, /* seq_parameter_set_id = */ 0);
+	bw_ue(bw, /* pic_parameter_set_id = */ 0);
+	bw_ue(bw, /* seq_parameter_set_id = */ 0);
 
-	put_bits(c->regs, c->entropy_coding_mode_flag, 1);
+	bw_bits(bw, c->entropy_coding_mode_flag, 1);
 
-	put_bits(c->regs, /* bottom_field_pic_order_in_frame_present_flag = */ 0, 1);
-	put_ue(c->regs, /* num_slice_groups_minus1 = */ 0);
+	bw_bits(bw, /* bottom_field_pic_order_in_frame_present_flag = */ 0, 1);
+	bw_ue(bw, /* num_slice_groups_minus1 = */ 0);
 
-	put_ue(c->regs, /* num_ref_idx_l0_default_active_minus1 = */ 0);
-	put_ue(c->regs, /* num_ref_idx_l1_default_active_minus1 = */ 0);
+	bw_ue(bw, /* num_ref_idx_l0_default_active_minus1 = */ 0);
+	bw_ue(bw, /* num_ref_idx_l1_default_active_minus1 = */ 0);
 
-	put_bits(c->regs, /* weighted_pred_flag = */ 0, 1);
-	put_bits(c->regs, /* weighted_bipred_idc = */ 0, 2);
+	bw_bits(bw, /* weighted_pred_flag = */ 0, 1);
+	bw_bits(bw, /* weighted_bipred_idc = */ 0, 2);
 
-	put_se(c->regs, (int)c->pic_init_qp - 26);
-	put_se(c->regs, (int)c->pic_init_qp - 26);
-	put_se(c->regs, /* chroma_qp_index_offset = */ 4);
+	bw_se(bw, (int)c->pic_init_qp - 26);
+	bw_se(bw, (int)c->pic_init_qp - 26);
+	bw_se(bw, /* chroma_qp_index_offset = */ 4);
 
-	put_bits(c->regs, /* deblocking_filter_control_present_flag = */ 1, 1);
-	put_bits(c->regs, /* constrained_intra_pred_flag = */ 0, 1);
-	put_bits(c->regs, /* redundant_pic_cnt_present_flag = */ 0, 1);
+	bw_bits(bw, /* deblocking_filter_control_present_flag = */ 1, 1);
+	bw_bits(bw, /* constrained_intra_pred_flag = */ 0, 1);
+	bw_bits(bw, /* redundant_pic_cnt_present_flag = */ 0, 1);
 
-	put_rbsp_trailing_bits(c->regs);
+	bw_rbsp_trailing_bits(bw);
 }
 
-static void put_slice_header(h264enc *c)
+static void write_slice_header(h264enc *c, struct bitwriter *bw)
 {
 	if (c->current_slice_type == SLICE_I)
-		put_start_code(c->regs, 3, 5);
+		bw_start_code(bw, 3, 5);
 	else
-		put_start_code(c->regs, 2, 1);
+		bw_start_code(bw, 2, 1);
 
-	put_ue(c->regs, /* first_mb_in_slice = */ 0);
-	put_ue(c->regs, c->current_slice_type);
-	put_ue(c->regs, /* pic_parameter_set_id = */ 0);
+	bw_ue(bw, /* first_mb_in_slice = */ 0);
+	bw_ue(bw, c->current_slice_type);
+	bw_ue(bw, /* pic_parameter_set_id = */ 0);
 
-	put_bits(c->regs, c->current_frame_num & 0xf, 4);
+	bw_bits(bw, c->current_frame_num & 0xf, 4);
 
 	if (c->current_slice_type == SLICE_I)
-		put_ue(c->regs, /* idr_pic_id = */ 0);
+		bw_ue(bw, /* idr_pic_id = */ 0);
 
 	if (c->current_slice_type == SLICE_P)
 	{
-		put_bits(c->regs, /* num_ref_idx_active_override_flag = */ 0, 1);
-		put_bits(c->regs, /* ref_pic_list_modification_flag_l0 = */ 0, 1);
-		put_bits(c->regs, /* adaptive_ref_pic_marking_mode_flag = */ 0, 1);
+		bw_bits(bw, /* num_ref_idx_active_override_flag = */ 0, 1);
+		bw_bits(bw, /* ref_pic_list_modification_flag_l0 = */ 0, 1);
+		bw_bits(bw, /* adaptive_ref_pic_marking_mode_flag = */ 0, 1);
 		if (c->entropy_coding_mode_flag)
-			put_ue(c->regs, /* cabac_init_idc = */ 0);
+			bw_ue(bw, /* cabac_init_idc = */ 0);
 	}
 
 	if (c->current_slice_type == SLICE_I)
 	{
-		put_bits(c->regs, /* no_output_of_prior_pics_flag = */ 0, 1);
-		put_bits(c->regs, /* long_term_reference_flag = */ 0, 1);
+		bw_bits(bw, /* no_output_of_prior_pics_flag = */ 0, 1);
+		bw_bits(bw, /* long_term_reference_flag = */ 0, 1);
 	}
 
-	put_se(c->regs, /* slice_qp_delta = */ 0);
+	bw_se(bw, /* slice_qp_delta = */ 0);
+
+	bw_ue(bw, /* disable_deblocking_filter_idc = */ 0);
+	bw_se(bw, /* slice_alpha_c0_offset_div2 = */ 0);
+	bw_se(bw, /* slice_beta_offset_div2 = */ 0);
+}
+
+static void build_sps_pps(h264enc *c)
+{
+	struct bitwriter bw;
+
+	bw_init(&bw, c->sps_pps, sizeof(c->sps_pps));
+	write_seq_parameter_set(c, &bw);
+	write_pic_parameter_set(c, &bw);
+
+	c->sps_pps_length = bw.length;
+	c->sps_pps_dirty = 0;
+}
+
+/* SPS and PPS if due, then the slice header */
+static void put_headers(h264enc *c, struct bitwriter *bw)
+{
+	if (c->write_sps_pps)
+	{
+		if (c->sps_pps_dirty)
+			build_sps_pps(c);
+		bw_bytes(bw, c->sps_pps, c->sps_pps_length);
+		c->write_sps_pps = 0;
+	}
+
+	write_slice_header(c, bw);
+}
+
+/*
+ * Write SPS/PPS if due and the slice header to the start of the bytestream
+ * buffer. The VE continues after the last non-zero byte, trailing zero bytes
+ * and the unaligned rest of the header are fed through put_bits() so its
+ * emulation prevention sees them. Returns the bit offset for VE_AVC_VLE_OFFSET.
+ */
+static unsigned int write_headers(h264enc *c)
+{
+	struct bitwriter bw;
+
+	bw_init(&bw, c->bytestream_buffer, c->bytestream_buffer_size);
+	put_headers(c, &bw);
+
+	c->header_length = bw.length;
+
+	unsigned int offset = bw.length;
+	while (offset > 0 && c->bytestream_buffer[offset - 1] == 0x00)
+		offset--;
+
+	c->header_zero_bytes = bw.length - offset;
+	c->header_tail = bw.cache & ((1 << bw.cache_bits) - 1);
+	c->header_tail_bits = bw.cache_bits;
+
+	return offset * 8;
+}
+
+static void put_header_tail(h264enc *c, unsigned int header_bits)
+{
+	unsigned int i;
+
+	for (i = 0; i < c->header_zero_bytes; i++)
+		put_bits(c->regs, 0, 8, &header_bits);
+	if (c->header_tail_bits)
+		put_bits(c->regs, c->header_tail, c->header_tail_bits, &header_bits);
+}
+
+#define REG(o, v) ((struct h264enc_reg){ .offset = (o), .value = (v) })
+#define REG_SET(o, v) ((struct h264enc_reg){ .offset = (o), .set_bits = 1, .value = (v) })
+
+static void build_register_program(h264enc *c)
+{
+	struct h264enc_reg *r = c->prog_output;
+
+	r[PROG_VLE_OFFSET] = REG(VE_AVC_VLE_OFFSET, 0x0);
+	r[PROG_VLE_ADDR] = REG(VE_AVC_VLE_ADDR, 0);
+	r[PROG_VLE_END] = REG(VE_AVC_VLE_END, 0);
+	r[3] = REG(VE_AVC_VLE_MAX, c->bytestream_buffer_size * 8);
+
+	r = c->prog_frame;
+
+	/* input size and format */
+	r[0] = REG(VE_ISP_INPUT_STRIDE, c->mb_stride << 16);
+	r[1] = REG(VE_ISP_INPUT_SIZE, (c->mb_width << 16) | (c->mb_height << 0));
+	r[2] = REG(VE_ISP_CTRL, c->input_color_format << 29);
+
+	/* input, reconstruction and reference buffers */
+	r[PROG_INPUT_LUMA] = REG(VE_ISP_INPUT_LUMA, 0);
+	r[PROG_INPUT_CHROMA] = REG(VE_ISP_INPUT_CHROMA, 0);
+	r[PROG_REC_LUMA] = REG(VE_AVC_REC_LUMA, 0);
+	r[PROG_REC_CHROMA] = REG(VE_AVC_REC_CHROMA, 0);
+	r[PROG_REC_SLUMA] = REG(VE_AVC_REC_SLUMA, 0);
+	r[PROG_REF_LUMA] = REG(VE_AVC_REF_LUMA, 0);
+	r[PROG_REF_CHROMA] = REG(VE_AVC_REF_CHROMA, 0);
+	r[PROG_REF_SLUMA] = REG(VE_AVC_REF_SLUMA, 0);
+
+	/* unknown purpose buffers */
+	r[11] = REG(VE_AVC_MB_INFO, ve_virt2phys(c->extra_buffer_line));
+	r[12] = REG(VE_AVC_UNK_BUF, ve_virt2phys(c->extra_buffer_frame));
+
+	/* enable interrupt and clear status flags */
+	r[13] = REG_SET(VE_AVC_CTRL, 0xf);
+	r[14] = REG_SET(VE_AVC_STATUS, 0x7);
+
+	/* encoding parameters */
+	r[PROG_PARAM] = REG(VE_AVC_PARAM, c->entropy_coding_mode_flag ? 0x100 : 0x0);
+	r[16] = REG(VE_AVC_QP, (4 << 16) | (c->pic_init_qp << 8) | c->pic_init_qp);
+	r[17] = REG(VE_AVC_MOTION_EST, 0x00000104);
+}
+
+static void run_register_program(void *regs, const struct h264enc_reg *r, unsigned int n)
+{
+	unsigned int i;
 
-	put_ue(c->regs, /* disable_deblocking_filter_idc = */ 0);
-	put_se(c->regs, /* slice_alpha_c0_offset_div2 = */ 0);
-	put_se(c->regs, /* slice_beta_offset_div2 = */ 0);
+	for (i = 0; i < n; i++)
+	{
+		if (r[i].set_bits)
+			writel(readl(regs + r[i].offset) | r[i].value, regs + r[i].offset);
+		else
+			writel(r[i].value, regs + r[i].offset);
+	}
 }
 
 void h264enc_free(h264enc *c)
 {
 	int i;
 
+	ve_client_free(c->ve_client);
 	ve_free(c->extra_buffer_line);
 	ve_free(c->extra_buffer_frame);
 	for (i = 0; i < 2; i++)
@@ -223,11 +510,49 @@ void h264enc_free(h264enc *c)
 		ve_free(c->ref_picture[i].luma_buffer);
 		ve_free(c->ref_picture[i].extra_buffer);
 	}
-	ve_free(c->bytestream_buffer);
-	ve_free(c->luma_buffer);
+	if (c->output)
+	{
+		for (i = 0; i < c->num_outputs; i++)
+			ve_free(c->output[i].packet.data);
+		free(c->output);
+	}
+	pthread_mutex_destroy(&c->output_lock);
+	pthread_cond_destroy(&c->output_free);
+	if (c->input)
+	{
+		for (i = 0; i < c->num_inputs; i++)
+			ve_free(c->input[i].luma_buffer);
+		free(c->input);
+	}
+	free(c->input_queue);
+	pthread_mutex_destroy(&c->input_lock);
+	pthread_cond_destroy(&c->input_free);
 	free(c);
 }
 
+/* the parameters the headers are made of */
+static void copy_params(h264enc *c, const struct h264enc_params *p)
+{
+	c->mb_width = DIV_ROUND_UP(p->width, 16);
+	c->mb_height = DIV_ROUND_UP(p->height, 16);
+	c->mb_stride = p->src_width / 16;
+
+	c->crop_right = (c->mb_width * 16 - p->width) / 2;
+	c->crop_bottom = (c->mb_height * 16 - p->height) / 2;
+
+	c->profile_idc = p->profile_idc;
+	c->level_idc = p->level_idc;
+
+	c->entropy_coding_mode_flag = p->entropy_coding_mode ? 1 : 0;
+	c->pic_init_qp = p->qp;
+	c->keyframe_interval = p->keyframe_interval;
+
+	c->write_sps_pps = 1;
+	c->sps_pps_dirty = 1;
+	c->current_frame_num = 0;
+	c->streaming_mode = (p->work_mode == ENC_MODE_STREAMING);
+}
+
 h264enc *h264enc_new(const struct h264enc_params *p)
 {
 	h264enc *c;
@@ -262,27 +587,11 @@ h264enc *h264enc_new(const struct h264enc_params *p)
 		return NULL;
 	}
 
-	/* copy parameters */
-	c->mb_width = DIV_ROUND_UP(p->width, 16);
-	c->mb_height = DIV_ROUND_UP(p->height, 16);
-	c->mb_stride = p->src_width / 16;
-
-	c->crop_right = (c->mb_width * 16 - p->width) / 2;
-	c->crop_bottom = (c->mb_height * 16 - p->height) / 2;
-
-	c->profile_idc = p->profile_idc;
-	c->level_idc = p->level_idc;
-
-	c->entropy_coding_mode_flag = p->entropy_coding_mode ? 1 : 0;
-	c->pic_init_qp = p->qp;
-	c->keyframe_interval = p->keyframe_interval;
-
-	c->write_sps_pps = 1;
-	c->current_frame_num = 0;
-	c->streaming_mode = (p->work_mode == ENC_MODE_STREAMING);
+	copy_params(c, p);
 
 	/* allocate input buffer */
 	c->input_color_format = p->src_format;
+	c->cache_mode = p->cache_mode;
 	switch (c->input_color_format)
 	{
 	case H264_FMT_NV12:
@@ -293,18 +602,53 @@ h264enc *h264enc_new(const struct h264enc_params *p)
 		break;
 	}
 
-	c->luma_buffer = ve_malloc(c->input_buffer_size);
-	if (c->luma_buffer == NULL)
+	pthread_mutex_init(&c->input_lock, NULL);
+	pthread_cond_init(&c->input_free, NULL);
+	pthread_mutex_init(&c->output_lock, NULL);
+	pthread_cond_init(&c->output_free, NULL);
+
+	c->num_inputs = p->input_buffers ? p->input_buffers : 1;
+	c->input = calloc(c->num_inputs, sizeof(*c->input));
+	c->input_queue = calloc(c->num_inputs, sizeof(*c->input_queue));
+	if (c->input == NULL || c->input_queue == NULL)
 		goto nomem;
 
-	c->chroma_buffer = c->luma_buffer + p->src_width * p->src_height;
+	for (i = 0; i < c->num_inputs; i++)
+	{
+		if (c->cache_mode == H264_CACHE_UNCACHED)
+			c->input[i].luma_buffer = ve_malloc_uncached(c->input_buffer_size);
+		else
+			c->input[i].luma_buffer = ve_malloc(c->input_buffer_size);
+		if (c->input[i].luma_buffer == NULL)
+			goto nomem;
+
+		c->input[i].chroma_buffer = c->input[i].luma_buffer + p->src_width * p->src_height;
+		c->input[i].luma_phys = ve_virt2phys(c->input[i].luma_buffer);
+		c->input[i].chroma_phys = ve_virt2phys(c->input[i].chroma_buffer);
+	}
 
-	/* allocate bytestream output buffer */
+	c->luma_buffer = c->input[0].luma_buffer;
+	c->chroma_buffer = c->input[0].chroma_buffer;
+
+	/* allocate bytestream output buffers */
 	c->bytestream_buffer_size = 1 * 1024 * 1024;
-	c->bytestream_buffer = ve_malloc(c->bytestream_buffer_size);
-	if (c->bytestream_buffer == NULL)
+	c->num_outputs = p->bytestream_buffers ? p->bytestream_buffers : 1;
+	c->output = calloc(c->num_outputs, sizeof(*c->output));
+	if (c->output == NULL)
 		goto nomem;
 
+	for (i = 0; i < c->num_outputs; i++)
+	{
+		c->output[i].packet.data = ve_malloc(c->bytestream_buffer_size);
+		c->output[i].packet.index = i;
+		if (c->output[i].packet.data == NULL)
+			goto nomem;
+		c->output[i].phys = ve_virt2phys(c->output[i].packet.data);
+	}
+
+	c->current_output = -1;
+	c->bytestream_buffer = c->output[0].packet.data;
+
 	/* allocate reference picture memory */
 	unsigned int luma_size = ALIGN(c->mb_width * 16, 32) * ALIGN(c->mb_height * 16, 32);
 	unsigned int chroma_size = ALIGN(c->mb_width * 16, 32) * ALIGN(c->mb_height * 8, 32);
@@ -315,6 +659,9 @@ h264enc *h264enc_new(const struct h264enc_params *p)
 		c->ref_picture[i].extra_buffer = ve_malloc(luma_size / 4);
 		if (c->ref_picture[i].luma_buffer == NULL || c->ref_picture[i].extra_buffer == NULL)
 			goto nomem;
+		c->ref_picture[i].luma_phys = ve_virt2phys(c->ref_picture[i].luma_buffer);
+		c->ref_picture[i].chroma_phys = ve_virt2phys(c->ref_picture[i].chroma_buffer);
+		c->ref_picture[i].extra_phys = ve_virt2phys(c->ref_picture[i].extra_buffer);
 	}
 
 	/* allocate unknown purpose buffers */
@@ -323,6 +670,13 @@ h264enc *h264enc_new(const struct h264enc_params *p)
 	if (c->extra_buffer_frame == NULL || c->extra_buffer_line == NULL)
 		goto nomem;
 
+	c->completion_fd = -1;
+	c->ve_client = ve_client_new(p->priority, p->late_policy);
+	if (c->ve_client == NULL)
+		goto nomem;
+
+	build_register_program(c);
+
 	return c;
 
 nomem:
@@ -331,9 +685,154 @@ nomem:
 	return NULL;
 }
 
+unsigned int h264enc_get_headers(const struct h264enc_params *p, int sps_pps, unsigned int frame_num,
+				 uint8_t *buf, unsigned int size)
+{
+	struct h264enc_internal c;
+	struct bitwriter bw;
+
+	memset(&c, 0, sizeof(c));
+	copy_params(&c, p);
+	c.write_sps_pps = sps_pps;
+	c.current_frame_num = frame_num;
+	c.current_slice_type = frame_num ? SLICE_P : SLICE_I;
+
+	bw_init(&bw, buf, size);
+	put_headers(&c, &bw);
+
+	/* the part left to put_bits(), as it ends up in the bytestream */
+	if (bw.cache_bits && bw.length < size)
+		buf[bw.length] = bw.cache << (8 - bw.cache_bits);
+
+	return bw.length * 8 + bw.cache_bits;
+}
+
 void *h264enc_get_input_buffer(const h264enc *c)
 {
-	return c->luma_buffer;
+	return c->input[0].luma_buffer;
+}
+
+void *h264enc_acquire_input_buffer(h264enc *c)
+{
+	unsigned int i;
+	void *buf = NULL;
+
+	pthread_mutex_lock(&c->input_lock);
+	while (buf == NULL)
+	{
+		for (i = 0; i < c->num_inputs; i++)
+		{
+			if (c->input[i].state == INPUT_FREE)
+			{
+				c->input[i].state = INPUT_FILLING;
+				buf = c->input[i].luma_buffer;
+				break;
+			}
+		}
+
+		if (buf == NULL)
+			pthread_cond_wait(&c->input_free, &c->input_lock);
+	}
+	pthread_mutex_unlock(&c->input_lock);
+
+	return buf;
+}
+
+void h264enc_submit_input_buffer(h264enc *c, void *buf)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&c->input_lock);
+	for (i = 0; i < c->num_inputs; i++)
+	{
+		if (c->input[i].luma_buffer == buf && c->input[i].state == INPUT_FILLING)
+		{
+			c->input[i].state = INPUT_QUEUED;
+			c->input_queue[(c->input_queue_head + c->input_queue_count) % c->num_inputs] = i;
+			c->input_queue_count++;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&c->input_lock);
+}
+
+void h264enc_input_written(h264enc *c, void *buf, unsigned int first_row, unsigned int rows)
+{
+	unsigned int i, stride = c->mb_stride * 16;
+
+	for (i = 0; i < c->num_inputs; i++)
+		if (c->input[i].luma_buffer == buf)
+			break;
+	if (i == c->num_inputs || c->cache_mode == H264_CACHE_FULL)
+		return;
+
+	struct h264enc_input *in = &c->input[i];
+	ve_flush_cache(in->luma_buffer + first_row * stride, rows * stride);
+
+	if (c->input_color_format == H264_FMT_NV12)
+	{
+		rows = (first_row + rows + 1) / 2 - first_row / 2;
+		first_row /= 2;
+	}
+	ve_flush_cache(in->chroma_buffer + first_row * stride, rows * stride);
+
+	in->flushed = 1;
+}
+
+void h264enc_release_input_buffer(h264enc *c, void *buf)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&c->input_lock);
+	for (i = 0; i < c->num_inputs; i++)
+	{
+		if (c->input[i].luma_buffer == buf && c->input[i].state == INPUT_FILLING)
+		{
+			c->input[i].state = INPUT_FREE;
+			pthread_cond_signal(&c->input_free);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&c->input_lock);
+}
+
+/* pick the oldest submitted input, or the legacy single buffer if none */
+static int next_input(h264enc *c)
+{
+	int idx = -1;
+
+	pthread_mutex_lock(&c->input_lock);
+	if (c->input_queue_count > 0)
+	{
+		idx = c->input_queue[c->input_queue_head];
+		c->input_queue_head = (c->input_queue_head + 1) % c->num_inputs;
+		c->input_queue_count--;
+	}
+	pthread_mutex_unlock(&c->input_lock);
+
+	if (idx < 0)
+	{
+		c->luma_buffer = c->input[0].luma_buffer;
+		c->chroma_buffer = c->input[0].chroma_buffer;
+	}
+	else
+	{
+		c->luma_buffer = c->input[idx].luma_buffer;
+		c->chroma_buffer = c->input[idx].chroma_buffer;
+	}
+
+	return idx;
+}
+
+static void release_input(h264enc *c, int idx)
+{
+	if (idx < 0)
+		return;
+
+	pthread_mutex_lock(&c->input_lock);
+	c->input[idx].state = INPUT_FREE;
+	pthread_cond_signal(&c->input_free);
+	pthread_mutex_unlock(&c->input_lock);
 }
 
 void *h264enc_get_bytestream_buffer(const h264enc *c)
@@ -346,98 +845,416 @@ unsigned int h264enc_get_bytestream_length(const h264enc *c)
 	return c->bytestream_length;
 }
 
-int h264enc_encode_picture(h264enc *c)
+/*
+ * pick a free bytestream buffer, output nobody took is overwritten.
+ * Without wait 0 when the sinks still hold all of them.
+ */
+static int next_output(h264enc *c, int wait)
 {
-	c->current_slice_type = c->current_frame_num ? SLICE_P : SLICE_I;
+	unsigned int i;
+	int idx = -1;
 
-	c->regs = ve_get(VE_ENGINE_AVC, 0);
+	pthread_mutex_lock(&c->output_lock);
+	for (i = 0; i < c->num_outputs; i++)
+		if (c->output[i].state == OUTPUT_READY)
+			c->output[i].state = OUTPUT_FREE;
 
-	/* flush buffers (output because otherwise we might read old data later) */
-	ve_flush_cache(c->bytestream_buffer, c->bytestream_buffer_size);
-	ve_flush_cache(c->luma_buffer, c->input_buffer_size);
+	while (idx < 0)
+	{
+		for (i = 0; i < c->num_outputs; i++)
+		{
+			if (c->output[i].state == OUTPUT_FREE)
+			{
+				idx = i;
+				break;
+			}
+		}
+
+		if (idx < 0 && !wait)
+		{
+			pthread_mutex_unlock(&c->output_lock);
+			return 0;
+		}
+		if (idx < 0)
+			pthread_cond_wait(&c->output_free, &c->output_lock);
+	}
+	c->output[idx].state = OUTPUT_ENCODING;
+	pthread_mutex_unlock(&c->output_lock);
 
-	/* set output buffer */
-	writel(0x0, c->regs + VE_AVC_VLE_OFFSET);
-	writel(ve_virt2phys(c->bytestream_buffer), c->regs + VE_AVC_VLE_ADDR);
-	writel(ve_virt2phys(c->bytestream_buffer) + c->bytestream_buffer_size - 1, c->regs + VE_AVC_VLE_END);
-	writel(c->bytestream_buffer_size * 8, c->regs + VE_AVC_VLE_MAX);
+	c->current_output = idx;
+	c->bytestream_buffer = c->output[idx].packet.data;
+	return 1;
+}
 
-	/* write headers */
-	if (c->write_sps_pps)
+/* the frame was never encoded, the buffer goes straight back */
+static void drop_output(h264enc *c)
+{
+	pthread_mutex_lock(&c->output_lock);
+	c->output[c->current_output].state = OUTPUT_FREE;
+	pthread_cond_signal(&c->output_free);
+	pthread_mutex_unlock(&c->output_lock);
+}
+
+static void finish_output(h264enc *c)
+{
+	struct h264enc_output *o = &c->output[c->current_output];
+
+	pthread_mutex_lock(&c->output_lock);
+	o->packet.length = c->bytestream_length;
+	o->packet.keyframe = (c->current_slice_type == SLICE_I);
+	o->state = OUTPUT_READY;
+	pthread_mutex_unlock(&c->output_lock);
+}
+
+struct h264enc_packet *h264enc_get_packet(h264enc *c)
+{
+	struct h264enc_packet *pkt = NULL;
+
+	if (c->current_output < 0)
+		return NULL;
+
+	pthread_mutex_lock(&c->output_lock);
+	struct h264enc_output *o = &c->output[c->current_output];
+	if (o->state == OUTPUT_READY)
 	{
-		put_seq_parameter_set(c);
-		put_pic_parameter_set(c);
-		c->write_sps_pps = 0;
+		o->state = OUTPUT_HELD;
+		o->refs = 1;
+		pkt = &o->packet;
 	}
-	put_slice_header(c);
+	pthread_mutex_unlock(&c->output_lock);
+
+	return pkt;
+}
+
+void h264enc_packet_ref(h264enc *c, struct h264enc_packet *pkt, int n)
+{
+	pthread_mutex_lock(&c->output_lock);
+	c->output[pkt->index].refs += n;
+	pthread_mutex_unlock(&c->output_lock);
+}
 
-	/* set input size */
-	writel(c->mb_stride << 16, c->regs + VE_ISP_INPUT_STRIDE);
-	writel((c->mb_width << 16) | (c->mb_height << 0), c->regs + VE_ISP_INPUT_SIZE);
+void h264enc_packet_release(h264enc *c, struct h264enc_packet *pkt)
+{
+	struct h264enc_output *o = &c->output[pkt->index];
 
-	/* set input format */
-	writel(c->input_color_format << 29, c->regs + VE_ISP_CTRL);
+	pthread_mutex_lock(&c->output_lock);
+	if (--o->refs <= 0)
+	{
+		o->refs = 0;
+		o->state = OUTPUT_FREE;
+		pthread_cond_signal(&c->output_free);
+	}
+	pthread_mutex_unlock(&c->output_lock);
+}
 
-	/* set input buffer */
-	writel(ve_virt2phys(c->luma_buffer), c->regs + VE_ISP_INPUT_LUMA);
-	writel(ve_virt2phys(c->chroma_buffer), c->regs + VE_ISP_INPUT_CHROMA);
+static uint64_t elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1000000ULL +
+		(to->tv_nsec - from->tv_nsec) / 1000;
+}
 
-	/* set reconstruction buffers */
-	struct h264enc_ref_pic *ref_pic = &c->ref_picture[c->current_frame_num % 2];
-	writel(ve_virt2phys(ref_pic->luma_buffer), c->regs + VE_AVC_REC_LUMA);
-	writel(ve_virt2phys(ref_pic->chroma_buffer), c->regs + VE_AVC_REC_CHROMA);
-	writel(ve_virt2phys(ref_pic->extra_buffer), c->regs + VE_AVC_REC_SLUMA);
+/*
+ * 1 when the frame is on the VE, 0 when dropped by the late policy. With
+ * try -1 instead of waiting for the VE or a bytestream buffer, nothing
+ * is taken then and the deadline stays for the next attempt.
+ */
+static int encode_start(h264enc *c, int try)
+{
+	unsigned int write_sps_pps = c->write_sps_pps;
+	const struct timespec *deadline = c->has_deadline ? &c->deadline : NULL;
+	int granted = 1;
 
-	/* set reference buffers */
-	if (c->current_slice_type != SLICE_I)
+	if (try)
 	{
-		ref_pic = &c->ref_picture[(c->current_frame_num + 1) % 2];
-		writel(ve_virt2phys(ref_pic->luma_buffer), c->regs + VE_AVC_REF_LUMA);
-		writel(ve_virt2phys(ref_pic->chroma_buffer), c->regs + VE_AVC_REF_CHROMA);
-		writel(ve_virt2phys(ref_pic->extra_buffer), c->regs + VE_AVC_REF_SLUMA);
+		if (!next_output(c, 0))
+			granted = -1;
+		else if ((granted = ve_try_acquire(c->ve_client, VE_ENGINE_AVC, 0, deadline)) < 0)
+			drop_output(c);
+		if (granted < 0)
+		{
+			c->ext_input = 0;
+			return -1;
+		}
+	}
+	else
+	{
+		next_output(c, 1);
 	}
 
-	/* set unknown purpose buffers */
-	writel(ve_virt2phys(c->extra_buffer_line), c->regs + VE_AVC_MB_INFO);
-	writel(ve_virt2phys(c->extra_buffer_frame), c->regs + VE_AVC_UNK_BUF);
+	c->pending_input = c->ext_input ? -1 : next_input(c);
 
-	/* enable interrupt and clear status flags */
-	writel(readl(c->regs + VE_AVC_CTRL) | 0xf, c->regs + VE_AVC_CTRL);
-	writel(readl(c->regs + VE_AVC_STATUS) | 0x7, c->regs + VE_AVC_STATUS);
+	c->current_slice_type = c->current_frame_num ? SLICE_P : SLICE_I;
+
+	/* write headers, the VE appends the slice data */
+	unsigned int header_bits = write_headers(c);
+
+	/* another instance may still be encoding, the VE is taken in turns */
+	if (!try)
+		granted = ve_acquire(c->ve_client, VE_ENGINE_AVC, 0, deadline);
+	c->has_deadline = 0;
+	if (!granted)
+	{
+		/* too late, as if never started */
+		c->write_sps_pps = write_sps_pps;
+		c->bytestream_length = 0;
+		c->ext_input = 0;
+		drop_output(c);
+		release_input(c, c->pending_input);
+		return 0;
+	}
+	c->regs = ve_get_regs();
+	clock_gettime(CLOCK_MONOTONIC, &c->ve_acquired);
+#ifdef VE_DEBUG_MMIO
+	c->mmio_start = ve_mmio_count;
+#endif
+
+	/*
+	 * flush buffers (output because otherwise we might read old data later).
+	 * Only the headers are dirty in the output, stale lines of what the CPU
+	 * read last time are dropped after encoding in encode_finish().
+	 */
+	if (c->cache_mode == H264_CACHE_FULL)
+		ve_flush_cache(c->bytestream_buffer, c->bytestream_buffer_size);
+	else
+		ve_flush_cache(c->bytestream_buffer, c->header_length);
+
+	if (!c->ext_input)
+	{
+		struct h264enc_input *in = &c->input[c->pending_input < 0 ? 0 : c->pending_input];
+		if (!in->flushed)
+			ve_flush_cache(c->luma_buffer, c->input_buffer_size);
+		in->flushed = 0;
+	}
+
+	/* set output buffer */
+	struct h264enc_output *out = &c->output[c->current_output];
+	c->prog_output[PROG_VLE_OFFSET].value = header_bits;
+	c->prog_output[PROG_VLE_ADDR].value = out->phys;
+	c->prog_output[PROG_VLE_END].value = out->phys + c->bytestream_buffer_size - 1;
+	run_register_program(c->regs, c->prog_output, ARRAY_SIZE(c->prog_output));
+	put_header_tail(c, header_bits);
+
+	/* patch the per-frame slots and replay the rest */
+	struct h264enc_reg *r = c->prog_frame;
+	if (c->ext_input)
+	{
+		r[PROG_INPUT_LUMA].value = c->ext_luma_phys;
+		r[PROG_INPUT_CHROMA].value = c->ext_chroma_phys;
+	}
+	else
+	{
+		struct h264enc_input *in = &c->input[c->pending_input < 0 ? 0 : c->pending_input];
+		r[PROG_INPUT_LUMA].value = in->luma_phys;
+		r[PROG_INPUT_CHROMA].value = in->chroma_phys;
+	}
+
+	/* reconstruction and reference swap every frame, the reference is ignored for I slices */
+	struct h264enc_ref_pic *rec = &c->ref_picture[c->current_frame_num % 2];
+	struct h264enc_ref_pic *ref = &c->ref_picture[(c->current_frame_num + 1) % 2];
+	r[PROG_REC_LUMA].value = rec->luma_phys;
+	r[PROG_REC_CHROMA].value = rec->chroma_phys;
+	r[PROG_REC_SLUMA].value = rec->extra_phys;
+	r[PROG_REF_LUMA].value = ref->luma_phys;
+	r[PROG_REF_CHROMA].value = ref->chroma_phys;
+	r[PROG_REF_SLUMA].value = ref->extra_phys;
 
-	/* set encoding parameters */
-	uint32_t params = 0x0;
-	if (c->entropy_coding_mode_flag)
-		params |= 0x100;
 	if (c->current_slice_type == SLICE_P)
-		params |= 0x10;
-	writel(params, c->regs + VE_AVC_PARAM);
-	writel((4 << 16) | (c->pic_init_qp << 8) | c->pic_init_qp, c->regs + VE_AVC_QP);
-	writel(0x00000104, c->regs + VE_AVC_MOTION_EST);
+		r[PROG_PARAM].value |= 0x10;
+	else
+		r[PROG_PARAM].value &= ~0x10;
+
+	run_register_program(c->regs, r, ARRAY_SIZE(c->prog_frame));
 
 	/* trigger encoding */
 	writel(0x8, c->regs + VE_AVC_TRIGGER);
-	ve_wait(1);
+#ifdef VE_DEBUG_MMIO
+	c->mmio_frame = ve_mmio_count - c->mmio_start;
+#endif
+	c->busy = 1;
+	return 1;
+}
+
+static int encode_finish(h264enc *c)
+{
+#ifdef VE_DEBUG_MMIO
+	unsigned long mmio_finish = ve_mmio_count;
+#endif
 
 	/* check result */
 	uint32_t status = readl(c->regs + VE_AVC_STATUS);
 	writel(status, c->regs + VE_AVC_STATUS);
 
-	/* save bytestream length */
-	c->bytestream_length = readl(c->regs + VE_AVC_VLE_LENGTH) / 8;
+	int timeout = (status & 0x3) == 0;
 
-	/* next frame */
-	c->current_frame_num++;
-	if (c->current_frame_num >= c->keyframe_interval) {
+	if (timeout)
+	{
+		/* VE didn't finish in time, the reference picture is lost too */
+		MSG("VE timeout, resetting");
+		ve_reset();
+		c->bytestream_length = 0;
 		c->current_frame_num = 0;
-		// insert each I frmae SPS/PPS if streaming
-		if (c->streaming_mode) 
+		if (c->streaming_mode)
 			c->write_sps_pps = 1;
 	}
+	else
+	{
+		/* save bytestream length */
+		c->bytestream_length = readl(c->regs + VE_AVC_VLE_LENGTH) / 8;
+
+		if (c->cache_mode != H264_CACHE_FULL)
+			ve_flush_cache(c->bytestream_buffer, c->bytestream_length);
+
+		/* next frame */
+		c->current_frame_num++;
+		if (c->current_frame_num >= c->keyframe_interval) {
+			c->current_frame_num = 0;
+			// insert each I frmae SPS/PPS if streaming
+			if (c->streaming_mode) 
+				c->write_sps_pps = 1;
+		}
+	}
+
+#ifdef VE_DEBUG_MMIO
+	c->mmio_frame += ve_mmio_count - mmio_finish;
+#endif
 
+	struct timespec t_put;
+	clock_gettime(CLOCK_MONOTONIC, &t_put);
+	c->stats.ve_us += elapsed_us(&c->ve_acquired, &t_put);
+	c->stats.frames++;
+	c->stats.bytes += c->bytestream_length;
 	ve_put();
+	c->busy = 0;
+	c->ext_input = 0;
+
+	/* a frame lost to the timeout gives no packet */
+	if (timeout)
+		drop_output(c);
+	else
+		finish_output(c);
+
+	/* hardware is done reading the input, hand it back to the ring */
+	release_input(c, c->pending_input);
 
 	//printf("VE status: %08X\n", status);
 
 	return (status & 0x3) == 0x1;
 }
+
+int h264enc_encode_picture(h264enc *c)
+{
+	if (!encode_start(c, 0))
+		return 0;
+	ve_wait(1);
+
+	return encode_finish(c);
+}
+
+static int submit(h264enc *c, int try)
+{
+	int ret = encode_start(c, try);
+
+	if (ret > 0)
+		c->waiting = c->completion_fd != -1 && ve_wait_async(c->ve_client, 1);
+	return ret;
+}
+
+int h264enc_submit(h264enc *c)
+{
+	if (c->busy)
+		return 0;
+
+	return submit(c, 0);
+}
+
+int h264enc_try_submit(h264enc *c)
+{
+	if (c->busy)
+		return 0;
+
+	return submit(c, 1);
+}
+
+int h264enc_encode_picture_phys(h264enc *c, uint32_t luma_phys, uint32_t chroma_phys)
+{
+	c->ext_luma_phys = luma_phys;
+	c->ext_chroma_phys = chroma_phys;
+	c->ext_input = 1;
+
+	return h264enc_encode_picture(c);
+}
+
+int h264enc_submit_phys(h264enc *c, uint32_t luma_phys, uint32_t chroma_phys)
+{
+	if (c->busy)
+		return 0;
+
+	c->ext_luma_phys = luma_phys;
+	c->ext_chroma_phys = chroma_phys;
+	c->ext_input = 1;
+
+	return submit(c, 0);
+}
+
+int h264enc_try_submit_phys(h264enc *c, uint32_t luma_phys, uint32_t chroma_phys)
+{
+	if (c->busy)
+		return 0;
+
+	c->ext_luma_phys = luma_phys;
+	c->ext_chroma_phys = chroma_phys;
+	c->ext_input = 1;
+
+	return submit(c, 1);
+}
+
+unsigned int h264enc_get_mmio_per_frame(const h264enc *c)
+{
+#ifdef VE_DEBUG_MMIO
+	return c->mmio_frame;
+#else
+	return 0;
+#endif
+}
+
+void h264enc_set_deadline(h264enc *c, const struct timespec *deadline)
+{
+	c->has_deadline = deadline != NULL;
+	if (deadline)
+		c->deadline = *deadline;
+}
+
+void h264enc_get_stats(const h264enc *c, struct h264enc_stats *st)
+{
+	struct ve_client_stats vs;
+
+	*st = c->stats;
+	ve_client_stats(c->ve_client, &vs);
+	st->wait_us = vs.wait_us;
+	st->late = vs.late;
+	st->dropped = vs.dropped;
+	st->max_queued = vs.max_queued;
+}
+
+int h264enc_get_completion_fd(h264enc *c)
+{
+	if (c->completion_fd == -1)
+		c->completion_fd = ve_client_event_fd(c->ve_client);
+
+	return c->completion_fd;
+}
+
+int h264enc_complete(h264enc *c)
+{
+	if (!c->busy)
+		return 0;
+
+	/* either returns at once when the interrupt came in meanwhile */
+	if (c->waiting)
+		ve_wait_result(c->ve_client);
+	else
+		ve_wait(1);
+	c->waiting = 0;
+
+	return encode_finish(c);
+}
@@ -21,6 +21,9 @@
 #ifndef __H264ENC_H__
 #define __H264ENC_H__
 
+#include <stdint.h>
+#include <time.h>
+
 struct h264enc_params {
 	unsigned int width;
 	unsigned int height;
@@ -32,6 +35,23 @@ struct h264enc_params {
 	unsigned int qp;
 	unsigned int keyframe_interval;
     enum wmode {ENC_MODE_FILE = 0, ENC_MODE_STREAMING} work_mode;
+	unsigned int input_buffers; /* size of the input ring, 0 means 1 */
+	unsigned int bytestream_buffers; /* size of the output pool, 0 means 1 */
+	enum cache_mode {
+		H264_CACHE_RANGE = 0,	/* flush only what was written */
+		H264_CACHE_FULL,	/* flush whole buffers every frame */
+		H264_CACHE_UNCACHED	/* uncached input buffers, no maintenance */
+	} cache_mode;
+	int priority;		/* VE scheduling, the higher goes first */
+	int late_policy;	/* VE_LATE_* for frames missing their deadline, see ve.h */
+};
+
+/* encoded frame, stays valid until its last reference is released */
+struct h264enc_packet {
+	void *data;
+	unsigned int length;
+	unsigned int keyframe;
+	unsigned int index;
 };
 
 typedef struct h264enc_internal h264enc;
@@ -39,8 +59,75 @@ typedef struct h264enc_internal h264enc;
 h264enc *h264enc_new(const struct h264enc_params *p);
 void h264enc_free(h264enc *c);
 void *h264enc_get_input_buffer(const h264enc *c);
+void *h264enc_acquire_input_buffer(h264enc *c);
+void h264enc_submit_input_buffer(h264enc *c, void *buf);
+void h264enc_release_input_buffer(h264enc *c, void *buf);
+
+/* tell the encoder which luma rows (and their chroma) of an input were written */
+void h264enc_input_written(h264enc *c, void *buf, unsigned int first_row, unsigned int rows);
 void *h264enc_get_bytestream_buffer(const h264enc *c);
 unsigned int h264enc_get_bytestream_length(const h264enc *c);
 int h264enc_encode_picture(h264enc *c);
 
+/* encode a frame the caller already has in VE memory in the encoder's layout */
+int h264enc_encode_picture_phys(h264enc *c, uint32_t luma_phys, uint32_t chroma_phys);
+struct h264enc_packet *h264enc_get_packet(h264enc *c);
+void h264enc_packet_ref(h264enc *c, struct h264enc_packet *pkt, int n);
+void h264enc_packet_release(h264enc *c, struct h264enc_packet *pkt);
+
+/*
+ * h264enc_submit() starts the next frame and returns while the VE encodes,
+ * h264enc_complete() (from the submitting thread) waits for the interrupt
+ * and collects the result like h264enc_encode_picture(). The VE stays
+ * held in between, do other work there rather than submit another frame.
+ *
+ * For an event loop: the completion fd becomes readable when this
+ * encoder's frame is done, h264enc_complete() then returns without
+ * waiting. h264enc_try_submit() returns -1 instead of waiting while
+ * another encoder has the VE or the sinks hold every bytestream buffer,
+ * try again once one of the completion fds fired.
+ */
+int h264enc_submit(h264enc *c);
+int h264enc_submit_phys(h264enc *c, uint32_t luma_phys, uint32_t chroma_phys);
+int h264enc_try_submit(h264enc *c);
+int h264enc_try_submit_phys(h264enc *c, uint32_t luma_phys, uint32_t chroma_phys);
+int h264enc_get_completion_fd(h264enc *c);
+int h264enc_complete(h264enc *c);
+
+/*
+ * the next frame should get the VE before deadline (CLOCK_MONOTONIC),
+ * NULL for none. One dropped by the late policy fails to encode and
+ * gives no packet, its input is released as if encoded.
+ */
+void h264enc_set_deadline(h264enc *c, const struct timespec *deadline);
+
+/*
+ * the bytes in front of the slice data for these parameters, made without
+ * a VE for checking them: SPS and PPS if sps_pps, then the slice header of
+ * frame frame_num of the GOP (0 is the IDR). Returns the length in bits,
+ * an unaligned end is zero padded to the byte.
+ */
+unsigned int h264enc_get_headers(const struct h264enc_params *p, int sps_pps, unsigned int frame_num,
+				 uint8_t *buf, unsigned int size);
+
+/* register accesses needed for the last encoded frame, 0 unless built with VE_DEBUG_MMIO */
+unsigned int h264enc_get_mmio_per_frame(const h264enc *c);
+
+/*
+ * VE use of one instance. Any number of instances can be open at once,
+ * each with its own buffers and reference pictures, they take turns on
+ * the one VE frame by frame.
+ */
+struct h264enc_stats {
+	unsigned long frames;
+	uint64_t bytes;
+	uint64_t ve_us;		/* VE held, from programming it to collecting the frame */
+	uint64_t wait_us;	/* waiting for another instance to give the VE back */
+	unsigned long late;	/* got the VE after their deadline */
+	unsigned long dropped;	/* not encoded, see h264enc_set_deadline() */
+	unsigned int max_queued;	/* most VE requests ahead of one of its frames */
+};
+
+void h264enc_get_stats(const h264enc *c, struct h264enc_stats *st);
+
 #endif
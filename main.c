@@ -42,36 +42,33 @@
 #include "video_device.h"
 #include "h264enc.h"
 #include "csc.h"
+#include "pipeline.h"
+#include "bench.h"
 
 #define USE_V4L_DEV
-//#define USE_FPS_MEASUREMENT
 
 #define DEF_VIDEO_DEV 	"/dev/video0"
 #define DEF_VIDEO_H		640
 #define DEF_VIDEO_W		480
 #define DEF_PIX_FMT		"UYVY"
 
+#define ENC_INPUT_BUFFERS	3 // VE input ring, frames converted ahead of the encoder
+#define ENC_OUTPUT_BUFFERS	4 // bytestream pool, frames the sinks may still hold and one for the encoder
+#define ENC_MAX_STREAMS		4 // encoders sharing the VE, the first one plus -e
+#define MAX_CAMERAS			4 // one -v each, all in one capture loop
+
 #define LB_DRV_NAME 	"v4l2loopback"
 #define LB_NAME_OFFSET	3 // starts with /dev/videoN(offset)
 
-static char VIDEO_DEV[20] = DEF_VIDEO_DEV;
-
 
 #define N_LB_DEV    2
-/* graphic thread init struct */
-static struct pthr_start {
-    char *lb_name;
-    int lb_codec;
-    int lb_fd;
-    int lb_nbuf;
-    int lb_w;
-    int lb_h;
-    void *lb_pbuf;
-    int tofile;
-    int file_fd;
-    char *fname;
-    int pix_format;
-} th_start[] = {
+#define CAM_MAX_LB	(N_LB_DEV + ENC_MAX_STREAMS - 1)
+/*
+ * loopback sinks of the first camera, see struct pthr_start in pipeline.h.
+ * -e adds an H264 one per stream, the other cameras get the same set
+ * numbered on after it, with _camN in the file names.
+ */
+static const struct pthr_start th_start[N_LB_DEV] = {
     {
         .lb_name = "/dev/video3",
         .lb_codec = SIMPLE_LB,
@@ -79,87 +76,116 @@ static struct pthr_start {
         .lb_h = -1,
         .tofile = 0,
         .file_fd = -1,
+        .fname = "out_sunxi_tst.yuv",
         .pix_format = V4L2_PIX_FMT_YUV420,
+        .policy = SINK_DROP_OLDEST,
     },
     {
         .lb_name = "/dev/video4",
         .lb_codec = H264_LB,
+        .stream = 0,
         .lb_w = -1,
         .lb_h = -1,
         .tofile = 1,
         .file_fd = -1,
         .fname = "out_sunxi_tst.mkv",
         .pix_format = V4L2_PIX_FMT_H264,
+        .policy = SINK_DROP_OLDEST,
     }
 };
 
-#ifdef USE_FPS_MEASUREMENT
-# ifndef MAX
-#  define MAX(x, y) ( ((x)>(y))?(x):(y) )
-# endif
+/* one capture device with its own format, size, encoder streams and loopbacks */
+struct camera {
+	char dev[20];
+	char replay_file[50];
+	int width;
+	int height;
+	int pix_fmt;
+	int enc_fmt;
+	int raw_fmt;
+	int deint_mode;
+	struct csc_geometry geom;
+	struct enc_stream streams[ENC_MAX_STREAMS];
+	int n_streams;
+	int raw_width;
+	int raw_height;
 
-# ifndef MIN
-#  define MIN(x, y) ( ((x)<(y))?(x):(y) )
-# endif
-/*
-*/
-unsigned long int time_diff(struct timespec *ts1, struct timespec *ts2) {
-    static struct timespec ts;
-    ts.tv_sec = MAX(ts2->tv_sec, ts1->tv_sec) - MIN(ts2->tv_sec, ts1->tv_sec);
-    ts.tv_nsec = MAX(ts2->tv_nsec, ts1->tv_nsec) - MIN(ts2->tv_nsec, ts1->tv_nsec);
-
-    if (ts.tv_sec > 0) {
-        ts.tv_sec--;
-        ts.tv_nsec += 1000000000;
-    }
+	int video_fd;
+	int field_order;
+	struct buffer *buffers;
+	int n_buffers;
+	struct pthr_start sinks[CAM_MAX_LB];
+	int n_lb;
+	char lb_names[CAM_MAX_LB][32];
+	char lb_fnames[CAM_MAX_LB][64];
+};
 
-    return((ts.tv_sec * 1000000000) + ts.tv_nsec);
-}
-#endif
+static struct camera cams[MAX_CAMERAS];
+static struct pipeline pipes[MAX_CAMERAS];
+static int n_cams;
 
 /*
- *
+ * fname with suffix put in front of its extension
  */
-static int read_frame(int fd, void *buffer, int size) {
-	int total = 0, len;
-	while (total < size)
-	{
-		len = read(fd, buffer + total, size - total);
-		if (len == 0)
-			return 0;
-		total += len;
-	}
-	return 1;
+static void sink_file_name(char *buf, int size, const char *fname, const char *suffix)
+{
+	const char *ext = strrchr(fname, '.');
+	int len = ext ? ext - fname : (int)strlen(fname);
+
+	snprintf(buf, size, "%.*s%s%s", len, fname, suffix, ext ? ext : "");
 }
 
 /*
  *
  */
 int main(const int argc, const char **argv) {
-	int nframes_ps = 0;
 	int in = -1, out = -1;
-	int size_out;
 	char input_file[50] = "";
 	char output_file[50] = "";
-	int height, width;
-	int video_fd;
-	struct buffer *buffers;
-	static int n_buffers;
 	/* V4L2 */
 	enum v4l2_buf_type type;
-	struct v4l2_buffer buf;
-	int i, cnt;
+	int i, k, cnt, n_lb;
 	char mod_param[128];
+	char suffix[32];
 	int opt;
-	int cap_dev_pix_fmt =  v4l2_fourcc(DEF_PIX_FMT[0], DEF_PIX_FMT[1], DEF_PIX_FMT[2], DEF_PIX_FMT[3]);
-
-	width = DEF_VIDEO_W;
-	height = DEF_VIDEO_H;
-
-	while ((opt = getopt(argc, argv, "v:i:o:w:h:f:")) != -1) {
+	int serial = 0;
+	int lb_enabled = 1;
+	int zero_copy = 1;
+	unsigned long max_frames = 0;
+	enum cache_mode cache_mode = H264_CACHE_RANGE;
+	int csc_threads = 0;
+	int benchmark = 0;
+	int deadline_ms = 0;
+	int low_latency = 0;
+	int budget_ms = 0;
+	int sink_policy[2] = { -1, -1 };	/* raw and H264 sinks, -1 keeps th_start's */
+	int sink_block_ms[2] = { 0, 0 };
+	struct camera defaults, *cam;
+
+	memset(&defaults, 0, sizeof(defaults));
+	strcpy(defaults.dev, DEF_VIDEO_DEV);
+	defaults.width = DEF_VIDEO_W;
+	defaults.height = DEF_VIDEO_H;
+	defaults.pix_fmt = v4l2_fourcc(DEF_PIX_FMT[0], DEF_PIX_FMT[1], DEF_PIX_FMT[2], DEF_PIX_FMT[3]);
+	defaults.deint_mode = -1;
+	defaults.field_order = -1;
+	defaults.video_fd = -1;
+	defaults.streams[0].qp = 24;
+	defaults.streams[0].keyframe_interval = 25;
+	defaults.n_streams = 1;
+	/* the options before the first -v are every camera's, the ones after a -v that camera's */
+	cam = &defaults;
+
+	while ((opt = getopt(argc, (char * const *)argv, "v:i:o:w:h:f:r:c:SnMC:T:BE:R:D:X:m:t:s:P:q:g:e:d:lL:O:")) != -1) {
         switch (opt) {
             case 'v':
-                strcpy(VIDEO_DEV, optarg);
+                if (n_cams == MAX_CAMERAS) {
+                    printf("At most %d cameras\n", MAX_CAMERAS);
+                    exit(EXIT_FAILURE);
+                }
+                cams[n_cams] = defaults;
+                cam = &cams[n_cams++];
+                snprintf(cam->dev, sizeof(cam->dev), "%s", optarg);
                 break;
             case 'i':
                 strcpy(input_file, optarg);
@@ -168,22 +194,243 @@ int main(const int argc, const char **argv) {
                 strcpy(output_file, optarg);
                 break;
             case 'w':
-                width = atoi(optarg);
-                break;   
+                cam->width = atoi(optarg);
+                break;
             case 'h':
-                height = atoi(optarg);
-                break; 
+                cam->height = atoi(optarg);
+                break;
             case 'f':
-                cap_dev_pix_fmt = v4l2_fourcc(optarg[0], optarg[1], optarg[2], optarg[3]);
-                break;             
-                    
+                cam->pix_fmt = v4l2_fourcc(optarg[0], optarg[1], optarg[2], optarg[3]);
+                break;
+            case 'r':
+                snprintf(cam->replay_file, sizeof(cam->replay_file), "%s", optarg);
+                break;
+            case 'c':
+                max_frames = strtoul(optarg, NULL, 0);
+                break;
+            case 'S':
+                serial = 1;
+                break;
+            case 'n':
+                lb_enabled = 0;
+                break;
+            case 'M':
+                zero_copy = 0;
+                break;
+            case 'C':
+                if (strcmp(optarg, "full") == 0)
+                    cache_mode = H264_CACHE_FULL;
+                else if (strcmp(optarg, "uncached") == 0)
+                    cache_mode = H264_CACHE_UNCACHED;
+                else if (strcmp(optarg, "range") == 0)
+                    cache_mode = H264_CACHE_RANGE;
+                else {
+                    printf("Cache maintenance is range|full|uncached\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'T':
+                csc_threads = atoi(optarg);
+                break;
+            case 'B':
+                benchmark = 1;
+                break;
+            case 'E':
+                if (strcmp(optarg, "nv16") == 0)
+                    cam->enc_fmt = V4L2_PIX_FMT_NV16;
+                else
+                    cam->enc_fmt = V4L2_PIX_FMT_NV12;
+                break;
+            case 'R':
+                cam->raw_fmt = v4l2_fourcc(optarg[0], optarg[1], optarg[2], optarg[3]);
+                break;
+            case 'D':
+                if (strcmp(optarg, "auto") == 0)
+                    cam->deint_mode = -1;
+                else if ((cam->deint_mode = csc_deint_mode(optarg)) < 0) {
+                    printf("Unknown deinterlacing mode %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'X':
+                if (sscanf(optarg, "%dx%d+%d+%d", &cam->geom.crop_width, &cam->geom.crop_height,
+                           &cam->geom.crop_x, &cam->geom.crop_y) < 2) {
+                    printf("Crop is WIDTHxHEIGHT[+X+Y]\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                cam->geom.hflip = strchr(optarg, 'h') != NULL;
+                cam->geom.vflip = strchr(optarg, 'v') != NULL;
+                break;
+            case 't':
+                cam->geom.rotate = atoi(optarg);
+                break;
+            case 's':
+                if (sscanf(optarg, "%dx%d", &cam->geom.scale_width, &cam->geom.scale_height) != 2) {
+                    printf("Encoded size is WIDTHxHEIGHT\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                if (sscanf(optarg, "%dx%d", &cam->raw_width, &cam->raw_height) != 2) {
+                    printf("Raw loopback size is WIDTHxHEIGHT\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'q':
+                cam->streams[0].qp = atoi(optarg);
+                break;
+            case 'g':
+                cam->streams[0].keyframe_interval = atoi(optarg);
+                break;
+            case 'e':
+                /* QP and GOP left out follow the first stream */
+                if (cam->n_streams == ENC_MAX_STREAMS) {
+                    printf("At most %d encoder streams\n", ENC_MAX_STREAMS);
+                    exit(EXIT_FAILURE);
+                }
+                if (sscanf(optarg, "%dx%d:%u:%u", &cam->streams[cam->n_streams].geom.scale_width,
+                           &cam->streams[cam->n_streams].geom.scale_height, &cam->streams[cam->n_streams].qp,
+                           &cam->streams[cam->n_streams].keyframe_interval) < 2) {
+                    printf("Encoder stream is WIDTHxHEIGHT[:QP[:GOP]]\n");
+                    exit(EXIT_FAILURE);
+                }
+                cam->n_streams++;
+                break;
+            case 'd':
+                deadline_ms = atoi(optarg);
+                break;
+            case 'l':
+                low_latency = 1;
+                break;
+            case 'L':
+                budget_ms = atoi(optarg);
+                break;
+            case 'O': {
+                /* raw: or h264: for one kind of sink, both without */
+                const char *arg = optarg;
+                int first = 0, last = 1;
+
+                if (strncmp(arg, "raw:", 4) == 0) {
+                    arg += 4;
+                    last = 0;
+                } else if (strncmp(arg, "h264:", 5) == 0) {
+                    arg += 5;
+                    first = 1;
+                }
+                for (i = first; i <= last; i++) {
+                    sink_policy[i] = sink_policy_parse(arg, &sink_block_ms[i]);
+                    if (sink_policy[i] < 0) {
+                        printf("Sink policy is [raw:|h264:]oldest|newest|block:MS\n");
+                        exit(EXIT_FAILURE);
+                    }
+                }
+                break;
+            }
+
             default:
-                printf("Usage: %s -v videodev -i input file -o output file -w width -h height -f format\n", argv[0]);
+                printf("Usage: %s -v videodev -i input file -o output file -w width -h height -f format"
+                       " [-r raw capture file] [-c frames] [-S serial loop] [-n no loopback, sinks to files] [-M copy into MMAP loopback buffers]"
+                       " [-C range|full|uncached cache maintenance] [-T colour conversion threads] [-B benchmark]"
+                       " [-E nv12|nv16 encoder input] [-R raw loopback format]"
+                       " [-D auto|off|bob|blend|motion deinterlacing]"
+                       " [-X WxH+X+Y crop] [-m h|v|hv mirror] [-t 90|180|270 rotation]"
+                       " [-s WxH encoded size] [-P WxH raw loopback size]"
+                       " [-q QP] [-g keyframe interval] [-e WxH[:QP[:GOP]] another encoder stream]"
+                       " [-d ms VE deadline] [-l low latency, newest frame only] [-L ms latency budget]"
+                       " [-O [raw:|h264:]oldest|newest|block:MS full sink queue]"
+                       " [-v videodev ... another camera with its own -w -h -f -r -E -R -D -X -m -t -s -P -q -g -e]\n", argv[0]);
                 exit(0);
-                break;    
+                break;
         }
     }
 
+    if (benchmark) {
+        int errors = bench_csc(csc_threads);
+
+        errors += bench_h264_headers();
+        errors += bench_ve();
+        bench_cache();
+        exit(errors ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    if (n_cams == 0)
+        cams[n_cams++] = defaults;
+
+    /* every format pair is checked here, nothing is dropped later on */
+    for (k = 0, n_lb = 0; k < n_cams; k++) {
+        cam = &cams[k];
+        if (!cam->enc_fmt)
+            cam->enc_fmt = cam->pix_fmt == V4L2_PIX_FMT_NV16 ? V4L2_PIX_FMT_NV16 : V4L2_PIX_FMT_NV12;
+        if (!csc_find_conversion(cam->pix_fmt, cam->enc_fmt)) {
+            printf("No conversion from %c%c%c%c capture to the encoder input of %s\n",
+                   cam->pix_fmt & 0xff, (cam->pix_fmt >> 8) & 0xff,
+                   (cam->pix_fmt >> 16) & 0xff, (cam->pix_fmt >> 24) & 0xff, cam->dev);
+            exit(EXIT_FAILURE);
+        }
+
+        /* the first camera's loopbacks, numbered on for the others */
+        for (i = 0; i < N_LB_DEV; i++, n_lb++) {
+            struct pthr_start *s = &cam->sinks[i];
+
+            *s = th_start[i];
+            if (k) {
+                sprintf(cam->lb_names[i], "/dev/video%d", n_lb + LB_NAME_OFFSET);
+                sprintf(suffix, "_cam%d", k);
+                sink_file_name(cam->lb_fnames[i], sizeof(cam->lb_fnames[i]), th_start[i].fname, suffix);
+                s->lb_name = cam->lb_names[i];
+                s->fname = cam->lb_fnames[i];
+            }
+
+            if (s->lb_codec != SIMPLE_LB)
+                continue;
+            if (cam->raw_fmt)
+                s->pix_format = cam->raw_fmt;
+            if (s->pix_format != cam->pix_fmt &&
+                !csc_find_conversion(cam->pix_fmt, s->pix_format)) {
+                printf("No conversion from %c%c%c%c capture to %c%c%c%c for %s\n",
+                       cam->pix_fmt & 0xff, (cam->pix_fmt >> 8) & 0xff,
+                       (cam->pix_fmt >> 16) & 0xff, (cam->pix_fmt >> 24) & 0xff,
+                       s->pix_format & 0xff, (s->pix_format >> 8) & 0xff,
+                       (s->pix_format >> 16) & 0xff, (s->pix_format >> 24) & 0xff,
+                       s->lb_name);
+                exit(EXIT_FAILURE);
+            }
+        }
+        cam->n_lb = N_LB_DEV;
+
+        /* one more H264 loopback for each stream after the first, after the camera's own */
+        for (i = 1; i < cam->n_streams; i++, n_lb++) {
+            struct pthr_start *s = &cam->sinks[cam->n_lb];
+
+            *s = th_start[1];
+            sprintf(cam->lb_names[cam->n_lb], "/dev/video%d", n_lb + LB_NAME_OFFSET);
+            if (k)
+                sprintf(suffix, "_cam%d_%d", k, i);
+            else
+                sprintf(suffix, "_%d", i);
+            sink_file_name(cam->lb_fnames[cam->n_lb], sizeof(cam->lb_fnames[cam->n_lb]),
+                           th_start[1].fname, suffix);
+            s->lb_name = cam->lb_names[cam->n_lb];
+            s->stream = i;
+            s->fname = cam->lb_fnames[cam->n_lb];
+            cam->n_lb++;
+        }
+
+        /* -O for every camera's sinks of that kind */
+        for (i = 0; i < cam->n_lb; i++) {
+            struct pthr_start *s = &cam->sinks[i];
+            int kind = s->lb_codec == H264_LB;
+
+            if (sink_policy[kind] >= 0) {
+                s->policy = sink_policy[kind];
+                s->block_ms = sink_block_ms[kind];
+            }
+        }
+    }
+    printf("Colour conversion threads: %d\n", csc_set_threads(csc_threads));
+
     if (strlen(input_file) > 0) {
 	    if (strcmp(input_file, "-") != 0) {
 			if ((in = open(argv[1], O_RDONLY)) == -1) {
@@ -203,54 +450,233 @@ int main(const int argc, const char **argv) {
 		}
 	}
 
+	for (k = 0; k < n_cams; k++) {
+		struct pipeline *pipe = &pipes[k];
+
+		cam = &cams[k];
+		memset(pipe, 0, sizeof(*pipe));
+		pipe->replay_fd = -1;
+		pipe->name = cam->dev;
+
+		/* a raw packed 4:2:2 file stands in for the capture device */
+		if (strlen(cam->replay_file) > 0) {
+			if ((pipe->replay_fd = open(cam->replay_file, O_RDONLY)) == -1) {
+				printf("could not open replay file %s\n", cam->replay_file);
+				return EXIT_FAILURE;
+			}
+			if (n_cams == 1)
+				pipe->name = cam->replay_file;
+		}
+
 #if defined(USE_V4L_DEV)
-	open_capture_dev(VIDEO_DEV, &video_fd);
-	if (video_fd < 0) {
-		errno_exit("video device");
-	}
+		if (pipe->replay_fd < 0 && in < 0) {
+			open_capture_dev(cam->dev, &cam->video_fd);
+			if (cam->video_fd < 0) {
+				errno_exit("video device");
+			}
 
-	if (dev_try_format(video_fd,  width, height, cap_dev_pix_fmt)) {
-		printf("Incompattible capture pixel format!\n");
-		close(video_fd);
-        goto app_exit;
-	}
+			if (dev_try_format(cam->video_fd, cam->width, cam->height, cam->pix_fmt)) {
+				printf("Incompattible capture pixel format on %s!\n", cam->dev);
+				close(cam->video_fd);
+				goto app_exit;
+			}
+
+			setup_capture_device(cam->dev, cam->video_fd, &cam->width, &cam->height, 30, cam->pix_fmt);
+			pipe->cap_stride = dev_get_bytesperline(cam->video_fd);
+			cam->field_order = dev_get_field_order(cam->video_fd);
+		}
+#endif
+
+		/* analog TV decoders deliver both fields woven into one frame */
+		if (cam->deint_mode < 0)
+			cam->deint_mode = cam->field_order >= 0 ? CSC_DEINT_MOTION : CSC_DEINT_OFF;
+		if (cam->field_order >= 0)
+			printf("%s: interlaced capture, %s field first\n", pipe->name, cam->field_order ? "bottom" : "top");
+		if (cam->deint_mode != CSC_DEINT_OFF)
+			printf("%s: deinterlacing %s\n", pipe->name, csc_deint_name(cam->deint_mode));
+		csc_deint_init(&pipe->deint, cam->deint_mode, cam->field_order > 0 ? 1 : 0);
+
+		/* the raw loopbacks get the deinterlaced picture too, not every conversion makes one */
+		for (i = 0; cam->deint_mode != CSC_DEINT_OFF && i < cam->n_lb &&
+		            (cam->pix_fmt == V4L2_PIX_FMT_UYVY || cam->pix_fmt == V4L2_PIX_FMT_YUYV); i++) {
+			const struct csc_conversion *conv = csc_find_conversion(cam->pix_fmt, cam->sinks[i].pix_format);
+
+			if (cam->sinks[i].lb_codec != SIMPLE_LB || (conv && (conv->caps & CSC_CONV_DEINT)))
+				continue;
+			printf("%s can't be deinterlaced in %c%c%c%c, use -R NV12, NV16, YU12 or YV12, or -D off\n",
+			       cam->sinks[i].lb_name,
+			       cam->sinks[i].pix_format & 0xff, (cam->sinks[i].pix_format >> 8) & 0xff,
+			       (cam->sinks[i].pix_format >> 16) & 0xff, (cam->sinks[i].pix_format >> 24) & 0xff);
+			exit(EXIT_FAILURE);
+		}
 
-    setup_capture_device(VIDEO_DEV, video_fd, &width, &height, 30, cap_dev_pix_fmt);
-    buffers = init_capt_mmap(VIDEO_DEV, video_fd, &n_buffers);
-#endif	
+		/*
+		 * every stream gets the picture after crop, scaling, mirror and rotation,
+		 * the ones added by -e the first one's crop, mirror and rotation at their own size
+		 */
+		for (i = 0; i < cam->n_streams; i++) {
+			struct enc_stream *st = &cam->streams[i];
+
+			if (i) {
+				int sw = st->geom.scale_width, sh = st->geom.scale_height;
+
+				st->geom = cam->geom;
+				st->geom.scale_width = sw;
+				st->geom.scale_height = sh;
+				if (!st->qp)
+					st->qp = cam->streams[0].qp;
+				if (!st->keyframe_interval)
+					st->keyframe_interval = cam->streams[0].keyframe_interval;
+			} else {
+				st->geom = cam->geom;
+			}
+
+			st->width = cam->width;
+			st->height = cam->height;
+			if (!csc_geometry_active(&st->geom))
+				continue;
+			if (cam->pix_fmt != V4L2_PIX_FMT_UYVY && cam->pix_fmt != V4L2_PIX_FMT_YUYV) {
+				printf("Crop, scaling, mirror and rotation need a YUYV or UYVY capture\n");
+				exit(EXIT_FAILURE);
+			}
+			if (csc_geometry_size(&st->geom, cam->width, cam->height, &st->width, &st->height) < 0) {
+				printf("Crop, size or rotation does not fit the %dx%d capture of %s\n",
+				       cam->width, cam->height, pipe->name);
+				exit(EXIT_FAILURE);
+			}
+			printf("%s stream %d: encoding %dx%d+%d+%d of the picture at %dx%d%s%s, rotated by %d\n",
+			       pipe->name, i,
+			       st->geom.crop_width, st->geom.crop_height, st->geom.crop_x, st->geom.crop_y,
+			       st->geom.scale_width, st->geom.scale_height,
+			       st->geom.hflip ? ", mirrored" : "", st->geom.vflip ? ", upside down" : "", st->geom.rotate);
+		}
+
+		/* raw loopbacks downscaled on their own, from the whole captured picture */
+		for (i = 0; (cam->raw_width || cam->raw_height) && i < cam->n_lb; i++) {
+			struct csc_geometry *g = &cam->sinks[i].geom;
+			const struct csc_conversion *conv;
+
+			if (cam->sinks[i].lb_codec != SIMPLE_LB)
+				continue;
+			g->scale_width = cam->raw_width;
+			g->scale_height = cam->raw_height;
+			if (cam->pix_fmt != V4L2_PIX_FMT_UYVY && cam->pix_fmt != V4L2_PIX_FMT_YUYV) {
+				printf("Raw loopback scaling needs a YUYV or UYVY capture\n");
+				exit(EXIT_FAILURE);
+			}
+			/* only the frame conversions scale, a copy or a per pixel one would overrun the sink */
+			conv = csc_find_conversion(cam->pix_fmt, cam->sinks[i].pix_format);
+			if (!conv || !(conv->caps & CSC_CONV_GEOM)) {
+				printf("%s can't be scaled in %c%c%c%c, use -R NV12, NV16, YU12 or YV12\n",
+				       cam->sinks[i].lb_name,
+				       cam->sinks[i].pix_format & 0xff, (cam->sinks[i].pix_format >> 8) & 0xff,
+				       (cam->sinks[i].pix_format >> 16) & 0xff, (cam->sinks[i].pix_format >> 24) & 0xff);
+				exit(EXIT_FAILURE);
+			}
+			if (csc_geometry_size(g, cam->width, cam->height, NULL, NULL) < 0) {
+				printf("Raw loopback size %dx%d does not fit the %dx%d capture\n",
+				       cam->raw_width, cam->raw_height, cam->width, cam->height);
+				exit(EXIT_FAILURE);
+			}
+			printf("%s at %dx%d\n", cam->sinks[i].lb_name, g->scale_width, g->scale_height);
+		}
+	}
 
 	struct h264enc_params params;
-	params.src_width = (width + 15) & ~15;
-	params.width = width;
-	params.src_height = (height + 15) & ~15;
-	params.height = height;
-	params.src_format = H264_FMT_NV12;
 	params.profile_idc = 77;
 	params.level_idc = 41;
 	params.entropy_coding_mode = H264_EC_CABAC;
-	params.qp = 24;
-	params.keyframe_interval = 25;
 	params.work_mode = ENC_MODE_STREAMING;
+	params.input_buffers = ENC_INPUT_BUFFERS;
+	params.bytestream_buffers = ENC_OUTPUT_BUFFERS;
+	params.cache_mode = cache_mode;
 
 	if (!ve_open()) {
 		printf("Failed to open CedarX device %s\n", "/dev/cedar_dev");
 		return EXIT_FAILURE;
 	}
 
-	h264enc *encoder = h264enc_new(&params);
+	/* each encoder of every camera has its own buffers and reference pictures, they take turns on the VE */
+	for (k = 0; k < n_cams; k++) {
+		cam = &cams[k];
+		params.src_format = (cam->enc_fmt == V4L2_PIX_FMT_NV16) ? H264_FMT_NV16 : H264_FMT_NV12;
+
+		for (i = 0; i < cam->n_streams; i++) {
+			struct enc_stream *st = &cam->streams[i];
+
+			params.src_width = (st->width + 15) & ~15;
+			params.width = st->width;
+			params.src_height = (st->height + 15) & ~15;
+			params.height = st->height;
+			params.qp = st->qp;
+			params.keyframe_interval = st->keyframe_interval;
+			/* the first stream is the live one, the others give way and skip frames they are late for */
+			params.priority = i ? 0 : 1;
+			params.late_policy = i ? VE_LATE_DROP : VE_LATE_RUN;
+
+			st->encoder = h264enc_new(&params);
+			if (st->encoder == NULL) {
+				printf("could not create encoder\n");
+				goto err;
+			}
+			printf("H264 encoder initialized for %s: %dx%d, QP %u, keyframe every %u frames\n",
+			       pipes[k].name, st->width, st->height, st->qp, st->keyframe_interval);
+		}
+	}
+	printf("Colour conversion kernels: %s\n", csc_get_kernels()->isa);
+
+	for (k = 0; k < n_cams; k++) {
+		struct pipeline *pipe = &pipes[k];
+		int width, height;
+
+		cam = &cams[k];
+		width = cam->width;
+		height = cam->height;
+		if (cam->video_fd < 0)
+			continue;
+
+		/*
+		 * NV12/NV16 in the VE's stride is captured straight into VE memory.
+		 * The VE still reads whole macroblock rows below the picture, so the
+		 * buffers get that much slack after the chroma.
+		 */
+		if (cam->pix_fmt == cam->enc_fmt && cam->n_streams == 1 &&
+				(width & 15) == 0 && (pipe->cap_stride == 0 || pipe->cap_stride == width)) {
+			int frame_size = width * height * (cam->pix_fmt == V4L2_PIX_FMT_NV12 ? 3 : 4) / 2;
+			int slack = width * (((height + 15) & ~15) - height);
+			struct buffer *buffers = calloc(V4L2MMAP_NBBUFFER, sizeof(*buffers));
+
+			for (i = 0; buffers && i < V4L2MMAP_NBBUFFER; i++) {
+				buffers[i].length = frame_size;
+				buffers[i].start = ve_malloc(frame_size + slack);
+				if (!buffers[i].start)
+					break;
+			}
 
-	if (encoder == NULL) {
-		printf("could not create encoder\n");
-		goto err;
-	} else {
-		printf("H264 encoder initialized: %dx%d\n", width, height);
+			if (buffers && i == V4L2MMAP_NBBUFFER &&
+					init_capt_userptr(cam->dev, cam->video_fd, buffers, V4L2MMAP_NBBUFFER) == 0) {
+				printf("Capturing %s directly into VE memory\n", cam->dev);
+				cam->buffers = buffers;
+				cam->n_buffers = V4L2MMAP_NBBUFFER;
+				pipe->cap_memory = V4L2_MEMORY_USERPTR;
+				pipe->direct = 1;
+			} else if (buffers) {
+				while (i--)
+					ve_free(buffers[i].start);
+				free(buffers);
+			}
+		}
+
+		if (!pipe->direct)
+			cam->buffers = init_capt_mmap(cam->dev, cam->video_fd, &cam->n_buffers);
 	}
 
+	h264enc *encoder = cams[0].streams[0].encoder;
 	void* output_buf = h264enc_get_bytestream_buffer(encoder);
 
-	int input_size = params.src_width * (params.src_height + params.src_height / 2);
+	int input_size = ((cams[0].streams[0].width + 15) & ~15) * ((cams[0].streams[0].height + 15) & ~15) *
+	                 (cams[0].enc_fmt == V4L2_PIX_FMT_NV16 ? 2 : 3) / 2;
 	void* input_buf = h264enc_get_input_buffer(encoder);
-	size_out = ((width) * (height) * 12 / 8);
 
 	if (in > 0 && out > 0) {
 		printf("Runnig h264 encoding from file %s...\n", input_file);
@@ -265,201 +691,151 @@ int main(const int argc, const char **argv) {
 		goto complete;
 	}
 
-#if defined(USE_V4L_DEV)
-	printf("Runnig h264 encoding from V4L device %s...\n", VIDEO_DEV);
-	// rmmod
-    remove_mod(LB_DRV_NAME);
-    cnt = sprintf(mod_param, "video_nr=");
-    for (i = 0;i < N_LB_DEV;i++) {
-        if (i != 0) {
-            strcat(mod_param, ",");
-            cnt++;
-        }
-        cnt += sprintf(mod_param + cnt, "%d", i + LB_NAME_OFFSET);
-    }
-    // insmod
-    init_mod("//usr//lib//"LB_DRV_NAME".ko", mod_param);
-
-    for (i = 0;i < N_LB_DEV;i++) {
-    	th_start[i].lb_w = width;
-        th_start[i].lb_h = height;
-    	open_out_dev(th_start[i].lb_name, width, height, th_start[i].lb_codec, &th_start[i].lb_fd, th_start[i].pix_format);
-    	th_start[i].lb_pbuf = init_out_mmap(&th_start[i].lb_fd, &th_start[i].lb_nbuf);
-
-    	if (!th_start[i].lb_pbuf) {
-            printf("No buffers for %s\n", th_start[i].lb_name);
-            exit(EXIT_FAILURE);
-        }
+	for (k = 0; k < n_cams; k++) {
+		if (pipes[k].replay_fd >= 0)
+			printf("Runnig h264 encoding from raw file %s...\n", cams[k].replay_file);
+		else
+			printf("Runnig h264 encoding from V4L device %s...\n", cams[k].dev);
+	}
 
-        /* open the file for writing codec bitstream */
-        if (th_start[i].tofile == 1) {
-            th_start[i].file_fd = open(th_start[i].fname, O_WRONLY | O_CREAT | O_TRUNC, 0755);
-            if (-1 == th_start[i].file_fd) {
-                printf("Failed to open file for writing %s\n", th_start[i].fname);
-                exit(EXIT_FAILURE);
-            }
-        }
-    }
+	/* one module load for the loopbacks of every camera */
+	if (lb_enabled) {
+		// rmmod
+	    remove_mod(LB_DRV_NAME);
+	    cnt = sprintf(mod_param, "video_nr=");
+	    for (i = 0;i < n_lb;i++) {
+	        if (i != 0) {
+	            strcat(mod_param, ",");
+	            cnt++;
+	        }
+	        cnt += sprintf(mod_param + cnt, "%d", i + LB_NAME_OFFSET);
+	    }
+	    // insmod
+	    init_mod("//usr//lib//"LB_DRV_NAME".ko", mod_param);
+	}
 
-    /* start capture */
-    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    if (-1 == xioctl(video_fd, VIDIOC_STREAMON, &type))
-        errno_exit("VIDIOC_STREAMON");
-
-    
-    while (1) {
-        fd_set fds;
-        struct timeval tv;
-        int r;
-#ifdef USE_FPS_MEASUREMENT
-        struct timespec tm[2];
-        clock_gettime(CLOCK_MONOTONIC, &tm[0]);
-#endif        
-
-        FD_ZERO(&fds);
-        FD_SET(video_fd, &fds);
-
-        /* Timeout. */
-        tv.tv_sec = 2;
-        tv.tv_usec = 0;
-
-        r = select(video_fd + 1, &fds, NULL, NULL, &tv);
-        if (-1 == r) {
-            if (EINTR == errno)  
-                continue;
-            
-            errno_exit("select");
-        }
-        if (0 == r) {
-            fprintf(stderr, "select timeout\n");
-            exit(EXIT_FAILURE);
-        }
+	for (k = 0; k < n_cams; k++) {
+		cam = &cams[k];
+	    for (i = 0;i < cam->n_lb;i++) {
+	        struct pthr_start *s = &cam->sinks[i];
+	        /* raw loopbacks carry the captured picture (or its -P size), H264 their stream's */
+	        int is_h264 = s->lb_codec == H264_LB;
+	        int scaled = csc_geometry_active(&s->geom);
+
+	    	s->lb_w = is_h264 ? cam->streams[s->stream].width : scaled ? s->geom.scale_width : cam->width;
+	        s->lb_h = is_h264 ? cam->streams[s->stream].height : scaled ? s->geom.scale_height : cam->height;
+
+	        if (lb_enabled) {
+		    	open_out_dev(s->lb_name, s->lb_w, s->lb_h, s->lb_codec, &s->lb_fd, s->pix_format);
+		    	/* raw sinks that have to convert write straight into MMAP buffers */
+		    	int zc = zero_copy && (s->lb_codec == H264_LB ||
+		    	                       (s->pix_format == cam->pix_fmt && !scaled));
+
+		    	if (sink_setup_output(s, zc) < 0) {
+		            printf("No buffers for %s\n", s->lb_name);
+		            exit(EXIT_FAILURE);
+		        }
+		    } else {
+		    	/* file-backed stand-in for the loopback device */
+		    	s->tofile = 1;
+		    }
+
+	        /* open the file for writing codec bitstream */
+	        if (s->tofile == 1) {
+	            s->file_fd = open(s->fname, O_WRONLY | O_CREAT | O_TRUNC, 0755);
+	            if (-1 == s->file_fd) {
+	                printf("Failed to open file for writing %s\n", s->fname);
+	                exit(EXIT_FAILURE);
+	            }
+	        }
+	    }
+	}
 
-        /* dequeue captured buffer */
-        CLEAR(buf);
-        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        buf.memory = V4L2_MEMORY_MMAP;
-        if (-1 == xioctl(video_fd, VIDIOC_DQBUF, &buf)) {
-            if (errno == EAGAIN) {
-                //printf("EAGAIN\n");
-                continue;
-            }
-            errno_exit("VIDIOC_DQBUF");
-        }
-        assert(buf.index < n_buffers);
-
-        for (i = 0;i < N_LB_DEV;i++) {
-        	int len = 0;
-        	void *pb = NULL;
-
-        	if (th_start[i].lb_codec == H264_LB) {  
-#if defined(CPU_HAS_NEON) 		        	
-        			int src_stride = width*2;
-        			int dst_stride_y = width;
-        			int dst_stride_uv = width;
-        			int uv_offset = width*height;
-#endif        			        	 
-        		if (cap_dev_pix_fmt == V4L2_PIX_FMT_UYVY) {		
-#if defined(CPU_HAS_NEON) 		        	
-        			UYVYToNV12_neon(buffers[buf.index].start, src_stride,
-		               		   input_buf, dst_stride_y,
-		               		   input_buf + uv_offset, dst_stride_uv,
-		                       width, height);
-#else
-        			uyvy422toNV12(width, height, buffers[buf.index].start, input_buf);
-#endif        			
-		    	} else if (cap_dev_pix_fmt == V4L2_PIX_FMT_YUYV) {
-#if defined(CPU_HAS_NEON) 
-		    		YUYVToNV12_neon(buffers[buf.index].start, src_stride,
-		               		   input_buf, dst_stride_y,
-		               		   input_buf + uv_offset, dst_stride_uv,
-		                       width, height);
-#else		    		
-		    		yuyv422toNV12(width, height, buffers[buf.index].start, input_buf);
-#endif
-		    	} else {
-		    		continue;
-		    	}
-   		
-        		if (h264enc_encode_picture(encoder)) {       			
-					len = h264enc_get_bytestream_length(encoder);
-					pb = output_buf;
-				} 	
-
-				wrt_to_lpbck(th_start[i].lb_fd, 
-							  pb,
-							  len, 
-							  n_buffers, 
-							  th_start[i].lb_pbuf);
-
-        	} else if (th_start[i].lb_codec == SIMPLE_LB) {
-        		struct v4l2_buffer dev_ibuf;
-    			CLEAR(dev_ibuf);
-        		pb = obtain_lbck_current_input_buf(th_start[i].lb_fd, n_buffers, th_start[i].lb_pbuf, &dev_ibuf);
-
-        		if (th_start[i].pix_format == cap_dev_pix_fmt) {
-        			len = buf.bytesused;
-        			memcpy(pb, buffers[buf.index].start, len);
-        		} else {
-#if defined(CPU_HAS_NEON)        			
-        			int src_stride = width*2;
-        			int dst_stride_y = width;
-        			int dst_stride_uv = width/2;
-        			int u_offset = width*height;
-        			int v_offset = u_offset + (u_offset/4);
-
-        			UYVYTo420P_neon(buffers[buf.index].start, src_stride,
-		               		   pb, dst_stride_y,
-		               		   pb + u_offset, dst_stride_uv,
-		               		   pb + v_offset, dst_stride_uv,
-		                       width, height);
-
-        		}
-#else 
-        		uyvy422to420(width, height, buffers[buf.index].start, pb);
-#endif
-				len = size_out;				
-				write_current_input_buf_to_lbck(th_start[i].lb_fd, &dev_ibuf, len);
-			}
-			
-			if (th_start[i].tofile == 1) {
-				write(th_start[i].file_fd, pb, len);
-			}
-        }
+	for (k = 0; k < n_cams; k++) {
+		struct pipeline *pipe = &pipes[k];
+
+		cam = &cams[k];
+		pipe->video_fd = cam->video_fd;
+		pipe->buffers = cam->buffers;
+		pipe->n_buffers = cam->n_buffers;
+		pipe->width = cam->width;
+		pipe->height = cam->height;
+		pipe->pix_fmt = cam->pix_fmt;
+		pipe->enc_fmt = cam->enc_fmt;
+		pipe->lb_enabled = lb_enabled;
+		pipe->max_frames = max_frames;
+		pipe->deadline_ms = deadline_ms;
+		pipe->latest = low_latency;
+		pipe->budget_ms = budget_ms;
+		pipe->streams = cam->streams;
+		pipe->n_streams = cam->n_streams;
+		pipe->n_jobs = ENC_INPUT_BUFFERS;
+		pipe->n_packets = ENC_OUTPUT_BUFFERS;
+		pipe->sinks = cam->sinks;
+		pipe->n_sinks = cam->n_lb;
+
+		if (pipeline_init(pipe) < 0) {
+			printf("could not set up the pipeline of %s\n", pipe->name);
+			exit(EXIT_FAILURE);
+		}
+	}
 
-#ifdef USE_FPS_MEASUREMENT
-            /* measure fps of the capture device */
-            clock_gettime(CLOCK_MONOTONIC, &tm[1]);
+	for (k = 0; k < n_cams; k++) {
+		if (pipes[k].replay_fd >= 0)
+			continue;
+	    /* start capture */
+	    type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	    if (-1 == xioctl(cams[k].video_fd, VIDIOC_STREAMON, &type))
+	        errno_exit("VIDIOC_STREAMON");
+	}
 
-            int dt_ms = (time_diff(&tm[0], &tm[1])) / 1000000;
-            if (dt_ms >= 1000) {
-                printf("CAPTURE FPS: %d\n",nframes_ps);
-                nframes_ps = 0;
-            }
-#endif
-        /* queue buffer */
-        if (-1 == xioctl(video_fd, VIDIOC_QBUF, &buf))
-            errno_exit("VIDIOC_QBUF");
+	if (serial) {
+		pipeline_run_serial(pipes, n_cams);
+		pipeline_report(pipes, n_cams, "serial");
+	} else {
+		pipeline_run_threaded(pipes, n_cams);
+		pipeline_report(pipes, n_cams, "threaded");
+	}
 
-        nframes_ps++;
-    }
+	struct ve_mem_stats mem;
+	ve_mem_stats(&mem);
+	printf("VE memory: %u of %u KiB used in %d allocations, peak %u KiB, largest free %u KiB, fragmentation %d%%\n",
+	    mem.used / 1024, mem.total / 1024, mem.allocations, mem.peak / 1024,
+	    mem.largest_free / 1024, mem.fragmentation);
 
 	printf("Done!\n");
-	for (i = 0;i < N_LB_DEV;i++) {
-        uninit_out_mmap(th_start[i].lb_fd, th_start[i].lb_pbuf, th_start[i].lb_nbuf);
-        
-        if (th_start[i].tofile == 1) {
-            close(th_start[i].file_fd);
-        }
-    }
-#endif	
+	for (k = 0; k < n_cams; k++) {
+		cam = &cams[k];
+		for (i = 0;i < cam->n_lb;i++) {
+			if (lb_enabled)
+		        sink_release_output(&pipes[k], &cam->sinks[i]);
+
+	        if (cam->sinks[i].tofile == 1) {
+	            close(cam->sinks[i].file_fd);
+	        }
+	    }
+
+		pipeline_free(&pipes[k]);
+
+		if (pipes[k].direct) {
+			for (i = 0;i < cam->n_buffers;i++)
+				ve_free(cam->buffers[i].start);
+			free(cam->buffers);
+		}
+	}
 
 complete:
-	h264enc_free(encoder);
-
 err:
+	for (k = 0; k < n_cams; k++)
+		for (i = 0; i < cams[k].n_streams; i++)
+			if (cams[k].streams[i].encoder)
+				h264enc_free(cams[k].streams[i].encoder);
+
 	ve_close();
-app_exit:    
+app_exit:
+	for (k = 0; k < n_cams; k++)
+		if (pipes[k].replay_fd >= 0)
+			close(pipes[k].replay_fd);
 	close(out);
 	close(in);
 
@@ -0,0 +1,1832 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/select.h>
+#include <sys/resource.h>
+#include <linux/videodev2.h>
+
+#include "pipeline.h"
+#include "csc.h"
+#include "ve.h"
+
+//#define USE_FPS_MEASUREMENT
+
+#define SINK_QUEUE_DEPTH    1   /* frames waiting for a sink besides the one it writes, each pins a buffer */
+#define SINK_STALL_MS       500 /* a device that takes nothing for this long is not waited for again */
+#define SINK_POLL_MS        5
+
+/*
+ *
+ */
+int fq_init(struct frame_queue *q, int size) {
+    memset(q, 0, sizeof(*q));
+    q->slot = calloc(size, sizeof(void *));
+    if (!q->slot)
+        return -1;
+    q->size = size;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->not_empty, NULL);
+    pthread_cond_init(&q->not_full, NULL);
+    return 0;
+}
+
+/*
+ *
+ */
+void fq_destroy(struct frame_queue *q) {
+    if (!q->slot)
+        return;
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->not_empty);
+    pthread_cond_destroy(&q->not_full);
+    free(q->slot);
+    q->slot = NULL;
+}
+
+/*
+ * called locked, fails with FQ_CLOSED once the queue is closed and
+ * FQ_FULL while it is full
+ */
+static int fq_put(struct frame_queue *q, void *item) {
+    if (q->closed)
+        return FQ_CLOSED;
+    if (q->count == q->size)
+        return FQ_FULL;
+    q->slot[(q->head + q->count) % q->size] = item;
+    q->count++;
+    pthread_cond_signal(&q->not_empty);
+    return 0;
+}
+
+/*
+ * blocks while the queue is full, fails once it is closed
+ */
+int fq_push(struct frame_queue *q, void *item) {
+    int ret;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->size && !q->closed)
+        pthread_cond_wait(&q->not_full, &q->lock);
+    ret = fq_put(q, item);
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+/*
+ * fails right away when the queue is full, FQ_FULL or FQ_CLOSED
+ */
+int fq_trypush(struct frame_queue *q, void *item) {
+    int ret;
+
+    pthread_mutex_lock(&q->lock);
+    ret = fq_put(q, item);
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+/*
+ * blocks up to timeout_ms while the queue is full
+ */
+int fq_push_timed(struct frame_queue *q, void *item, int timeout_ms) {
+    struct timespec until;
+    int ret;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->size && !q->closed)
+        if (pthread_cond_timedwait(&q->not_full, &q->lock, &until) == ETIMEDOUT)
+            break;
+    ret = fq_put(q, item);
+    pthread_mutex_unlock(&q->lock);
+    return ret;
+}
+
+/*
+ * blocks while the queue is empty, returns NULL once it is closed and drained
+ */
+void *fq_pop(struct frame_queue *q) {
+    void *item = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait(&q->not_empty, &q->lock);
+    if (q->count > 0) {
+        item = q->slot[q->head];
+        q->head = (q->head + 1) % q->size;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+/*
+ * NULL right away when the queue is empty
+ */
+void *fq_trypop(struct frame_queue *q) {
+    void *item = NULL;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0) {
+        item = q->slot[q->head];
+        q->head = (q->head + 1) % q->size;
+        q->count--;
+        pthread_cond_signal(&q->not_full);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return item;
+}
+
+/*
+ *
+ */
+int fq_count(struct frame_queue *q) {
+    int count;
+
+    pthread_mutex_lock(&q->lock);
+    count = q->count;
+    pthread_mutex_unlock(&q->lock);
+    return count;
+}
+
+/*
+ *
+ */
+void fq_close(struct frame_queue *q) {
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->not_empty);
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ *
+ */
+int read_frame(int fd, void *buffer, int size) {
+    int total = 0, len;
+    while (total < size)
+    {
+        len = read(fd, buffer + total, size - total);
+        if (len <= 0)
+            return 0;
+        total += len;
+    }
+    return 1;
+}
+
+static uint64_t elapsed_us(struct timespec *from, struct timespec *to) {
+    return (uint64_t)(to->tv_sec - from->tv_sec) * 1000000 +
+           (to->tv_nsec - from->tv_nsec) / 1000;
+}
+
+/*
+ * user plus system time of the whole process
+ */
+static uint64_t cpu_time_us(void) {
+    struct rusage ru;
+
+    getrusage(RUSAGE_SELF, &ru);
+    return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+/*
+ * size of one frame in the capture format
+ */
+static int frame_bytes(struct pipeline *p) {
+    return csc_frame_size(p->pix_fmt, p->width, p->height);
+}
+
+/*
+ * a frame just taken from the camera or the replay file
+ */
+static void capture_stamp(struct pipeline *p, struct cap_frame *f) {
+#ifdef USE_FPS_MEASUREMENT
+    static struct timespec tm;
+    static int nframes_ps;
+#endif
+
+    clock_gettime(CLOCK_MONOTONIC, &f->ts);
+    p->cap_last = f->ts;
+    p->captured++;
+
+#ifdef USE_FPS_MEASUREMENT
+    /* measure fps of the capture device */
+    nframes_ps++;
+    if (elapsed_us(&tm, &f->ts) >= 1000000) {
+        printf("CAPTURE FPS: %d\n", nframes_ps);
+        nframes_ps = 0;
+        tm = f->ts;
+    }
+#endif
+}
+
+/*
+ * fill a free buffer from the replay file standing in for the camera, 0 at its end
+ */
+static int capture_replay(struct pipeline *p, struct cap_frame *f) {
+    if (!read_frame(p->replay_fd, f->data, frame_bytes(p)))
+        return 0;
+    f->buf.bytesused = frame_bytes(p);
+    capture_stamp(p, f);
+    return 1;
+}
+
+/*
+ *
+ */
+static void capture_put(struct pipeline *p, struct cap_frame *f) {
+    if (p->replay_fd >= 0) {
+        fq_push(&p->cap_free, f);
+        return;
+    }
+
+    if (-1 == xioctl(p->video_fd, VIDIOC_QBUF, &f->buf))
+        errno_exit("VIDIOC_QBUF");
+}
+
+/*
+ * another buffer done by the driver, without waiting for it
+ */
+static int capture_ready(int fd) {
+    struct timeval tv = { 0, 0 };
+    fd_set fds;
+
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    return select(fd + 1, &fds, NULL, NULL, &tv) > 0;
+}
+
+/*
+ * frame of a camera select() found ready, NULL when the driver had none
+ * after all. In low-latency mode every buffer the driver has done is
+ * taken and all but the newest go straight back to it.
+ */
+static struct cap_frame *capture_dequeue(struct pipeline *p) {
+    struct v4l2_buffer buf;
+    struct cap_frame *f = NULL;
+
+    do {
+        /* dequeue captured buffer */
+        CLEAR(buf);
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = p->cap_memory;
+        if (-1 == xioctl(p->video_fd, VIDIOC_DQBUF, &buf)) {
+            if (errno == EAGAIN)
+                break;
+            errno_exit("VIDIOC_DQBUF");
+        }
+
+        if (buf.index >= p->n_buffers) {
+            fprintf(stderr, "VIDIOC_DQBUF: bad buffer index %d\n", buf.index);
+            exit(EXIT_FAILURE);
+        }
+        if (f) {
+            capture_put(p, f);
+            pthread_mutex_lock(&p->ref_lock);
+            p->stale++;
+            pthread_mutex_unlock(&p->ref_lock);
+        }
+        f = &p->frames[buf.index];
+        f->buf = buf;
+    } while (p->latest && capture_ready(p->video_fd));
+
+    if (f)
+        capture_stamp(p, f);
+    return f;
+}
+
+static void capture_end(struct pipeline *p, void (*on_end)(struct pipeline *)) {
+    p->cap_done = 1;
+    on_end(p);
+}
+
+/*
+ * the one event loop over every camera. Frames go to on_frame as they
+ * arrive, a camera that has delivered its last one goes to on_end. The
+ * replay files are always ready, they only wait for a buffer to come back,
+ * and a camera without a frame for 2 s is stopped.
+ */
+static void capture_loop(struct pipeline *p, int n,
+                         void (*on_frame)(struct pipeline *, struct cap_frame *),
+                         void (*on_end)(struct pipeline *)) {
+    struct pipeline *c;
+    struct cap_frame *f;
+    struct timespec now;
+    struct timeval tv;
+    fd_set fds;
+    int i, r, live, maxfd, ready, waiting;
+
+    for (i = 0; i < n; i++) {
+        p[i].cap_done = 0;
+        p[i].cap_last = p[i].t_start;
+    }
+
+    while (1) {
+        FD_ZERO(&fds);
+        maxfd = -1;
+        live = ready = waiting = 0;
+
+        for (i = 0; i < n; i++) {
+            c = &p[i];
+            if (c->cap_done)
+                continue;
+            if (c->max_frames && c->captured >= c->max_frames) {
+                capture_end(c, on_end);
+                continue;
+            }
+            live++;
+
+            if (c->replay_fd < 0) {
+                FD_SET(c->video_fd, &fds);
+                if (c->video_fd > maxfd)
+                    maxfd = c->video_fd;
+                continue;
+            }
+
+            f = fq_trypop(&c->cap_free);
+            if (!f) {
+                waiting++;
+            } else if (capture_replay(c, f)) {
+                on_frame(c, f);
+                ready++;
+            } else {
+                capture_end(c, on_end);
+            }
+        }
+
+        if (!live)
+            break;
+
+        /* only replay files left and all of them out of buffers, wait for the first */
+        if (maxfd < 0) {
+            if (ready || !waiting)
+                continue;
+            for (i = 0; p[i].cap_done; i++)
+                ;
+            c = &p[i];
+            f = fq_pop(&c->cap_free);
+            if (f && capture_replay(c, f))
+                on_frame(c, f);
+            else
+                capture_end(c, on_end);
+            continue;
+        }
+
+        /* replay files with frames to read are not held up by the cameras */
+        tv.tv_sec = ready || waiting ? 0 : 2;
+        tv.tv_usec = !ready && waiting ? 2000 : 0;
+
+        r = select(maxfd + 1, &fds, NULL, NULL, &tv);
+        if (-1 == r) {
+            if (EINTR == errno)
+                continue;
+
+            errno_exit("select");
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        for (i = 0; i < n; i++) {
+            c = &p[i];
+            if (c->cap_done || c->replay_fd >= 0)
+                continue;
+
+            if (FD_ISSET(c->video_fd, &fds)) {
+                f = capture_dequeue(c);
+                if (f)
+                    on_frame(c, f);
+            } else if (elapsed_us(&c->cap_last, &now) >= 2000000) {
+                fprintf(stderr, "%s: select timeout\n", c->name);
+                capture_end(c, on_end);
+            }
+        }
+    }
+}
+
+/*
+ * older than the latency budget, not worth converting any more
+ */
+static int frame_late(struct pipeline *p, struct cap_frame *f) {
+    struct timespec now;
+
+    if (!p->budget_ms)
+        return 0;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return elapsed_us(&f->ts, &now) > (uint64_t)p->budget_ms * 1000;
+}
+
+/*
+ * hand the capture buffer back once its last consumer is done
+ */
+static void frame_release(struct pipeline *p, struct cap_frame *f) {
+    int refs;
+
+    pthread_mutex_lock(&p->ref_lock);
+    refs = --f->refs;
+    pthread_mutex_unlock(&p->ref_lock);
+
+    if (refs == 0)
+        capture_put(p, f);
+}
+
+/*
+ * low latency: a frame waiting in a queue is dropped for the newer one
+ * queued behind it, refs is what the queue's consumer holds of it. At
+ * most a queue's worth, a replay file refills it as fast as it drains.
+ */
+static void *queue_latest(struct pipeline *p, struct frame_queue *q, void *item, int refs,
+                          unsigned long *dropped) {
+    void *newer;
+    int n, i;
+
+    for (n = 0; item && p->latest && n < q->size && (newer = fq_trypop(q)); n++) {
+        pthread_mutex_lock(&p->ref_lock);
+        (*dropped)++;
+        pthread_mutex_unlock(&p->ref_lock);
+        for (i = 0; i < refs; i++)
+            frame_release(p, item);
+        item = newer;
+    }
+    return item;
+}
+
+/*
+ *
+ */
+static void sink_done(struct pthr_start *s, struct timespec *ts) {
+    struct timespec now;
+    uint64_t lat;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    lat = elapsed_us(ts, &now);
+
+    s->frames++;
+    s->lat_sum_us += lat;
+    if (lat > s->lat_max_us)
+        s->lat_max_us = lat;
+}
+
+/*
+ * NV12/NV16 capture frame already in VE memory, encoded in place
+ */
+static void frame_phys(struct pipeline *p, struct cap_frame *f, uint32_t *luma, uint32_t *chroma) {
+    *luma = ve_virt2phys(f->data);
+    *chroma = *luma + p->width * p->height;
+}
+
+/*
+ * capture frame to a stream's encoder input through the registry's
+ * conversion (a plain copy when the formats match but the frame could
+ * not be captured into VE memory), filled out to whole macroblocks by
+ * repeating the edges
+ */
+static int fill_encoder_input(struct pipeline *p, struct enc_stream *st, struct cap_frame *f,
+                              void *input_buf) {
+    struct csc_image src, dst;
+    int width = p->width;
+    int height = p->height;
+    /* the VE reads whole macroblocks, see h264enc_new() */
+    int stride = (st->width + 15) & ~15;
+    int rows = (st->height + 15) & ~15;
+
+    if (!st->conv)
+        return -1;
+
+    csc_image_init(&dst, p->enc_fmt, input_buf, st->width, st->height, stride, rows);
+    dst.out_width = stride;
+    dst.out_height = rows;
+
+    /* only the first stream makes the raw sinks' picture */
+    if (p->fused && f->planar && st == p->streams) {
+        /* the raw sinks' I420/YV12 comes out of the same read of the frame */
+        struct csc_image planar;
+
+        csc_image_init(&planar, p->planar_fmt, f->planar, width, height, 0, 0);
+        csc_packed422_to_nv12_i420(p->pix_fmt == V4L2_PIX_FMT_UYVY, f->data, p->cap_stride,
+                                   dst.plane[0], dst.stride[0],
+                                   dst.plane[1], dst.stride[1],
+                                   planar.plane[0], planar.stride[0],
+                                   planar.plane[1], planar.stride[1],
+                                   planar.plane[2], planar.stride[2],
+                                   width, height, stride, rows, &st->deint);
+        f->planar_ready = 1;
+    } else {
+        csc_image_init(&src, p->pix_fmt, f->data, width, height, p->cap_stride, 0);
+        src.deint = &st->deint;
+        if (csc_geometry_active(&st->geom))
+            src.geom = &st->geom;
+        st->conv->run(&src, &dst);
+    }
+
+    h264enc_input_written(st->encoder, input_buf, 0, rows);
+    return 0;
+}
+
+/*
+ * every stream's encoder input, input[n] for stream n, from one pass over
+ * the frame through the first stream's crop, mirrors and deinterlacer.
+ * The time is shared out over the streams.
+ */
+static int convert_pyramid(struct pipeline *p, struct cap_frame *f, void *const *input) {
+    struct csc_image src, dst[CSC_PYRAMID_MAX];
+    struct timespec t0, t1;
+    int n, ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    csc_image_init(&src, p->pix_fmt, f->data, p->width, p->height, p->cap_stride, 0);
+    src.deint = &p->streams[0].deint;
+    if (csc_geometry_active(&p->streams[0].geom))
+        src.geom = &p->streams[0].geom;
+    for (n = 0; n < p->n_streams; n++) {
+        struct enc_stream *st = &p->streams[n];
+
+        csc_image_init(&dst[n], p->enc_fmt, input[n], st->width, st->height, (st->width + 15) & ~15,
+                       (st->height + 15) & ~15);
+        dst[n].out_width = (st->width + 15) & ~15;
+        dst[n].out_height = (st->height + 15) & ~15;
+    }
+    ret = csc_convert_pyramid(&src, dst, p->n_streams);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    if (ret < 0)
+        return ret;
+
+    for (n = 0; n < p->n_streams; n++) {
+        struct enc_stream *st = &p->streams[n];
+
+        h264enc_input_written(st->encoder, input[n], 0, dst[n].out_height);
+        st->csc_us += elapsed_us(&t0, &t1) / p->n_streams;
+        st->csc_frames++;
+    }
+    return 0;
+}
+
+static int convert_for_encoder(struct pipeline *p, struct enc_stream *st, struct cap_frame *f,
+                               void *input_buf) {
+    struct timespec t0, t1;
+    int ret;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    ret = fill_encoder_input(p, st, f, input_buf);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (ret == 0) {
+        st->csc_us += elapsed_us(&t0, &t1);
+        st->csc_frames++;
+    }
+    return ret;
+}
+
+/*
+ * drop the sink's reference to a capture frame or an encoded packet
+ */
+static void sink_item_release(struct pipeline *p, struct pthr_start *s, void *item) {
+    if (s->lb_codec == H264_LB)
+        h264enc_packet_release(p->streams[s->stream].encoder, item);
+    else
+        frame_release(p, item);
+}
+
+/*
+ * drop one item and count it against the sink
+ */
+static void sink_drop(struct pipeline *p, struct pthr_start *s, void *item, unsigned long *count) {
+    (*count)++;
+    sink_item_release(p, s, item);
+}
+
+static const char *const sink_policy_names[] = {
+    [SINK_DROP_OLDEST] = "oldest",
+    [SINK_DROP_NEWEST] = "newest",
+    [SINK_BLOCK] = "block",
+};
+
+/*
+ * oldest, newest or block:MS, -1 for anything else
+ */
+int sink_policy_parse(const char *name, int *block_ms) {
+    if (strcmp(name, "oldest") == 0)
+        return SINK_DROP_OLDEST;
+    if (strcmp(name, "newest") == 0)
+        return SINK_DROP_NEWEST;
+    if (sscanf(name, "block:%d", block_ms) == 1 && *block_ms > 0)
+        return SINK_BLOCK;
+    return -1;
+}
+
+const char *sink_policy_name(int policy) {
+    if (policy < 0 || policy > SINK_BLOCK)
+        return "unknown";
+    return sink_policy_names[policy];
+}
+
+/*
+ * hand an item to a sink's queue. When it is full the policy drops the
+ * oldest item queued or the new one, a blocking sink holds the producer
+ * up to block_ms first. Nothing waits on a slow reader any longer.
+ */
+static void sink_push(struct pipeline *p, struct pthr_start *s, void *item) {
+    void *old;
+    int ret;
+
+    switch (s->policy) {
+    case SINK_DROP_OLDEST:
+        /* the sink thread may take the oldest itself meanwhile */
+        while ((ret = fq_trypush(&s->q, item)) == FQ_FULL)
+            if ((old = fq_trypop(&s->q)))
+                sink_drop(p, s, old, &s->dropped);
+        if (ret == FQ_CLOSED)
+            sink_drop(p, s, item, &s->dropped);
+        break;
+    case SINK_BLOCK:
+        if (fq_push_timed(&s->q, item, s->block_ms) < 0)
+            sink_drop(p, s, item, &s->dropped);
+        break;
+    default:
+        if (fq_trypush(&s->q, item) < 0)
+            sink_drop(p, s, item, &s->dropped);
+        break;
+    }
+}
+
+/*
+ * the loopback device can take a frame within timeout_ms: a zero-copy
+ * slot still free, or a buffer the reader is done with
+ */
+static int sink_device_ready(struct pthr_start *s, int timeout_ms) {
+    int idx, held = 0;
+
+    if (s->lb_memory == V4L2_MEMORY_USERPTR) {
+        for (idx = 0; idx < s->lb_nbuf; idx++)
+            if (s->lb_held[idx])
+                held++;
+        if (held < s->lb_max_held)
+            return 1;
+    }
+    return wait_out_buf(s->lb_fd, timeout_ms);
+}
+
+/*
+ * wait for the loopback device to take the sink's frame, 0 when it is to
+ * be dropped. The capture loop of a serial run only waits for a blocking
+ * sink, up to block_ms. A sink thread waits up to SINK_STALL_MS, a
+ * drop-oldest one only until a newer frame is queued behind. A device
+ * that let SINK_STALL_MS pass is not waited for again until it takes
+ * frames by itself, an absent reader costs one wait and no more.
+ */
+static int sink_wait_device(struct pipeline *p, struct pthr_start *s) {
+    int limit, waited, slice;
+
+    if (!p->lb_enabled)
+        return 1;
+
+    if (sink_device_ready(s, 0)) {
+        if (s->stalled)
+            fprintf(stderr, "%s: the device takes frames again\n", s->lb_name);
+        s->stalled = 0;
+        return 1;
+    }
+    if (s->stalled)
+        return 0;
+
+    if (p->serial)
+        limit = s->policy == SINK_BLOCK ? s->block_ms : 0;
+    else
+        limit = SINK_STALL_MS;
+
+    for (waited = 0; waited < limit; waited += slice) {
+        slice = limit - waited;
+        if (!p->serial && s->policy == SINK_DROP_OLDEST && slice > SINK_POLL_MS)
+            slice = SINK_POLL_MS;
+        if (sink_device_ready(s, slice))
+            return 1;
+        if (!p->serial && s->policy == SINK_DROP_OLDEST && fq_count(&s->q))
+            return 0;
+    }
+
+    if (!p->serial) {
+        fprintf(stderr, "%s: no buffer back from the device in %d ms, dropping frames until there is one\n",
+                s->lb_name, SINK_STALL_MS);
+        s->stalled = 1;
+    }
+    return 0;
+}
+
+/*
+ * queue the producer's memory to the loopback device, the sink keeps its
+ * reference until the device gives the buffer back. 1 when the device
+ * has no buffer to give back, -1 when it refuses our memory.
+ */
+static int sink_queue_userptr(struct pipeline *p, struct pthr_start *s, void *item, void *data, int len) {
+    int idx, held = 0;
+
+    for (idx = 0; idx < s->lb_nbuf; idx++)
+        if (s->lb_held[idx])
+            held++;
+
+    if (held >= s->lb_max_held) {
+        idx = dqbuf_out_userptr(s->lb_fd, 0);
+        if (idx < 0 || idx >= s->lb_nbuf)
+            return 1;
+        if (s->lb_held[idx]) {
+            sink_item_release(p, s, s->lb_held[idx]);
+            s->lb_held[idx] = NULL;
+        }
+    } else {
+        for (idx = 0; s->lb_held[idx]; idx++)
+            ;
+    }
+
+    if (-1 == qbuf_out_userptr(s->lb_fd, idx, data, len))
+        return -1;
+
+    s->lb_held[idx] = item;
+    return 0;
+}
+
+/*
+ * the driver took USERPTR buffers but refused our memory, copy from now on
+ */
+static void sink_fallback_to_copy(struct pipeline *p, struct pthr_start *s) {
+    int i;
+
+    fprintf(stderr, "%s: zero-copy output refused (%s), falling back to memcpy\n",
+            s->lb_name, strerror(errno));
+
+    uninit_out_userptr(s->lb_fd);
+    for (i = 0; i < s->lb_nbuf; i++) {
+        if (s->lb_held[i]) {
+            sink_item_release(p, s, s->lb_held[i]);
+            s->lb_held[i] = NULL;
+        }
+    }
+
+    s->lb_pbuf = init_out_mmap(&s->lb_fd, &s->lb_nbuf);
+    s->lb_memory = V4L2_MEMORY_MMAP;
+}
+
+/*
+ * try zero-copy output first, see sink_fallback_to_copy()
+ */
+int sink_setup_output(struct pthr_start *s, int zero_copy) {
+    if (zero_copy && init_out_userptr(s->lb_fd, &s->lb_nbuf) == 0) {
+        s->lb_held = calloc(s->lb_nbuf, sizeof(void *));
+        if (s->lb_held) {
+            s->lb_memory = V4L2_MEMORY_USERPTR;
+            return 0;
+        }
+        uninit_out_userptr(s->lb_fd);
+    }
+
+    s->lb_pbuf = init_out_mmap(&s->lb_fd, &s->lb_nbuf);
+    s->lb_memory = V4L2_MEMORY_MMAP;
+    return s->lb_pbuf ? 0 : -1;
+}
+
+/*
+ *
+ */
+void sink_release_output(struct pipeline *p, struct pthr_start *s) {
+    int i;
+
+    if (s->lb_memory == V4L2_MEMORY_USERPTR) {
+        uninit_out_userptr(s->lb_fd);
+        for (i = 0; i < s->lb_nbuf; i++)
+            if (s->lb_held[i])
+                sink_item_release(p, s, s->lb_held[i]);
+    } else {
+        uninit_out_mmap(s->lb_fd, s->lb_pbuf, s->lb_nbuf);
+    }
+
+    free(s->lb_held);
+    s->lb_held = NULL;
+}
+
+/*
+ * raw loopback sink in any registry format, consumes one reference to the frame
+ */
+static void sink_raw(struct pipeline *p, struct pthr_start *s, struct cap_frame *f) {
+    struct v4l2_buffer dev_ibuf;
+    int scaled = csc_geometry_active(&s->geom);
+    int width = scaled ? s->lb_w : p->width;
+    int height = scaled ? s->lb_h : p->height;
+    int len, ret;
+    void *pb;
+
+    if (!sink_wait_device(p, s)) {
+        sink_drop(p, s, f, &s->busy);
+        return;
+    }
+
+    /* same format on both sides, hand the capture buffer over as it is */
+    if (p->lb_enabled && s->lb_memory == V4L2_MEMORY_USERPTR) {
+        ret = sink_queue_userptr(p, s, f, f->data, f->buf.bytesused);
+        if (ret == 0) {
+            if (s->tofile == 1)
+                write(s->file_fd, f->data, f->buf.bytesused);
+            sink_done(s, &f->ts);
+            return;
+        }
+        if (ret > 0) {
+            sink_drop(p, s, f, &s->busy);
+            return;
+        }
+        sink_fallback_to_copy(p, s);
+    }
+
+    if (p->lb_enabled) {
+        CLEAR(dev_ibuf);
+        pb = obtain_lbck_current_input_buf(s->lb_fd, s->lb_nbuf, s->lb_pbuf, &dev_ibuf);
+        if (!pb) {
+            sink_drop(p, s, f, &s->busy);
+            return;
+        }
+    } else {
+        pb = s->scratch;
+    }
+
+    len = csc_frame_size(s->pix_format, width, height);
+    if (f->planar_ready && s->pix_format == p->planar_fmt && !scaled) {
+        if (p->lb_enabled)
+            memcpy(pb, f->planar, len);
+        else
+            pb = f->planar;
+    } else if (s->pix_format == p->pix_fmt && !scaled) {
+        len = f->buf.bytesused;
+        memcpy(pb, f->data, len);
+    } else {
+        struct csc_image src, dst;
+
+        csc_image_init(&src, p->pix_fmt, f->data, p->width, p->height, p->cap_stride, 0);
+        csc_image_init(&dst, s->pix_format, pb, width, height, 0, 0);
+        src.deint = &s->deint;
+        if (scaled)
+            src.geom = &s->geom;
+        s->conv->run(&src, &dst);
+    }
+
+    if (p->lb_enabled)
+        write_current_input_buf_to_lbck(s->lb_fd, &dev_ibuf, len);
+
+    if (s->tofile == 1)
+        write(s->file_fd, pb, len);
+
+    sink_done(s, &f->ts);
+    frame_release(p, f);
+}
+
+/*
+ * H264 loopback sink of one stream, consumes one reference to the packet.
+ * The P frames after a lost packet miss their reference, the sink skips
+ * them and starts again at the next IDR, which carries SPS and PPS.
+ */
+static void sink_h264(struct pipeline *p, struct pthr_start *s, struct h264enc_packet *pkt) {
+    struct enc_stream *st = &p->streams[s->stream];
+    unsigned long seq = st->pkt_seq[pkt->index];
+    int ret;
+
+    /* dropped in the queue */
+    if (seq != s->next_seq)
+        s->need_idr = 1;
+    s->next_seq = seq + 1;
+
+    if (s->need_idr && !pkt->keyframe) {
+        sink_drop(p, s, pkt, &s->gop_skipped);
+        return;
+    }
+    if (!sink_wait_device(p, s)) {
+        sink_drop(p, s, pkt, &s->busy);
+        s->need_idr = 1;
+        return;
+    }
+    s->need_idr = 0;
+
+    /* the packet is delivered once the device has it, see sink_raw() */
+    if (p->lb_enabled && s->lb_memory == V4L2_MEMORY_USERPTR) {
+        ret = sink_queue_userptr(p, s, pkt, pkt->data, pkt->length);
+        if (ret == 0) {
+            if (s->tofile == 1)
+                write(s->file_fd, pkt->data, pkt->length);
+            sink_done(s, &st->pkt_ts[pkt->index]);
+            return;
+        }
+        if (ret > 0) {
+            sink_drop(p, s, pkt, &s->busy);
+            s->need_idr = 1;
+            return;
+        }
+        sink_fallback_to_copy(p, s);
+    }
+
+    if (p->lb_enabled && wrt_to_lpbck(s->lb_fd, pkt->data, pkt->length, s->lb_nbuf, s->lb_pbuf) < 0) {
+        sink_drop(p, s, pkt, &s->busy);
+        s->need_idr = 1;
+        return;
+    }
+
+    if (s->tofile == 1)
+        write(s->file_fd, pkt->data, pkt->length);
+
+    sink_done(s, &st->pkt_ts[pkt->index]);
+    h264enc_packet_release(st->encoder, pkt);
+}
+
+/*
+ *
+ */
+int pipeline_init(struct pipeline *p) {
+    int i;
+
+    pthread_mutex_init(&p->ref_lock, NULL);
+
+    if (!p->cap_memory)
+        p->cap_memory = V4L2_MEMORY_MMAP;
+    if (!p->enc_fmt)
+        p->enc_fmt = p->pix_fmt == V4L2_PIX_FMT_NV16 ? V4L2_PIX_FMT_NV16 : V4L2_PIX_FMT_NV12;
+    if (!p->cap_stride)
+        p->cap_stride = (p->pix_fmt == V4L2_PIX_FMT_UYVY || p->pix_fmt == V4L2_PIX_FMT_YUYV) ?
+                        p->width * 2 : p->width;
+
+    /* fields are only woven in packed 4:2:2, see struct csc_deint */
+    if (p->deint.mode != CSC_DEINT_OFF &&
+        p->pix_fmt != V4L2_PIX_FMT_UYVY && p->pix_fmt != V4L2_PIX_FMT_YUYV) {
+        fprintf(stderr, "deinterlacing needs a YUYV or UYVY capture, left off\n");
+        p->deint.mode = CSC_DEINT_OFF;
+    }
+
+    if (p->n_streams < 1) {
+        fprintf(stderr, "no encoder stream\n");
+        return -1;
+    }
+
+    /* the capture buffer is encoded in place, that makes one picture only */
+    if (p->direct && p->n_streams > 1) {
+        fprintf(stderr, "%d encoder streams need the capture converted\n", p->n_streams);
+        return -1;
+    }
+
+    for (i = 0; i < p->n_streams; i++) {
+        struct enc_stream *st = &p->streams[i];
+
+        csc_deint_init(&st->deint, p->deint.mode, p->deint.field);
+        st->n_sinks = 0;
+
+        /* the geometry is applied by the packed 4:2:2 conversions, each stream has its own */
+        st->width = p->width;
+        st->height = p->height;
+        if (csc_geometry_active(&st->geom)) {
+            if ((p->pix_fmt != V4L2_PIX_FMT_UYVY && p->pix_fmt != V4L2_PIX_FMT_YUYV) || p->direct) {
+                fprintf(stderr, "stream %d: crop, size, mirror and rotation need a YUYV or UYVY capture\n", i);
+                return -1;
+            }
+            if (csc_geometry_size(&st->geom, p->width, p->height, &st->width, &st->height) < 0) {
+                fprintf(stderr, "stream %d: crop, size or rotation does not fit the %dx%d capture\n",
+                        i, p->width, p->height);
+                return -1;
+            }
+        }
+
+        /* every conversion is looked up once here, not per frame */
+        st->conv = NULL;
+        if (!p->direct) {
+            st->conv = csc_find_conversion(p->pix_fmt, p->enc_fmt);
+            if (!st->conv) {
+                fprintf(stderr, "no conversion from the capture format to the encoder input\n");
+                return -1;
+            }
+            if (p->deint.mode != CSC_DEINT_OFF && !(st->conv->caps & CSC_CONV_DEINT)) {
+                fprintf(stderr, "stream %d: the encoder input can't be deinterlaced\n", i);
+                return -1;
+            }
+            if (csc_geometry_active(&st->geom) && !(st->conv->caps & CSC_CONV_GEOM)) {
+                fprintf(stderr, "stream %d: the encoder input can't be cropped, scaled or rotated\n", i);
+                return -1;
+            }
+        }
+    }
+
+    /* replayed frames live in plain memory, recycled through cap_free */
+    if (p->replay_fd >= 0) {
+        p->n_buffers = V4L2MMAP_NBBUFFER;
+        p->buffers = calloc(p->n_buffers, sizeof(*p->buffers));
+        if (!p->buffers)
+            return -1;
+        for (i = 0; i < p->n_buffers; i++) {
+            p->buffers[i].length = frame_bytes(p);
+            p->buffers[i].start = malloc(p->buffers[i].length);
+            if (!p->buffers[i].start)
+                return -1;
+        }
+    }
+
+    p->n_raw = p->n_h264 = 0;
+    for (i = 0; i < p->n_sinks; i++) {
+        struct pthr_start *s = &p->sinks[i];
+
+        if (s->lb_codec == H264_LB) {
+            if (s->stream < 0 || s->stream >= p->n_streams) {
+                fprintf(stderr, "%s: no encoder stream %d\n", s->lb_name, s->stream);
+                return -1;
+            }
+            p->streams[s->stream].n_sinks++;
+            p->n_h264++;
+        } else if (s->lb_codec == SIMPLE_LB) {
+            p->n_raw++;
+        }
+
+        /* a full queue is up to the sink's policy, see sink_push() */
+        if (fq_init(&s->q, SINK_QUEUE_DEPTH) < 0)
+            return -1;
+        s->stalled = s->need_idr = 0;
+        s->next_seq = 0;
+        s->dropped = s->busy = s->gop_skipped = 0;
+
+        /*
+         * frames queued zero-copy stay held, capture and encoder must not
+         * run dry: an H264 sink holds these, the one it writes and the one
+         * queued, the encoder keeps one for itself
+         */
+        if (s->lb_codec == SIMPLE_LB)
+            s->lb_max_held = 1;
+        else
+            s->lb_max_held = p->n_packets > SINK_QUEUE_DEPTH + 2 ? p->n_packets - SINK_QUEUE_DEPTH - 2 : 1;
+        if (s->lb_max_held > s->lb_nbuf)
+            s->lb_max_held = s->lb_nbuf;
+
+        /* the same format is passed through as captured, anything else needs a conversion */
+        csc_deint_init(&s->deint, p->deint.mode, p->deint.field);
+        s->conv = NULL;
+        if (s->lb_codec == SIMPLE_LB && s->pix_format != p->pix_fmt) {
+            s->conv = csc_find_conversion(p->pix_fmt, s->pix_format);
+            if (!s->conv) {
+                fprintf(stderr, "%s: no conversion from the capture format\n", s->lb_name);
+                return -1;
+            }
+        }
+
+        /* passed through or converted without it, the fields would arrive combed */
+        if (s->lb_codec == SIMPLE_LB && p->deint.mode != CSC_DEINT_OFF &&
+            !(s->conv && (s->conv->caps & CSC_CONV_DEINT))) {
+            fprintf(stderr, "%s: no deinterlacing conversion to this format\n", s->lb_name);
+            return -1;
+        }
+
+        /* a raw sink of its own size, made by the same packed 4:2:2 conversions as the encoder's */
+        if (s->lb_codec == SIMPLE_LB && csc_geometry_active(&s->geom)) {
+            if (p->pix_fmt != V4L2_PIX_FMT_UYVY && p->pix_fmt != V4L2_PIX_FMT_YUYV) {
+                fprintf(stderr, "%s: scaling needs a YUYV or UYVY capture\n", s->lb_name);
+                return -1;
+            }
+            if (!s->conv || !(s->conv->caps & CSC_CONV_GEOM)) {
+                fprintf(stderr, "%s: scaling needs an NV12, NV16, YU12 or YV12 output\n", s->lb_name);
+                return -1;
+            }
+            if (csc_geometry_size(&s->geom, p->width, p->height, &s->lb_w, &s->lb_h) < 0) {
+                fprintf(stderr, "%s: size does not fit the %dx%d capture\n", s->lb_name,
+                        p->width, p->height);
+                return -1;
+            }
+        }
+
+        if (!p->lb_enabled && s->lb_codec == SIMPLE_LB) {
+            int size = csc_frame_size(s->pix_format, p->width, p->height);
+
+            s->scratch = malloc(size > p->width * p->height * 2 ? size : p->width * p->height * 2);
+            if (!s->scratch)
+                return -1;
+        }
+    }
+
+    /* every stream hands its packets to sinks of its own */
+    for (i = 0; p->n_h264 && i < p->n_streams; i++) {
+        if (!p->streams[i].n_sinks) {
+            fprintf(stderr, "stream %d has no H264 sink\n", i);
+            return -1;
+        }
+    }
+
+    p->frames = calloc(p->n_buffers, sizeof(*p->frames));
+    if (!p->frames)
+        return -1;
+
+    /*
+     * packed 4:2:2 going to both the encoder and I420/YV12 raw sinks is
+     * converted once for all of them
+     */
+    p->fused = p->n_h264 && p->n_raw && !p->direct && p->enc_fmt == V4L2_PIX_FMT_NV12 &&
+               (p->pix_fmt == V4L2_PIX_FMT_UYVY || p->pix_fmt == V4L2_PIX_FMT_YUYV) &&
+               !csc_geometry_active(&p->streams[0].geom);
+    p->planar_fmt = 0;
+    for (i = 0; p->fused && i < p->n_sinks; i++) {
+        struct pthr_start *s = &p->sinks[i];
+
+        if (s->lb_codec != SIMPLE_LB)
+            continue;
+        if ((s->pix_format != V4L2_PIX_FMT_YUV420 && s->pix_format != V4L2_PIX_FMT_YVU420) ||
+            (p->planar_fmt && p->planar_fmt != s->pix_format) || csc_geometry_active(&s->geom))
+            p->fused = 0;
+        else
+            p->planar_fmt = s->pix_format;
+    }
+
+    for (i = 0; p->fused && i < p->n_buffers; i++) {
+        p->frames[i].planar = malloc(csc_frame_size(p->planar_fmt, p->width, p->height));
+        if (!p->frames[i].planar)
+            return -1;
+    }
+
+    /*
+     * streams that only differ in size are read from the frame once for
+     * all of them: the same crop and mirrors, no quarter turn. Deinterlaced
+     * alike, the first stream's deinterlacer does it for all.
+     */
+    p->pyramid = p->n_streams > 1 && p->n_streams <= CSC_PYRAMID_MAX && !p->direct && !p->fused &&
+                 (p->pix_fmt == V4L2_PIX_FMT_UYVY || p->pix_fmt == V4L2_PIX_FMT_YUYV);
+    for (i = 0; p->pyramid && i < p->n_streams; i++) {
+        struct csc_geometry a = p->streams[0].geom, b = p->streams[i].geom;
+        int w, h;
+
+        csc_geometry_size(&a, p->width, p->height, &w, &h);
+        csc_geometry_size(&b, p->width, p->height, &w, &h);
+        if (a.crop_x != b.crop_x || a.crop_y != b.crop_y || a.crop_width != b.crop_width ||
+            a.crop_height != b.crop_height || a.hflip != b.hflip || a.vflip != b.vflip ||
+            a.rotate != b.rotate || a.rotate % 180)
+            p->pyramid = 0;
+    }
+
+    /* capture time and number of the frame held by each bytestream buffer */
+    if (p->n_packets < 1)
+        p->n_packets = 1;
+    for (i = 0; i < p->n_streams; i++) {
+        p->streams[i].pkt_ts = calloc(p->n_packets, sizeof(*p->streams[i].pkt_ts));
+        p->streams[i].pkt_seq = calloc(p->n_packets, sizeof(*p->streams[i].pkt_seq));
+        if (!p->streams[i].pkt_ts || !p->streams[i].pkt_seq)
+            return -1;
+        p->streams[i].seq = 0;
+    }
+
+    /* one job per slot of each stream's input ring */
+    if (p->n_jobs < 1)
+        p->n_jobs = 1;
+    p->jobs = calloc(p->n_jobs * p->n_streams, sizeof(*p->jobs));
+    if (!p->jobs)
+        return -1;
+
+    if (fq_init(&p->cap_free, p->n_buffers) < 0 ||
+        fq_init(&p->csc_in, p->n_buffers) < 0 ||
+        fq_init(&p->enc_in, p->n_jobs * p->n_streams) < 0 ||
+        fq_init(&p->enc_free, p->n_jobs * p->n_streams) < 0)
+        return -1;
+
+    for (i = 0; i < p->n_buffers; i++) {
+        p->frames[i].data = p->buffers[i].start;
+        p->frames[i].buf.index = i;
+        if (p->replay_fd >= 0)
+            fq_push(&p->cap_free, &p->frames[i]);
+    }
+
+    for (i = 0; i < p->n_jobs * p->n_streams; i++)
+        fq_push(&p->enc_free, &p->jobs[i]);
+
+    return 0;
+}
+
+/*
+ *
+ */
+void pipeline_free(struct pipeline *p) {
+    int i;
+
+    for (i = 0; i < p->n_sinks; i++) {
+        fq_destroy(&p->sinks[i].q);
+        free(p->sinks[i].scratch);
+        p->sinks[i].scratch = NULL;
+        csc_deint_free(&p->sinks[i].deint);
+    }
+    for (i = 0; i < p->n_streams; i++) {
+        csc_deint_free(&p->streams[i].deint);
+        free(p->streams[i].pkt_ts);
+        p->streams[i].pkt_ts = NULL;
+        free(p->streams[i].pkt_seq);
+        p->streams[i].pkt_seq = NULL;
+    }
+    csc_deint_free(&p->deint);
+
+    fq_destroy(&p->cap_free);
+    fq_destroy(&p->csc_in);
+    fq_destroy(&p->enc_in);
+    fq_destroy(&p->enc_free);
+
+    if (p->replay_fd >= 0 && p->buffers) {
+        for (i = 0; i < p->n_buffers; i++)
+            free(p->buffers[i].start);
+        free(p->buffers);
+        p->buffers = NULL;
+    }
+
+    for (i = 0; p->frames && i < p->n_buffers; i++)
+        free(p->frames[i].planar);
+    free(p->frames);
+    p->frames = NULL;
+    free(p->jobs);
+    p->jobs = NULL;
+    pthread_mutex_destroy(&p->ref_lock);
+}
+
+/*
+ * VE time of one frame, from submit to the encoder being done with it.
+ * The serial loop serves the raw sinks in between, that time is included.
+ */
+static void encode_done(struct enc_stream *st, struct timespec *submitted) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    st->enc_us += elapsed_us(submitted, &now);
+    st->enc_frames++;
+}
+
+static int stream_sink(struct pipeline *p, struct pthr_start *s, struct enc_stream *st) {
+    return s->lb_codec == H264_LB && &p->streams[s->stream] == st;
+}
+
+/*
+ * a frame not on the VE within deadline_ms of its capture is up to the
+ * stream's late policy, see h264enc_set_deadline()
+ */
+static void stream_deadline(struct pipeline *p, struct enc_stream *st, const struct timespec *ts) {
+    struct timespec dl = *ts;
+
+    if (!p->deadline_ms)
+        return;
+
+    dl.tv_sec += p->deadline_ms / 1000;
+    dl.tv_nsec += (p->deadline_ms % 1000) * 1000000L;
+    if (dl.tv_nsec >= 1000000000) {
+        dl.tv_sec++;
+        dl.tv_nsec -= 1000000000;
+    }
+    h264enc_set_deadline(st->encoder, &dl);
+}
+
+/*
+ * start a stream's frame on the VE, the capture buffer itself in direct mode
+ */
+static int stream_submit(struct pipeline *p, struct enc_stream *st, struct cap_frame *f,
+                         struct timespec *t_submit) {
+    stream_deadline(p, st, &f->ts);
+    if (p->direct) {
+        uint32_t luma, chroma;
+
+        frame_phys(p, f, &luma, &chroma);
+        clock_gettime(CLOCK_MONOTONIC, t_submit);
+        return h264enc_submit_phys(st->encoder, luma, chroma);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, t_submit);
+    return h264enc_submit(st->encoder);
+}
+
+/*
+ * collect a stream's frame and write it to the stream's sinks
+ */
+static void stream_complete(struct pipeline *p, struct enc_stream *st, struct cap_frame *f,
+                            struct timespec *t_submit) {
+    struct h264enc_packet *pkt;
+    int i;
+
+    h264enc_complete(st->encoder);
+    encode_done(st, t_submit);
+    pkt = h264enc_get_packet(st->encoder);
+    if (!pkt)
+        return;
+
+    st->pkt_ts[pkt->index] = f->ts;
+    st->pkt_seq[pkt->index] = st->seq++;
+    h264enc_packet_ref(st->encoder, pkt, st->n_sinks - 1);
+    for (i = 0; i < p->n_sinks; i++)
+        if (stream_sink(p, &p->sinks[i], st))
+            sink_h264(p, &p->sinks[i], pkt);
+}
+
+/*
+ * convert, encode and write every sink of one frame. The raw sinks are
+ * served while the VE encodes the first stream, each further stream is
+ * converted while the VE encodes the one before.
+ */
+static void serial_frame(struct pipeline *p, struct cap_frame *f) {
+    struct timespec t_submit;
+    void *input[CSC_PYRAMID_MAX];
+    int i, n, submitted, next, ready = -1;
+
+    /* sinks may keep the frame queued on the loopback device */
+    f->refs = p->n_raw + 1;
+    f->planar_ready = 0;
+
+    submitted = 0;
+    if (p->n_h264 && frame_late(p, f)) {
+        p->streams[0].skipped++;
+    } else if (p->n_h264 && p->pyramid) {
+        /* every stream at once, the later ones are only submitted in turn */
+        for (n = 0; n < p->n_streams; n++)
+            input[n] = h264enc_get_input_buffer(p->streams[n].encoder);
+        ready = convert_pyramid(p, f, input);
+        if (ready == 0)
+            submitted = stream_submit(p, &p->streams[0], f, &t_submit);
+    } else if (p->n_h264 && (p->direct ||
+                             convert_for_encoder(p, &p->streams[0], f,
+                                                 h264enc_get_input_buffer(p->streams[0].encoder)) == 0)) {
+        submitted = stream_submit(p, &p->streams[0], f, &t_submit);
+    }
+
+    for (i = 0; i < p->n_sinks; i++) {
+        if (p->sinks[i].lb_codec != SIMPLE_LB)
+            continue;
+        if (frame_late(p, f)) {
+            p->sinks[i].skipped++;
+            frame_release(p, f);
+        } else {
+            sink_raw(p, &p->sinks[i], f);
+        }
+    }
+
+    /* the later streams wait for the ones before, they may be over the budget by then */
+    for (n = 0; p->n_h264 && n < p->n_streams; n++) {
+        struct enc_stream *st = &p->streams[n];
+
+        next = n + 1 < p->n_streams;
+        if (next && frame_late(p, f)) {
+            st[1].skipped++;
+            next = 0;
+        }
+        if (p->pyramid)
+            next = next && ready == 0;
+        else
+            next = next &&
+                   convert_for_encoder(p, st + 1, f, h264enc_get_input_buffer(st[1].encoder)) == 0;
+        if (submitted)
+            stream_complete(p, st, f, &t_submit);
+        submitted = next && stream_submit(p, st + 1, f, &t_submit);
+    }
+
+    frame_release(p, f);
+}
+
+static void serial_end(struct pipeline *p) {
+    clock_gettime(CLOCK_MONOTONIC, &p->t_end);
+}
+
+/*
+ * capture, convert, encode and write every sink of the n cameras on the
+ * calling thread, each frame as it arrives
+ */
+int pipeline_run_serial(struct pipeline *p, int n) {
+    uint64_t cpu_start = cpu_time_us();
+    struct timespec t_start;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+    for (i = 0; i < n; i++) {
+        p[i].t_start = t_start;
+        p[i].serial = 1;
+    }
+
+    capture_loop(p, n, serial_frame, serial_end);
+
+    cpu_start = cpu_time_us() - cpu_start;
+    for (i = 0; i < n; i++)
+        p[i].cpu_us = cpu_start;
+    return 0;
+}
+
+/*
+ *
+ */
+static void push_raw_sinks(struct pipeline *p, struct cap_frame *f) {
+    int i;
+
+    for (i = 0; i < p->n_sinks; i++)
+        if (p->sinks[i].lb_codec == SIMPLE_LB)
+            sink_push(p, &p->sinks[i], f);
+}
+
+static void close_raw_sinks(struct pipeline *p) {
+    int i;
+
+    for (i = 0; i < p->n_sinks; i++)
+        if (p->sinks[i].lb_codec == SIMPLE_LB)
+            fq_close(&p->sinks[i].q);
+}
+
+/*
+ * the last of a camera's threads to finish ends its run
+ */
+static void thread_done(struct pipeline *p) {
+    pthread_mutex_lock(&p->ref_lock);
+    if (--p->running == 0)
+        clock_gettime(CLOCK_MONOTONIC, &p->t_end);
+    pthread_mutex_unlock(&p->ref_lock);
+}
+
+/*
+ * hands a frame to the camera's threads. The CSC queue holds every
+ * capture buffer and the raw sinks drop by their policy, so this does
+ * not block the other cameras in the capture loop.
+ */
+static void capture_dispatch(struct pipeline *p, struct cap_frame *f) {
+    f->refs = p->n_raw + (p->n_h264 ? 1 : 0);
+    if (f->refs == 0) {
+        capture_put(p, f);
+        return;
+    }
+
+    /* fused: the CSC stage passes the frame on once its planar copy exists */
+    f->planar_ready = 0;
+    if (!p->fused)
+        push_raw_sinks(p, f);
+
+    if (p->n_h264)
+        fq_push(&p->csc_in, f);
+}
+
+static void capture_finish(struct pipeline *p) {
+    if (!p->fused)
+        close_raw_sinks(p);
+    fq_close(&p->csc_in);
+}
+
+/*
+ * a free slot of every stream's input ring filled in one pass, job is the
+ * first stream's. The slots are all taken before the conversion, so it
+ * waits for the slowest encoder.
+ */
+static void pyramid_jobs(struct pipeline *p, struct cap_frame *f, struct enc_job *job) {
+    struct enc_job *jobs[CSC_PYRAMID_MAX];
+    void *input[CSC_PYRAMID_MAX];
+    int n, count, ret;
+
+    for (count = 0; count < p->n_streams; count++) {
+        jobs[count] = count ? fq_pop(&p->enc_free) : job;
+        if (!jobs[count])
+            break;
+        jobs[count]->stream = &p->streams[count];
+        jobs[count]->ts = f->ts;
+        jobs[count]->frame = NULL;
+        jobs[count]->input = input[count] = h264enc_acquire_input_buffer(p->streams[count].encoder);
+    }
+
+    ret = count == p->n_streams ? convert_pyramid(p, f, input) : -1;
+    for (n = 0; n < count; n++) {
+        if (ret < 0) {
+            h264enc_release_input_buffer(p->streams[n].encoder, input[n]);
+            fq_push(&p->enc_free, jobs[n]);
+        } else {
+            h264enc_submit_input_buffer(p->streams[n].encoder, input[n]);
+            fq_push(&p->enc_in, jobs[n]);
+        }
+    }
+}
+
+/*
+ * one job per stream and frame, the streams in turn
+ */
+static void *csc_thread(void *arg) {
+    struct pipeline *p = arg;
+    struct cap_frame *f;
+    struct enc_job *job;
+    int n, ret;
+
+    while ((f = queue_latest(p, &p->csc_in, fq_pop(&p->csc_in), p->fused ? p->n_raw + 1 : 1,
+                                  &p->stale))) {
+        job = fq_pop(&p->enc_free);
+        if (!job) {
+            frame_release(p, f);
+            break;
+        }
+
+        /*
+         * waited too long for the encoder, skip it here rather than encode a
+         * stale picture. Fused raw sinks would get it from this stage, it is
+         * skipped for them too.
+         */
+        if (frame_late(p, f)) {
+            fq_push(&p->enc_free, job);
+            for (n = 0; n < p->n_streams; n++)
+                p->streams[n].skipped++;
+            for (n = 0; n < (p->fused ? p->n_raw + 1 : 1); n++)
+                frame_release(p, f);
+            continue;
+        }
+
+        /* the VE reads the capture buffer itself, keep it until encoded */
+        if (p->direct) {
+            job->stream = p->streams;
+            job->ts = f->ts;
+            job->frame = f;
+            job->input = NULL;
+            fq_push(&p->enc_in, job);
+            continue;
+        }
+
+        if (p->pyramid) {
+            pyramid_jobs(p, f, job);
+            frame_release(p, f);
+            continue;
+        }
+
+        /* fill a free slot of each input ring while the VE encodes the previous ones */
+        for (n = 0; job; n++) {
+            struct enc_stream *st = &p->streams[n];
+
+            job->stream = st;
+            job->ts = f->ts;
+            job->frame = NULL;
+            job->input = h264enc_acquire_input_buffer(st->encoder);
+            ret = convert_for_encoder(p, st, f, job->input);
+            if (n == 0 && p->fused)
+                push_raw_sinks(p, f);
+
+            if (ret < 0) {
+                h264enc_release_input_buffer(st->encoder, job->input);
+                fq_push(&p->enc_free, job);
+            } else {
+                h264enc_submit_input_buffer(st->encoder, job->input);
+                fq_push(&p->enc_in, job);
+            }
+
+            job = n + 1 < p->n_streams ? fq_pop(&p->enc_free) : NULL;
+        }
+        frame_release(p, f);
+    }
+
+    if (p->fused)
+        close_raw_sinks(p);
+    fq_close(&p->enc_in);
+    thread_done(p);
+    return NULL;
+}
+
+/*
+ * encodes the jobs in order, every stream's packets go to its own sinks
+ */
+static void *encode_thread(void *arg) {
+    struct pipeline *p = arg;
+    struct enc_job *job;
+    struct h264enc_packet *pkt;
+    int i;
+
+    while ((job = fq_pop(&p->enc_in))) {
+        struct enc_stream *st = job->stream;
+        struct timespec t_start;
+
+        clock_gettime(CLOCK_MONOTONIC, &t_start);
+        stream_deadline(p, st, &job->ts);
+        /* blocks only while every bytestream buffer is still held by a sink */
+        if (job->frame) {
+            uint32_t luma, chroma;
+
+            frame_phys(p, job->frame, &luma, &chroma);
+            h264enc_encode_picture_phys(st->encoder, luma, chroma);
+            frame_release(p, job->frame);
+        } else {
+            h264enc_encode_picture(st->encoder);
+        }
+        fq_push(&p->enc_free, job);
+
+        /* none when dropped at its deadline */
+        pkt = h264enc_get_packet(st->encoder);
+        if (!pkt)
+            continue;
+        encode_done(st, &t_start);
+        st->pkt_ts[pkt->index] = job->ts;
+        st->pkt_seq[pkt->index] = st->seq++;
+
+        /* zero-copy hand-off, the last sink to release it recycles the buffer */
+        h264enc_packet_ref(st->encoder, pkt, st->n_sinks - 1);
+        for (i = 0; i < p->n_sinks; i++)
+            if (stream_sink(p, &p->sinks[i], st))
+                sink_push(p, &p->sinks[i], pkt);
+    }
+
+    for (i = 0; i < p->n_sinks; i++)
+        if (p->sinks[i].lb_codec == H264_LB)
+            fq_close(&p->sinks[i].q);
+
+    thread_done(p);
+    return NULL;
+}
+
+struct sink_arg {
+    struct pipeline *p;
+    struct pthr_start *s;
+};
+
+/*
+ *
+ */
+static void *sink_thread(void *arg) {
+    struct pipeline *p = ((struct sink_arg *)arg)->p;
+    struct pthr_start *s = ((struct sink_arg *)arg)->s;
+    void *item;
+
+    while ((item = fq_pop(&s->q))) {
+        if (s->lb_codec == H264_LB) {
+            sink_h264(p, s, item);
+            continue;
+        }
+
+        item = queue_latest(p, &s->q, item, 1, &s->skipped);
+        if (frame_late(p, item)) {
+            s->skipped++;
+            frame_release(p, item);
+        } else {
+            sink_raw(p, s, item);
+        }
+    }
+
+    thread_done(p);
+    return NULL;
+}
+
+/*
+ * colour conversion, encoding and every sink of each of the n cameras on
+ * their own threads, the capture loop of all of them on the calling one
+ */
+int pipeline_run_threaded(struct pipeline *p, int n) {
+    uint64_t cpu_start = cpu_time_us();
+    struct timespec t_start;
+    struct sink_arg *args, *a;
+    int i, k, total = 0;
+
+    for (k = 0; k < n; k++)
+        total += p[k].n_sinks;
+    args = calloc(total, sizeof(*args));
+    if (!args)
+        return -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+    for (k = 0, a = args; k < n; k++) {
+        p[k].t_start = t_start;
+        p[k].serial = 0;
+        p[k].running = p[k].n_sinks + 2;
+
+        for (i = 0; i < p[k].n_sinks; i++, a++) {
+            a->p = &p[k];
+            a->s = &p[k].sinks[i];
+            if (pthread_create(&p[k].sinks[i].thread, NULL, sink_thread, a))
+                errno_exit("pthread_create");
+        }
+        if (pthread_create(&p[k].enc_th, NULL, encode_thread, &p[k]) ||
+            pthread_create(&p[k].csc_th, NULL, csc_thread, &p[k]))
+            errno_exit("pthread_create");
+    }
+
+    capture_loop(p, n, capture_dispatch, capture_finish);
+
+    for (k = 0; k < n; k++) {
+        pthread_join(p[k].csc_th, NULL);
+        pthread_join(p[k].enc_th, NULL);
+        for (i = 0; i < p[k].n_sinks; i++)
+            pthread_join(p[k].sinks[i].thread, NULL);
+    }
+
+    cpu_start = cpu_time_us() - cpu_start;
+    for (k = 0; k < n; k++)
+        p[k].cpu_us = cpu_start;
+
+    free(args);
+    return 0;
+}
+
+/*
+ * one camera's frames, sinks and encoder streams, us is the time of the
+ * whole run the VE was shared in. Returns the camera's VE time.
+ */
+static uint64_t report_camera(struct pipeline *p, const char *label, uint64_t us) {
+    uint64_t cam_us = elapsed_us(&p->t_start, &p->t_end);
+    uint64_t ve_us = 0;
+    int i;
+
+    printf("%s: %lu frames in %llu ms, %.2f fps\n", label, p->captured,
+           (unsigned long long)(cam_us / 1000),
+           cam_us ? p->captured * 1000000.0 / cam_us : 0.0);
+
+    for (i = 0; i < p->n_sinks; i++) {
+        struct pthr_start *s = &p->sinks[i];
+
+        printf("  %-12s %lu frames, latency avg %.2f ms max %.2f ms\n",
+               s->lb_name, s->frames,
+               s->frames ? s->lat_sum_us / 1000.0 / s->frames : 0.0,
+               s->lat_max_us / 1000.0);
+        if (s->lb_codec == SIMPLE_LB && (p->latest || p->budget_ms))
+            printf("    %lu frames skipped for a newer one or over the budget\n", s->skipped);
+        if (s->policy == SINK_BLOCK)
+            printf("    block %d ms:", s->block_ms);
+        else
+            printf("    drop %s:", sink_policy_name(s->policy));
+        printf(" %lu dropped in the queue, %lu with the device busy", s->dropped, s->busy);
+        if (s->lb_codec == H264_LB)
+            printf(", %lu skipped to the next IDR", s->gop_skipped);
+        printf("\n");
+    }
+
+    if (p->latest)
+        printf("  low latency: %lu frames passed over for a newer one before conversion\n", p->stale);
+
+    if (!p->n_streams)
+        return 0;
+
+    /* compare runs with and without -D at the same QP */
+    printf("  encoder input %c%c%c%c, deinterlacing %s\n",
+           p->enc_fmt & 0xff, (p->enc_fmt >> 8) & 0xff,
+           (p->enc_fmt >> 16) & 0xff, (p->enc_fmt >> 24) & 0xff,
+           csc_deint_name(p->deint.mode));
+    if (p->pyramid)
+        printf("  the %d streams converted in one pass, its time shared out\n", p->n_streams);
+
+    for (i = 0; i < p->n_streams; i++) {
+        struct enc_stream *st = &p->streams[i];
+        struct h264enc_stats es;
+
+        h264enc_get_stats(st->encoder, &es);
+        ve_us += es.ve_us;
+        printf("  stream %d %dx%d QP %u GOP %u: conversion %.2f ms, encode %.2f ms, H264 %.1f KiB per frame\n",
+               i, st->width, st->height, st->qp, st->keyframe_interval,
+               st->csc_frames ? st->csc_us / 1000.0 / st->csc_frames : 0.0,
+               st->enc_frames ? st->enc_us / 1000.0 / st->enc_frames : 0.0,
+               es.frames ? es.bytes / 1024.0 / es.frames : 0.0);
+        /* VE held by this stream, and kept from it by the others */
+        printf("    VE %.1f%% of the run, %.2f ms held and %.2f ms waited per frame",
+               us ? es.ve_us * 100.0 / us : 0.0,
+               es.frames ? es.ve_us / 1000.0 / es.frames : 0.0,
+               es.frames + es.dropped ? es.wait_us / 1000.0 / (es.frames + es.dropped) : 0.0);
+        /* counted in VE_DEBUG_MMIO builds only */
+        if (h264enc_get_mmio_per_frame(st->encoder))
+            printf(", %u register accesses", h264enc_get_mmio_per_frame(st->encoder));
+        printf("\n");
+        if (p->deadline_ms)
+            printf("    %d ms deadline: %lu frames late, %lu dropped, up to %u VE requests ahead\n",
+                   p->deadline_ms, es.late, es.dropped, es.max_queued);
+        if (p->budget_ms)
+            printf("    %lu frames over the %d ms budget skipped before conversion\n",
+                   st->skipped, p->budget_ms);
+    }
+    return ve_us;
+}
+
+/*
+ * every camera on its own, then what they share: CPU, VE and cache maintenance
+ */
+void pipeline_report(struct pipeline *p, int n, const char *mode) {
+    uint64_t us = 0, ve_us = 0;
+    unsigned long captured = 0;
+    int k, streams = 0;
+
+    for (k = 0; k < n; k++) {
+        uint64_t cam_us = elapsed_us(&p[k].t_start, &p[k].t_end);
+
+        if (cam_us > us)
+            us = cam_us;
+        captured += p[k].captured;
+        streams += p[k].n_streams;
+    }
+
+    for (k = 0; k < n; k++)
+        ve_us += report_camera(&p[k], n > 1 ? p[k].name : mode, us);
+
+    if (n > 1)
+        printf("%s: %lu frames from %d cameras in %llu ms, %.2f fps\n", mode, captured, n,
+               (unsigned long long)(us / 1000), us ? captured * 1000000.0 / us : 0.0);
+
+    if (captured)
+        printf("  CPU time per frame: %.2f ms\n", p->cpu_us / 1000.0 / captured);
+
+    if (streams) {
+        struct ve_cache_stats cs;
+        struct ve_sched_stats vs;
+
+        ve_sched_stats(&vs);
+        if (streams > 1)
+            printf("  VE busy %.1f%% of the run with %d streams, %lu engine switches in %lu jobs\n",
+                   us ? ve_us * 100.0 / us : 0.0, streams, vs.engine_switches, vs.jobs);
+
+        ve_cache_stats(&cs);
+        if (captured)
+            printf("  cache maintenance per frame: %.1f KiB in %.1f flushes, %.1f us\n",
+                   cs.bytes / 1024.0 / captured, (double)cs.flushes / captured,
+                   (double)cs.time_us / captured);
+    }
+}
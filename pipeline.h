@@ -0,0 +1,201 @@
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#include <linux/videodev2.h>
+
+#include "video_device.h"
+#include "h264enc.h"
+#include "csc.h"
+
+/* bounded FIFO connecting two pipeline stages */
+struct frame_queue {
+    void **slot;
+    int size;
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+/* why a push failed, decided under the queue lock */
+enum fq_error {
+    FQ_FULL = -1,
+    FQ_CLOSED = -2,
+};
+
+int fq_init(struct frame_queue *q, int size);
+void fq_destroy(struct frame_queue *q);
+int fq_push(struct frame_queue *q, void *item);
+int fq_trypush(struct frame_queue *q, void *item);
+int fq_push_timed(struct frame_queue *q, void *item, int timeout_ms);
+void *fq_pop(struct frame_queue *q);
+void *fq_trypop(struct frame_queue *q);
+int fq_count(struct frame_queue *q);
+void fq_close(struct frame_queue *q);
+
+/* captured frame, shared by the encoder and the raw sinks */
+struct cap_frame {
+    struct v4l2_buffer buf;
+    void *data;
+    int refs;
+    struct timespec ts;
+    /* raw sink picture made in the same pass as the encoder input, see fused */
+    void *planar;
+    int planar_ready;
+};
+
+/*
+ * one H264 encoder on the captured frames with its own picture, QP and
+ * GOP. Several of them take turns on the VE, each frame is encoded by
+ * every stream before the next one.
+ */
+struct enc_stream {
+    h264enc *encoder;
+    struct csc_geometry geom;   /* crop, size, mirror and rotation of the encoded picture */
+    int width;                  /* encoded picture, width x height after geom */
+    int height;
+    unsigned int qp;
+    unsigned int keyframe_interval;
+    const struct csc_conversion *conv;
+    struct csc_deint deint;     /* the stream's own, like the raw sinks' */
+    int n_sinks;
+    struct timespec *pkt_ts;    /* capture time of the frame held by each bytestream buffer */
+    unsigned long *pkt_seq;     /* and its number in the stream, a sink sees what it lost */
+    unsigned long seq;
+
+    uint64_t csc_us;
+    unsigned long csc_frames;
+    uint64_t enc_us;
+    unsigned long enc_frames;
+    unsigned long skipped;      /* over the pipeline's budget_ms before conversion */
+};
+
+/* encoder input slot, or the capture frame itself in direct mode */
+struct enc_job {
+    struct enc_stream *stream;
+    void *input;
+    struct cap_frame *frame;
+    struct timespec ts;
+};
+
+/* what a sink does with a frame when its queue is full, see sink_push() */
+enum sink_policy {
+    SINK_DROP_OLDEST = 0,
+    SINK_DROP_NEWEST,
+    SINK_BLOCK,         /* the producer waits up to block_ms, then drops the new one */
+};
+
+/* loopback sink, one thread each in the threaded pipeline */
+struct pthr_start {
+    char *lb_name;
+    int lb_codec;
+    int stream;                         /* H264 sinks: index of the encoder stream */
+    int lb_fd;
+    int lb_nbuf;
+    int lb_w;
+    int lb_h;
+    void *lb_pbuf;
+    int tofile;
+    int file_fd;
+    char *fname;
+    int pix_format;
+    const struct csc_conversion *conv;  /* capture to pix_format, NULL when they match */
+    struct csc_deint deint;             /* this sink's own, the motion history is per stream */
+    struct csc_geometry geom;           /* raw sinks: picture size, lb_w x lb_h after it */
+    int lb_memory;
+    void **lb_held;
+    int lb_max_held;
+
+    void *scratch;
+    struct frame_queue q;
+    pthread_t thread;
+    unsigned long frames;
+    uint64_t lat_sum_us;
+    uint64_t lat_max_us;
+    unsigned long skipped;              /* raw sinks: for a newer frame or over budget_ms */
+
+    int policy;                         /* enum sink_policy */
+    int block_ms;
+    int stalled;                        /* the device took nothing for SINK_STALL_MS, not waited for */
+    int need_idr;                       /* H264 sinks: a packet was lost, the rest of its GOP is skipped */
+    unsigned long next_seq;
+    unsigned long dropped;              /* queue full, by the policy */
+    unsigned long busy;                 /* no device buffer in time */
+    unsigned long gop_skipped;          /* H264 sinks: waiting for the next IDR */
+};
+
+/*
+ * one camera with its encoder streams and sinks. Several of them are run
+ * from one capture loop, sharing the VE and the colour conversion threads.
+ */
+struct pipeline {
+    const char *name;   /* capture device or replay file, in messages and the report */
+    int video_fd;
+    int replay_fd;
+    struct buffer *buffers;
+    int n_buffers;
+    int width;
+    int height;
+    int pix_fmt;
+    int cap_stride;     /* bytes per capture line, 0 for tightly packed */
+    int enc_fmt;        /* encoder input of every stream, V4L2_PIX_FMT_NV12 or _NV16, 0 follows the capture */
+    struct csc_deint deint;     /* mode and field set by the caller, off for progressive */
+    int cap_memory;
+    int direct;
+    int fused;
+    int pyramid;        /* every stream's encoder input from one pass, see csc_convert_pyramid() */
+    int planar_fmt;
+    int lb_enabled;
+    unsigned long max_frames;
+    int deadline_ms;    /* VE deadline of each frame after its capture, 0 for none */
+    int latest;         /* low latency: the newest of the buffers the driver has done, the rest requeued */
+    int budget_ms;      /* frames older than this are skipped before conversion, 0 for none */
+    int serial;         /* sinks are written from the capture loop, not their own threads */
+
+    struct enc_stream *streams;
+    int n_streams;
+
+    struct pthr_start *sinks;
+    int n_sinks;
+
+    struct cap_frame *frames;
+    struct frame_queue cap_free;
+    struct frame_queue csc_in;
+    struct frame_queue enc_in;
+    struct frame_queue enc_free;
+    struct enc_job *jobs;
+    int n_jobs;         /* per stream */
+    int n_packets;
+    int n_raw;
+    int n_h264;
+    pthread_mutex_t ref_lock;
+    pthread_t csc_th;
+    pthread_t enc_th;
+    int running;        /* threads not done yet, the last one sets t_end */
+
+    int cap_done;
+    struct timespec cap_last;
+    unsigned long captured;
+    unsigned long stale;    /* frames dropped for a newer one before conversion, see latest */
+    struct timespec t_start;
+    struct timespec t_end;
+    uint64_t cpu_us;    /* the whole process, shared by every camera of the run */
+};
+
+int read_frame(int fd, void *buffer, int size);
+int pipeline_init(struct pipeline *p);
+void pipeline_free(struct pipeline *p);
+int pipeline_run_serial(struct pipeline *p, int n);
+int pipeline_run_threaded(struct pipeline *p, int n);
+void pipeline_report(struct pipeline *p, int n, const char *mode);
+int sink_policy_parse(const char *name, int *block_ms);
+const char *sink_policy_name(int policy);
+int sink_setup_output(struct pthr_start *s, int zero_copy);
+void sink_release_output(struct pipeline *p, struct pthr_start *s);
+
+#endif
@@ -17,12 +17,18 @@
  *
  */
 
+#include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include "ve.h"
@@ -30,6 +36,7 @@
 #define DEVICE "/dev/cedar_dev"
 #define PAGE_OFFSET (0xc0000000) // from kernel 0xC0000000
 #define PAGE_SIZE (4096)
+#define DRAM_OFFSET (0x40000000) // VE address 0 is the start of DRAM
 
 enum IOCTL_CMD
 {
@@ -69,23 +76,247 @@ struct cedarv_cache_range
 	long end;
 };
 
-struct memchunk_t
+/*
+ * The reserved memory is mapped once and handed out by a buddy allocator
+ * over its pages. Page metadata lives in normal memory, so virt<->phys is
+ * plain pointer arithmetic. Allocations take 2^order pages and give the
+ * unused tail back, which keeps odd sizes like 720p frames from wasting
+ * up to half a block.
+ */
+#define MAX_ORDER 16
+#define PAGE_FREE 0x80
+
+struct ve_arena
 {
-	uint32_t phys_addr;
+	void *virt;
+	void *uncached; /* second, write-combined view through /dev/mem, if requested */
+	int uncached_tried;
+	uint32_t phys;
 	int size;
-	void *virt_addr;
-	struct memchunk_t *next;
+	int npages;
+
+	uint8_t *page_state;	/* PAGE_FREE | order on the first page of a free block */
+	int *next, *prev;	/* free list links, indexed by page */
+	int *alloc_pages;	/* pages of the allocation starting here */
+	int free_head[MAX_ORDER + 1];
+
+	int used_pages, peak_pages, allocations;
+};
+
+/* VE_CTRL with every engine off */
+#define VE_CTRL_IDLE 0x00130007
+
+/* requests for the engine already switched in served in a row at most */
+#define VE_BATCH_MAX 4
+
+struct ve_client
+{
+	int priority;
+	enum ve_late_policy late;
+	struct ve_client_stats stats;
+
+	/* signalled by the waiter when its job is done, see ve_wait_async() */
+	int event_fd;
+	int wait_result;
+};
+
+/* queued ve_get()/ve_acquire(), on the caller's stack until it is served */
+struct ve_request
+{
+	struct ve_client *client;
+	uint32_t ctrl;
+	int has_deadline;
+	struct timespec deadline;
+	unsigned long seq;
+	enum { REQ_WAITING = 0, REQ_GRANTED, REQ_DROPPED } state;
+	struct ve_request *next;
 };
 
+#define IN_RANGE(p, base, size) ((base) && (void *)(p) >= (base) && (void *)(p) < (base) + (size))
+
 static struct
 {
 	int fd;
 	void *regs;
 	int version;
-	struct memchunk_t first_memchunk;
+	struct ve_arena mem;
 	pthread_rwlock_t memory_lock;
-	pthread_mutex_t device_lock;
-} ve = { .fd = -1, .memory_lock = PTHREAD_RWLOCK_INITIALIZER, .device_lock = PTHREAD_MUTEX_INITIALIZER };
+
+	/* VE scheduler, see ve_acquire() */
+	pthread_mutex_t sched_lock;
+	pthread_cond_t sched_cond;
+	struct ve_request *queue;
+	int busy;
+	uint32_t ctrl;		/* VE_CTRL as last written, 0 when unknown */
+	int batch;		/* requests served in a row with it */
+	unsigned long seq;
+	struct ve_client anonymous;
+	struct ve_sched_stats sched;
+
+	/* cache maintenance done through ve_flush_cache() */
+	unsigned long flushes;
+	uint64_t flush_bytes, flush_us;
+
+	/* interrupt waiter, one for the VE since it runs one job at a time */
+	pthread_t waiter;
+	int waiter_running;
+	pthread_mutex_t wait_lock;
+	pthread_cond_t wait_cond;
+	struct ve_client *wait_client;
+	int wait_timeout;
+} ve = { .fd = -1, .memory_lock = PTHREAD_RWLOCK_INITIALIZER,
+	 .sched_lock = PTHREAD_MUTEX_INITIALIZER, .sched_cond = PTHREAD_COND_INITIALIZER,
+	 .anonymous = { .event_fd = -1 },
+	 .wait_lock = PTHREAD_MUTEX_INITIALIZER, .wait_cond = PTHREAD_COND_INITIALIZER };
+
+#ifdef VE_DEBUG_MMIO
+unsigned long ve_mmio_count;
+#endif
+
+static void arena_push(struct ve_arena *a, int page, int order)
+{
+	a->page_state[page] = PAGE_FREE | order;
+	a->prev[page] = -1;
+	a->next[page] = a->free_head[order];
+	if (a->free_head[order] != -1)
+		a->prev[a->free_head[order]] = page;
+	a->free_head[order] = page;
+}
+
+static void arena_unlink(struct ve_arena *a, int page, int order)
+{
+	if (a->prev[page] != -1)
+		a->next[a->prev[page]] = a->next[page];
+	else
+		a->free_head[order] = a->next[page];
+	if (a->next[page] != -1)
+		a->prev[a->next[page]] = a->prev[page];
+	a->page_state[page] = 0;
+}
+
+static void arena_free_block(struct ve_arena *a, int page, int order)
+{
+	while (order < MAX_ORDER)
+	{
+		int buddy = page ^ (1 << order);
+		if (buddy >= a->npages || a->page_state[buddy] != (PAGE_FREE | order))
+			break;
+
+		arena_unlink(a, buddy, order);
+		if (buddy < page)
+			page = buddy;
+		order++;
+	}
+
+	arena_push(a, page, order);
+}
+
+/* split [page, page + n) into the largest aligned blocks and free them */
+static void arena_free_range(struct ve_arena *a, int page, int n)
+{
+	while (n > 0)
+	{
+		int order = 0;
+		while (order < MAX_ORDER && !(page & (1 << order)) && (2 << order) <= n)
+			order++;
+
+		arena_free_block(a, page, order);
+		page += 1 << order;
+		n -= 1 << order;
+	}
+}
+
+static int arena_alloc(struct ve_arena *a, int n)
+{
+	int order = 0, o;
+
+	/* an empty block would hand out a page still on the free lists */
+	if (n < 1)
+		return -1;
+
+	while ((1 << order) < n)
+		order++;
+	if (order > MAX_ORDER)
+		return -1;
+
+	for (o = order; o <= MAX_ORDER && a->free_head[o] == -1; o++)
+		;
+	if (o > MAX_ORDER)
+		return -1;
+
+	int page = a->free_head[o];
+	arena_unlink(a, page, o);
+
+	/* split down, the upper halves go back to the free lists */
+	while (o > order)
+	{
+		o--;
+		arena_push(a, page + (1 << o), o);
+	}
+
+	/* return the tail beyond what was asked for */
+	arena_free_range(a, page + n, (1 << order) - n);
+
+	a->alloc_pages[page] = n;
+	a->used_pages += n;
+	a->allocations++;
+	if (a->used_pages > a->peak_pages)
+		a->peak_pages = a->used_pages;
+
+	return page;
+}
+
+static void arena_free(struct ve_arena *a)
+{
+	if (a->virt)
+		munmap(a->virt, a->size);
+	a->virt = NULL;
+	if (a->uncached)
+		munmap(a->uncached, a->size);
+	a->uncached = NULL;
+	a->uncached_tried = 0;
+
+	free(a->page_state);
+	free(a->next);
+	free(a->prev);
+	free(a->alloc_pages);
+	a->page_state = NULL;
+	a->next = a->prev = a->alloc_pages = NULL;
+}
+
+static int arena_init(struct ve_arena *a, uint32_t reserved_mem, int size)
+{
+	int o;
+
+	a->size = size & ~(PAGE_SIZE - 1);
+	a->npages = a->size / PAGE_SIZE;
+	a->phys = reserved_mem - PAGE_OFFSET;
+
+	a->virt = mmap(NULL, a->size, PROT_READ | PROT_WRITE, MAP_SHARED, ve.fd, reserved_mem);
+	if (a->virt == MAP_FAILED)
+	{
+		a->virt = NULL;
+		return 0;
+	}
+
+	a->page_state = calloc(a->npages, sizeof(*a->page_state));
+	a->next = malloc(a->npages * sizeof(*a->next));
+	a->prev = malloc(a->npages * sizeof(*a->prev));
+	a->alloc_pages = calloc(a->npages, sizeof(*a->alloc_pages));
+	if (!a->page_state || !a->next || !a->prev || !a->alloc_pages)
+	{
+		arena_free(a);
+		return 0;
+	}
+
+	for (o = 0; o <= MAX_ORDER; o++)
+		a->free_head[o] = -1;
+	a->used_pages = a->peak_pages = a->allocations = 0;
+
+	arena_free_range(a, 0, a->npages);
+
+	return 1;
+}
 
 int ve_open(void)
 {
@@ -105,20 +336,24 @@ int ve_open(void)
 	if (ve.regs == MAP_FAILED)
 		goto err;
 
-	ve.first_memchunk.phys_addr = info.reserved_mem - PAGE_OFFSET;
-	ve.first_memchunk.size = info.reserved_mem_size;
+	if (!arena_init(&ve.mem, info.reserved_mem, info.reserved_mem_size))
+	{
+		munmap(ve.regs, 0x800);
+		goto err;
+	}
 
 	ioctl(ve.fd, IOCTL_ENGINE_REQ, 0);
 	ioctl(ve.fd, IOCTL_ENABLE_VE, 0);
 	ioctl(ve.fd, IOCTL_SET_VE_FREQ, 320);
 	ioctl(ve.fd, IOCTL_RESET_VE, 0);
 
-	writel(0x00130007, ve.regs + VE_CTRL);
+	writel(VE_CTRL_IDLE, ve.regs + VE_CTRL);
+	ve.ctrl = VE_CTRL_IDLE;
 
 	ve.version = readl(ve.regs + VE_VERSION) >> 16;
 	printf("[CedarX SUNXI] VE version 0x%04x opened.\n", ve.version);
 	printf("REGS pa: %08X\n", info.registers);
-	printf("MEMORY pa %08X, page offset %08X size %d\n", info.reserved_mem, ve.first_memchunk.phys_addr, ve.first_memchunk.size);
+	printf("MEMORY pa %08X, page offset %08X size %d\n", info.reserved_mem, ve.mem.phys, ve.mem.size);
 
 	return 1;
 
@@ -133,12 +368,23 @@ void ve_close(void)
 	if (ve.fd == -1)
 		return;
 
+	if (ve.waiter_running)
+	{
+		pthread_mutex_lock(&ve.wait_lock);
+		ve.waiter_running = 0;
+		pthread_cond_signal(&ve.wait_cond);
+		pthread_mutex_unlock(&ve.wait_lock);
+		pthread_join(ve.waiter, NULL);
+	}
+
 	ioctl(ve.fd, IOCTL_DISABLE_VE, 0);
 	ioctl(ve.fd, IOCTL_ENGINE_REL, 0);
 
 	munmap(ve.regs, 0x800);
 	ve.regs = NULL;
 
+	arena_free(&ve.mem);
+
 	close(ve.fd);
 	ve.fd = -1;
 }
@@ -158,27 +404,360 @@ int ve_wait(int timeout)
 		return ioctl(ve.fd, IOCTL_WAIT_VE_DE, timeout);
 }
 
-void *ve_get(int engine, uint32_t flags)
+void ve_reset(void)
 {
-	if (pthread_mutex_lock(&ve.device_lock))
-		return NULL;
+	if (ve.fd == -1)
+		return;
+
+	ioctl(ve.fd, IOCTL_RESET_VE, 0);
+
+	/* the next request switches its engine in again */
+	pthread_mutex_lock(&ve.sched_lock);
+	ve.ctrl = 0;
+	pthread_mutex_unlock(&ve.sched_lock);
+}
+
+/*
+ * The cedar interrupt can only be waited for in an ioctl, so one thread
+ * does that for whichever client has its job on the VE and tells it
+ * through the client's own eventfd. Callers poll that with the rest of
+ * their descriptors instead of each parking a thread in the kernel.
+ */
+static void *ve_waiter(void *arg)
+{
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&ve.wait_lock);
+	while (ve.waiter_running)
+	{
+		struct ve_client *client = ve.wait_client;
+
+		if (!client)
+		{
+			pthread_cond_wait(&ve.wait_cond, &ve.wait_lock);
+			continue;
+		}
+
+		int timeout = ve.wait_timeout;
+		pthread_mutex_unlock(&ve.wait_lock);
+
+		int result = ve_wait(timeout);
+
+		pthread_mutex_lock(&ve.wait_lock);
+		client->wait_result = result;
+		ve.wait_client = NULL;
+		if (write(client->event_fd, &one, sizeof(one)) != sizeof(one))
+			perror("VE eventfd");
+	}
+	pthread_mutex_unlock(&ve.wait_lock);
+
+	return NULL;
+}
+
+int ve_client_event_fd(struct ve_client *client)
+{
+	if (ve.fd == -1 || !client)
+		return -1;
+
+	pthread_mutex_lock(&ve.wait_lock);
+	if (client->event_fd == -1)
+		client->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (client->event_fd != -1 && !ve.waiter_running)
+	{
+		ve.waiter_running = 1;
+		if (pthread_create(&ve.waiter, NULL, ve_waiter, NULL))
+			ve.waiter_running = 0;
+	}
+	pthread_mutex_unlock(&ve.wait_lock);
+
+	return ve.waiter_running ? client->event_fd : -1;
+}
+
+int ve_wait_async(struct ve_client *client, int timeout)
+{
+	if (!client || client->event_fd == -1 || !ve.waiter_running)
+		return 0;
+
+	pthread_mutex_lock(&ve.wait_lock);
+	ve.wait_client = client;
+	ve.wait_timeout = timeout;
+	pthread_cond_signal(&ve.wait_cond);
+	pthread_mutex_unlock(&ve.wait_lock);
+
+	return 1;
+}
+
+int ve_wait_result(struct ve_client *client)
+{
+	struct pollfd pfd = { .fd = client->event_fd, .events = POLLIN };
+	uint64_t cnt;
+
+	while (read(client->event_fd, &cnt, sizeof(cnt)) != sizeof(cnt))
+	{
+		if (errno != EAGAIN && errno != EINTR)
+			return 0;
+		poll(&pfd, 1, -1);
+	}
+
+	return client->wait_result;
+}
+
+static int ts_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/* a is served before b of the same priority */
+static int request_before(const struct ve_request *a, const struct ve_request *b)
+{
+	if (ve.batch < VE_BATCH_MAX && (a->ctrl == ve.ctrl) != (b->ctrl == ve.ctrl))
+		return a->ctrl == ve.ctrl;
+	if (a->has_deadline != b->has_deadline)
+		return a->has_deadline;
+	if (a->has_deadline && ts_before(&a->deadline, &b->deadline) != ts_before(&b->deadline, &a->deadline))
+		return ts_before(&a->deadline, &b->deadline);
+	return a->seq < b->seq;
+}
+
+/*
+ * Hand the free VE to the next request, the late ones of clients that
+ * drop them are taken out on the way. Called with sched_lock held.
+ */
+static void ve_dispatch(void)
+{
+	struct ve_request **pp, *r, *best = NULL;
+	int prio, best_prio = 0;
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	for (pp = &ve.queue; (r = *pp); )
+	{
+		int late = r->has_deadline && !ts_before(&now, &r->deadline);
+
+		if (late && r->client->late == VE_LATE_DROP)
+		{
+			r->state = REQ_DROPPED;
+			*pp = r->next;
+			continue;
+		}
+
+		prio = late && r->client->late == VE_LATE_DEFER ? INT_MIN : r->client->priority;
+		if (!best || prio > best_prio || (prio == best_prio && request_before(r, best)))
+		{
+			best = r;
+			best_prio = prio;
+		}
+		pp = &r->next;
+	}
+
+	if (best)
+	{
+		for (pp = &ve.queue; *pp != best; pp = &(*pp)->next)
+			;
+		*pp = best->next;
+		best->state = REQ_GRANTED;
+		ve.busy = 1;
+	}
+	pthread_cond_broadcast(&ve.sched_cond);
+}
+
+static void request_init(struct ve_request *req, struct ve_client *client, int engine, uint32_t flags,
+			 const struct timespec *deadline)
+{
+	memset(req, 0, sizeof(*req));
+	req->client = client ? client : &ve.anonymous;
 	if (ve_get_version() >= 0x1633)
-		writel(0x001300C0 | (engine & 0xf) | (flags & ~0xf), ve.regs + VE_CTRL);
+		req->ctrl = 0x001300C0 | (engine & 0xf) | (flags & ~0xf);
+	else
+		req->ctrl = 0x00130000 | (engine & 0xf) | (flags & ~0xf);
+	if (deadline)
+	{
+		req->has_deadline = 1;
+		req->deadline = *deadline;
+	}
+}
+
+/* the request got the VE at now, switch its engine in. Called with sched_lock held. */
+static void request_granted(struct ve_request *req, const struct timespec *now)
+{
+	struct ve_client_stats *st = &req->client->stats;
+
+	st->jobs++;
+	if (req->has_deadline && !ts_before(now, &req->deadline))
+		st->late++;
+
+	ve.sched.jobs++;
+	if (req->ctrl == ve.ctrl)
+	{
+		ve.batch++;
+	}
 	else
-		writel(0x00130000 | (engine & 0xf) | (flags & ~0xf), ve.regs + VE_CTRL);
+	{
+		ve.sched.engine_switches++;
+		ve.batch = 1;
+		ve.ctrl = req->ctrl;
+		if (ve.regs)
+			writel(req->ctrl, ve.regs + VE_CTRL);
+	}
+}
+
+/*
+ * Wait for the VE and switch the engine in, 0 if the request was dropped
+ * at its deadline instead (deadline may be NULL, CLOCK_MONOTONIC). The
+ * engine is left on between requests for it, see ve_put().
+ */
+int ve_acquire(struct ve_client *client, int engine, uint32_t flags, const struct timespec *deadline)
+{
+	struct ve_request req, *r;
+	struct timespec t0, t1;
+	unsigned int ahead;
+	uint64_t wait;
+
+	request_init(&req, client, engine, flags, deadline);
+
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+	if (pthread_mutex_lock(&ve.sched_lock))
+		return 0;
+
+	req.seq = ve.seq++;
+	ahead = ve.busy;
+	for (r = ve.queue; r; r = r->next)
+		ahead++;
+	req.next = ve.queue;
+	ve.queue = &req;
+
+	if (!ve.busy)
+		ve_dispatch();
+	while (req.state == REQ_WAITING)
+		pthread_cond_wait(&ve.sched_cond, &ve.sched_lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	wait = (t1.tv_sec - t0.tv_sec) * 1000000ULL + (t1.tv_nsec - t0.tv_nsec) / 1000;
+
+	struct ve_client_stats *st = &req.client->stats;
+	st->wait_us += wait;
+	if (wait > st->max_wait_us)
+		st->max_wait_us = wait;
+	st->queued += ahead;
+	if (ahead > st->max_queued)
+		st->max_queued = ahead;
+
+	if (req.state == REQ_DROPPED)
+	{
+		st->dropped++;
+		pthread_mutex_unlock(&ve.sched_lock);
+		return 0;
+	}
+
+	request_granted(&req, &t1);
+	pthread_mutex_unlock(&ve.sched_lock);
+
+	return 1;
+}
+
+/*
+ * ve_acquire() that never waits: the VE only when it is free and nobody
+ * is queued for it, -1 and nothing queued otherwise
+ */
+int ve_try_acquire(struct ve_client *client, int engine, uint32_t flags, const struct timespec *deadline)
+{
+	struct ve_request req;
+	struct timespec now;
+
+	request_init(&req, client, engine, flags, deadline);
+
+	if (pthread_mutex_lock(&ve.sched_lock))
+		return -1;
+	if (ve.busy || ve.queue)
+	{
+		pthread_mutex_unlock(&ve.sched_lock);
+		return -1;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (req.has_deadline && !ts_before(&now, &req.deadline) && req.client->late == VE_LATE_DROP)
+	{
+		req.client->stats.dropped++;
+		pthread_mutex_unlock(&ve.sched_lock);
+		return 0;
+	}
+
+	ve.seq++;
+	ve.busy = 1;
+	request_granted(&req, &now);
+	pthread_mutex_unlock(&ve.sched_lock);
+
+	return 1;
+}
+
+void *ve_get_regs(void)
+{
+	return ve.regs;
+}
+
+void *ve_get(int engine, uint32_t flags)
+{
+	if (!ve_acquire(NULL, engine, flags, NULL))
+		return NULL;
 
 	return ve.regs;
 }
 
 void ve_put(void)
 {
-	writel(0x00130007, ve.regs + VE_CTRL);
-	pthread_mutex_unlock(&ve.device_lock);
+	pthread_mutex_lock(&ve.sched_lock);
+	ve.busy = 0;
+	if (ve.queue)
+		ve_dispatch();
+
+	/* nobody left waiting, switch the engines off */
+	if (!ve.busy && ve.ctrl != VE_CTRL_IDLE)
+	{
+		if (ve.regs)
+			writel(VE_CTRL_IDLE, ve.regs + VE_CTRL);
+		ve.ctrl = VE_CTRL_IDLE;
+		ve.batch = 0;
+	}
+	pthread_mutex_unlock(&ve.sched_lock);
+}
+
+struct ve_client *ve_client_new(int priority, enum ve_late_policy late)
+{
+	struct ve_client *client = calloc(1, sizeof(*client));
+
+	if (client)
+	{
+		client->priority = priority;
+		client->late = late;
+		client->event_fd = -1;
+	}
+	return client;
+}
+
+void ve_client_free(struct ve_client *client)
+{
+	if (client && client->event_fd != -1)
+		close(client->event_fd);
+	free(client);
+}
+
+void ve_client_stats(const struct ve_client *client, struct ve_client_stats *st)
+{
+	pthread_mutex_lock(&ve.sched_lock);
+	*st = client->stats;
+	pthread_mutex_unlock(&ve.sched_lock);
+}
+
+void ve_sched_stats(struct ve_sched_stats *st)
+{
+	pthread_mutex_lock(&ve.sched_lock);
+	*st = ve.sched;
+	pthread_mutex_unlock(&ve.sched_lock);
 }
 
 void *ve_malloc(int size)
 {
-	if (ve.fd == -1)
+	if (ve.fd == -1 || size <= 0)
 		return NULL;
 
 	if (pthread_rwlock_wrlock(&ve.memory_lock))
@@ -186,48 +765,82 @@ void *ve_malloc(int size)
 
 	void *addr = NULL;
 
-	size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
-	struct memchunk_t *c, *best_chunk = NULL;
-	for (c = &ve.first_memchunk; c != NULL; c = c->next)
-	{
-		if(c->virt_addr == NULL && c->size >= size)
-		{
-			if (best_chunk == NULL || c->size < best_chunk->size)
-				best_chunk = c;
+	int page = arena_alloc(&ve.mem, (size + PAGE_SIZE - 1) / PAGE_SIZE);
+	if (page >= 0)
+		addr = ve.mem.virt + page * PAGE_SIZE;
 
-			if (c->size == size)
-				break;
-		}
-	}
+	pthread_rwlock_unlock(&ve.memory_lock);
+	return addr;
+}
 
-	if (!best_chunk)
-		goto out;
+/*
+ * /dev/mem opened O_SYNC maps RAM the kernel has in its memory map
+ * write-combined on ARM: normal uncached memory, stores are merged and
+ * unaligned ones allowed. Anything outside it, like a no-map carve-out,
+ * is mapped strongly ordered whatever the flags, every store waits for
+ * the bus. /proc/iomem tells the two apart.
+ */
+static int phys_in_system_ram(unsigned long start, unsigned long size)
+{
+	FILE *f = fopen("/proc/iomem", "r");
+	char line[128];
+	unsigned long first, last;
+	int found = 0;
 
-	int left_size = best_chunk->size - size;
+	if (f == NULL)
+		return 0;
 
-	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, ve.fd, best_chunk->phys_addr + PAGE_OFFSET);
-	if (addr == MAP_FAILED)
-	{
-		addr = NULL;
-		goto out;
-	}
+	while (!found && fgets(line, sizeof(line), f))
+		if (sscanf(line, "%lx-%lx", &first, &last) == 2 && strstr(line, ": System RAM")
+		    && start >= first && start + size - 1 <= last)
+			found = 1;
 
-	best_chunk->virt_addr = addr;
-	best_chunk->size = size;
+	fclose(f);
+	return found;
+}
 
-	if (left_size > 0)
+/*
+ * Memory the CPU only streams through, e.g. encoder input written once by
+ * the CSC. It needs no cache maintenance. Falls back to normal memory if
+ * no write-combined view can be set up, a strongly ordered one would make
+ * the CSC slower than flushing.
+ */
+void *ve_malloc_uncached(int size)
+{
+	void *addr = ve_malloc(size);
+	if (addr == NULL)
+		return NULL;
+
+	pthread_rwlock_wrlock(&ve.memory_lock);
+	if (!ve.mem.uncached_tried)
 	{
-		c = malloc(sizeof(struct memchunk_t));
-		c->phys_addr = best_chunk->phys_addr + size;
-		c->size = left_size;
-		c->virt_addr = NULL;
-		c->next = best_chunk->next;
-		best_chunk->next = c;
+		unsigned long pa = DRAM_OFFSET + ve.mem.phys;
+		int fd;
+
+		ve.mem.uncached_tried = 1;
+		if (!phys_in_system_ram(pa, ve.mem.size))
+			fprintf(stderr, "VE memory is not in the kernel's RAM, /dev/mem would map it strongly ordered;"
+				" using cached buffers\n");
+		else
+		{
+			fd = open("/dev/mem", O_RDWR | O_SYNC);
+			if (fd != -1)
+			{
+				void *uc = mmap(NULL, ve.mem.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, pa);
+				if (uc != MAP_FAILED)
+					ve.mem.uncached = uc;
+				close(fd);
+			}
+			if (ve.mem.uncached == NULL)
+				fprintf(stderr, "no write-combined view of VE memory, using cached buffers\n");
+		}
 	}
-
-out:
 	pthread_rwlock_unlock(&ve.memory_lock);
-	return addr;
+
+	if (ve.mem.uncached == NULL)
+		return addr;
+
+	return ve.mem.uncached + (addr - ve.mem.virt);
 }
 
 void ve_free(void *ptr)
@@ -238,32 +851,23 @@ void ve_free(void *ptr)
 	if (ptr == NULL)
 		return;
 
-	if (pthread_rwlock_wrlock(&ve.memory_lock))
+	if (IN_RANGE(ptr, ve.mem.uncached, ve.mem.size))
+		ptr = ve.mem.virt + (ptr - ve.mem.uncached);
+
+	if (!IN_RANGE(ptr, ve.mem.virt, ve.mem.size))
 		return;
 
-	struct memchunk_t *c;
-	for (c = &ve.first_memchunk; c != NULL; c = c->next)
-	{
-		if (c->virt_addr == ptr)
-		{
-			munmap(ptr, c->size);
-			c->virt_addr = NULL;
-			break;
-		}
-	}
+	if (pthread_rwlock_wrlock(&ve.memory_lock))
+		return;
 
-	for (c = &ve.first_memchunk; c != NULL; c = c->next)
+	int page = (ptr - ve.mem.virt) / PAGE_SIZE;
+	int n = ve.mem.alloc_pages[page];
+	if (n > 0)
 	{
-		if (c->virt_addr == NULL)
-		{
-			while (c->next != NULL && c->next->virt_addr == NULL)
-			{
-				struct memchunk_t *n = c->next;
-				c->size += n->size;
-				c->next = n->next;
-				free(n);
-			}
-		}
+		ve.mem.alloc_pages[page] = 0;
+		ve.mem.used_pages -= n;
+		ve.mem.allocations--;
+		arena_free_range(&ve.mem, page, n);
 	}
 
 	pthread_rwlock_unlock(&ve.memory_lock);
@@ -271,46 +875,72 @@ void ve_free(void *ptr)
 
 uint32_t ve_virt2phys(void *ptr)
 {
-	if (ve.fd == -1)
-		return 0;
+	if (IN_RANGE(ptr, ve.mem.virt, ve.mem.size))
+		return ve.mem.phys + (ptr - ve.mem.virt);
 
-	if (pthread_rwlock_rdlock(&ve.memory_lock))
-		return 0;
+	if (IN_RANGE(ptr, ve.mem.uncached, ve.mem.size))
+		return ve.mem.phys + (ptr - ve.mem.uncached);
 
-	uint32_t addr = 0;
+	return 0;
+}
 
-	struct memchunk_t *c;
-	for (c = &ve.first_memchunk; c != NULL; c = c->next)
-	{
-		if (c->virt_addr == NULL)
-			continue;
+void ve_mem_stats(struct ve_mem_stats *st)
+{
+	int o;
 
-		if (c->virt_addr == ptr)
-		{
-			addr = c->phys_addr;
-			break;
-		}
-		else if (ptr > c->virt_addr && ptr < (c->virt_addr + c->size))
+	pthread_rwlock_rdlock(&ve.memory_lock);
+
+	st->total = ve.mem.size;
+	st->used = ve.mem.used_pages * PAGE_SIZE;
+	st->peak = ve.mem.peak_pages * PAGE_SIZE;
+	st->allocations = ve.mem.allocations;
+	st->write_combined = ve.mem.uncached != NULL;
+
+	st->largest_free = 0;
+	for (o = MAX_ORDER; o >= 0; o--)
+	{
+		if (ve.mem.free_head[o] != -1)
 		{
-			addr = c->phys_addr + (ptr - c->virt_addr);
+			st->largest_free = (1 << o) * PAGE_SIZE;
 			break;
 		}
 	}
 
 	pthread_rwlock_unlock(&ve.memory_lock);
-	return addr;
+
+	/* share of free memory not usable for the largest possible allocation */
+	unsigned int free_mem = st->total - st->used;
+	st->fragmentation = free_mem ? 100 - (int)((uint64_t)st->largest_free * 100 / free_mem) : 0;
 }
 
 void ve_flush_cache(void *start, int len)
 {
-	if (ve.fd == -1)
+	if (ve.fd == -1 || len <= 0)
+		return;
+
+	if (IN_RANGE(start, ve.mem.uncached, ve.mem.size))
 		return;
 
 	struct cedarv_cache_range range =
 	{
-		.start = (int)start,
-		.end = (int)(start + len)
+		.start = (long)start,
+		.end = (long)(start + len)
 	};
 
+	struct timespec t0, t1;
+	clock_gettime(CLOCK_MONOTONIC, &t0);
+
 	ioctl(ve.fd, IOCTL_FLUSH_CACHE, (void*)(&range));
+
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	__sync_fetch_and_add(&ve.flushes, 1);
+	__sync_fetch_and_add(&ve.flush_bytes, len);
+	__sync_fetch_and_add(&ve.flush_us, (t1.tv_sec - t0.tv_sec) * 1000000ULL + (t1.tv_nsec - t0.tv_nsec) / 1000);
+}
+
+void ve_cache_stats(struct ve_cache_stats *st)
+{
+	st->flushes = ve.flushes;
+	st->bytes = ve.flush_bytes;
+	st->time_us = ve.flush_us;
 }
@@ -21,31 +21,118 @@
 #define __VE_H__
 
 #include <stdint.h>
+#include <time.h>
 
 int ve_open(void);
 void ve_close(void);
 int ve_get_version(void);
 int ve_wait(int timeout);
+void ve_reset(void);
 void *ve_get(int engine, uint32_t flags);
 void ve_put(void);
 
+/*
+ * VE scheduling. Every ve_get() and ve_acquire() is queued and the VE
+ * handed to the highest priority request when it is put back, the one
+ * for the engine already switched in among equals (a few in a row at
+ * most), then the earliest deadline, then the oldest. A request still
+ * waiting at its deadline is handled by its client's late policy.
+ * Without a client a request has priority 0 and no deadline.
+ */
+enum ve_late_policy
+{
+	VE_LATE_RUN = 0,	/* run it anyway, counted as late */
+	VE_LATE_DEFER,		/* behind every request still in time */
+	VE_LATE_DROP		/* not run, ve_acquire() returns 0 */
+};
+
+struct ve_client_stats
+{
+	unsigned long jobs;	/* got the VE */
+	unsigned long late;	/* got it after their deadline */
+	unsigned long dropped;	/* gave up at their deadline */
+	uint64_t wait_us, max_wait_us;
+	unsigned long queued;	/* requests ahead of each of its own, summed */
+	unsigned int max_queued;
+};
+
+struct ve_sched_stats
+{
+	unsigned long jobs;
+	unsigned long engine_switches;	/* VE_CTRL written, the rest ran on the engine left switched in */
+};
+
+struct ve_client;
+
+struct ve_client *ve_client_new(int priority, enum ve_late_policy late);
+void ve_client_free(struct ve_client *client);
+int ve_acquire(struct ve_client *client, int engine, uint32_t flags, const struct timespec *deadline);
+int ve_try_acquire(struct ve_client *client, int engine, uint32_t flags, const struct timespec *deadline);
+void *ve_get_regs(void);
+void ve_client_stats(const struct ve_client *client, struct ve_client_stats *st);
+void ve_sched_stats(struct ve_sched_stats *st);
+
+/*
+ * Completion of a client's job without waiting for it. The client's
+ * eventfd (-1 if there is none) is readable once the job it armed with
+ * ve_wait_async() after triggering is done, ve_wait_result() then takes
+ * ve_wait()'s result off it. ve_wait_async() returns 0 without an fd,
+ * the caller waits itself.
+ */
+int ve_client_event_fd(struct ve_client *client);
+int ve_wait_async(struct ve_client *client, int timeout);
+int ve_wait_result(struct ve_client *client);
+
+struct ve_mem_stats
+{
+	unsigned int total, used, peak;
+	unsigned int largest_free;
+	int allocations;
+	int fragmentation; /* percent */
+	int write_combined; /* ve_malloc_uncached() got its view, see there */
+};
+
+struct ve_cache_stats
+{
+	unsigned long flushes;
+	uint64_t bytes;
+	uint64_t time_us;
+};
+
 void *ve_malloc(int size);
+void *ve_malloc_uncached(int size);
 void ve_free(void *ptr);
 uint32_t ve_virt2phys(void *ptr);
+void ve_mem_stats(struct ve_mem_stats *st);
 void ve_flush_cache(void *start, int len);
+void ve_cache_stats(struct ve_cache_stats *st);
+
+/*
+ * number of register accesses so far, only touched by the VE owner.
+ * Counted in debug builds only (-DVE_DEBUG_MMIO), see the Makefile.
+ */
+#ifdef VE_DEBUG_MMIO
+extern unsigned long ve_mmio_count;
+#define VE_MMIO_COUNT() (ve_mmio_count++)
+#else
+#define VE_MMIO_COUNT() do { } while (0)
+#endif
 
 static inline void writeb(uint8_t val, void *addr)
 {
+	VE_MMIO_COUNT();
 	*((volatile uint8_t *)addr) = val;
 }
 
 static inline void writel(uint32_t val, void *addr)
 {
+	VE_MMIO_COUNT();
 	*((volatile uint32_t *)addr) = val;
 }
 
 static inline uint32_t readl(void *addr)
 {
+	VE_MMIO_COUNT();
 	return *((volatile uint32_t *) addr);
 }
 
@@ -182,6 +182,50 @@ int setup_capture_device(char *name, int fd, int *w, int *h, int fps, int pix_fo
     return 0;          
 }
 
+/*
+ * bytes per line of the current capture format, 0 if the driver doesn't say
+ */
+int dev_get_bytesperline(int fd) {
+    struct v4l2_format fmt;
+
+    CLEAR(fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (-1 == xioctl(fd, VIDIOC_G_FMT, &fmt))
+        return 0;
+
+    return fmt.fmt.pix.bytesperline;
+}
+
+/*
+ * field order of an interlaced capture with both fields in one buffer:
+ * 0 top field first, 1 bottom first, -1 progressive or fields not
+ * interleaved line by line. Plain INTERLACED follows the standard, NTSC
+ * sends the bottom field first.
+ */
+int dev_get_field_order(int fd) {
+    struct v4l2_format fmt;
+    v4l2_std_id std_id;
+
+    CLEAR(fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    if (-1 == xioctl(fd, VIDIOC_G_FMT, &fmt))
+        return -1;
+
+    switch (fmt.fmt.pix.field) {
+    case V4L2_FIELD_INTERLACED_TB:
+        return 0;
+    case V4L2_FIELD_INTERLACED_BT:
+        return 1;
+    case V4L2_FIELD_INTERLACED:
+        if (-1 != xioctl(fd, VIDIOC_G_STD, &std_id) && (std_id & V4L2_STD_NTSC) &&
+            !(std_id & ~V4L2_STD_NTSC))
+            return 1;
+        return 0;
+    default:
+        return -1;
+    }
+}
+
 /*
  *
  */
@@ -259,6 +303,53 @@ struct buffer *init_capt_mmap(char *name, int fd, int *nbuff) {
     return pb;
 }
 
+/*
+ * capture into caller-allocated memory (e.g. VE reserved memory) with
+ * V4L2_MEMORY_USERPTR, returns -1 when the driver refuses it
+ */
+int init_capt_userptr(char *name, int fd, struct buffer *pb, int nbuff) {
+    int i;
+    struct v4l2_requestbuffers req;
+
+    CLEAR(req);
+    req.count = nbuff;
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_USERPTR;
+
+    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &req)) {
+        fprintf(stderr, "%s does not support user pointer i/o\n", name);
+        return -1;
+    }
+
+    if (req.count < nbuff)
+        goto err;
+
+    for (i = 0; i < nbuff; ++i) {
+        struct v4l2_buffer buf;
+
+        CLEAR(buf);
+        buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        buf.memory = V4L2_MEMORY_USERPTR;
+        buf.index = i;
+        buf.m.userptr = (unsigned long)pb[i].start;
+        buf.length = pb[i].length;
+
+        if (-1 == xioctl(fd, VIDIOC_QBUF, &buf)) {
+            perror("VIDIOC_QBUF");
+            goto err;
+        }
+    }
+
+    return 0;
+
+err:
+    CLEAR(req);
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_USERPTR;
+    xioctl(fd, VIDIOC_REQBUFS, &req);
+    return -1;
+}
+
 /*
 */
 void open_out_dev(char *name, int w, int h, int mode, int *fd, int pix_format) {      
@@ -415,10 +506,121 @@ void uninit_out_mmap(int fd, struct buffer *pb, int nbuf) {
     free(pb);
 }
 
+/*
+ * USERPTR output queue: the producer's own memory is queued to the loopback
+ * device instead of being copied into MMAP buffers. Returns -1 when the
+ * driver refuses it, the caller then falls back to init_out_mmap().
+ */
+int init_out_userptr(int fd, int *nbuff) {
+    enum v4l2_buf_type type2;
+    struct v4l2_requestbuffers rb2;
+
+    CLEAR(rb2);
+
+    rb2.count = V4L2MMAP_NBBUFFER;
+    rb2.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    rb2.memory = V4L2_MEMORY_USERPTR;
+
+    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &rb2) || rb2.count < 1)
+        return -1;
+
+    type2 = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    if (-1 == xioctl(fd, VIDIOC_STREAMON, &type2)) {
+        CLEAR(rb2);
+        rb2.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+        rb2.memory = V4L2_MEMORY_USERPTR;
+        xioctl(fd, VIDIOC_REQBUFS, &rb2);
+        return -1;
+    }
+
+    *nbuff = rb2.count;
+    return 0;
+}
+
+/*
+*/
+void uninit_out_userptr(int fd) {
+    enum v4l2_buf_type type2;
+    struct v4l2_requestbuffers rb2;
+
+    type2 = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    if (-1 == xioctl(fd, VIDIOC_STREAMOFF, &type2))
+            errno_exit("VIDIOC_STREAMOFF");
+
+    CLEAR(rb2);
+
+    rb2.count = 0;
+    rb2.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    rb2.memory = V4L2_MEMORY_USERPTR;
+
+    if (-1 == xioctl(fd, VIDIOC_REQBUFS, &rb2))
+        errno_exit("VIDIOC_REQBUFS");
+}
+
 /*
  *
  */
-void wrt_to_lpbck (int fd, unsigned char* data, int size_out, int nbuf, struct buffer *pb) {       
+int qbuf_out_userptr(int fd, int index, void *data, int size) {
+    struct v4l2_buffer buff2;
+
+    CLEAR(buff2);
+    buff2.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    buff2.memory = V4L2_MEMORY_USERPTR;
+    buff2.index = index;
+    buff2.m.userptr = (unsigned long)data;
+    buff2.length = size;
+    buff2.bytesused = size;
+
+    return xioctl(fd, VIDIOC_QBUF, &buff2);
+}
+
+/*
+ * wait up to timeout_ms for the device to give a queued buffer back,
+ * returns its index or -1
+ */
+int dqbuf_out_userptr(int fd, int timeout_ms) {
+    struct v4l2_buffer buff2;
+    fd_set fds;
+    struct timeval tv;
+
+    CLEAR(buff2);
+    buff2.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    buff2.memory = V4L2_MEMORY_USERPTR;
+
+    while (-1 == xioctl(fd, VIDIOC_DQBUF, &buff2)) {
+        if (errno != EAGAIN)
+            return -1;
+
+        FD_ZERO(&fds);
+        FD_SET(fd, &fds);
+        tv.tv_sec = timeout_ms / 1000;
+        tv.tv_usec = (timeout_ms % 1000) * 1000;
+        if (select(fd + 1, NULL, &fds, NULL, &tv) <= 0)
+            return -1;
+    }
+
+    return buff2.index;
+}
+
+/*
+ * waits up to timeout_ms for an output buffer the driver is done with,
+ * 0 when there is none
+ */
+int wait_out_buf(int fd, int timeout_ms) {
+    fd_set fds;
+    struct timeval tv;
+
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    return select(fd + 1, NULL, &fds, NULL, &tv) > 0;
+}
+
+/*
+ * -1 when the reader has not given a buffer back yet
+ */
+int wrt_to_lpbck (int fd, unsigned char* data, int size_out, int nbuf, struct buffer *pb) {       
     int size = 0;
     if (nbuf > 0) {      
         struct v4l2_buffer buff2;
@@ -427,7 +629,9 @@ void wrt_to_lpbck (int fd, unsigned char* data, int size_out, int nbuf, struct b
         buff2.memory = V4L2_MEMORY_MMAP;
                 
         if (-1 == xioctl(fd, VIDIOC_DQBUF, &buff2)) {
-                errno_exit("VIDIOC_DQBUF");
+            if (errno == EAGAIN)
+                return -1;
+            errno_exit("VIDIOC_DQBUF");
         } else if (buff2.index < nbuf) {
             buff2.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
             size = size_out;
@@ -443,12 +647,15 @@ void wrt_to_lpbck (int fd, unsigned char* data, int size_out, int nbuf, struct b
             
             if (-1 == xioctl(fd, VIDIOC_QBUF, &buff2))
                     errno_exit("VIDIOC_QBUF");
+        } else {
+            return -1;
         }
     }    
+    return 0;
 }
 
 /*
- *
+ * NULL when the reader has not given a buffer back yet
  */
 void *obtain_lbck_current_input_buf(int fd, int nbuf, struct buffer *pb, struct v4l2_buffer *buff) {
     unsigned char *retval = NULL;
@@ -458,7 +665,8 @@ void *obtain_lbck_current_input_buf(int fd, int nbuf, struct buffer *pb, struct
     buff->memory = V4L2_MEMORY_MMAP;
 
     if (-1 == xioctl(fd, VIDIOC_DQBUF, buff)) {
-                errno_exit("VIDIOC_DQBUF");
+        if (errno != EAGAIN)
+            errno_exit("VIDIOC_DQBUF");
     } else if (buff->index < nbuf) {
         buff->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
         retval = pb[buff->index].start;
@@ -8,11 +8,11 @@ struct buffer {
     unsigned int dma_addr;
 };
 
-enum {
+enum open_mode_t {
     SIMPLE_LB = 0,
     H264_LB,
     H263_LB,
-} open_mode_t;
+};
 
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
@@ -21,13 +21,21 @@ enum {
 void open_capture_dev(char *name, int *fd);
 int setup_capture_device(char *name, int fd, int *w, int *h, int fps, int pix_format);
 struct buffer *init_capt_mmap(char *name, int fd, int *nbuff);
+int init_capt_userptr(char *name, int fd, struct buffer *pb, int nbuff);
 int xioctl(int fh, int request, void *arg);
 void errno_exit(const char *s);
 int dev_try_format(int fd, int w, int h, int fmtid);
+int dev_get_bytesperline(int fd);
+int dev_get_field_order(int fd);
 void open_out_dev(char *name, int w, int h, int mode, int *fd, int pix_format);
 struct buffer *init_out_mmap(int *fd, int *nbuff);
 void uninit_out_mmap(int fd, struct buffer *pb, int nbuf);
-void wrt_to_lpbck (int fd, unsigned char* data, int size_out, int nbuf, struct buffer *pb);
+int init_out_userptr(int fd, int *nbuff);
+void uninit_out_userptr(int fd);
+int qbuf_out_userptr(int fd, int index, void *data, int size);
+int dqbuf_out_userptr(int fd, int timeout_ms);
+int wait_out_buf(int fd, int timeout_ms);
+int wrt_to_lpbck (int fd, unsigned char* data, int size_out, int nbuf, struct buffer *pb);
 void *obtain_lbck_current_input_buf(int fd, int nbuf, struct buffer *pb, struct v4l2_buffer *buff);
 void write_current_input_buf_to_lbck(int fd, struct v4l2_buffer *buff, int size_out);
 unsigned int fourcc(char a, char b, char c, char d);